@@ -28,6 +28,11 @@
 #include "simulation2/components/ICmpRangeManager.h"
 #include "simulation2/components/ICmpTerrain.h"
 
+#if ARCH_X86_X64
+# include <emmintrin.h>
+# include "lib/sysdep/arch/x86_x64/x86_x64.h"
+#endif
+
 /*
 
 The LOS bitmap is computed with one value per map vertex, based on
@@ -41,6 +46,12 @@ then the blur shifts the image back into the corner.
 
 The blurred bitmap is then uploaded into a GL texture for use by the renderer.
 
+The unblurred bitmap is kept between updates. CCmpRangeManager reports which
+regions of its LOS state have changed since the last update, so only those
+parts of the bitmap are regenerated, and only those parts (plus the (N-1)/2
+texels around them that the blur spreads the changes into) are blurred
+and uploaded.
+
 */
 
 
@@ -48,8 +59,13 @@ The blurred bitmap is then uploaded into a GL texture for use by the renderer.
 static const size_t g_BlurSize = 7;
 
 CLOSTexture::CLOSTexture(CSimulation2& simulation) :
-	m_Simulation(simulation), m_Dirty(true), m_Texture(0), m_MapSize(0), m_TextureSize(0)
+	m_Simulation(simulation), m_Dirty(true), m_EnableSSE2(false), m_LosPlayer(-1), m_LosDirtyID(0),
+	m_Texture(0), m_MapSize(0), m_TextureSize(0)
 {
+#if ARCH_X86_X64
+	if (x86_x64::Cap(x86_x64::CAP_SSE2))
+		m_EnableSSE2 = true;
+#endif
 }
 
 CLOSTexture::~CLOSTexture()
@@ -111,6 +127,11 @@ void CLOSTexture::ConstructTexture(int unit)
 
 	m_MapSize = cmpTerrain->GetVerticesPerSide();
 
+	// Start again with an empty bitmap, and regenerate all of it
+	m_LosBitmap.clear();
+	m_LosBitmap.resize(GetBitmapSize(m_MapSize, m_MapSize));
+	m_LosDirtyID = 0;
+
 	m_TextureSize = (GLsizei)round_up_to_pow2((size_t)m_MapSize + g_BlurSize - 1);
 
 	glGenTextures(1, &m_Texture);
@@ -167,23 +188,54 @@ void CLOSTexture::RecomputeTexture(int unit)
 	}
 
 	if (!m_Texture)
+	{
 		ConstructTexture(unit);
+		if (!m_Texture)
+			return;
+	}
 
 	PROFILE("recompute LOS texture");
 
-	std::vector<u8> losData;
-	losData.resize(GetBitmapSize(m_MapSize, m_MapSize));
-
 	CmpPtr<ICmpRangeManager> cmpRangeManager(m_Simulation, SYSTEM_ENTITY);
 	if (cmpRangeManager.null())
 		return;
 
-	ICmpRangeManager::CLosQuerier los (cmpRangeManager->GetLosQuerier(g_Game->GetPlayerID()));
+	// Switching to a different player changes the whole texture
+	player_id_t player = g_Game->GetPlayerID();
+	if (player != m_LosPlayer)
+	{
+		m_LosPlayer = player;
+		m_LosDirtyID = 0;
+	}
+
+	std::vector<ICmpRangeManager::LosRegion> regions;
+	cmpRangeManager->GetLosDirtyRegions(&m_LosDirtyID, regions);
+	if (regions.empty())
+		return;
+
+	ICmpRangeManager::CLosQuerier los (cmpRangeManager->GetLosQuerier(player));
 
-	GenerateBitmap(los, &losData[0], m_MapSize, m_MapSize);
+	// Regenerate all the changed regions before blurring any of them,
+	// since the blur around one region may cover another
+	for (size_t i = 0; i < regions.size(); ++i)
+		GenerateBitmap(los, &m_LosBitmap[0], m_MapSize, m_MapSize, regions[i]);
 
 	g_Renderer.BindTexture(unit, m_Texture);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_MapSize + g_BlurSize - 1, m_MapSize + g_BlurSize - 1, GL_ALPHA, GL_UNSIGNED_BYTE, &losData[0]);
+
+	for (size_t i = 0; i < regions.size(); ++i)
+	{
+		// Changes spread out by the blur radius
+		ICmpRangeManager::LosRegion region = regions[i];
+		region.i0 = std::max(region.i0 - (i32)(g_BlurSize/2), 0);
+		region.j0 = std::max(region.j0 - (i32)(g_BlurSize/2), 0);
+		region.i1 = std::min(region.i1 + (i32)(g_BlurSize/2), (i32)m_MapSize);
+		region.j1 = std::min(region.j1 + (i32)(g_BlurSize/2), (i32)m_MapSize);
+
+		m_BlurredBuffer.resize((region.i1 - region.i0) * (region.j1 - region.j0));
+		BlurBitmap(&m_LosBitmap[0], m_MapSize, m_MapSize, region, &m_BlurredBuffer[0]);
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, region.i0, region.j0, region.i1 - region.i0, region.j1 - region.j0, GL_ALPHA, GL_UNSIGNED_BYTE, &m_BlurredBuffer[0]);
+	}
 }
 
 size_t CLOSTexture::GetBitmapSize(size_t w, size_t h)
@@ -191,25 +243,19 @@ size_t CLOSTexture::GetBitmapSize(size_t w, size_t h)
 	return (w + g_BlurSize - 1) * (h + g_BlurSize - 1);
 }
 
-void CLOSTexture::GenerateBitmap(ICmpRangeManager::CLosQuerier los, u8* losData, size_t w, size_t h)
+void CLOSTexture::GenerateBitmap(ICmpRangeManager::CLosQuerier los, u8* losData, size_t w, size_t h, const ICmpRangeManager::LosRegion& region)
 {
-	const size_t rowSize = w + g_BlurSize-1; // size of losData rows
-
-	u8 *dataPtr = losData;
+	ENSURE(0 <= region.i0 && region.i0 <= region.i1 && region.i1 <= (i32)w);
+	ENSURE(0 <= region.j0 && region.j0 <= region.j1 && region.j1 <= (i32)h);
 
-	// Initialise the top padding
-	for (size_t j = 0; j < g_BlurSize/2; ++j)
-		for (size_t i = 0; i < rowSize; ++i)
-			*dataPtr++ = 0;
+	const size_t rowSize = w + g_BlurSize-1; // size of losData rows
 
-	for (size_t j = 0; j < h; ++j)
+	for (i32 j = region.j0; j < region.j1; ++j)
 	{
-		// Initialise the left padding
-		for (size_t i = 0; i < g_BlurSize/2; ++i)
-			*dataPtr++ = 0;
+		u8* dataPtr = &losData[(j + g_BlurSize/2)*rowSize + g_BlurSize/2 + region.i0];
 
 		// Fill in the visibility data
-		for (size_t i = 0; i < w; ++i)
+		for (i32 i = region.i0; i < region.i1; ++i)
 		{
 			if (los.IsVisible_UncheckedRange(i, j))
 				*dataPtr++ = 255;
@@ -218,52 +264,94 @@ void CLOSTexture::GenerateBitmap(ICmpRangeManager::CLosQuerier los, u8* losData,
 			else
 				*dataPtr++ = 0;
 		}
-
-		// Initialise the right padding
-		for (size_t i = 0; i < g_BlurSize/2; ++i)
-			*dataPtr++ = 0;
 	}
+}
 
-	// Initialise the bottom padding
-	for (size_t j = 0; j < g_BlurSize/2; ++j)
-		for (size_t i = 0; i < rowSize; ++i)
-			*dataPtr++ = 0;
+// The blur kernels compute out[i] from in[i], in[i+step], ..., in[i+6*step],
+// so the outputs are shifted back into the corner by the padding size.
+// The intermediate results are rounded down to u8 after each pass.
 
-	// Horizontal blur:
+static void BlurSpan(const u8* in, size_t step, u8* out, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		const u8* d = &in[i];
+		out[i] = (
+			1*d[0*step] +
+			6*d[1*step] +
+			15*d[2*step] +
+			20*d[3*step] +
+			15*d[4*step] +
+			6*d[5*step] +
+			1*d[6*step]
+		) / 64;
+	}
+}
 
-	for (size_t j = g_BlurSize/2; j < h + g_BlurSize/2; ++j)
+#if ARCH_X86_X64
+static void BlurSpan_SSE2(const u8* in, size_t step, u8* out, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c6 = _mm_set1_epi16(6);
+	const __m128i c15 = _mm_set1_epi16(15);
+	const __m128i c20 = _mm_set1_epi16(20);
+
+	// Compute 16 outputs at once, in two halves of 16-bit values
+	// (the largest sum is 64*255, so it can't overflow)
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
 	{
-		for (size_t i = 0; i < w; ++i)
-		{
-			u8* d = &losData[i+j*rowSize];
-			*d = (
-				1*d[0] +
-				6*d[1] +
-				15*d[2] +
-				20*d[3] +
-				15*d[4] +
-				6*d[5] +
-				1*d[6]
-			) / 64;
-		}
+		const u8* d = &in[i];
+		__m128i v0 = _mm_loadu_si128((const __m128i*)&d[0*step]);
+		__m128i v1 = _mm_loadu_si128((const __m128i*)&d[1*step]);
+		__m128i v2 = _mm_loadu_si128((const __m128i*)&d[2*step]);
+		__m128i v3 = _mm_loadu_si128((const __m128i*)&d[3*step]);
+		__m128i v4 = _mm_loadu_si128((const __m128i*)&d[4*step]);
+		__m128i v5 = _mm_loadu_si128((const __m128i*)&d[5*step]);
+		__m128i v6 = _mm_loadu_si128((const __m128i*)&d[6*step]);
+
+		// The filter is symmetric, so add the pairs of taps with equal weights first
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(v0, zero), _mm_unpacklo_epi8(v6, zero));
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(v0, zero), _mm_unpackhi_epi8(v6, zero));
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(c6, _mm_add_epi16(_mm_unpacklo_epi8(v1, zero), _mm_unpacklo_epi8(v5, zero))));
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(c6, _mm_add_epi16(_mm_unpackhi_epi8(v1, zero), _mm_unpackhi_epi8(v5, zero))));
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(c15, _mm_add_epi16(_mm_unpacklo_epi8(v2, zero), _mm_unpacklo_epi8(v4, zero))));
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(c15, _mm_add_epi16(_mm_unpackhi_epi8(v2, zero), _mm_unpackhi_epi8(v4, zero))));
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(c20, _mm_unpacklo_epi8(v3, zero)));
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(c20, _mm_unpackhi_epi8(v3, zero)));
+
+		__m128i result = _mm_packus_epi16(_mm_srli_epi16(lo, 6), _mm_srli_epi16(hi, 6));
+		_mm_storeu_si128((__m128i*)&out[i], result);
 	}
 
+	// Do the remainder with the scalar code
+	BlurSpan(&in[i], step, &out[i], n - i);
+}
+#endif
+
+void CLOSTexture::BlurBitmap(const u8* losData, size_t w, size_t h, const ICmpRangeManager::LosRegion& region, u8* blurred)
+{
+	ENSURE(0 <= region.i0 && region.i0 <= region.i1 && region.i1 <= (i32)w);
+	ENSURE(0 <= region.j0 && region.j0 <= region.j1 && region.j1 <= (i32)h);
+
+	const size_t rowSize = w + g_BlurSize-1; // size of losData rows
+	const size_t regionW = region.i1 - region.i0;
+	const size_t regionH = region.j1 - region.j0;
+
+	void (*blurSpan)(const u8*, size_t, u8*, size_t) = &BlurSpan;
+#if ARCH_X86_X64
+	if (m_EnableSSE2)
+		blurSpan = &BlurSpan_SSE2;
+#endif
+
+	// Horizontal blur of every padded row that the vertical blur will read:
+
+	m_BlurBuffer.resize(regionW * (regionH + g_BlurSize-1));
+	for (size_t j = 0; j < regionH + g_BlurSize-1; ++j)
+		blurSpan(&losData[(region.j0 + j)*rowSize + region.i0], 1, &m_BlurBuffer[j*regionW], regionW);
+
 	// Vertical blur:
 
-	for (size_t j = 0; j < h; ++j)
-	{
-		for (size_t i = 0; i < w; ++i)
-		{
-			u8* d = &losData[i+j*rowSize];
-			*d = (
-				1*d[0*rowSize] +
-				6*d[1*rowSize] +
-				15*d[2*rowSize] +
-				20*d[3*rowSize] +
-				15*d[4*rowSize] +
-				6*d[5*rowSize] +
-				1*d[6*rowSize]
-			) / 64;
-		}
-	}
+	for (size_t j = 0; j < regionH; ++j)
+		blurSpan(&m_BlurBuffer[j*regionW], regionW, &blurred[j*regionW], regionW);
 }
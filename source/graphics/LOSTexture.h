@@ -75,13 +75,42 @@ private:
 	void ConstructTexture(int unit);
 	void RecomputeTexture(int unit);
 
+	/**
+	 * Returns the size of the unblurred LOS bitmap for a w*h vertex map,
+	 * which includes padding around the edges for the blur.
+	 */
 	size_t GetBitmapSize(size_t w, size_t h);
-	void GenerateBitmap(ICmpRangeManager::CLosQuerier los, u8* losData, size_t w, size_t h);
+
+	/**
+	 * Recomputes the unblurred LOS values of the vertexes in @p region,
+	 * in the bitmap @p losData (of GetBitmapSize(w, h) bytes, whose padding must be 0).
+	 */
+	void GenerateBitmap(ICmpRangeManager::CLosQuerier los, u8* losData, size_t w, size_t h, const ICmpRangeManager::LosRegion& region);
+
+	/**
+	 * Computes the blurred LOS values of the vertexes in @p region from the
+	 * unblurred bitmap @p losData, and stores them in @p blurred
+	 * (in rows of region.i1-region.i0 bytes).
+	 */
+	void BlurBitmap(const u8* losData, size_t w, size_t h, const ICmpRangeManager::LosRegion& region, u8* blurred);
 
 	CSimulation2& m_Simulation;
 
 	bool m_Dirty;
 
+	// Whether to use the SSE2 versions of the blur kernels
+	bool m_EnableSSE2;
+
+	// Unblurred LOS bitmap from the last recomputation, so that only
+	// the parts that have changed need to be regenerated
+	std::vector<u8> m_LosBitmap;
+	player_id_t m_LosPlayer;
+	size_t m_LosDirtyID;
+
+	// Temporary buffers for BlurBitmap and texture uploads
+	std::vector<u8> m_BlurBuffer;
+	std::vector<u8> m_BlurredBuffer;
+
 	GLuint m_Texture;
 
 	ssize_t m_MapSize; // vertexes per side
@@ -199,6 +199,40 @@ void CModel::CalcAnimatedObjectBounds(CSkeletonAnimDef* anim, CBoundingBoxAligne
 	m_AnimTime = AnimTime;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// GetAnimationObjectBounds: calculate (or fetch the cached) bounds encompassing all vertex positions for given
+// animation, and restore the current animation state afterwards
+CBoundingBoxAligned CModel::GetAnimationObjectBounds(CSkeletonAnim* anim)
+{
+	if (anim->m_AnimDef && m_BoneMatrices && anim->m_ObjectBounds.IsEmpty())
+	{
+		CSkeletonAnim* oldAnim = m_Anim;
+		float oldAnimTime = m_AnimTime;
+		int oldFlags = m_Flags;
+
+		if (SetAnimation(anim))
+			CalcAnimatedObjectBounds(anim->m_AnimDef, anim->m_ObjectBounds);
+
+		m_Anim = oldAnim;
+		m_AnimTime = oldAnimTime;
+		m_Flags = oldFlags;
+		m_ObjectBounds.SetEmpty();
+		InvalidateBounds();
+		InvalidatePosition();
+	}
+
+	if (!anim->m_ObjectBounds.IsEmpty())
+		return anim->m_ObjectBounds;
+
+	// Static (or unusable) animations leave the model in its rest pose
+	CBoundingBoxAligned bounds;
+	size_t numverts = m_pModelDef->GetNumVertices();
+	SModelVertex* verts = m_pModelDef->GetVertices();
+	for (size_t i = 0; i < numverts; ++i)
+		bounds += verts[i].m_Coords;
+	return bounds;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////
 const CBoundingBoxAligned CModel::GetWorldBoundsRec()
 {
@@ -167,6 +167,11 @@ public:
 	/// object-space bounds need to take animations into account.
 	void CalcAnimatedObjectBounds(CSkeletonAnimDef* anim,CBoundingBoxAligned& result);
 
+	/// Returns object-space bounds encompassing all vertex positions in every frame of the given animation (or the
+	/// static bounds, if it's not a skeletal animation that this model can play), without changing the current
+	/// animation. The result is cached in @p anim, so this should only be given animations from this model's actor.
+	CBoundingBoxAligned GetAnimationObjectBounds(CSkeletonAnim* anim);
+
 	// --- SELECTION BOX/BOUNDS ----------------------------------------------------------------------
 
 	/// Reimplemented here since proper models should participate in selection boxes.
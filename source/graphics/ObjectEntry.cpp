@@ -253,3 +253,11 @@ std::vector<CSkeletonAnim*> CObjectEntry::GetAnimations(const CStr& animationNam
 		anims.push_back(it->second);
 	return anims;
 }
+
+std::vector<CSkeletonAnim*> CObjectEntry::GetAllAnimations() const
+{
+	std::vector<CSkeletonAnim*> anims;
+	for (SkeletonAnimMap::const_iterator it = m_Animations.begin(); it != m_Animations.end(); ++it)
+		anims.push_back(it->second);
+	return anims;
+}
@@ -64,6 +64,9 @@ public:
 	// Returns all the animations matching the given name.
 	std::vector<CSkeletonAnim*> GetAnimations(const CStr& animationName) const;
 
+	// Returns all the animations, of any name.
+	std::vector<CSkeletonAnim*> GetAllAnimations() const;
+
 	// corresponding model
 	CModelAbstract* m_Model;
 
@@ -27,10 +27,17 @@
 #include "ps/CLogger.h"
 #include "ps/CStr.h"
 #include "ps/Profiler2.h"
+#include "ps/WorkerPool.h"
 #include "ps/XML/Xeromyces.h"
 
 #include "nvtt/nvtt.h"
 
+/**
+ * Upper limit on the number of conversion threads, since each queued or
+ * in-progress request holds a whole uncompressed texture in memory.
+ */
+static const size_t MAX_WORKER_THREADS = 8;
+
 /**
  * Output handler to collect NVTT's output into a simplistic buffer.
  * WARNING: Used in the worker thread - must be thread-safe.
@@ -275,7 +282,7 @@ CTextureConverter::CTextureConverter(PIVFS vfs, bool highQuality) :
 	// to avoid bugs caused by ABI changes
 	ENSURE(nvtt::version() >= NVTT_VERSION);
 
-	// Set up the worker thread:
+	// Set up the worker threads:
 
 	int ret;
 
@@ -286,32 +293,38 @@ CTextureConverter::CTextureConverter(PIVFS vfs, bool highQuality) :
 	ret = pthread_mutex_init(&m_WorkerMutex, NULL);
 	ENSURE(ret == 0);
 
-	ret = pthread_create(&m_WorkerThread, NULL, &RunThread, this);
-	ENSURE(ret == 0);
-
-	// Maybe we should share some centralised pool of worker threads?
-	// For now we'll just stick with a single thread for this specific use.
+	// Compression is almost entirely CPU-bound, so use one thread per spare core
+	// (but always at least one, since the main thread never converts anything itself)
+	size_t numThreads = std::max((size_t)1, CWorkerPool::GetDefaultNumThreads(MAX_WORKER_THREADS));
+	m_WorkerThreads.resize(numThreads);
+	for (size_t i = 0; i < numThreads; ++i)
+	{
+		ret = pthread_create(&m_WorkerThreads[i], NULL, &RunThread, this);
+		ENSURE(ret == 0);
+	}
 }
 
 CTextureConverter::~CTextureConverter()
 {
-	// Tell the thread to shut down
+	// Tell the threads to shut down
 	pthread_mutex_lock(&m_WorkerMutex);
 	m_Shutdown = true;
 	pthread_mutex_unlock(&m_WorkerMutex);
 
-	// Wake it up so it sees the notification
-	SDL_SemPost(m_WorkerSem);
+	// Wake them all up so they see the notification
+	for (size_t i = 0; i < m_WorkerThreads.size(); ++i)
+		SDL_SemPost(m_WorkerSem);
 
-	// Wait for it to shut down cleanly
-	pthread_join(m_WorkerThread, NULL);
+	// Wait for them to shut down cleanly
+	for (size_t i = 0; i < m_WorkerThreads.size(); ++i)
+		pthread_join(m_WorkerThreads[i], NULL);
 
 	// Clean up resources
 	SDL_DestroySemaphore(m_WorkerSem);
 	pthread_mutex_destroy(&m_WorkerMutex);
 }
 
-bool CTextureConverter::ConvertTexture(const CTexturePtr& texture, const VfsPath& src, const VfsPath& dest, const Settings& settings)
+bool CTextureConverter::ConvertTexture(const CTexturePtr& texture, const VfsPath& src, const VfsPath& dest, const Settings& settings, bool highPriority)
 {
 	shared_ptr<u8> file;
 	size_t fileSize;
@@ -421,15 +434,40 @@ bool CTextureConverter::ConvertTexture(const CTexturePtr& texture, const VfsPath
 	tex_free(&tex);
 
 	pthread_mutex_lock(&m_WorkerMutex);
-	m_RequestQueue.push_back(request);
+	if (highPriority)
+		m_HighPriorityQueue.push_back(request);
+	else
+		m_RequestQueue.push_back(request);
 	pthread_mutex_unlock(&m_WorkerMutex);
 
-	// Wake up the worker thread
+	// Wake up a worker thread
 	SDL_SemPost(m_WorkerSem);
 
 	return true;
 }
 
+bool CTextureConverter::Prioritize(const CTexturePtr& texture)
+{
+	bool found = false;
+
+	// Moving the request between queues doesn't change the number of queued
+	// requests, so the semaphore doesn't need to be touched
+	pthread_mutex_lock(&m_WorkerMutex);
+	for (std::deque<shared_ptr<ConversionRequest> >::iterator it = m_RequestQueue.begin(); it != m_RequestQueue.end(); ++it)
+	{
+		if ((*it)->texture == texture)
+		{
+			m_HighPriorityQueue.push_back(*it);
+			m_RequestQueue.erase(it);
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&m_WorkerMutex);
+
+	return found;
+}
+
 bool CTextureConverter::Poll(CTexturePtr& texture, VfsPath& dest, bool& ok)
 {
 	shared_ptr<ConversionResult> result;
@@ -449,6 +487,9 @@ bool CTextureConverter::Poll(CTexturePtr& texture, VfsPath& dest, bool& ok)
 		return false;
 	}
 
+	texture = result->texture;
+	dest = result->dest;
+
 	if (!result->ret)
 	{
 		// conversion had failed
@@ -469,16 +510,14 @@ bool CTextureConverter::Poll(CTexturePtr& texture, VfsPath& dest, bool& ok)
 	}
 
 	// Succeeded in converting texture
-	texture = result->texture;
-	dest = result->dest;
 	ok = true;
 	return true;
 }
 
-bool CTextureConverter::IsBusy()
+bool CTextureConverter::IsBusy(bool highPriority)
 {
 	pthread_mutex_lock(&m_WorkerMutex);
-	bool busy = !m_RequestQueue.empty();
+	bool busy = !m_HighPriorityQueue.empty() || (!highPriority && !m_RequestQueue.empty());
 	pthread_mutex_unlock(&m_WorkerMutex);
 
 	return busy;
@@ -504,9 +543,18 @@ void* CTextureConverter::RunThread(void* data)
 			break;
 		}
 		// If we weren't woken up for shutdown, we must have been woken up for
-		// a new request, so grab it from the queue
-		shared_ptr<ConversionRequest> request = textureConverter->m_RequestQueue.front();
-		textureConverter->m_RequestQueue.pop_front();
+		// a new request, so grab the most important one from the queues
+		shared_ptr<ConversionRequest> request;
+		if (!textureConverter->m_HighPriorityQueue.empty())
+		{
+			request = textureConverter->m_HighPriorityQueue.front();
+			textureConverter->m_HighPriorityQueue.pop_front();
+		}
+		else
+		{
+			request = textureConverter->m_RequestQueue.front();
+			textureConverter->m_RequestQueue.pop_front();
+		}
 		pthread_mutex_unlock(&textureConverter->m_WorkerMutex);
 
 		// Set up the result object
@@ -30,8 +30,9 @@ class MD5;
  * Texture conversion helper class.
  * Provides an asynchronous API to convert input image files into compressed DDS,
  * given various conversion settings.
- * (The (potentially very slow) compression is a performed in a background thread,
- * so the game can remain responsive).
+ * (The (potentially very slow) compression is a performed in a pool of background
+ * threads, so the game can remain responsive and multiple textures can be
+ * compressed in parallel).
  * Also provides an API to load conversion settings from XML files.
  *
  * XML files are of the form:
@@ -152,9 +153,9 @@ public:
 	CTextureConverter(PIVFS vfs, bool highQuality);
 
 	/**
-	 * Destroy texture converter and wait to shut down worker thread.
-	 * This might take a long time (maybe seconds) if the worker is busy
-	 * processing a texture.
+	 * Destroy texture converter and wait to shut down worker threads.
+	 * This might take a long time (maybe seconds) if the workers are busy
+	 * processing textures.
 	 */
 	~CTextureConverter();
 
@@ -177,25 +178,39 @@ public:
 	 * Otherwise it will return true and start an asynchronous conversion request,
 	 * whose result will be returned from Poll() (with the texture and dest passed
 	 * into this function).
+	 * High-priority requests are processed before any queued low-priority ones
+	 * (but results may be returned in any order).
 	 */
-	bool ConvertTexture(const CTexturePtr& texture, const VfsPath& src, const VfsPath& dest, const Settings& settings);
+	bool ConvertTexture(const CTexturePtr& texture, const VfsPath& src, const VfsPath& dest, const Settings& settings, bool highPriority = false);
+
+	/**
+	 * Move a queued low-priority request for the given texture ahead of all
+	 * other low-priority requests, as if it had been made with highPriority.
+	 * Returns false if there is no such request (e.g. it's already being converted).
+	 */
+	bool Prioritize(const CTexturePtr& texture);
 
 	/**
 	 * Returns the result of a successful ConvertTexture call.
 	 * If no result is available yet, returns false.
-	 * Otherwise, if the conversion succeeded, it sets ok to true and sets
-	 * texture and dest to the corresponding values passed into ConvertTexture(),
-	 * then returns true.
-	 * If the conversion failed, it sets ok to false and doesn't touch the other arguments,
+	 * Otherwise it sets texture and dest to the corresponding values passed
+	 * into ConvertTexture(), sets ok to whether the conversion succeeded,
 	 * then returns true.
 	 */
 	bool Poll(CTexturePtr& texture, VfsPath& dest, bool& ok);
 
 	/**
-	 * Returns whether there is currently a queued request from ConvertTexture().
-	 * (Note this may return false while the worker thread is still converting the last texture.)
+	 * Returns whether there is currently a queued request from ConvertTexture()
+	 * that no worker thread has started on yet, i.e. whether all the workers are
+	 * busy. If highPriority, only high-priority requests are considered.
+	 * (Note this may return false while the worker threads are still converting the last textures.)
+	 */
+	bool IsBusy(bool highPriority = false);
+
+	/**
+	 * Returns the number of worker threads converting textures in parallel.
 	 */
-	bool IsBusy();
+	size_t GetNumWorkerThreads() const { return m_WorkerThreads.size(); }
 
 private:
 	static void* RunThread(void* data);
@@ -203,13 +218,14 @@ private:
 	PIVFS m_VFS;
 	bool m_HighQuality;
 
-	pthread_t m_WorkerThread;
+	std::vector<pthread_t> m_WorkerThreads;
 	pthread_mutex_t m_WorkerMutex;
-	SDL_sem* m_WorkerSem;
+	SDL_sem* m_WorkerSem; // posted once per queued request (and once per thread on shutdown)
 
 	struct ConversionRequest;
 	struct ConversionResult;
 
+	std::deque<shared_ptr<ConversionRequest> > m_HighPriorityQueue; // protected by m_WorkerMutex
 	std::deque<shared_ptr<ConversionRequest> > m_RequestQueue; // protected by m_WorkerMutex
 	std::deque<shared_ptr<ConversionResult> > m_ResultQueue; // protected by m_WorkerMutex
 	bool m_Shutdown; // protected by m_WorkerMutex
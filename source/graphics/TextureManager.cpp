@@ -284,8 +284,9 @@ public:
 	/**
 	 * Initiates an asynchronous conversion process, from the texture's
 	 * source file to the corresponding loose cache file.
+	 * High-priority requests jump ahead of queued prefetch conversions.
 	 */
-	void ConvertTexture(const CTexturePtr& texture)
+	void ConvertTexture(const CTexturePtr& texture, bool highPriority)
 	{
 		VfsPath sourcePath = texture->m_Properties.m_Path;
 
@@ -301,31 +302,58 @@ public:
 
 		CTextureConverter::Settings settings = GetConverterSettings(texture);
 
-		m_TextureConverter.ConvertTexture(texture, sourcePath, looseCachePath, settings);
+		m_TextureConverter.ConvertTexture(texture, sourcePath, looseCachePath, settings, highPriority);
 	}
 
-	bool GenerateCachedTexture(const VfsPath& sourcePath, VfsPath& archiveCachePath)
+	/**
+	 * Called when a prefetched texture that was already sent to the converter
+	 * is actually needed, to move it ahead of the other prefetched textures.
+	 */
+	void PrioritizeConversion(const CTexturePtr& texture)
+	{
+		m_TextureConverter.Prioritize(texture);
+	}
+
+	bool StartGeneratingCachedTexture(const VfsPath& sourcePath, VfsPath& archiveCachePath, VfsPath& outputPath, bool& converting)
 	{
 		archiveCachePath = m_CacheLoader.ArchiveCachePath(sourcePath);
 
 		CTextureProperties textureProps(sourcePath);
 		CTexturePtr texture = CreateTexture(textureProps);
-		CTextureConverter::Settings settings = GetConverterSettings(texture);
 
-		if (!m_TextureConverter.ConvertTexture(texture, sourcePath, VfsPath("cache") / archiveCachePath, settings))
+		MD5 hash;
+		u32 version;
+		PrepareCacheKey(texture, hash, version);
+		outputPath = m_CacheLoader.LooseCachePath(sourcePath, hash, version);
+		if (outputPath.empty())
 			return false;
 
-		while (true)
+		// The path depends on the source file and the conversion settings,
+		// so if it already exists then it's up to date
+		if (m_VFS->GetFileInfo(outputPath, NULL) >= 0)
 		{
-			CTexturePtr textureOut;
-			VfsPath dest;
-			bool ok;
-			if (m_TextureConverter.Poll(textureOut, dest, ok))
-				return ok;
-
-			// Spin-loop is dumb but it works okay for now
-			SDL_Delay(0);
+			converting = false;
+			return true;
 		}
+
+		CTextureConverter::Settings settings = GetConverterSettings(texture);
+
+		if (!m_TextureConverter.ConvertTexture(texture, sourcePath, outputPath, settings))
+			return false;
+
+		converting = true;
+		return true;
+	}
+
+	bool PollGeneratedCachedTexture(VfsPath& outputPath, bool& ok)
+	{
+		CTexturePtr texture;
+		return m_TextureConverter.Poll(texture, outputPath, ok);
+	}
+
+	bool IsConverterBusy()
+	{
+		return m_TextureConverter.IsBusy();
 	}
 
 	bool MakeProgress()
@@ -351,10 +379,11 @@ public:
 			}
 		}
 
-		// We'll only push new conversion requests if it's not already busy
-		bool converterBusy = m_TextureConverter.IsBusy();
-
-		if (!converterBusy)
+		// We'll only push new conversion requests if the workers don't already
+		// have requests waiting for them (to limit the memory used by queued textures).
+		// High-priority requests skip ahead of prefetched ones, so they only need
+		// to wait for other high-priority requests.
+		if (!m_TextureConverter.IsBusy(true))
 		{
 			// Look for all high-priority textures needing conversion.
 			// (Iterating over all textures isn't optimally efficient, but it
@@ -366,7 +395,7 @@ public:
 				{
 					// Start converting this texture
 					(*it)->m_State = CTexture::HIGH_IS_CONVERTING;
-					ConvertTexture(*it);
+					ConvertTexture(*it, true);
 					return true;
 				}
 			}
@@ -390,14 +419,14 @@ public:
 		}
 
 		// If we've got nothing better to do, then start converting prefetched textures.
-		if (!converterBusy)
+		if (!m_TextureConverter.IsBusy())
 		{
 			for (TextureCache::iterator it = m_TextureCache.begin(); it != m_TextureCache.end(); ++it)
 			{
 				if ((*it)->m_State == CTexture::PREFETCH_NEEDS_CONVERTING)
 				{
 					(*it)->m_State = CTexture::PREFETCH_IS_CONVERTING;
-					ConvertTexture(*it);
+					ConvertTexture(*it, false);
 					return true;
 				}
 			}
@@ -550,6 +579,16 @@ bool CTexture::TryLoad()
 				m_State = HIGH_NEEDS_CONVERTING;
 		}
 	}
+	else if (m_State == PREFETCH_IS_CONVERTING)
+	{
+		// The prefetched conversion may still be queued behind lots of other
+		// prefetched textures, so move it to the front
+		if (shared_ptr<CTexture> self = m_Self.lock())
+		{
+			m_TextureManager->PrioritizeConversion(self);
+			m_State = HIGH_IS_CONVERTING;
+		}
+	}
 
 	return (m_State == LOADED);
 }
@@ -636,7 +675,17 @@ bool CTextureManager::MakeProgress()
 	return m->MakeProgress();
 }
 
-bool CTextureManager::GenerateCachedTexture(const VfsPath& path, VfsPath& outputPath)
+bool CTextureManager::StartGeneratingCachedTexture(const VfsPath& path, VfsPath& archiveCachePath, VfsPath& outputPath, bool& converting)
+{
+	return m->StartGeneratingCachedTexture(path, archiveCachePath, outputPath, converting);
+}
+
+bool CTextureManager::PollGeneratedCachedTexture(VfsPath& outputPath, bool& ok)
+{
+	return m->PollGeneratedCachedTexture(outputPath, ok);
+}
+
+bool CTextureManager::IsConverterBusy()
 {
-	return m->GenerateCachedTexture(path, outputPath);
+	return m->IsConverterBusy();
 }
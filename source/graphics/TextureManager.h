@@ -102,12 +102,32 @@ public:
 	bool MakeProgress();
 
 	/**
-	 * Synchronously converts and compresses and saves the texture,
-	 * and returns the output path (minus a "cache/" prefix). This
-	 * is intended for pre-caching textures in release archives.
-	 * @return true on success
+	 * Begins converting and compressing the texture in the background. This
+	 * is intended for pre-caching textures in release archives, and must not
+	 * be mixed with MakeProgress.
+	 * The output is saved as a loose cache file, whose name depends on the source
+	 * file's timestamp and size and on the conversion settings, so a previous
+	 * output can be reused if it still exists.
+	 * @param archiveCachePath set to the name to store the texture as in an archive
+	 * @param outputPath set to the path of the loose cache file (with a "cache/" prefix)
+	 * @param converting set to true if a conversion was started (and will be
+	 *  returned by PollGeneratedCachedTexture), or false if outputPath is up to date
+	 * @return false on error
 	 */
-	bool GenerateCachedTexture(const VfsPath& path, VfsPath& outputPath);
+	bool StartGeneratingCachedTexture(const VfsPath& path, VfsPath& archiveCachePath, VfsPath& outputPath, bool& converting);
+
+	/**
+	 * Returns true if a conversion begun by StartGeneratingCachedTexture has finished,
+	 * setting outputPath to identify it and ok to whether it succeeded.
+	 * Conversions may finish in a different order to how they were started.
+	 */
+	bool PollGeneratedCachedTexture(VfsPath& outputPath, bool& ok);
+
+	/**
+	 * Returns whether all the texture converter threads are already busy, so that
+	 * StartGeneratingCachedTexture would just queue up more work (and memory).
+	 */
+	bool IsConverterBusy();
 
 private:
 	CTextureManagerImpl* m;
@@ -23,6 +23,49 @@
 
 class TestLOSTexture : public CxxTest::TestSuite
 {
+	typedef ICmpRangeManager::LosRegion LosRegion;
+
+	// Regenerates and blurs the whole bitmap
+	void generateFull(CLOSTexture& tex, const std::vector<u32>& state, ssize_t size, std::vector<u8>& losData, std::vector<u8>& blurred)
+	{
+		ICmpRangeManager::CLosQuerier los(1, state, size);
+
+		LosRegion all = { 0, 0, (i32)size, (i32)size };
+		losData.clear();
+		losData.resize(tex.GetBitmapSize(size, size));
+		blurred.resize(size*size);
+		tex.GenerateBitmap(los, &losData[0], size, size, all);
+		tex.BlurBitmap(&losData[0], size, size, all, &blurred[0]);
+	}
+
+	// Regenerates the given region of the bitmap and blurs the area around it
+	// into the full-size blurred bitmap, like CLOSTexture::RecomputeTexture
+	void generateRegion(CLOSTexture& tex, const std::vector<u32>& state, ssize_t size, const LosRegion& region, std::vector<u8>& losData, std::vector<u8>& blurred)
+	{
+		ICmpRangeManager::CLosQuerier los(1, state, size);
+
+		tex.GenerateBitmap(los, &losData[0], size, size, region);
+
+		LosRegion blurRegion = {
+			std::max(region.i0 - 3, 0), std::max(region.j0 - 3, 0),
+			std::min(region.i1 + 3, (i32)size), std::min(region.j1 + 3, (i32)size)
+		};
+		std::vector<u8> out((blurRegion.i1 - blurRegion.i0) * (blurRegion.j1 - blurRegion.j0));
+		tex.BlurBitmap(&losData[0], size, size, blurRegion, &out[0]);
+
+		for (i32 j = blurRegion.j0; j < blurRegion.j1; ++j)
+			for (i32 i = blurRegion.i0; i < blurRegion.i1; ++i)
+				blurred[i + j*size] = out[(i - blurRegion.i0) + (j - blurRegion.j0)*(blurRegion.i1 - blurRegion.i0)];
+	}
+
+	// Sets every vertex in the region to the given state
+	void fill(std::vector<u32>& state, ssize_t size, const LosRegion& region, u32 value)
+	{
+		for (i32 j = region.j0; j < region.j1; ++j)
+			for (i32 i = region.i0; i < region.i1; ++i)
+				state[i + j*size] = value;
+	}
+
 public:
 	void test_basic()
 	{
@@ -42,17 +85,72 @@ public:
 		};
 		std::vector<u32> inputDataVec(inputData, inputData+size*size);
 
-		ICmpRangeManager::CLosQuerier los(1, inputDataVec, size);
+		std::vector<u8> losData, blurred;
+		generateFull(tex, inputDataVec, size, losData, blurred);
 
-		std::vector<u8> losData;
-		losData.resize(tex.GetBitmapSize(size, size));
+//		for (size_t i = 0; i < blurred.size(); ++i)
+//			printf("%s %3d", i % size ? "" : "\n", blurred[i]);
 
-		tex.GenerateBitmap(los, &losData[0], size, size);
+		TS_ASSERT_EQUALS(blurred[0], 104);
+	}
 
-//		for (size_t i = 0; i < losData.size(); ++i)
-//			printf("%s %3d", i % (size_t)sqrt(losData.size()) ? "" : "\n", losData[i]);
+	void test_sse2()
+	{
+		CSimulation2 sim(NULL, NULL);
+		CLOSTexture tex(sim);
+		if (!tex.m_EnableSSE2)
+			return;
 
-		TS_ASSERT_EQUALS(losData[0], 104);
+		// Random-ish state, with a size that isn't a multiple of the SIMD width
+		const ssize_t size = 45;
+		std::vector<u32> state(size*size);
+		u32 x = 1;
+		for (size_t i = 0; i < state.size(); ++i)
+		{
+			x = x * 1103515245 + 12345;
+			state[i] = (x >> 16) % 3;
+		}
+
+		std::vector<u8> losData, blurred, blurredScalar;
+		generateFull(tex, state, size, losData, blurred);
+		tex.m_EnableSSE2 = false;
+		generateFull(tex, state, size, losData, blurredScalar);
+
+		TS_ASSERT(blurred == blurredScalar);
+	}
+
+	void test_incremental()
+	{
+		CSimulation2 sim(NULL, NULL);
+		CLOSTexture tex(sim);
+
+		const ssize_t size = 65;
+		std::vector<u32> state(size*size);
+		LosRegion explored = { 5, 5, 40, 30 };
+		fill(state, size, explored, 1);
+
+		std::vector<u8> losData, blurred;
+		generateFull(tex, state, size, losData, blurred);
+
+		// Change some regions (including ones at the edges of the map,
+		// and ones whose blurred areas overlap), and update only those
+		LosRegion changes[] = {
+			{ 10, 10, 26, 20 },
+			{ 0, 0, 3, 60 },
+			{ 28, 12, 36, 22 },
+			{ 48, 48, 65, 65 },
+			{ 20, 40, 21, 41 }
+		};
+		for (size_t n = 0; n < ARRAY_SIZE(changes); ++n)
+		{
+			fill(state, size, changes[n], n % 2 ? 1 : 2);
+			generateRegion(tex, state, size, changes[n], losData, blurred);
+
+			std::vector<u8> losDataFull, blurredFull;
+			generateFull(tex, state, size, losDataFull, blurredFull);
+			TS_ASSERT(losData == losDataFull);
+			TS_ASSERT(blurred == blurredFull);
+		}
 	}
 
 	void test_perf_DISABLED()
@@ -64,18 +162,42 @@ public:
 		std::vector<u32> inputDataVec;
 		inputDataVec.resize(size*size);
 
-		ICmpRangeManager::CLosQuerier los(1, inputDataVec, size);
-
 		size_t reps = 128;
 		double t = timer_Time();
 		for (size_t i = 0; i < reps; ++i)
 		{
-			std::vector<u8> losData;
-			losData.resize(tex.GetBitmapSize(size, size));
-
-			tex.GenerateBitmap(los, &losData[0], size, size);
+			std::vector<u8> losData, blurred;
+			generateFull(tex, inputDataVec, size, losData, blurred);
 		}
 		double dt = timer_Time() - t;
-		printf("\n# %f secs\n", dt/reps);
+		printf("\n# full: %f secs\n", dt/reps);
+
+		// Typical update after a few units have moved: a few 16x16 blocks
+		std::vector<u8> losData, blurred;
+		generateFull(tex, inputDataVec, size, losData, blurred);
+		LosRegion regions[] = {
+			{ 16, 32, 48, 48 },
+			{ 128, 128, 144, 144 },
+			{ 200, 64, 232, 96 }
+		};
+		t = timer_Time();
+		for (size_t i = 0; i < reps; ++i)
+			for (size_t n = 0; n < ARRAY_SIZE(regions); ++n)
+				generateRegion(tex, inputDataVec, size, regions[n], losData, blurred);
+		dt = timer_Time() - t;
+		printf("# incremental: %f secs\n", dt/reps);
+
+		if (tex.m_EnableSSE2)
+		{
+			tex.m_EnableSSE2 = false;
+			t = timer_Time();
+			for (size_t i = 0; i < reps; ++i)
+			{
+				std::vector<u8> losData, blurred;
+				generateFull(tex, inputDataVec, size, losData, blurred);
+			}
+			dt = timer_Time() - t;
+			printf("# full (without SSE2): %f secs\n", dt/reps);
+		}
 	}
 };
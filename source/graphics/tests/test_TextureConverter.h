@@ -23,8 +23,11 @@
 #include "lib/file/vfs/vfs.h"
 #include "lib/res/h_mgr.h"
 #include "lib/tex/tex.h"
+#include "ps/CStr.h"
 #include "ps/XML/Xeromyces.h"
 
+#include <set>
+
 class TestTextureConverter : public CxxTest::TestSuite
 {
 	PIVFS m_VFS;
@@ -100,4 +103,44 @@ public:
 
 		tex_free(&tex);
 	}
+
+	void test_convert_parallel()
+	{
+		VfsPath src = L"art/textures/b/test.png";
+
+		CTextureConverter converter(m_VFS, false);
+		TS_ASSERT_LESS_THAN_EQUALS((size_t)1, converter.GetNumWorkerThreads());
+
+		CTextureConverter::Settings settings = converter.ComputeSettings(L"", std::vector<CTextureConverter::SettingsFile*>());
+
+		// Queue more requests than there are workers, with a mixture of priorities
+		const size_t num = converter.GetNumWorkerThreads() * 2 + 2;
+		std::set<VfsPath> pending;
+		for (size_t i = 0; i < num; ++i)
+		{
+			VfsPath dest = VfsPath(L"cache") / (L"test" + CStrW::FromUInt(i) + L".png");
+			TS_ASSERT(converter.ConvertTexture(CTexturePtr(), src, dest, settings, i % 2 == 0));
+			pending.insert(dest);
+		}
+
+		// Every request should produce exactly one result
+		for (size_t i = 0; i < 1000 && !pending.empty(); ++i)
+		{
+			CTexturePtr texture;
+			VfsPath dest;
+			bool ok;
+			if (converter.Poll(texture, dest, ok))
+			{
+				TS_ASSERT(ok);
+				TS_ASSERT_EQUALS(pending.erase(dest), (size_t)1);
+				continue;
+			}
+			SDL_Delay(10);
+		}
+		TS_ASSERT(pending.empty());
+		TS_ASSERT(!converter.IsBusy());
+
+		// Nothing is queued any more, so there's nothing to prioritize
+		TS_ASSERT(!converter.Prioritize(CTexturePtr()));
+	}
 };
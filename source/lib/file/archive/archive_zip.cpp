@@ -1,4 +1,4 @@
-/* Copyright (c) 2010 Wildfire Games
+/* Copyright (c) 2012 Wildfire Games
  *
  * Permission is hereby granted, free of charge, to any person obtaining
  * a copy of this software and associated documentation files (the
@@ -34,6 +34,7 @@
 #include "lib/bits.h"
 #include "lib/byte_order.h"
 #include "lib/allocators/pool.h"
+#include "lib/posix/posix_pthread.h"
 #include "lib/sysdep/filesystem.h"
 #include "lib/file/archive/archive.h"
 #include "lib/file/archive/codec_zlib.h"
@@ -289,6 +290,15 @@ cassert(sizeof(ECDR) == 22);
 // ArchiveFile_Zip
 //-----------------------------------------------------------------------------
 
+// protects ArchiveFile_Zip's offset fixup (files may be loaded by
+// several threads at once)
+static pthread_mutex_t fixup_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct FixupLock
+{
+	FixupLock() { pthread_mutex_lock(&fixup_mutex); }
+	~FixupLock() { pthread_mutex_unlock(&fixup_mutex); }
+};
+
 class ArchiveFile_Zip : public IArchiveFile
 {
 public:
@@ -316,7 +326,7 @@ public:
 
 	virtual Status Load(const OsPath& UNUSED(name), const shared_ptr<u8>& buf, size_t size) const
 	{
-		AdjustOffset();
+		const off_t ofs = AdjustOffset();
 
 		PICodec codec;
 		switch(m_method)
@@ -333,7 +343,7 @@ public:
 
 		Stream stream(codec);
 		stream.SetOutputBuffer(buf.get(), size);
-		io::Operation op(*m_file.get(), 0, m_csize, m_ofs);
+		io::Operation op(*m_file.get(), 0, m_csize, ofs);
 		StreamFeeder streamFeeder(stream);
 		RETURN_STATUS_IF_ERR(io::Run(op, io::Parameters(), streamFeeder));
 		RETURN_STATUS_IF_ERR(stream.Finish());
@@ -397,20 +407,37 @@ private:
 	 * this is called at file-open time instead of while mounting to
 	 * reduce seeks: since reading the file will typically follow, the
 	 * block cache entirely absorbs the IO cost.
+	 *
+	 * the LFH is read without holding the lock; if several threads race to
+	 * fix up the same file, only the first result is applied.
+	 *
+	 * @return offset of the file data.
 	 **/
-	void AdjustOffset() const
+	off_t AdjustOffset() const
 	{
-		if(!(m_flags & NeedsFixup))
-			return;
-		m_flags &= ~NeedsFixup;
+		off_t ofs;
+		{
+			FixupLock lock;
+			if(!(m_flags & NeedsFixup))
+				return m_ofs;
+			ofs = m_ofs;
+		}
 
 		// performance note: this ends up reading one file block, which is
 		// only in the block cache if the file starts in the same block as a
 		// previously read file (i.e. both are small).
 		LFH lfh;
-		io::Operation op(*m_file.get(), 0, sizeof(LFH), m_ofs);
-		if(io::Run(op, io::Parameters(), LFH_Copier((u8*)&lfh, sizeof(LFH))) == INFO::OK)
-			m_ofs += (off_t)lfh.Size();
+		io::Operation op(*m_file.get(), 0, sizeof(LFH), ofs);
+		const bool ok = (io::Run(op, io::Parameters(), LFH_Copier((u8*)&lfh, sizeof(LFH))) == INFO::OK);
+
+		FixupLock lock;
+		if(m_flags & NeedsFixup)
+		{
+			m_flags &= ~NeedsFixup;
+			if(ok)
+				m_ofs += (off_t)lfh.Size();
+		}
+		return m_ofs;
 	}
 
 	PFile m_file;
@@ -1,4 +1,4 @@
-/* Copyright (c) 2011 Wildfire Games
+/* Copyright (c) 2012 Wildfire Games
  *
  * Permission is hereby granted, free of charge, to any person obtaining
  * a copy of this software and associated documentation files (the
@@ -24,6 +24,7 @@
 #include "lib/file/io/io.h"
 
 #include "lib/sysdep/rtl.h"
+#include "lib/posix/posix_pthread.h"
 
 static const StatusDefinition ioStatusDefinitions[] = {
 	{ ERR::IO, L"Error during IO", EIO }
@@ -36,6 +37,30 @@ namespace io {
 // note that the Windows aio implementation requires buffers, sizes and
 // offsets to be sector-aligned.
 
+// synchronous IO must be safe when several threads share a file descriptor
+// (e.g. an archive). Windows has no pread/pwrite, so the seek and transfer
+// are done while holding a lock instead.
+#if OS_WIN
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct IoLock
+{
+	IoLock() { pthread_mutex_lock(&io_mutex); }
+	~IoLock() { pthread_mutex_unlock(&io_mutex); }
+};
+#endif
+
+static ssize_t TransferAt(aiocb& cb)
+{
+	void* buf = (void*)cb.aio_buf;	// cast from volatile void*
+#if OS_WIN
+	IoLock lock;
+	ENSURE(lseek(cb.aio_fildes, cb.aio_offset, SEEK_SET) == cb.aio_offset);
+	return (cb.aio_lio_opcode == LIO_WRITE)? write(cb.aio_fildes, buf, cb.aio_nbytes) : read(cb.aio_fildes, buf, cb.aio_nbytes);
+#else
+	return (cb.aio_lio_opcode == LIO_WRITE)? pwrite(cb.aio_fildes, buf, cb.aio_nbytes, cb.aio_offset) : pread(cb.aio_fildes, buf, cb.aio_nbytes, cb.aio_offset);
+#endif
+}
+
 Status Issue(aiocb& cb, size_t queueDepth)
 {
 #if CONFIG2_FILE_ENABLE_AIO
@@ -50,10 +75,7 @@ Status Issue(aiocb& cb, size_t queueDepth)
 	UNUSED2(queueDepth);
 #endif
 	{
-		ENSURE(lseek(cb.aio_fildes, cb.aio_offset, SEEK_SET) == cb.aio_offset);
-
-		void* buf = (void*)cb.aio_buf;	// cast from volatile void*
-		const ssize_t bytesTransferred = (cb.aio_lio_opcode == LIO_WRITE)? write(cb.aio_fildes, buf, cb.aio_nbytes) : read(cb.aio_fildes, buf, cb.aio_nbytes);
+		const ssize_t bytesTransferred = TransferAt(cb);
 		if(bytesTransferred < 0)
 			WARN_RETURN(StatusFromErrno());
 
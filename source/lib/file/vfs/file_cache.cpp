@@ -1,4 +1,4 @@
-/* Copyright (c) 2010 Wildfire Games
+/* Copyright (c) 2012 Wildfire Games
  *
  * Permission is hereby granted, free of charge, to any person obtaining
  * a copy of this software and associated documentation files (the
@@ -37,6 +37,20 @@
 #include "lib/allocators/headerless.h"
 #include "lib/sysdep/os_cpu.h"	// os_cpu_PageSize
 #include "lib/posix/posix_mman.h"	// mprotect
+#include "lib/posix/posix_pthread.h"
+
+
+// the cache may be used by several threads at once, and the shared_ptr
+// deleters return memory to the allocator from whichever thread drops
+// the last reference. each cache and its allocator therefore have their
+// own mutex. the cache's may be held while the allocator's is taken
+// (e.g. when evicting), but not vice versa.
+struct FileCacheLock
+{
+	FileCacheLock(pthread_mutex_t& mutex) : m_mutex(mutex) { pthread_mutex_lock(&m_mutex); }
+	~FileCacheLock() { pthread_mutex_unlock(&m_mutex); }
+	pthread_mutex_t& m_mutex;
+};
 
 
 //-----------------------------------------------------------------------------
@@ -90,16 +104,24 @@ private:
 // adds statistics and AllocatorChecker to a HeaderlessAllocator
 class Allocator
 {
+	NONCOPYABLE(Allocator);
 public:
 	Allocator(size_t maxSize)
 		: m_allocator(maxSize)
 	{
+		pthread_mutex_init(&m_mutex, 0);
+	}
+
+	~Allocator()
+	{
+		pthread_mutex_destroy(&m_mutex);
 	}
 
 	shared_ptr<u8> Allocate(size_t size, const PAllocator& pthis)
 	{
 		const size_t alignedSize = Align<maxSectorSize>(size);
 
+		FileCacheLock lock(m_mutex);
 		u8* mem = (u8*)m_allocator.Allocate(alignedSize);
 		if(!mem)
 			return DummySharedPtr<u8>(0);	// (prevent FileCacheDeleter from seeing a null pointer)
@@ -121,6 +143,7 @@ public:
 		// HeaderlessAllocator needs to affix boundary tags.
 		(void)mprotect(mem, size, PROT_READ|PROT_WRITE);
 
+		FileCacheLock lock(m_mutex);
 #ifndef NDEBUG
 		m_checker.OnDeallocate(mem, alignedSize);
 #endif
@@ -129,7 +152,16 @@ public:
 		stats_buf_free();
 	}
 
+	// (the extant buffer count is shared with Allocate and Deallocate,
+	// so references must be counted under the same lock.)
+	void AddReference()
+	{
+		FileCacheLock lock(m_mutex);
+		stats_buf_ref();
+	}
+
 private:
+	pthread_mutex_t m_mutex;
 	HeaderlessAllocator m_allocator;
 
 #ifndef NDEBUG
@@ -156,10 +188,17 @@ void FileCacheDeleter::operator()(u8* mem) const
 
 class FileCache::Impl
 {
+	NONCOPYABLE(Impl);
 public:
 	Impl(size_t maxSize)
 		: m_allocator(new Allocator(maxSize))
 	{
+		pthread_mutex_init(&m_mutex, 0);
+	}
+
+	~Impl()
+	{
+		pthread_mutex_destroy(&m_mutex);
 	}
 
 	shared_ptr<u8> Reserve(size_t size)
@@ -167,6 +206,8 @@ public:
 		// (should never happen because the VFS ensures size != 0.)
 		ENSURE(size != 0);
 
+		FileCacheLock lock(m_mutex);
+
 		// (300 iterations have been observed when reserving several MB
 		// of space in a full cache)
 		for(;;)
@@ -193,6 +234,14 @@ public:
 
 	void Add(const VfsPath& pathname, const shared_ptr<u8>& data, size_t size, size_t cost)
 	{
+		FileCacheLock lock(m_mutex);
+
+		// another thread may have loaded and added the same file in the
+		// meantime; keep its copy (ours is freed when the caller is done).
+		shared_ptr<u8> existingData;
+		if(m_cache.retrieve(pathname, existingData, 0, false))
+			return;
+
 		// zero-copy cache => all users share the contents => must not
 		// allow changes. this will be reverted when deallocating.
 		(void)mprotect((void*)data.get(), size, PROT_READ);
@@ -202,15 +251,18 @@ public:
 
 	bool Retrieve(const VfsPath& pathname, shared_ptr<u8>& data, size_t& size)
 	{
+		FileCacheLock lock(m_mutex);
+
 		// (note: don't call stats_cache because we don't know the file size
 		// in case of a cache miss; doing so is left to the caller.)
-		stats_buf_ref();
+		m_allocator->AddReference();
 
 		return m_cache.retrieve(pathname, data, &size);
 	}
 
 	void Remove(const VfsPath& pathname)
 	{
+		FileCacheLock lock(m_mutex);
 		m_cache.remove(pathname);
 
 		// note: we could check if someone is still holding a reference
@@ -218,6 +270,8 @@ public:
 	}
 
 private:
+	pthread_mutex_t m_mutex;
+
 	typedef Cache<VfsPath, shared_ptr<u8> > CacheType;
 	CacheType m_cache;
 
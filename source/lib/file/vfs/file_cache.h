@@ -1,4 +1,4 @@
-/* Copyright (c) 2010 Wildfire Games
+/* Copyright (c) 2012 Wildfire Games
  *
  * Permission is hereby granted, free of charge, to any person obtaining
  * a copy of this software and associated documentation files (the
@@ -41,6 +41,9 @@
  * reference should be active at a time. in other words, read a file,
  * process it, and only then start reading the next file.
  *
+ * all methods are thread-safe. if several threads Add() the same file,
+ * the first copy is kept.
+ *
  * rationale: this is rather similar to BlockCache; however, the differences
  * (Reserve's size parameter, eviction policies) are enough to warrant
  * separate implementations.
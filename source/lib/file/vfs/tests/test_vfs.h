@@ -0,0 +1,268 @@
+/* Copyright (c) 2012 Wildfire Games
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lib/self_test.h"
+
+#include "lib/file/vfs/vfs.h"
+#include "lib/file/file_system.h"
+#include "lib/allocators/shared_ptr.h"
+#include "lib/posix/posix_pthread.h"
+#include "lib/timer.h"
+
+class TestVfs : public CxxTest::TestSuite
+{
+	static const size_t numDirectories = 8;
+	static const size_t numFilesPerDirectory = 32;
+
+	static VfsPath FilePathname(size_t i)
+	{
+		wchar_t name[32];
+		swprintf_s(name, ARRAY_SIZE(name), L"dir%d/file%d.bin", (int)(i / numFilesPerDirectory), (int)(i % numFilesPerDirectory));
+		return VfsPath(name);
+	}
+
+	// (sizes vary so that some files are too large for the cache)
+	static size_t FileSize(size_t i)
+	{
+		return 1000 + (i * 7919) % (256*KiB);
+	}
+
+	static u8 FileByte(size_t i, size_t offset)
+	{
+		return (u8)(i * 31 + offset * 7 + (offset >> 8));
+	}
+
+	// writes a synthetic mod tree
+	void CreateFiles()
+	{
+		PIVFS vfs = CreateVfs(1*MiB);
+		TS_ASSERT_OK(vfs->Mount(L"", DataDir()/"_testvfs"));
+		for(size_t i = 0; i < numDirectories*numFilesPerDirectory; ++i)
+		{
+			const size_t size = FileSize(i);
+			shared_ptr<u8> data;
+			TS_ASSERT_OK(AllocateAligned(data, size, maxSectorSize));
+			for(size_t offset = 0; offset < size; ++offset)
+				data.get()[offset] = FileByte(i, offset);
+			TS_ASSERT_OK(vfs->CreateFile(FilePathname(i), data, size));
+		}
+	}
+
+	struct LoaderThread
+	{
+		PIVFS vfs;
+		size_t first;	// index of the first file to load (so the threads don't all start together)
+		size_t passes;
+		size_t bytesLoaded;
+		size_t errors;
+		pthread_t thread;
+	};
+
+	static void* LoaderThreadFunc(void* data)
+	{
+		LoaderThread* t = (LoaderThread*)data;
+		const size_t numFiles = numDirectories*numFilesPerDirectory;
+		for(size_t pass = 0; pass < t->passes; ++pass)
+		{
+			for(size_t n = 0; n < numFiles; ++n)
+			{
+				const size_t i = (t->first + n) % numFiles;
+				shared_ptr<u8> contents;
+				size_t size;
+				if(t->vfs->LoadFile(FilePathname(i), contents, size) != INFO::OK || size != FileSize(i))
+				{
+					t->errors++;
+					continue;
+				}
+				for(size_t offset = 0; offset < size; offset += 97)
+				{
+					if(contents.get()[offset] != FileByte(i, offset))
+					{
+						t->errors++;
+						break;
+					}
+				}
+				t->bytesLoaded += size;
+			}
+		}
+		return 0;
+	}
+
+	struct WriterThread
+	{
+		PIVFS vfs;
+		VfsPath pathname;
+		size_t versions;
+		size_t errors;
+		pthread_t thread;
+	};
+
+	// replaces a file with new contents and checks that loading it
+	// immediately afterwards never returns stale contents, even if other
+	// threads were loading the old version at the same time
+	static void* WriterThreadFunc(void* data)
+	{
+		WriterThread* t = (WriterThread*)data;
+		const size_t size = 1000;
+		for(size_t n = 0; n < t->versions; ++n)
+		{
+			shared_ptr<u8> buf;
+			if(AllocateAligned(buf, size, maxSectorSize) != INFO::OK)
+			{
+				t->errors++;
+				continue;
+			}
+			memset(buf.get(), (int)n, size);
+			if(t->vfs->CreateFile(t->pathname, buf, size) != INFO::OK)
+			{
+				t->errors++;
+				continue;
+			}
+
+			shared_ptr<u8> contents;
+			size_t loadedSize;
+			if(t->vfs->LoadFile(t->pathname, contents, loadedSize) != INFO::OK || loadedSize != size ||
+				contents.get()[0] != (u8)n || contents.get()[size-1] != (u8)n)
+				t->errors++;
+		}
+		return 0;
+	}
+
+	// @return total number of bytes loaded
+	size_t LoadConcurrently(const PIVFS& vfs, size_t numThreads, size_t passes)
+	{
+		std::vector<LoaderThread> threads(numThreads);
+		for(size_t i = 0; i < numThreads; ++i)
+		{
+			LoaderThread& t = threads[i];
+			t.vfs = vfs;
+			t.first = i * 37;
+			t.passes = passes;
+			t.bytesLoaded = 0;
+			t.errors = 0;
+			TS_ASSERT_EQUALS(pthread_create(&t.thread, NULL, LoaderThreadFunc, &t), 0);
+		}
+
+		size_t bytesLoaded = 0;
+		for(size_t i = 0; i < numThreads; ++i)
+		{
+			TS_ASSERT_EQUALS(pthread_join(threads[i].thread, NULL), 0);
+			TS_ASSERT_EQUALS(threads[i].errors, (size_t)0);
+			bytesLoaded += threads[i].bytesLoaded;
+		}
+		return bytesLoaded;
+	}
+
+public:
+	void setUp()
+	{
+		DeleteDirectory(DataDir()/"_testvfs"); // clean up in case the last test run failed
+		CreateFiles();
+	}
+
+	void tearDown()
+	{
+		DeleteDirectory(DataDir()/"_testvfs");
+	}
+
+	void test_load_concurrent()
+	{
+		// (the cache is small enough that files are evicted and reloaded)
+		PIVFS vfs = CreateVfs(4*MiB);
+		TS_ASSERT_OK(vfs->Mount(L"", DataDir()/"_testvfs", VFS_MOUNT_MUST_EXIST));
+		LoadConcurrently(vfs, 4, 3);
+	}
+
+	void test_load_while_writing()
+	{
+		PIVFS vfs = CreateVfs(4*MiB);
+		TS_ASSERT_OK(vfs->Mount(L"", DataDir()/"_testvfs", VFS_MOUNT_MUST_EXIST));
+
+		const VfsPath pathname(L"dir0/changed.bin");
+		{
+			shared_ptr<u8> data;
+			TS_ASSERT_OK(AllocateAligned(data, 1000, maxSectorSize));
+			memset(data.get(), 0xFF, 1000);
+			TS_ASSERT_OK(vfs->CreateFile(pathname, data, 1000));
+		}
+
+		std::vector<LoaderThread> threads(2);
+		for(size_t i = 0; i < threads.size(); ++i)
+		{
+			LoaderThread& t = threads[i];
+			t.vfs = vfs;
+			t.first = i * 37;
+			t.passes = 2;
+			t.bytesLoaded = 0;
+			t.errors = 0;
+			TS_ASSERT_EQUALS(pthread_create(&t.thread, NULL, LoaderThreadFunc, &t), 0);
+		}
+
+		WriterThread writer;
+		writer.vfs = vfs;
+		writer.pathname = pathname;
+		writer.versions = 50;
+		writer.errors = 0;
+		TS_ASSERT_EQUALS(pthread_create(&writer.thread, NULL, WriterThreadFunc, &writer), 0);
+
+		// meanwhile, keep loading the file that is being replaced, so that
+		// loads of old versions race with the writer's. (the contents may be
+		// torn while a write is in progress, so only the writer checks them.)
+		for(size_t n = 0; n < 500; ++n)
+		{
+			shared_ptr<u8> contents;
+			size_t size;
+			(void)vfs->LoadFile(pathname, contents, size);
+		}
+
+		TS_ASSERT_EQUALS(pthread_join(writer.thread, NULL), 0);
+		TS_ASSERT_EQUALS(writer.errors, (size_t)0);
+		for(size_t i = 0; i < threads.size(); ++i)
+		{
+			TS_ASSERT_EQUALS(pthread_join(threads[i].thread, NULL), 0);
+			TS_ASSERT_EQUALS(threads[i].errors, (size_t)0);
+		}
+
+		// the last version must have replaced any stale copies in the cache
+		shared_ptr<u8> contents;
+		size_t size;
+		TS_ASSERT_OK(vfs->LoadFile(pathname, contents, size));
+		TS_ASSERT_EQUALS(size, (size_t)1000);
+		TS_ASSERT_EQUALS(contents.get()[999], (u8)49);
+	}
+
+	// disabled by default; run tests with the "-test TestVfs" flag to enable
+	void test_performance_DISABLED()
+	{
+		for(size_t numThreads = 1; numThreads <= 8; numThreads *= 2)
+		{
+			// (the cache is much smaller than the files, so nearly every load reads the file)
+			PIVFS vfs = CreateVfs(1*MiB);
+			TS_ASSERT_OK(vfs->Mount(L"", DataDir()/"_testvfs", VFS_MOUNT_MUST_EXIST));
+
+			const double t0 = timer_Time();
+			const size_t bytesLoaded = LoadConcurrently(vfs, numThreads, 4);
+			const double t = timer_Time() - t0;
+			printf("%d threads: %f MB/s\n", (int)numThreads, bytesLoaded / t / MiB);
+		}
+	}
+};
@@ -1,4 +1,4 @@
-/* Copyright (c) 2010 Wildfire Games
+/* Copyright (c) 2012 Wildfire Games
  *
  * Permission is hereby granted, free of charge, to any person obtaining
  * a copy of this software and associated documentation files (the
@@ -54,7 +54,7 @@ class VFS : public IVFS
 public:
 	VFS(size_t cacheSize)
 		: m_cacheSize(cacheSize), m_fileCache(m_cacheSize)
-		, m_trace(CreateTrace(8*MiB))
+		, m_trace(CreateTrace(8*MiB)), m_cacheGeneration(0)
 	{
 	}
 
@@ -141,6 +141,7 @@ public:
 		// wipe out any cached blocks. this is necessary to cover the (rare) case
 		// of file cache contents predating the file write.
 		m_fileCache.Remove(pathname);
+		m_cacheGeneration++;
 
 		const VfsFile file(name, size, time(0), realDirectory->Priority(), realDirectory);
 		directory->AddFile(file);
@@ -151,35 +152,56 @@ public:
 
 	virtual Status LoadFile(const VfsPath& pathname, shared_ptr<u8>& fileContents, size_t& size)
 	{
-		ScopedLock s;
+		// (the file cache is thread-safe, so hits don't need the lock)
 		const bool isCacheHit = m_fileCache.Retrieve(pathname, fileContents, size);
+		bool isCacheable = false;
+		size_t cacheGeneration = 0;
 		if(!isCacheHit)
 		{
-			VfsDirectory* directory; VfsFile* file;
-			// per 2010-05-01 meeting, this shouldn't raise 'scary error
-			// dialogs', which might fail to display the culprit pathname
-			// instead, callers should log the error, including pathname.
-			RETURN_STATUS_IF_ERR(vfs_Lookup(pathname, &m_rootDirectory, directory, &file));
+			// only the lookup (which may populate directories) needs the lock.
+			// our reference keeps the loader alive, so the IO and decompression
+			// can proceed while other threads use the VFS.
+			OsPath name;
+			PIFileLoader loader;
+			{
+				ScopedLock s;
+				VfsDirectory* directory; VfsFile* file;
+				// per 2010-05-01 meeting, this shouldn't raise 'scary error
+				// dialogs', which might fail to display the culprit pathname
+				// instead, callers should log the error, including pathname.
+				RETURN_STATUS_IF_ERR(vfs_Lookup(pathname, &m_rootDirectory, directory, &file));
+				name = file->Name();
+				size = file->Size();
+				loader = file->Loader();
+				cacheGeneration = m_cacheGeneration;
+			}
 
 			fileContents = DummySharedPtr((u8*)0);
-			size = file->Size();
 			if(size != 0)	// (the file cache can't handle zero-length allocations)
 			{
 				if(size < m_cacheSize/2)	// (avoid evicting lots of previous data)
 					fileContents = m_fileCache.Reserve(size);
 				if(fileContents)
 				{
-					RETURN_STATUS_IF_ERR(file->Loader()->Load(file->Name(), fileContents, file->Size()));
-					m_fileCache.Add(pathname, fileContents, size);
+					RETURN_STATUS_IF_ERR(loader->Load(name, fileContents, size));
+					isCacheable = true;
 				}
 				else
 				{
 					RETURN_STATUS_IF_ERR(AllocateAligned(fileContents, size, maxSectorSize));
-					RETURN_STATUS_IF_ERR(file->Loader()->Load(file->Name(), fileContents, file->Size()));
+					RETURN_STATUS_IF_ERR(loader->Load(name, fileContents, size));
 				}
 			}
 		}
 
+		// (the trace and statistics aren't thread-safe)
+		ScopedLock s;
+
+		// don't cache the contents if the file was written or removed while
+		// we were loading it
+		if(isCacheable && cacheGeneration == m_cacheGeneration)
+			m_fileCache.Add(pathname, fileContents, size);
+
 		stats_io_user_request(size);
 		stats_cache(isCacheHit? CR_HIT : CR_MISS, size);
 		m_trace->NotifyLoad(pathname, size);
@@ -228,6 +250,7 @@ public:
 	{
 		ScopedLock s;
 		m_fileCache.Remove(pathname);
+		m_cacheGeneration++;
 
 		VfsDirectory* directory; VfsFile* file;
 		RETURN_STATUS_IF_ERR(vfs_Lookup(pathname, &m_rootDirectory, directory, &file));
@@ -279,6 +302,7 @@ private:
 	size_t m_cacheSize;
 	FileCache m_fileCache;
 	PITrace m_trace;
+	size_t m_cacheGeneration;	// incremented whenever cached file contents are invalidated
 	mutable VfsDirectory m_rootDirectory;
 };
 
@@ -69,7 +69,9 @@ enum VfsMountFlags
 };
 
 // (member functions are thread-safe after the instance has been
-// constructed - each acquires a pthread mutex.)
+// constructed - each acquires a pthread mutex. LoadFile only holds it
+// while looking up the file, so several threads can read and decompress
+// files at the same time.)
 struct IVFS
 {
 	virtual ~IVFS() {}
@@ -52,6 +52,7 @@ that of Atlas depending on commandline parameters.
 #include "ps/Profiler2.h"
 #include "ps/Pyrogenesis.h"
 #include "ps/Replay.h"
+#include "ps/ReplayBenchmark.h"
 #include "ps/UserReport.h"
 #include "ps/Util.h"
 #include "ps/VideoMode.h"
@@ -77,6 +78,8 @@ that of Atlas depending on commandline parameters.
 #include <unistd.h> // geteuid
 #endif // OS_UNIX
 
+#include <fstream>
+
 extern bool g_GameRestarted;
 
 void kill_mainloop();
@@ -431,6 +434,74 @@ void restart_mainloop_in_atlas()
 	restart_in_atlas = true;
 }
 
+static int exit_status = EXIT_SUCCESS;	// returned from main
+
+// Runs each of the -replay-benchmark replays, writes the timing reports, and
+// compares them against -replay-benchmark-baseline (if given).
+// Returns false if there were any regressions.
+static bool RunReplayBenchmark(const CmdLineArgs& args)
+{
+	std::vector<std::string> regions;
+	std::vector<CStr> regionArgs = args.GetMultiple("replay-benchmark-region");
+	if (regionArgs.empty())
+		regions = CReplayBenchmark::GetDefaultRegions();
+	else
+		regions.assign(regionArgs.begin(), regionArgs.end());
+
+	size_t numWorstTurns = 10;
+	if (args.Has("replay-benchmark-worst"))
+		numWorstTurns = args.Get("replay-benchmark-worst").ToUInt();
+
+	CReplayBenchmark benchmark(regions, numWorstTurns);
+
+	std::vector<CStr> replays = args.GetMultiple("replay-benchmark");
+	for (size_t i = 0; i < replays.size(); ++i)
+	{
+		benchmark.StartReplay(replays[i]);
+
+		CReplayPlayer replay;
+		replay.SetBenchmark(&benchmark);
+		replay.Load(replays[i]);
+		replay.Replay();
+	}
+
+	// Output file names are based on this, with the extension replaced
+	OsPath output = psLogDir() / "replay_benchmark";
+	if (args.Has("replay-benchmark-output"))
+		output = args.Get("replay-benchmark-output");
+	output = output.ChangeExtension(L"");
+
+	std::ofstream json(OsString(output.ChangeExtension(L".json")).c_str());
+	benchmark.WriteJSON(json);
+	std::ofstream csv(OsString(output.ChangeExtension(L".csv")).c_str());
+	benchmark.WriteCSV(csv);
+	std::ofstream turnsCSV(OsString(output.ChangeExtension(L"_turns.csv")).c_str());
+	benchmark.WriteTurnsCSV(turnsCSV);
+	debug_printf(L"Replay benchmark results saved to '%ls.json'\n", output.string().c_str());
+
+	if (!args.Has("replay-benchmark-baseline"))
+		return true;
+
+	double threshold = 10.0; // percent
+	if (args.Has("replay-benchmark-threshold"))
+		threshold = args.Get("replay-benchmark-threshold").ToDouble();
+
+	std::ifstream baseline(args.Get("replay-benchmark-baseline").c_str());
+	std::vector<std::string> regressions;
+	if (!baseline.good() || !benchmark.CompareWithBaseline(baseline, threshold / 100.0, 0.1, regressions))
+	{
+		debug_printf(L"Failed to read replay benchmark baseline '%hs'\n", args.Get("replay-benchmark-baseline").c_str());
+		return false;
+	}
+
+	for (size_t i = 0; i < regressions.size(); ++i)
+		debug_printf(L"REGRESSION: %hs\n", regressions[i].c_str());
+	if (regressions.empty())
+		debug_printf(L"No regressions over %.1f%% compared to the baseline\n", threshold);
+
+	return regressions.empty();
+}
+
 // moved into a helper function to ensure args is destroyed before
 // exit(), which may result in a memory leak.
 static void RunGameOrAtlas(int argc, const char* argv[])
@@ -460,9 +531,13 @@ static void RunGameOrAtlas(int argc, const char* argv[])
 		g_VFS->Mount(L"", paths.RData()/"mods"/"public", VFS_MOUNT_MUST_EXIST);
 
 		{
+			u32 startTurn = 0;
+			if (args.Has("replay-turn"))
+				startTurn = args.Get("replay-turn").ToUInt();
+
 			CReplayPlayer replay;
 			replay.Load(args.Get("replay"));
-			replay.Replay();
+			replay.Replay(startTurn);
 		}
 
 		g_VFS.reset();
@@ -471,6 +546,45 @@ static void RunGameOrAtlas(int argc, const char* argv[])
 		return;
 	}
 
+	// run non-visual simulation replays and report their timings if requested
+	if (args.Has("replay-benchmark"))
+	{
+		snd_disable(true);
+
+		Paths paths(args);
+		g_VFS = CreateVfs(20 * MiB);
+		g_VFS->Mount(L"cache/", paths.Cache(), VFS_MOUNT_ARCHIVABLE);
+		g_VFS->Mount(L"", paths.RData()/"mods"/"public", VFS_MOUNT_MUST_EXIST);
+
+		if (!RunReplayBenchmark(args))
+			exit_status = EXIT_FAILURE;
+
+		g_VFS.reset();
+
+		CXeromyces::Terminate();
+		return;
+	}
+
+	// convert a replay log between the text and binary formats if requested
+	if (args.Has("replay-convert"))
+	{
+		std::string input = args.Get("replay-convert");
+		std::string output;
+		if (args.Has("replay-convert-output"))
+			output = args.Get("replay-convert-output");
+		else
+			output = input + ".converted";
+
+		if (!ConvertReplay(input, output))
+		{
+			debug_printf(L"Failed to convert replay %hs\n", input.c_str());
+			exit_status = EXIT_FAILURE;
+		}
+
+		CXeromyces::Terminate();
+		return;
+	}
+
 	// run in archive-building mode if requested
 	if (args.Has("archivebuild"))
 	{
@@ -483,7 +597,10 @@ static void RunGameOrAtlas(int argc, const char* argv[])
 		else
 			zip = mod.Filename().ChangeExtension(L".zip");
 
-		CArchiveBuilder builder(mod, paths.Cache());
+		// Keep converted files between runs, so rebuilding after small changes is fast
+		bool incremental = args.Has("archivebuild-incremental");
+
+		CArchiveBuilder builder(mod, paths.Cache(), incremental);
 		builder.Build(zip);
 
 		CXeromyces::Terminate();
@@ -538,5 +655,5 @@ int main(int argc, char* argv[])
 	// Shut down profiler initialised by EarlyInit
 	g_Profiler2.Shutdown();
 
-	return EXIT_SUCCESS;
+	return exit_status;
 }
@@ -36,6 +36,10 @@
 
 CNetClient *g_NetClient = NULL;
 
+// Largest uncompressed game state we'll accept when rejoining a game
+// (real games are a few tens of megabytes at most)
+static const u32 JOIN_SYNC_MAX_STATE_SIZE = 256*MiB;
+
 /**
  * Async task for receiving the initial game state when rejoining an
  * in-progress network game.
@@ -45,16 +49,55 @@ class CNetFileReceiveTask_ClientRejoin : public CNetFileReceiveTask
 	NONCOPYABLE(CNetFileReceiveTask_ClientRejoin);
 public:
 	CNetFileReceiveTask_ClientRejoin(CNetClient& client)
-		: m_Client(client)
+		: m_Client(client), m_StateSize(0), m_Failed(false)
+	{
+	}
+
+	virtual void OnData(const std::string& data)
 	{
+		if (m_Failed)
+			return;
+
+		// The data starts with a 4-byte uncompressed size, which we
+		// check before decompressing anything
+		size_t pos = 0;
+		if (!m_Decompressor)
+		{
+			pos = std::min(data.size(), 4 - m_Header.size());
+			m_Header.append(data, 0, pos);
+			if (m_Header.size() < 4)
+				return;
+
+			m_StateSize = read_le32(m_Header.data());
+			if (m_StateSize > JOIN_SYNC_MAX_STATE_SIZE)
+			{
+				LOGERROR(L"Net client: Rejoin game state is too large (%u bytes)", m_StateSize);
+				m_Failed = true;
+				return;
+			}
+
+			m_State.reserve(m_StateSize);
+			m_Decompressor.reset(new CZLibStreamDecompressor(m_StateSize));
+		}
+
+		// Decompress the state as it arrives, rather than storing the whole
+		// compressed data first
+		if (!m_Decompressor->Decompress(data.data() + pos, data.size() - pos, m_State))
+			m_Failed = true;
 	}
 
 	virtual void OnComplete()
 	{
 		// We've received the game state from the server
 
+		if (m_Failed || !m_Decompressor || !m_Decompressor->IsFinished() || m_State.size() != m_StateSize)
+		{
+			LOGERROR(L"Net client: Failed to decompress rejoin game state");
+			return;
+		}
+
 		// Save it so we can use it after the map has finished loading
-		m_Client.m_JoinSyncBuffer = m_Buffer;
+		m_Client.m_JoinSyncBuffer.swap(m_State);
 
 		// Pretend the server told us to start the game
 		CGameStartMessage start;
@@ -63,8 +106,17 @@ public:
 
 private:
 	CNetClient& m_Client;
+	std::string m_Header;
+	u32 m_StateSize;
+	shared_ptr<CZLibStreamDecompressor> m_Decompressor;
+	std::string m_State;
+	bool m_Failed;
 };
 
+// Amount of serialized game state to compress per Poll, when sending it to a
+// rejoining player, so that compressing a large state doesn't stall the game
+static const size_t JOIN_SYNC_COMPRESS_CHUNK_SIZE = 256*KiB;
+
 CNetClient::CNetClient(CGame* game) :
 	m_Session(NULL),
 	m_UserName(L"anonymous"),
@@ -143,13 +195,44 @@ void CNetClient::SetAndOwnSession(CNetClientSession* session)
 
 void CNetClient::DestroyConnection()
 {
+	m_JoinSyncSends.clear();
 	SAFE_DELETE(m_Session);
 }
 
 void CNetClient::Poll()
 {
 	if (m_Session)
+	{
+		SendJoinSyncStates();
 		m_Session->Poll();
+	}
+}
+
+void CNetClient::SendJoinSyncStates()
+{
+	size_t remaining = JOIN_SYNC_COMPRESS_CHUNK_SIZE;
+	while (!m_JoinSyncSends.empty() && remaining)
+	{
+		SJoinSyncSend& send = m_JoinSyncSends.front();
+
+		size_t len = std::min(remaining, send.state.size() - send.offset);
+		std::string compressed;
+		send.compressor->Compress(send.state.data() + send.offset, len, compressed);
+		send.offset += len;
+		remaining -= len;
+
+		if (send.offset == send.state.size())
+		{
+			send.compressor->Finish(compressed);
+			m_Session->GetFileTransferer().AppendResponse(send.requestID, compressed);
+			m_Session->GetFileTransferer().FinishResponse(send.requestID);
+			m_JoinSyncSends.pop_front();
+		}
+		else if (!compressed.empty())
+		{
+			m_Session->GetFileTransferer().AppendResponse(send.requestID, compressed);
+		}
+	}
 }
 
 void CNetClient::Flush()
@@ -273,12 +356,23 @@ bool CNetClient::HandleMessage(CNetMessage* message)
 		bool ok = m_Game->GetSimulation2()->SerializeState(stream);
 		ENSURE(ok);
 
-		// Compress the content with zlib to save bandwidth
+		// The state has to be serialized now, to be consistent with the current turn,
+		// but compressing it (with zlib, to save bandwidth) and sending it is spread
+		// over the following frames by SendJoinSyncStates, so the game can keep running
 		// (TODO: if this is still too large, compressing with e.g. LZMA works much better)
-		std::string compressed;
-		CompressZLib(stream.str(), compressed, true);
+		m_JoinSyncSends.push_back(SJoinSyncSend());
+		SJoinSyncSend& send = m_JoinSyncSends.back();
+		send.requestID = reqMessage->m_RequestID;
+		send.state = stream.str();
+		send.offset = 0;
+		send.compressor.reset(new CZLibStreamCompressor());
+
+		m_Session->GetFileTransferer().StartStreamedResponse(reqMessage->m_RequestID);
 
-		m_Session->GetFileTransferer().StartResponse(reqMessage->m_RequestID, compressed);
+		// Send the uncompressed size first, so the rejoiner can check it
+		std::string header(4, '\0');
+		write_le32(&header[0], (u32)send.state.size());
+		m_Session->GetFileTransferer().AppendResponse(reqMessage->m_RequestID, header);
 
 		return true;
 	}
@@ -297,10 +391,8 @@ void CNetClient::LoadFinished()
 		// We're rejoining a game, and just finished loading the initial map,
 		// so deserialize the saved game state now
 
-		std::string state;
-		DecompressZLib(m_JoinSyncBuffer, state, true);
-
-		std::stringstream stream(state);
+		std::stringstream stream(m_JoinSyncBuffer);
+		m_JoinSyncBuffer.clear();
 
 		u32 turn;
 		stream.read((char*)&turn, sizeof(turn));
@@ -507,6 +599,12 @@ bool CNetClient::OnJoinSyncEndCommandBatch(void* context, CFsmEvent* event)
 	// Execute all the received commands for the latest turn
 	client->m_ClientTurnManager->UpdateFastForward();
 
+	// Tell the server how far we've caught up, so it can decide when
+	// we're close enough to the other players to become active
+	CLoadedGameMessage loaded;
+	loaded.m_CurrentTurn = client->m_ClientTurnManager->GetCurrentTurn();
+	client->SendMessage(&loaded);
+
 	return true;
 }
 
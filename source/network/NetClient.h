@@ -26,11 +26,13 @@
 #include "ps/CStr.h"
 
 #include <deque>
+#include <list>
 
 class CGame;
 class CNetClientSession;
 class CNetClientTurnManager;
 class CNetServer;
+class CZLibStreamCompressor;
 class ScriptInterface;
 
 // NetClient session FSM states
@@ -218,6 +220,23 @@ private:
 
 	/// Serialized game state received when joining an in-progress game
 	std::string m_JoinSyncBuffer;
+
+	/**
+	 * Compress and send the next part of the game states requested by
+	 * players rejoining the game.
+	 */
+	void SendJoinSyncStates();
+
+	/// Game state being sent to a rejoining player
+	struct SJoinSyncSend
+	{
+		u32 requestID;
+		std::string state;
+		size_t offset; // amount of state already compressed
+		shared_ptr<CZLibStreamCompressor> compressor;
+	};
+
+	std::list<SJoinSyncSend> m_JoinSyncSends;
 };
 
 /// Global network client for the standard game
@@ -19,18 +19,27 @@ Status CNetFileTransferer::HandleMessageReceive(const CNetMessage* message)
 			return ERR::FAIL;
 		}
 
-		if (respMessage->m_Length == 0 || respMessage->m_Length > MAX_FILE_TRANSFER_SIZE)
+		shared_ptr<CNetFileReceiveTask> task = m_FileReceiveTasks[respMessage->m_RequestID];
+
+		if (respMessage->m_Length == FILE_TRANSFER_STREAMED_LENGTH)
 		{
-			LOGERROR(L"Net transfer: Invalid size for file transfer response (length=%d)", (int)respMessage->m_Length);
-			return ERR::FAIL;
-		}
+			task->m_Streamed = true;
 
-		shared_ptr<CNetFileReceiveTask> task = m_FileReceiveTasks[respMessage->m_RequestID];
+			LOGMESSAGERENDER(L"Downloading data over network - please wait...");
+		}
+		else
+		{
+			if (respMessage->m_Length == 0 || respMessage->m_Length > MAX_FILE_TRANSFER_SIZE)
+			{
+				LOGERROR(L"Net transfer: Invalid size for file transfer response (length=%d)", (int)respMessage->m_Length);
+				return ERR::FAIL;
+			}
 
-		task->m_Length = respMessage->m_Length;
-		task->m_Buffer.reserve(respMessage->m_Length);
+			task->m_Length = respMessage->m_Length;
+			task->m_Buffer.reserve(respMessage->m_Length);
 
-		LOGMESSAGERENDER(L"Downloading data over network (%d KB) - please wait...", (int)(task->m_Length/1024));
+			LOGMESSAGERENDER(L"Downloading data over network (%d KB) - please wait...", (int)(task->m_Length/1024));
+		}
 		m_LastProgressReportTime = timer_Time();
 
 		return INFO::OK;
@@ -47,20 +56,32 @@ Status CNetFileTransferer::HandleMessageReceive(const CNetMessage* message)
 
 		shared_ptr<CNetFileReceiveTask> task = m_FileReceiveTasks[dataMessage->m_RequestID];
 
-		task->m_Buffer += dataMessage->m_Data;
+		// An empty packet marks the end of a streamed response
+		bool streamEnd = dataMessage->m_Data.empty();
+		if (streamEnd && !task->m_Streamed)
+		{
+			LOGERROR(L"Net transfer: Empty file transfer data (id=%d)", (int)dataMessage->m_RequestID);
+			return ERR::FAIL;
+		}
+
+		task->m_Received += dataMessage->m_Data.size();
 
-		if (task->m_Buffer.size() > task->m_Length)
+		size_t maxLength = task->m_Streamed ? MAX_FILE_TRANSFER_SIZE : task->m_Length;
+		if (task->m_Received > maxLength)
 		{
-			LOGERROR(L"Net transfer: Invalid size for file transfer data (length=%d actual=%d)", (int)task->m_Length, (int)task->m_Buffer.size());
+			LOGERROR(L"Net transfer: Invalid size for file transfer data (length=%d actual=%d)", (int)maxLength, (int)task->m_Received);
 			return ERR::FAIL;
 		}
 
+		if (!streamEnd)
+			task->OnData(dataMessage->m_Data);
+
 		CFileTransferAckMessage ackMessage;
 		ackMessage.m_RequestID = task->m_RequestID;
 		ackMessage.m_NumPackets = 1; // TODO: would be nice to send a single ack for multiple packets at once
 		m_Session->SendMessage(&ackMessage);
 
-		if (task->m_Buffer.size() == task->m_Length)
+		if (task->m_Streamed ? streamEnd : task->m_Received == task->m_Length)
 		{
 			LOGMESSAGERENDER(L"Download completed");
 
@@ -75,7 +96,10 @@ Status CNetFileTransferer::HandleMessageReceive(const CNetMessage* message)
 		double t = timer_Time();
 		if (t > m_LastProgressReportTime + 0.5)
 		{
-			LOGMESSAGERENDER(L"Downloading data: %.1f%% of %d KB", 100.f*task->m_Buffer.size()/task->m_Length, (int)(task->m_Length/1024));
+			if (task->m_Streamed)
+				LOGMESSAGERENDER(L"Downloading data: %d KB", (int)(task->m_Received/1024));
+			else
+				LOGMESSAGERENDER(L"Downloading data: %.1f%% of %d KB", 100.f*task->m_Received/task->m_Length, (int)(task->m_Length/1024));
 			m_LastProgressReportTime = t;
 		}
 
@@ -129,6 +153,9 @@ void CNetFileTransferer::StartResponse(u32 requestID, const std::string& data)
 	task.offset = 0;
 	task.packetsInFlight = 0;
 	task.maxWindowSize = DEFAULT_FILE_TRANSFER_WINDOW_SIZE;
+	task.streamed = false;
+	task.finished = true;
+	task.sentEnd = false;
 
 	m_FileSendTasks[task.requestID] = task;
 	CFileTransferResponseMessage respMessage;
@@ -137,6 +164,38 @@ void CNetFileTransferer::StartResponse(u32 requestID, const std::string& data)
 	m_Session->SendMessage(&respMessage);
 }
 
+void CNetFileTransferer::StartStreamedResponse(u32 requestID)
+{
+	CNetFileSendTask task;
+	task.requestID = requestID;
+	task.offset = 0;
+	task.packetsInFlight = 0;
+	task.maxWindowSize = DEFAULT_FILE_TRANSFER_WINDOW_SIZE;
+	task.streamed = true;
+	task.finished = false;
+	task.sentEnd = false;
+
+	m_FileSendTasks[task.requestID] = task;
+	CFileTransferResponseMessage respMessage;
+	respMessage.m_RequestID = requestID;
+	respMessage.m_Length = FILE_TRANSFER_STREAMED_LENGTH;
+	m_Session->SendMessage(&respMessage);
+}
+
+void CNetFileTransferer::AppendResponse(u32 requestID, const std::string& data)
+{
+	FileSendTasksMap::iterator it = m_FileSendTasks.find(requestID);
+	ENSURE(it != m_FileSendTasks.end() && it->second.streamed && !it->second.finished);
+	it->second.buffer += data;
+}
+
+void CNetFileTransferer::FinishResponse(u32 requestID)
+{
+	FileSendTasksMap::iterator it = m_FileSendTasks.find(requestID);
+	ENSURE(it != m_FileSendTasks.end() && it->second.streamed && !it->second.finished);
+	it->second.finished = true;
+}
+
 void CNetFileTransferer::Poll()
 {
 	// Find tasks which have fewer packets in flight than their window size,
@@ -153,6 +212,22 @@ void CNetFileTransferer::Poll()
 			it->second.packetsInFlight++;
 			m_Session->SendMessage(&dataMessage);
 		}
+
+		if (it->second.streamed && it->second.offset == it->second.buffer.size())
+		{
+			// Streamed responses can be large, so drop the data once it's been sent
+			it->second.buffer.clear();
+			it->second.offset = 0;
+
+			if (it->second.finished && !it->second.sentEnd && it->second.packetsInFlight < it->second.maxWindowSize)
+			{
+				CFileTransferDataMessage dataMessage;
+				dataMessage.m_RequestID = it->second.requestID;
+				it->second.sentEnd = true;
+				it->second.packetsInFlight++;
+				m_Session->SendMessage(&dataMessage);
+			}
+		}
 	}
 
 	// TODO: need to garbage-collect finished tasks
@@ -38,6 +38,11 @@ static const size_t DEFAULT_FILE_TRANSFER_WINDOW_SIZE = 32;
 // Some arbitrary limit to make it slightly harder to use up all of someone's RAM
 static const size_t MAX_FILE_TRANSFER_SIZE = 8*MiB;
 
+// Length sent in the response to a request whose data is streamed as it's
+// produced, so the total isn't known yet. The end of the data is marked
+// by an empty data packet.
+static const u32 FILE_TRANSFER_STREAMED_LENGTH = 0xFFFFFFFF;
+
 /**
  * Asynchronous file-receiving task.
  * Other code should subclass this, implement OnComplete(),
@@ -46,11 +51,19 @@ static const size_t MAX_FILE_TRANSFER_SIZE = 8*MiB;
 class CNetFileReceiveTask
 {
 public:
-	CNetFileReceiveTask() : m_RequestID(0), m_Length(0) { }
+	CNetFileReceiveTask() : m_RequestID(0), m_Length(0), m_Streamed(false), m_Received(0) { }
 	virtual ~CNetFileReceiveTask() {}
 
 	/**
-	 * Called when m_Buffer contains the full received data.
+	 * Called for each packet of data as it's received.
+	 * By default this appends it to m_Buffer; tasks that can process the data
+	 * incrementally (or forward it elsewhere) may override this instead.
+	 */
+	virtual void OnData(const std::string& data) { m_Buffer += data; }
+
+	/**
+	 * Called when all the data has been received (and, unless OnData was
+	 * overridden, m_Buffer contains the full data).
 	 */
 	virtual void OnComplete() = 0;
 
@@ -62,7 +75,11 @@ public:
 	 */
 	u32 m_RequestID;
 
-	size_t m_Length;
+	size_t m_Length; // total length, if not m_Streamed
+
+	bool m_Streamed;
+
+	size_t m_Received;
 
 	std::string m_Buffer;
 };
@@ -98,6 +115,22 @@ public:
 	 */
 	void StartResponse(u32 requestID, const std::string& data);
 
+	/**
+	 * Starts a response whose data isn't all available yet. Data is sent
+	 * as it's added by AppendResponse, until FinishResponse is called.
+	 */
+	void StartStreamedResponse(u32 requestID);
+
+	/**
+	 * Adds data to a response started by StartStreamedResponse.
+	 */
+	void AppendResponse(u32 requestID, const std::string& data);
+
+	/**
+	 * Marks the end of a response started by StartStreamedResponse.
+	 */
+	void FinishResponse(u32 requestID);
+
 	/**
 	 * Call frequently (e.g. once per frame) to trigger any necessary
 	 * packet processing.
@@ -115,6 +148,9 @@ private:
 		size_t offset;
 		size_t maxWindowSize;
 		size_t packetsInFlight;
+		bool streamed;
+		bool finished; // whether all of a streamed response's data has been added
+		bool sentEnd; // whether the end of a streamed response has been sent
 	};
 
 	INetSession* m_Session;
@@ -43,6 +43,19 @@ static const int CHANNEL_COUNT = 1;
  */
 static const int HOST_SERVICE_TIMEOUT = 50;
 
+/**
+ * A rejoining client becomes an active player (which makes everyone wait
+ * for it to finish each turn) once it's within this many turns of the
+ * rest of the game...
+ */
+static const u32 JOIN_SYNC_MAX_TURNS_BEHIND = 4;
+
+/**
+ * ...or once it's been sent this many batches of turns to catch up with
+ * and still hasn't got that close.
+ */
+static const size_t JOIN_SYNC_MAX_ROUNDS = 10;
+
 CNetServer* g_NetServer = NULL;
 
 static CStr DebugName(CNetServerSession* session)
@@ -57,6 +70,8 @@ static CStr DebugName(CNetServerSession* session)
 /**
  * Async task for receiving the initial game state to be forwarded to another
  * client that is rejoining an in-progress network game.
+ * The (compressed) state is forwarded as it arrives, rather than after
+ * receiving all of it.
  */
 class CNetFileReceiveTask_ServerRejoin : public CNetFileReceiveTask
 {
@@ -67,35 +82,41 @@ public:
 	{
 	}
 
+	virtual void OnData(const std::string& data)
+	{
+		CNetServerWorker::SJoinSync* joinSync = GetJoinSync();
+		if (!joinSync)
+			return;
+
+		// If the rejoining player has asked for the state already, send it
+		// straight on, else keep it until they ask
+		if (joinSync->requestID)
+			joinSync->session->GetFileTransferer().AppendResponse(joinSync->requestID, data);
+		else
+			joinSync->buffer += data;
+	}
+
 	virtual void OnComplete()
 	{
-		// We've received the game state from an existing player - now
-		// we need to send it onwards to the newly rejoining player
+		CNetServerWorker::SJoinSync* joinSync = GetJoinSync();
+		if (!joinSync)
+			return;
 
-		// Find the session corresponding to the rejoining host (if any)
-		CNetServerSession* session = NULL;
-		for (size_t i = 0; i < m_Server.m_Sessions.size(); ++i)
-		{
-			if (m_Server.m_Sessions[i]->GetHostID() == m_RejoinerHostID)
-			{
-				session = m_Server.m_Sessions[i];
-				break;
-			}
-		}
+		joinSync->received = true;
+		if (joinSync->requestID)
+			joinSync->session->GetFileTransferer().FinishResponse(joinSync->requestID);
+	}
 
-		if (!session)
+private:
+	CNetServerWorker::SJoinSync* GetJoinSync()
+	{
+		std::map<u32, CNetServerWorker::SJoinSync>::iterator it = m_Server.m_JoinSyncs.find(m_RejoinerHostID);
+		if (it == m_Server.m_JoinSyncs.end())
 		{
 			LOGMESSAGE(L"Net server: rejoining client disconnected before we sent to it");
-			return;
+			return NULL;
 		}
-
-		// Store the received state file, and tell the client to start downloading it from us
-		// TODO: this will get kind of confused if there's multiple clients downloading in parallel;
-		// they'll race and get whichever happens to be the latest received by the server,
-		// which should still work but isn't great
-		m_Server.m_JoinSyncFile = m_Buffer;
-		CJoinSyncStartMessage message;
-		session->SendMessage(&message);
+		return &it->second;
 	}
 
 private:
@@ -400,11 +421,28 @@ void CNetServerWorker::HandleMessageReceive(const CNetMessage* message, CNetServ
 	{
 		CFileTransferRequestMessage* reqMessage = (CFileTransferRequestMessage*)message;
 
-		// Rejoining client got our JoinSyncStart after we received the state from
-		// another client, and has now requested that we forward it to them
+		// Rejoining client got our JoinSyncStart, and has now requested that we
+		// forward it the state we're receiving from another client. Send whatever
+		// we've got so far, and the rest as it arrives (see CNetFileReceiveTask_ServerRejoin)
+
+		std::map<u32, SJoinSync>::iterator it = m_JoinSyncs.find(session->GetHostID());
+		if (it == m_JoinSyncs.end() || it->second.requestID)
+		{
+			LOGERROR(L"Net server: Unexpected file transfer request from %hs", DebugName(session).c_str());
+			return;
+		}
+
+		SJoinSync& joinSync = it->second;
+		joinSync.requestID = reqMessage->m_RequestID;
 
-		ENSURE(!m_JoinSyncFile.empty());
-		session->GetFileTransferer().StartResponse(reqMessage->m_RequestID, m_JoinSyncFile);
+		session->GetFileTransferer().StartStreamedResponse(joinSync.requestID);
+		if (!joinSync.buffer.empty())
+		{
+			session->GetFileTransferer().AppendResponse(joinSync.requestID, joinSync.buffer);
+			std::string().swap(joinSync.buffer);
+		}
+		if (joinSync.received)
+			session->GetFileTransferer().FinishResponse(joinSync.requestID);
 
 		return;
 	}
@@ -433,11 +471,14 @@ void CNetServerWorker::SetupSession(CNetServerSession* session)
 	session->AddTransition(NSS_PREGAME, (uint)NMT_CHAT, NSS_PREGAME, (void*)&OnChat, context);
 	session->AddTransition(NSS_PREGAME, (uint)NMT_LOADED_GAME, NSS_INGAME, (void*)&OnLoadedGame, context);
 
+	session->AddTransition(NSS_JOIN_SYNCING, (uint)NMT_CONNECTION_LOST, NSS_UNCONNECTED, (void*)&OnDisconnect, context);
 	session->AddTransition(NSS_JOIN_SYNCING, (uint)NMT_LOADED_GAME, NSS_INGAME, (void*)&OnJoinSyncingLoadedGame, context);
 
 	session->AddTransition(NSS_INGAME, (uint)NMT_CONNECTION_LOST, NSS_UNCONNECTED, (void*)&OnDisconnect, context);
 	session->AddTransition(NSS_INGAME, (uint)NMT_CHAT, NSS_INGAME, (void*)&OnChat, context);
 	session->AddTransition(NSS_INGAME, (uint)NMT_SIMULATION_COMMAND, NSS_INGAME, (void*)&OnInGame, context);
+	// Rejoining clients report their progress until they've received our LOADED_GAME, so ignore any late reports
+	session->AddTransition(NSS_INGAME, (uint)NMT_LOADED_GAME, NSS_INGAME);
 	session->AddTransition(NSS_INGAME, (uint)NMT_SYNC_CHECK, NSS_INGAME, (void*)&OnInGame, context);
 	session->AddTransition(NSS_INGAME, (uint)NMT_END_COMMAND_BATCH, NSS_INGAME, (void*)&OnInGame, context);
 
@@ -471,6 +512,8 @@ void CNetServerWorker::OnUserLeave(CNetServerSession* session)
 {
 	RemovePlayer(session->GetGUID());
 
+	m_JoinSyncs.erase(session->GetHostID());
+
 	if (m_ServerTurnManager)
 		m_ServerTurnManager->UninitialiseClient(session->GetHostID()); // TODO: only for non-observers
 
@@ -674,6 +717,13 @@ bool CNetServerWorker::OnAuthenticate(void* context, CFsmEvent* event)
 
 	if (isRejoining)
 	{
+		SJoinSync& joinSync = server.m_JoinSyncs[newHostID];
+		joinSync.session = session;
+		joinSync.received = false;
+		joinSync.requestID = 0;
+		joinSync.sentTurn = 0;
+		joinSync.rounds = 0;
+
 		// Request a copy of the current game state from an existing player,
 		// so we can send it on to the new player
 
@@ -684,6 +734,11 @@ bool CNetServerWorker::OnAuthenticate(void* context, CFsmEvent* event)
 			shared_ptr<CNetFileReceiveTask>(new CNetFileReceiveTask_ServerRejoin(server, newHostID))
 		);
 
+		// Tell the new player to start downloading it from us straight away,
+		// so we can forward it as it arrives
+		CJoinSyncStartMessage message;
+		session->SendMessage(&message);
+
 		session->SetNextState(NSS_JOIN_SYNCING);
 	}
 
@@ -762,15 +817,14 @@ bool CNetServerWorker::OnLoadedGame(void* context, CFsmEvent* event)
 bool CNetServerWorker::OnJoinSyncingLoadedGame(void* context, CFsmEvent* event)
 {
 	// A client rejoining an in-progress game has now finished loading the
-	// map and deserialized the initial state.
-	// The simulation may have progressed since then, so send any subsequent
-	// commands to them and set them as an active player so they can participate
-	// in all future turns.
-	// 
-	// (TODO: if it takes a long time for them to receive and execute all these
-	// commands, the other players will get frozen for that time and may be unhappy;
-	// we could try repeating this process a few times until the client converges
-	// on the up-to-date state, before setting them as active.)
+	// map and deserialized the initial state, or has run some of the turns
+	// we've sent it since then.
+	// The simulation keeps going for the other players meanwhile, so we send
+	// the rejoiner the commands for every turn that has been processed, and
+	// repeat that each time it has run them, until it's close to the current turn.
+	// Only then do we set it as an active player so it can participate in all
+	// future turns, so the other players don't get frozen for the whole time it
+	// takes to catch up.
 
 	ENSURE(event->GetType() == (uint)NMT_LOADED_GAME);
 
@@ -779,12 +833,34 @@ bool CNetServerWorker::OnJoinSyncingLoadedGame(void* context, CFsmEvent* event)
 
 	CLoadedGameMessage* message = (CLoadedGameMessage*)event->GetParamRef();
 
+	std::map<u32, SJoinSync>::iterator it = server.m_JoinSyncs.find(session->GetHostID());
+	if (it == server.m_JoinSyncs.end())
+	{
+		LOGERROR(L"Net server: Unexpected loaded game message from %hs", DebugName(session).c_str());
+		return false;
+	}
+	SJoinSync& joinSync = it->second;
+
 	u32 turn = message->m_CurrentTurn;
 	u32 readyTurn = server.m_ServerTurnManager->GetReadyTurn();
 
-	// Send them all commands received since their saved state,
-	// and turn-ended messages for any turns that have already been processed
-	for (size_t i = turn + 1; i < std::max(readyTurn+1, (u32)server.m_SavedCommands.size()); ++i)
+	// It reports its progress after every turn; wait until it has
+	// run all the turns we've sent it
+	if (turn < joinSync.sentTurn)
+	{
+		session->SetNextState(NSS_JOIN_SYNCING);
+		return true;
+	}
+
+	joinSync.rounds++;
+	bool catchingUp = (readyTurn > turn + JOIN_SYNC_MAX_TURNS_BEHIND && joinSync.rounds < JOIN_SYNC_MAX_ROUNDS);
+
+	// Send them all commands received since their current turn,
+	// and turn-ended messages for any turns that have already been processed.
+	// (While they're still catching up, commands for later turns are left
+	// for the next round, so they're not sent twice.)
+	size_t endTurn = catchingUp ? readyTurn+1 : std::max(readyTurn+1, (u32)server.m_SavedCommands.size());
+	for (size_t i = turn + 1; i < endTurn; ++i)
 	{
 		if (i < server.m_SavedCommands.size())
 			for (size_t j = 0; j < server.m_SavedCommands[i].size(); ++j)
@@ -799,6 +875,15 @@ bool CNetServerWorker::OnJoinSyncingLoadedGame(void* context, CFsmEvent* event)
 		}
 	}
 
+	if (catchingUp)
+	{
+		joinSync.sentTurn = readyTurn;
+		session->SetNextState(NSS_JOIN_SYNCING);
+		return true;
+	}
+
+	server.m_JoinSyncs.erase(it);
+
 	// Tell the turn manager to expect commands from this new client
 	server.m_ServerTurnManager->InitialiseClient(session->GetHostID(), readyTurn);
 
@@ -291,10 +291,22 @@ private:
 	std::vector<std::vector<CSimulationMessage> > m_SavedCommands;
 
 	/**
-	 * The latest copy of the simulation state, received from an existing
-	 * client when a new client has asked to rejoin the game.
+	 * Progress of a client rejoining an in-progress game: the simulation state
+	 * being relayed to it from an existing client, and how far it has caught up
+	 * with the turns that were run since that state.
 	 */
-	std::string m_JoinSyncFile;
+	struct SJoinSync
+	{
+		CNetServerSession* session;
+		std::string buffer; // state received before the rejoiner asked for it
+		bool received; // whether the whole state has been received
+		u32 requestID; // the rejoiner's request for the state, or 0 if it hasn't asked yet
+		u32 sentTurn; // latest turn whose commands have been sent to the rejoiner
+		size_t rounds; // number of times we've sent it commands to catch up with
+	};
+
+	/// Clients that are rejoining the game, indexed by host ID
+	std::map<u32, SJoinSync> m_JoinSyncs;
 
 private:
 	// Thread-related stuff:
@@ -42,6 +42,9 @@ static const int DEFAULT_TURN_LENGTH_SP = 200;
 
 static const int COMMAND_DELAY = 2;
 
+// Memory available for time warp snapshots (as deltas, so this is normally many snapshots)
+static const size_t TIME_WARP_MAX_MEMORY = 64*1024*1024;
+
 #if 0
 #define NETTURN_LOG(args) debug_printf args
 #else
@@ -60,7 +63,7 @@ static std::wstring Hexify(const std::string& s)
 CNetTurnManager::CNetTurnManager(CSimulation2& simulation, u32 defaultTurnLength, int clientId, IReplayLogger& replay) :
 	m_Simulation2(simulation), m_CurrentTurn(0), m_ReadyTurn(1), m_TurnLength(defaultTurnLength), m_DeltaTime(0),
 	m_PlayerId(-1), m_ClientId(clientId), m_HasSyncError(false), m_Replay(replay),
-	m_TimeWarpNumTurns(0)
+	m_TimeWarpNumTurns(0), m_TimeWarpStates(TIME_WARP_MAX_MEMORY)
 {
 	// When we are on turn n, we schedule new commands for n+2.
 	// We know that all other clients have finished scheduling commands for n (else we couldn't have got here).
@@ -151,8 +154,9 @@ bool CNetTurnManager::Update(float frameLength, size_t maxTurns)
 		{
 			PROFILE3("time warp serialization");
 			std::stringstream stream;
-			m_Simulation2.SerializeState(stream);
-			m_TimeWarpStates.push_back(stream.str());
+			std::vector<SSerializedSegment> segments;
+			m_Simulation2.SerializeState(stream, &segments);
+			m_TimeWarpStates.Push(stream.str(), segments);
 		}
 
 		// Put all the client commands into a single list, in a globally consistent order
@@ -299,18 +303,18 @@ bool CNetTurnManager::TurnNeedsFullHash(u32 turn)
 
 void CNetTurnManager::EnableTimeWarpRecording(size_t numTurns)
 {
-	m_TimeWarpStates.clear();
+	m_TimeWarpStates.Clear();
 	m_TimeWarpNumTurns = numTurns;
 }
 
 void CNetTurnManager::RewindTimeWarp()
 {
-	if (m_TimeWarpStates.empty())
+	std::string state;
+	if (!m_TimeWarpStates.Pop(state))
 		return;
 
-	std::stringstream stream(m_TimeWarpStates.back());
+	std::stringstream stream(state);
 	m_Simulation2.DeserializeState(stream);
-	m_TimeWarpStates.pop_back();
 
 	// Reset the turn manager state, so we won't execute stray commands and
 	// won't do the next snapshot until the appropriate time.
@@ -19,8 +19,8 @@
 #define INCLUDED_NETTURNMANAGER
 
 #include "simulation2/helpers/SimulationCommand.h"
+#include "simulation2/serialization/SnapshotStore.h"
 
-#include <list>
 #include <map>
 
 class CNetServerWorker;
@@ -120,6 +120,8 @@ public:
 	 * Enables the recording of state snapshots every @p numTurns,
 	 * which can be jumped back to via RewindTimeWarp().
 	 * If @p numTurns is 0 then recording is disabled.
+	 * Snapshots are stored as deltas, and the oldest are discarded
+	 * when they use more than TIME_WARP_MAX_MEMORY.
 	 */
 	void EnableTimeWarpRecording(size_t numTurns);
 
@@ -181,7 +183,7 @@ protected:
 
 private:
 	size_t m_TimeWarpNumTurns; // 0 if disabled
-	std::list<std::string> m_TimeWarpStates;
+	CSnapshotStore m_TimeWarpStates;
 	std::string m_QuickSaveState; // TODO: should implement a proper disk-based quicksave system
 };
 
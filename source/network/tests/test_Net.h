@@ -333,4 +333,110 @@ public:
 			wait(clients, 100);
 		}
 	}
+
+	// Rejoins a game over a local connection, and checks that the other player
+	// keeps playing while the rejoiner downloads the (streamed) game state and
+	// catches up, and that they end up with the same state.
+	// Disabled by default, like test_rejoin_DISABLED, because it uses real sockets,
+	// waits for them with SDL_Delay, and needs the public mod's data
+	void test_rejoin_loopback_DISABLED()
+	{
+		ScriptInterface scriptInterface("Engine", "Test", ScriptInterface::CreateRuntime());
+		TestLogger logger;
+
+		std::vector<CNetClient*> clients;
+
+		CGame client1Game(true);
+		CGame client2Game(true);
+
+		CNetServer server;
+
+		CScriptValRooted attrs;
+		scriptInterface.Eval("({mapType:'scenario',map:'_default'})", attrs);
+		server.UpdateGameAttributes(attrs.get(), scriptInterface);
+
+		CNetClient client1(&client1Game);
+		CNetClient client2(&client2Game);
+
+		client1.SetUserName(L"alice");
+		client2.SetUserName(L"bob");
+
+		clients.push_back(&client1);
+		clients.push_back(&client2);
+
+		connect(server, clients);
+
+		server.StartGame();
+		SDL_Delay(100);
+		for (size_t j = 0; j < clients.size(); ++j)
+		{
+			clients[j]->Poll();
+			TS_ASSERT_OK(LDR_NonprogressiveLoad());
+			clients[j]->LoadFinished();
+		}
+
+		wait(clients, 100);
+
+		for (size_t i = 0; i < 3; ++i)
+		{
+			client1Game.GetTurnManager()->Update(1.0f, 1);
+			client2Game.GetTurnManager()->Update(1.0f, 1);
+			wait(clients, 100);
+		}
+
+		client2.DestroyConnection();
+		clients.pop_back();
+
+		CGame client2BGame(true);
+		CNetClient client2B(&client2BGame);
+		client2B.SetUserName(L"bob");
+		clients.push_back(&client2B);
+
+		TS_ASSERT(client2B.SetupConnection("127.0.0.1"));
+
+		u32 rejoinTurn = client1Game.GetTurnManager()->GetCurrentTurn();
+
+		// Wait for the state to arrive, which makes the client start loading the game
+		bool started = false;
+		for (size_t i = 0; i < 50 && !started; ++i)
+		{
+			client1Game.GetTurnManager()->Update(1.0f, 1);
+			wait(clients, 100);
+			started = (client2B.TestReadGuiMessages().find(L"\"start\"") != std::wstring::npos);
+		}
+		TS_ASSERT(started);
+		TS_ASSERT_EQUALS(client2B.GetCurrState(), (uint)NCS_JOIN_SYNCING);
+
+		TS_ASSERT_OK(LDR_NonprogressiveLoad());
+		client2B.LoadFinished();
+
+		// Alice doesn't have to wait while Bob catches up
+		for (size_t i = 0; i < 50 && client2B.GetCurrState() != NCS_INGAME; ++i)
+		{
+			client1Game.GetTurnManager()->Update(1.0f, 1);
+			wait(clients, 100);
+		}
+		TS_ASSERT_EQUALS(client2B.GetCurrState(), (uint)NCS_INGAME);
+		TS_ASSERT_LESS_THAN(rejoinTurn, client1Game.GetTurnManager()->GetCurrentTurn());
+
+		// Once they're both on the same turn, they must agree on the state
+		for (size_t i = 0; i < 50; ++i)
+		{
+			u32 turn1 = client1Game.GetTurnManager()->GetCurrentTurn();
+			u32 turn2 = client2BGame.GetTurnManager()->GetCurrentTurn();
+			if (turn1 == turn2)
+				break;
+			if (turn1 < turn2)
+				client1Game.GetTurnManager()->Update(1.0f, 1);
+			else
+				client2BGame.GetTurnManager()->Update(1.0f, 1);
+			wait(clients, 100);
+		}
+		TS_ASSERT_EQUALS(client1Game.GetTurnManager()->GetCurrentTurn(), client2BGame.GetTurnManager()->GetCurrentTurn());
+
+		std::string hash1, hash2;
+		TS_ASSERT(client1Game.GetSimulation2()->ComputeStateHash(hash1, false));
+		TS_ASSERT(client2BGame.GetSimulation2()->ComputeStateHash(hash2, false));
+		TS_ASSERT(hash1 == hash2);
+	}
 };
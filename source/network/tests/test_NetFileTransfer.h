@@ -0,0 +1,224 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "network/NetFileTransfer.h"
+#include "network/NetMessage.h"
+#include "network/NetSession.h"
+#include "ps/Compress.h"
+#include "scriptinterface/ScriptInterface.h"
+
+#include <deque>
+
+/**
+ * Session that queues serialized messages, to be delivered to another
+ * CNetFileTransferer without going through the network.
+ */
+class CLoopbackSession : public INetSession
+{
+public:
+	virtual bool SendMessage(const CNetMessage* message)
+	{
+		std::vector<u8> data(message->GetSerializedLength());
+		message->Serialize(&data[0]);
+		m_Queue.push_back(data);
+		return true;
+	}
+
+	// Delivers the queued messages to the transferer, returning any requests it didn't handle
+	std::vector<u32> Deliver(CNetFileTransferer& transferer, ScriptInterface& scriptInterface)
+	{
+		std::vector<u32> requests;
+		while (!m_Queue.empty())
+		{
+			CNetMessage* message = CNetMessageFactory::CreateMessage(&m_Queue.front()[0], m_Queue.front().size(), scriptInterface);
+			m_Queue.pop_front();
+			TS_ASSERT(message);
+			if (!message)
+				continue;
+
+			Status status = transferer.HandleMessageReceive(message);
+			TS_ASSERT(status != ERR::FAIL);
+			if (status == INFO::SKIPPED && message->GetType() == NMT_FILE_TRANSFER_REQUEST)
+				requests.push_back(static_cast<CFileTransferRequestMessage*>(message)->m_RequestID);
+
+			delete message;
+		}
+		return requests;
+	}
+
+	std::deque<std::vector<u8> > m_Queue;
+};
+
+class CTestReceiveTask : public CNetFileReceiveTask
+{
+public:
+	CTestReceiveTask(bool compressed) : m_Compressed(compressed), m_Completed(false), m_Failed(false), m_Decompressor(16*MiB) { }
+
+	virtual void OnData(const std::string& data)
+	{
+		if (!m_Compressed)
+			CNetFileReceiveTask::OnData(data);
+		else if (!m_Decompressor.Decompress(data.data(), data.size(), m_Buffer))
+			m_Failed = true;
+	}
+
+	virtual void OnComplete()
+	{
+		m_Completed = true;
+	}
+
+	bool m_Compressed;
+	bool m_Completed;
+	bool m_Failed;
+	CZLibStreamDecompressor m_Decompressor;
+};
+
+class TestNetFileTransfer : public CxxTest::TestSuite
+{
+	std::string makeData(size_t size)
+	{
+		// Something that compresses a bit, but not too trivially
+		std::string data;
+		u32 x = 12345;
+		for (size_t i = 0; i < size; ++i)
+		{
+			x = x * 1103515245 + 12345;
+			data += (char)('a' + (x >> 16) % 8);
+		}
+		return data;
+	}
+
+public:
+	void test_response()
+	{
+		ScriptInterface script("Test", "Test", ScriptInterface::CreateRuntime());
+		CLoopbackSession toServer, toClient;
+		CNetFileTransferer client(&toServer), server(&toClient);
+
+		std::string data = makeData(10000);
+
+		shared_ptr<CTestReceiveTask> task(new CTestReceiveTask(false));
+		client.StartTask(task);
+
+		std::vector<u32> requests = toServer.Deliver(server, script);
+		TS_ASSERT_EQUALS(requests.size(), (size_t)1);
+		server.StartResponse(requests.at(0), data);
+
+		for (size_t i = 0; i < 100 && !task->m_Completed; ++i)
+		{
+			server.Poll();
+			toClient.Deliver(client, script);
+			toServer.Deliver(server, script);
+		}
+
+		TS_ASSERT(task->m_Completed);
+		TS_ASSERT(!task->m_Streamed);
+		TS_ASSERT(task->m_Buffer == data);
+	}
+
+	void test_streamed_compressed()
+	{
+		ScriptInterface script("Test", "Test", ScriptInterface::CreateRuntime());
+		CLoopbackSession toServer, toClient;
+		CNetFileTransferer client(&toServer), server(&toClient);
+
+		std::string data = makeData(200000);
+
+		shared_ptr<CTestReceiveTask> task(new CTestReceiveTask(true));
+		client.StartTask(task);
+
+		std::vector<u32> requests = toServer.Deliver(server, script);
+		TS_ASSERT_EQUALS(requests.size(), (size_t)1);
+		u32 requestID = requests.at(0);
+		server.StartStreamedResponse(requestID);
+
+		// Produce the data a piece at a time, like CNetClient does for rejoin states
+		CZLibStreamCompressor compressor;
+		size_t offset = 0;
+		bool receivedBeforeFinish = false;
+		for (size_t i = 0; i < 1000 && !task->m_Completed; ++i)
+		{
+			if (offset < data.size())
+			{
+				std::string compressed;
+				size_t len = std::min((size_t)10000, data.size() - offset);
+				compressor.Compress(data.data() + offset, len, compressed);
+				offset += len;
+				if (offset == data.size())
+					compressor.Finish(compressed);
+				server.AppendResponse(requestID, compressed);
+				if (offset == data.size())
+					server.FinishResponse(requestID);
+				else if (!task->m_Buffer.empty())
+					receivedBeforeFinish = true;
+			}
+
+			server.Poll();
+			toClient.Deliver(client, script);
+			toServer.Deliver(server, script);
+		}
+
+		TS_ASSERT(task->m_Completed);
+		TS_ASSERT(task->m_Streamed);
+		TS_ASSERT(!task->m_Failed);
+		TS_ASSERT(task->m_Decompressor.IsFinished());
+		TS_ASSERT(task->m_Buffer == data);
+		TS_ASSERT(receivedBeforeFinish);
+		TS_ASSERT_LESS_THAN(task->m_Received, data.size());
+	}
+
+	void test_decompress_invalid()
+	{
+		std::string data = makeData(1000);
+		std::string compressed;
+		CZLibStreamCompressor compressor;
+		compressor.Compress(data.data(), data.size(), compressed);
+		compressor.Finish(compressed);
+
+		std::string out;
+		CZLibStreamDecompressor truncated(data.size());
+		TS_ASSERT(truncated.Decompress(compressed.data(), compressed.size() - 1, out));
+		TS_ASSERT(!truncated.IsFinished());
+
+		out.clear();
+		CZLibStreamDecompressor trailing(data.size());
+		TS_ASSERT(!trailing.Decompress((compressed + "x").data(), compressed.size() + 1, out));
+
+		out.clear();
+		std::string corrupt = compressed;
+		corrupt[0] = 0;
+		CZLibStreamDecompressor bad(data.size());
+		TS_ASSERT(!bad.Decompress(corrupt.data(), corrupt.size(), out));
+
+		// Streams that decompress to more than the maximum size are rejected,
+		// even when they're fed in small pieces
+		out.clear();
+		CZLibStreamDecompressor exact(data.size());
+		TS_ASSERT(exact.Decompress(compressed.data(), compressed.size(), out));
+		TS_ASSERT(exact.IsFinished());
+
+		out.clear();
+		CZLibStreamDecompressor tooLarge(data.size() - 1);
+		bool ok = true;
+		for (size_t i = 0; i < compressed.size() && ok; ++i)
+			ok = tooLarge.Decompress(compressed.data() + i, 1, out);
+		TS_ASSERT(!ok);
+		TS_ASSERT_LESS_THAN_EQUALS(out.size(), data.size());
+	}
+};
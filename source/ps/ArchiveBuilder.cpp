@@ -20,6 +20,8 @@
 #include "ArchiveBuilder.h"
 
 #include "graphics/TextureManager.h"
+#include "lib/external_libraries/libsdl.h"
+#include "lib/sysdep/filesystem.h"
 #include "lib/tex/tex_codec.h"
 #include "lib/file/archive/archive_zip.h"
 #include "lib/file/vfs/vfs_util.h"
@@ -32,28 +34,31 @@
 
 #include <boost/algorithm/string.hpp>
 
-CArchiveBuilder::CArchiveBuilder(const OsPath& mod, const OsPath& tempdir) :
-	m_TempDir(tempdir)
+CArchiveBuilder::CArchiveBuilder(const OsPath& mod, const OsPath& tempdir, bool incremental) :
+	m_TempDir(tempdir), m_Incremental(incremental)
 {
 	tex_codec_register_all();
 
 	m_VFS = CreateVfs(20*MiB);
 
-	DeleteDirectory(m_TempDir/"_archivecache"); // clean up in case the last run failed
-
-	m_VFS->Mount(L"cache/", m_TempDir/"_archivecache/");
+	if (!m_Incremental)
+		DeleteDirectory(m_TempDir/"_archivecache"); // clean up in case the last run failed
 
 	m_VFS->Mount(L"", mod/"", VFS_MOUNT_MUST_EXIST | VFS_MOUNT_KEEP_DELETED);
 
 	// Collect the list of files before loading any base mods
+	// (or the cache, which may still contain files from previous incremental builds)
 	vfs::ForEachFile(m_VFS, L"", &CollectFileCB, (uintptr_t)static_cast<void*>(this), 0, vfs::DIR_RECURSIVE);
+
+	m_VFS->Mount(L"cache/", m_TempDir/"_archivecache/");
 }
 
 CArchiveBuilder::~CArchiveBuilder()
 {
 	m_VFS.reset();
 
-	DeleteDirectory(m_TempDir/"_archivecache");
+	if (!m_Incremental)
+		DeleteDirectory(m_TempDir/"_archivecache");
 
 	tex_codec_unregister_all();
 }
@@ -63,6 +68,20 @@ void CArchiveBuilder::AddBaseMod(const OsPath& mod)
 	m_VFS->Mount(L"", mod/"", VFS_MOUNT_MUST_EXIST);
 }
 
+/**
+ * Collects the results of finished texture conversions.
+ */
+static void PollTextureConversions(CTextureManager& texman, std::set<VfsPath>& converting)
+{
+	VfsPath outputPath;
+	bool ok;
+	while (texman.PollGeneratedCachedTexture(outputPath, ok))
+	{
+		ENSURE(ok);
+		converting.erase(outputPath);
+	}
+}
+
 void CArchiveBuilder::Build(const OsPath& archive)
 {
 	// Disable zip compression because it significantly hurts download size
@@ -72,14 +91,20 @@ void CArchiveBuilder::Build(const OsPath& archive)
 	// (See http://trac.wildfiregames.com/ticket/671)
 	const bool noDeflate = true;
 
-	PIArchiveWriter writer = CreateArchiveWriter_Zip(archive, noDeflate);
-
 	// Use CTextureManager instead of CTextureConverter directly,
 	// so it can deal with all the loading of settings.xml files
 	CTextureManager texman(m_VFS, true, true);
 
 	CXeromyces xero;
 
+	// Files to store in the archive, as (VFS path of the data, name in the archive),
+	// in the order of m_Files so the archive doesn't depend on when conversions finish
+	std::vector<std::pair<VfsPath, VfsPath> > entries;
+
+	// Cached files used by this build, and the subset of textures that are still converting
+	std::set<VfsPath> cacheFiles;
+	std::set<VfsPath> converting;
+
 	for (size_t i = 0; i < m_Files.size(); ++i)
 	{
 		Status ret;
@@ -97,41 +122,103 @@ void CArchiveBuilder::Build(const OsPath& archive)
 			!boost::algorithm::starts_with(path.string(), L"art/textures/terrain/alphamaps/")
 		)
 		{
-			VfsPath cachedPath;
-			debug_printf(L"Converting texture %ls\n", realPath.string().c_str());
-			bool ok = texman.GenerateCachedTexture(path, cachedPath);
+			// Don't queue up more textures (each holding all its uncompressed data)
+			// than the converter threads can keep up with
+			while (texman.IsConverterBusy())
+			{
+				PollTextureConversions(texman, converting);
+				SDL_Delay(1);
+			}
+
+			VfsPath archiveCachePath, cachedPath;
+			bool started;
+			bool ok = texman.StartGeneratingCachedTexture(path, archiveCachePath, cachedPath, started);
 			ENSURE(ok);
 
-			OsPath cachedRealPath;
-			ret = m_VFS->GetRealPath(VfsPath("cache")/cachedPath, cachedRealPath);
-			ENSURE(ret == INFO::OK);
+			if (started)
+			{
+				debug_printf(L"Converting texture %ls\n", realPath.string().c_str());
+				converting.insert(cachedPath);
+			}
+			else
+			{
+				debug_printf(L"Reusing converted texture %ls\n", realPath.string().c_str());
+			}
 
-			writer->AddFile(cachedRealPath, cachedPath);
+			cacheFiles.insert(cachedPath);
+			entries.push_back(std::make_pair(cachedPath, archiveCachePath));
 
 			// We don't want to store the original file too (since it's a
 			// large waste of space), so skip to the next file
+			PollTextureConversions(texman, converting);
 			continue;
 		}
 
 		// TODO: should cache DAE->PMD and DAE->PSA conversions too
 
-		debug_printf(L"Adding %ls\n", realPath.string().c_str());
-		writer->AddFile(realPath, path);
+		entries.push_back(std::make_pair(path, path));
 
 		// Also cache XMB versions of all XML files
+		// (this is cheap compared to textures, so it's done here while the
+		// converter threads are busy)
 		if (path.Extension() == L".xml")
 		{
-			VfsPath cachedPath;
+			VfsPath archiveCachePath, cachedPath;
 			debug_printf(L"Converting XML file %ls\n", realPath.string().c_str());
-			bool ok = xero.GenerateCachedXMB(m_VFS, path, cachedPath);
+			bool ok = xero.GenerateCachedXMB(m_VFS, path, archiveCachePath, cachedPath);
 			ENSURE(ok);
 
-			OsPath cachedRealPath;
-			ret = m_VFS->GetRealPath(VfsPath("cache")/cachedPath, cachedRealPath);
-			ENSURE(ret == INFO::OK);
-
-			writer->AddFile(cachedRealPath, cachedPath);
+			cacheFiles.insert(cachedPath);
+			entries.push_back(std::make_pair(cachedPath, archiveCachePath));
 		}
+
+		PollTextureConversions(texman, converting);
+	}
+
+	// Wait for the last textures
+	while (!converting.empty())
+	{
+		PollTextureConversions(texman, converting);
+		SDL_Delay(1);
+	}
+
+	PIArchiveWriter writer = CreateArchiveWriter_Zip(archive, noDeflate);
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		OsPath realPath;
+		Status ret = m_VFS->GetRealPath(entries[i].first, realPath);
+		ENSURE(ret == INFO::OK);
+
+		debug_printf(L"Adding %ls\n", realPath.string().c_str());
+		writer->AddFile(realPath, entries[i].second);
+	}
+
+	if (m_Incremental)
+		RemoveUnusedCacheFiles(cacheFiles);
+}
+
+static Status CollectCacheFileCB(const VfsPath& pathname, const FileInfo& UNUSED(fileInfo), const uintptr_t cbData)
+{
+	std::vector<VfsPath>* files = static_cast<std::vector<VfsPath>*>((void*)cbData);
+	files->push_back(pathname);
+
+	return INFO::OK;
+}
+
+void CArchiveBuilder::RemoveUnusedCacheFiles(const std::set<VfsPath>& used)
+{
+	std::vector<VfsPath> files;
+	vfs::ForEachFile(m_VFS, L"cache/", &CollectCacheFileCB, (uintptr_t)static_cast<void*>(&files), 0, vfs::DIR_RECURSIVE);
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (used.find(files[i]) != used.end())
+			continue;
+
+		OsPath realPath;
+		if (m_VFS->GetRealPath(files[i], realPath) == INFO::OK)
+			wunlink(realPath);
 	}
 }
 
@@ -21,6 +21,8 @@
 #include "lib/file/vfs/vfs.h"
 #include "ps/CStr.h"
 
+#include <set>
+
 /**
  * Packages a mod's files into a distributable archive.
  * This includes various game-specific knowledge on how to convert
@@ -35,8 +37,11 @@ public:
 	 *
 	 * @param mod path to data/mods/foo directory, containing files for conversion
 	 * @param tempdir path to a writable directory for temporary files
+	 * @param incremental if true, converted files are kept in tempdir after building,
+	 *  and reused by later builds if their source file and conversion settings
+	 *  haven't changed (instead of converting everything from scratch)
 	 */
-	CArchiveBuilder(const OsPath& mod, const OsPath& tempdir);
+	CArchiveBuilder(const OsPath& mod, const OsPath& tempdir, bool incremental = false);
 
 	~CArchiveBuilder();
 
@@ -51,6 +56,8 @@ public:
 
 	/**
 	 * Do all the processing and packing of files into the archive.
+	 * Textures are converted on several threads, but the archive's contents
+	 * are always stored in the same order.
 	 * @param archive path of .zip file to generate (will be overwritten if it exists)
 	 */
 	void Build(const OsPath& archive);
@@ -58,9 +65,16 @@ public:
 private:
 	static Status CollectFileCB(const VfsPath& pathname, const FileInfo& fileInfo, const uintptr_t cbData);
 
+	/**
+	 * Deletes cached files that weren't used by the last build, so the
+	 * incremental cache doesn't keep growing as files are edited.
+	 */
+	void RemoveUnusedCacheFiles(const std::set<VfsPath>& used);
+
 	PIVFS m_VFS;
 	std::vector<VfsPath> m_Files;
 	OsPath m_TempDir;
+	bool m_Incremental;
 };
 
 #endif // INCLUDED_ARCHIVEBUILDER
@@ -0,0 +1,576 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "BinaryReplay.h"
+
+#include "lib/byte_order.h"
+#include "ps/CLogger.h"
+#include "ps/Util.h"
+
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+static const char REPLAY_MAGIC[4] = { '0', 'A', 'D', 'R' };
+static const char REPLAY_INDEX_MAGIC[4] = { '0', 'A', 'D', 'I' };
+static const u32 REPLAY_VERSION = 1;
+
+static const size_t HEADER_SIZE = 8; // magic, version
+static const size_t RECORD_HEADER_SIZE = 5; // type, payload size
+static const size_t TRAILER_SIZE = 12; // index record offset, index magic
+
+static bool Unhexify(const std::string& hex, std::string& out)
+{
+	if (hex.size() % 2)
+		return false;
+
+	out.resize(hex.size() / 2);
+	for (size_t i = 0; i < out.size(); ++i)
+	{
+		int value = 0;
+		for (size_t j = 0; j < 2; ++j)
+		{
+			char c = hex[i*2 + j];
+			value <<= 4;
+			if (c >= '0' && c <= '9')
+				value |= c - '0';
+			else if (c >= 'a' && c <= 'f')
+				value |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F')
+				value |= c - 'A' + 10;
+			else
+				return false;
+		}
+		out[i] = (char)value;
+	}
+	return true;
+}
+
+static u64 StreamOffset(std::istream& stream)
+{
+	return (u64)(std::streamoff)stream.tellg();
+}
+
+static void SeekStream(std::istream& stream, u64 offset)
+{
+	stream.clear();
+	stream.seekg((std::streamoff)offset);
+}
+
+////////////////////////////////////////////////////////////////
+
+CBinaryReplayWriter::CBinaryReplayWriter(std::ostream& stream) :
+	m_Stream(stream), m_Offset(0), m_Finished(false)
+{
+	m_Stream.write(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+	m_Offset += sizeof(REPLAY_MAGIC);
+	WriteU32(REPLAY_VERSION);
+}
+
+CBinaryReplayWriter::~CBinaryReplayWriter()
+{
+	if (!m_Finished)
+		Finish();
+}
+
+void CBinaryReplayWriter::WriteU32(u32 value)
+{
+	u8 buf[4];
+	write_le32(buf, value);
+	m_Stream.write((const char*)buf, sizeof(buf));
+	m_Offset += sizeof(buf);
+}
+
+void CBinaryReplayWriter::WriteString(const std::string& str)
+{
+	m_Stream.write(str.data(), str.size());
+	m_Offset += str.size();
+}
+
+void CBinaryReplayWriter::WriteRecordHeader(u8 type, size_t size)
+{
+	ENSURE(!m_Finished);
+	ENSURE(size <= 0xFFFFFFFFu);
+
+	m_Stream.put((char)type);
+	m_Offset += 1;
+	WriteU32((u32)size);
+}
+
+void CBinaryReplayWriter::StartGame(const std::string& attribs)
+{
+	WriteRecordHeader(SReplayRecord::START, attribs.size());
+	WriteString(attribs);
+	m_Stream.flush();
+}
+
+void CBinaryReplayWriter::Turn(u32 n, u32 turnLength, const std::vector<SReplayCommand>& commands)
+{
+	size_t size = 12;
+	for (size_t i = 0; i < commands.size(); ++i)
+		size += 8 + commands[i].data.size();
+
+	WriteRecordHeader(SReplayRecord::TURN, size);
+	WriteU32(n);
+	WriteU32(turnLength);
+	WriteU32((u32)commands.size());
+	for (size_t i = 0; i < commands.size(); ++i)
+	{
+		WriteU32(commands[i].player);
+		WriteU32((u32)commands[i].data.size());
+		WriteString(commands[i].data);
+	}
+	m_Stream.flush();
+}
+
+void CBinaryReplayWriter::Hash(const std::string& hash, bool quick)
+{
+	WriteRecordHeader(SReplayRecord::HASH, 1 + hash.size());
+	m_Stream.put(quick ? 1 : 0);
+	m_Offset += 1;
+	WriteString(hash);
+}
+
+void CBinaryReplayWriter::Snapshot(u32 n, const std::string& state)
+{
+	m_Snapshots.push_back(std::make_pair(n, m_Offset));
+
+	WriteRecordHeader(SReplayRecord::SNAPSHOT, 4 + state.size());
+	WriteU32(n);
+	WriteString(state);
+	m_Stream.flush();
+}
+
+void CBinaryReplayWriter::WriteRecord(const SReplayRecord& record)
+{
+	switch (record.type)
+	{
+	case SReplayRecord::START:
+		StartGame(record.data);
+		break;
+	case SReplayRecord::TURN:
+		Turn(record.turn, record.turnLength, record.commands);
+		break;
+	case SReplayRecord::HASH:
+		Hash(record.data, record.quick);
+		break;
+	case SReplayRecord::SNAPSHOT:
+		Snapshot(record.turn, record.data);
+		break;
+	default:
+		debug_warn(L"Invalid replay record type");
+	}
+}
+
+void CBinaryReplayWriter::Finish()
+{
+	u64 indexOffset = m_Offset;
+
+	WriteRecordHeader(SReplayRecord::INDEX, 4 + m_Snapshots.size() * 12);
+	WriteU32((u32)m_Snapshots.size());
+	for (size_t i = 0; i < m_Snapshots.size(); ++i)
+	{
+		WriteU32(m_Snapshots[i].first);
+		WriteU32((u32)(m_Snapshots[i].second & 0xFFFFFFFFu));
+		WriteU32((u32)(m_Snapshots[i].second >> 32));
+	}
+
+	WriteU32((u32)(indexOffset & 0xFFFFFFFFu));
+	WriteU32((u32)(indexOffset >> 32));
+	m_Stream.write(REPLAY_INDEX_MAGIC, sizeof(REPLAY_INDEX_MAGIC));
+	m_Offset += sizeof(REPLAY_INDEX_MAGIC);
+	m_Stream.flush();
+
+	m_Finished = true;
+}
+
+////////////////////////////////////////////////////////////////
+
+CBinaryReplayReader::CBinaryReplayReader(std::istream& stream) :
+	m_Stream(stream), m_FirstRecord(HEADER_SIZE), m_End(0)
+{
+}
+
+bool CBinaryReplayReader::Open()
+{
+	SeekStream(m_Stream, 0);
+
+	u8 header[HEADER_SIZE];
+	if (!m_Stream.read((char*)header, sizeof(header)))
+		return false;
+	if (memcmp(header, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0)
+		return false;
+	if (read_le32(header + 4) != REPLAY_VERSION)
+		return false;
+
+	m_Stream.seekg(0, std::ios::end);
+	u64 size = StreamOffset(m_Stream);
+
+	bool haveIndex = false;
+	if (size >= HEADER_SIZE + TRAILER_SIZE)
+	{
+		u8 trailer[TRAILER_SIZE];
+		SeekStream(m_Stream, size - TRAILER_SIZE);
+		if (m_Stream.read((char*)trailer, sizeof(trailer)) &&
+			memcmp(trailer + 8, REPLAY_INDEX_MAGIC, sizeof(REPLAY_INDEX_MAGIC)) == 0)
+		{
+			haveIndex = ReadIndex(read_le64(trailer), size - TRAILER_SIZE);
+		}
+	}
+
+	if (!haveIndex)
+	{
+		m_End = size;
+		RebuildIndex();
+	}
+
+	m_StartAttributes.clear();
+	SeekStream(m_Stream, m_FirstRecord);
+	SReplayRecord record;
+	if (ReadRecord(record) && record.type == SReplayRecord::START)
+		m_StartAttributes.swap(record.data);
+
+	SeekStream(m_Stream, m_FirstRecord);
+	return true;
+}
+
+bool CBinaryReplayReader::ReadIndex(u64 offset, u64 end)
+{
+	if (offset < m_FirstRecord || offset + RECORD_HEADER_SIZE > end)
+		return false;
+
+	SeekStream(m_Stream, offset);
+
+	u8 type;
+	u32 size;
+	if (!ReadRecordHeader(type, size) || type != SReplayRecord::INDEX || size < 4)
+		return false;
+
+	// (Check the size against the file before allocating anything for it)
+	if (offset + RECORD_HEADER_SIZE + size > end)
+		return false;
+
+	std::string buf(size, '\0');
+	if (!m_Stream.read(&buf[0], size))
+		return false;
+
+	const u8* p = (const u8*)buf.data();
+	u32 count = read_le32(p);
+	if (size != 4 + (u64)count * 12)
+		return false;
+
+	m_Snapshots.clear();
+	for (u32 i = 0; i < count; ++i)
+	{
+		const u8* entry = p + 4 + i * 12;
+		m_Snapshots.push_back(std::make_pair(read_le32(entry), read_le64(entry + 4)));
+	}
+
+	m_End = offset;
+	return true;
+}
+
+void CBinaryReplayReader::RebuildIndex()
+{
+	m_Snapshots.clear();
+
+	SeekStream(m_Stream, m_FirstRecord);
+
+	// Skip through the records, stopping at the first incomplete one
+	u64 offset = m_FirstRecord;
+	while (true)
+	{
+		u8 type;
+		u32 size;
+		if (!ReadRecordHeader(type, size))
+			break;
+
+		u64 next = offset + RECORD_HEADER_SIZE + size;
+		if (next > m_End)
+			break;
+
+		if (type == SReplayRecord::SNAPSHOT)
+		{
+			u8 buf[4];
+			if (size < 4 || !m_Stream.read((char*)buf, sizeof(buf)))
+				break;
+			m_Snapshots.push_back(std::make_pair(read_le32(buf), offset));
+		}
+		else if (type == SReplayRecord::INDEX)
+		{
+			// An index without a valid trailer - treat it as the end
+			break;
+		}
+
+		offset = next;
+		SeekStream(m_Stream, offset);
+	}
+
+	m_End = offset;
+}
+
+bool CBinaryReplayReader::ReadRecordHeader(u8& type, u32& size)
+{
+	u8 buf[RECORD_HEADER_SIZE];
+	if (!m_Stream.read((char*)buf, sizeof(buf)))
+		return false;
+	type = buf[0];
+	size = read_le32(buf + 1);
+	return true;
+}
+
+// (The caller must have checked that the payload size fits before m_End)
+bool CBinaryReplayReader::ReadRecordPayload(u8 type, u32 size, SReplayRecord& record)
+{
+	record.type = (SReplayRecord::EType)type;
+	record.turn = 0;
+	record.turnLength = 0;
+	record.quick = false;
+	record.data.clear();
+	record.commands.clear();
+
+	switch (type)
+	{
+	case SReplayRecord::START:
+	{
+		record.data.resize(size);
+		return size == 0 || m_Stream.read(&record.data[0], size);
+	}
+	case SReplayRecord::TURN:
+	{
+		std::string buf(size, '\0');
+		if (size < 12 || !m_Stream.read(&buf[0], size))
+			return false;
+
+		const u8* p = (const u8*)buf.data();
+		const u8* end = p + size;
+		record.turn = read_le32(p);
+		record.turnLength = read_le32(p + 4);
+		u32 count = read_le32(p + 8);
+		p += 12;
+
+		// Every command has at least an 8-byte header, so reject counts the
+		// payload can't hold before allocating anything for them
+		if (count > (u32)(end - p) / 8)
+			return false;
+
+		record.commands.resize(count);
+		for (u32 i = 0; i < count; ++i)
+		{
+			if (end - p < 8)
+				return false;
+			record.commands[i].player = read_le32(p);
+			u32 len = read_le32(p + 4);
+			p += 8;
+			if ((u32)(end - p) < len)
+				return false;
+			record.commands[i].data.assign((const char*)p, len);
+			p += len;
+		}
+		return true;
+	}
+	case SReplayRecord::HASH:
+	{
+		char quick;
+		if (size < 1 || !m_Stream.get(quick))
+			return false;
+		record.quick = (quick != 0);
+		record.data.resize(size - 1);
+		return size == 1 || m_Stream.read(&record.data[0], size - 1);
+	}
+	case SReplayRecord::SNAPSHOT:
+	{
+		u8 buf[4];
+		if (size < 4 || !m_Stream.read((char*)buf, sizeof(buf)))
+			return false;
+		record.turn = read_le32(buf);
+		record.data.resize(size - 4);
+		return size == 4 || m_Stream.read(&record.data[0], size - 4);
+	}
+	default:
+		return false;
+	}
+}
+
+bool CBinaryReplayReader::ReadRecord(SReplayRecord& record)
+{
+	while (true)
+	{
+		u64 offset = StreamOffset(m_Stream);
+		if (!m_Stream.good() || offset + RECORD_HEADER_SIZE > m_End)
+			return false;
+
+		u8 type;
+		u32 size;
+		if (!ReadRecordHeader(type, size))
+			return false;
+
+		if (offset + RECORD_HEADER_SIZE + size > m_End)
+			return false;
+
+		// Skip record types we don't know about, so newer versions can add
+		// optional data without breaking older readers
+		if (type < SReplayRecord::START || type >= SReplayRecord::INDEX)
+		{
+			SeekStream(m_Stream, offset + RECORD_HEADER_SIZE + size);
+			continue;
+		}
+
+		return ReadRecordPayload(type, size, record);
+	}
+}
+
+std::vector<u32> CBinaryReplayReader::GetSnapshotTurns() const
+{
+	std::vector<u32> turns;
+	for (size_t i = 0; i < m_Snapshots.size(); ++i)
+		turns.push_back(m_Snapshots[i].first);
+	return turns;
+}
+
+bool CBinaryReplayReader::SeekToSnapshot(u32 turn, SReplayRecord& record)
+{
+	// Snapshots are written in turn order, so find the last one <= turn
+	std::vector<std::pair<u32, u64> >::const_iterator it =
+		std::upper_bound(m_Snapshots.begin(), m_Snapshots.end(), std::make_pair(turn, (u64)-1));
+	if (it == m_Snapshots.begin())
+		return false;
+	--it;
+
+	u64 oldOffset = StreamOffset(m_Stream);
+
+	// The offset comes from the index and the size from the record header,
+	// so check both against the file before seeking or allocating
+	u8 type;
+	u32 size;
+	bool ok = (it->second >= m_FirstRecord && it->second + RECORD_HEADER_SIZE <= m_End);
+	if (ok)
+	{
+		SeekStream(m_Stream, it->second);
+		ok = ReadRecordHeader(type, size) && type == SReplayRecord::SNAPSHOT &&
+			it->second + RECORD_HEADER_SIZE + size <= m_End &&
+			ReadRecordPayload(type, size, record);
+	}
+
+	if (!ok)
+	{
+		LOGERROR(L"Invalid snapshot for turn %u in replay", it->first);
+		SeekStream(m_Stream, oldOffset);
+		return false;
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////
+
+static void StripLeadingSpace(std::string& line)
+{
+	if (!line.empty() && line[0] == ' ')
+		line.erase(0, 1);
+}
+
+bool ConvertTextReplayToBinary(std::istream& text, std::ostream& binary)
+{
+	CBinaryReplayWriter writer(binary);
+
+	std::vector<SReplayCommand> commands;
+	u32 turn = 0;
+	u32 turnLength = 0;
+
+	std::string type;
+	while (text >> type)
+	{
+		if (type == "start")
+		{
+			std::string line;
+			std::getline(text, line);
+			StripLeadingSpace(line);
+			writer.StartGame(line);
+		}
+		else if (type == "turn")
+		{
+			if (!(text >> turn >> turnLength))
+				return false;
+			commands.clear();
+		}
+		else if (type == "cmd")
+		{
+			SReplayCommand cmd;
+			if (!(text >> cmd.player))
+				return false;
+			std::getline(text, cmd.data);
+			StripLeadingSpace(cmd.data);
+			commands.push_back(cmd);
+		}
+		else if (type == "end")
+		{
+			writer.Turn(turn, turnLength, commands);
+			commands.clear();
+		}
+		else if (type == "hash" || type == "hash-quick")
+		{
+			std::string hex, hash;
+			text >> hex;
+			if (!Unhexify(hex, hash))
+				return false;
+			writer.Hash(hash, type == "hash-quick");
+		}
+		else
+		{
+			LOGERROR(L"Unrecognised replay token %hs", type.c_str());
+			return false;
+		}
+	}
+
+	writer.Finish();
+	return binary.good();
+}
+
+bool ConvertBinaryReplayToText(std::istream& binary, std::ostream& text)
+{
+	CBinaryReplayReader reader(binary);
+	if (!reader.Open())
+		return false;
+
+	// (This must match the output of CReplayLogger)
+	SReplayRecord record;
+	while (reader.ReadRecord(record))
+	{
+		switch (record.type)
+		{
+		case SReplayRecord::START:
+			text << "start " << record.data << "\n";
+			break;
+		case SReplayRecord::TURN:
+			text << "turn " << record.turn << " " << record.turnLength << "\n";
+			for (size_t i = 0; i < record.commands.size(); ++i)
+				text << "cmd " << record.commands[i].player << " " << record.commands[i].data << "\n";
+			text << "end\n";
+			break;
+		case SReplayRecord::HASH:
+			text << (record.quick ? "hash-quick " : "hash ") << Hexify(record.data) << "\n";
+			break;
+		default:
+			break;
+		}
+	}
+
+	return text.good();
+}
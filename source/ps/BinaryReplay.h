@@ -0,0 +1,184 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_BINARYREPLAY
+#define INCLUDED_BINARYREPLAY
+
+/*
+ * Binary replay format.
+ *
+ * This holds the same data as the text commands.txt log (game attributes, the
+ * commands of each turn, and state hashes), plus occasional complete
+ * serialized simulation states ("snapshots"), so that a replay can be started
+ * from any turn without simulating everything before it.
+ *
+ * The file is a header followed by a sequence of records, each of which is
+ * a type byte and a 32-bit payload size followed by the payload. (All integers
+ * are little-endian.) When the log is finished cleanly, an index of the
+ * snapshots is appended as a final record, followed by a fixed-size trailer
+ * that points at it. If the trailer is missing (e.g. the game crashed), the
+ * reader rebuilds the index by skipping through the record headers.
+ *
+ * Commands and game attributes are stored as JSON strings, the same as in the
+ * text format, so the two formats can be converted without a script context.
+ * Converting text to binary can't add snapshots (that needs the simulation) -
+ * but replaying a text log will record a binary log with snapshots.
+ */
+
+/**
+ * A single player command, with its data in JSON form.
+ */
+struct SReplayCommand
+{
+	u32 player;
+	std::string data;
+};
+
+/**
+ * One record read from a binary replay.
+ */
+struct SReplayRecord
+{
+	enum EType
+	{
+		START = 1,    // game attributes: data
+		TURN = 2,     // turn, turnLength, commands
+		HASH = 3,     // state hash after the previous turn: data (raw bytes), quick
+		SNAPSHOT = 4, // serialized state before running turn: turn, data
+		INDEX = 5     // only used internally
+	};
+
+	EType type;
+	u32 turn;
+	u32 turnLength;
+	bool quick;
+	std::string data;
+	std::vector<SReplayCommand> commands;
+};
+
+/**
+ * Writes a binary replay to a stream. The stream must outlive the writer.
+ */
+class CBinaryReplayWriter
+{
+	NONCOPYABLE(CBinaryReplayWriter);
+public:
+	CBinaryReplayWriter(std::ostream& stream);
+
+	/**
+	 * Calls Finish, if it hasn't been called already.
+	 */
+	~CBinaryReplayWriter();
+
+	void StartGame(const std::string& attribs);
+	void Turn(u32 n, u32 turnLength, const std::vector<SReplayCommand>& commands);
+	void Hash(const std::string& hash, bool quick);
+
+	/**
+	 * Stores the serialized simulation state from before turn @p n is run.
+	 * Should be called before the Turn(n, ...) record is written.
+	 */
+	void Snapshot(u32 n, const std::string& state);
+
+	/**
+	 * Writes the snapshot index. Nothing else can be written afterwards.
+	 */
+	void Finish();
+
+	/**
+	 * Writes a record (of any type except INDEX) read from another replay.
+	 */
+	void WriteRecord(const SReplayRecord& record);
+
+private:
+	void WriteRecordHeader(u8 type, size_t size);
+	void WriteU32(u32 value);
+	void WriteString(const std::string& str);
+
+	std::ostream& m_Stream;
+	u64 m_Offset;
+	bool m_Finished;
+	std::vector<std::pair<u32, u64> > m_Snapshots; // (turn, record offset)
+};
+
+/**
+ * Reads a binary replay from a seekable stream. The stream must outlive the reader.
+ */
+class CBinaryReplayReader
+{
+	NONCOPYABLE(CBinaryReplayReader);
+public:
+	CBinaryReplayReader(std::istream& stream);
+
+	/**
+	 * Checks the header and loads (or rebuilds) the snapshot index.
+	 * Leaves the stream positioned at the first record.
+	 * @return false if the stream isn't a binary replay.
+	 */
+	bool Open();
+
+	/**
+	 * Reads the next record, skipping the index.
+	 * @return false at the end of the replay (or on error).
+	 */
+	bool ReadRecord(SReplayRecord& record);
+
+	/**
+	 * Returns the game attributes JSON string from the START record.
+	 */
+	const std::string& GetStartAttributes() const { return m_StartAttributes; }
+
+	/**
+	 * Returns the turns that have snapshots, in increasing order.
+	 */
+	std::vector<u32> GetSnapshotTurns() const;
+
+	/**
+	 * Finds the latest snapshot taken at or before the given turn, and reads it
+	 * into @p record (a SNAPSHOT record). The following ReadRecord calls will
+	 * continue from the turn after the snapshot.
+	 * @return false if there is no such snapshot (in which case the stream position
+	 *  is unchanged, and the replay has to be run from the start).
+	 */
+	bool SeekToSnapshot(u32 turn, SReplayRecord& record);
+
+private:
+	bool ReadRecordHeader(u8& type, u32& size);
+	bool ReadRecordPayload(u8 type, u32 size, SReplayRecord& record);
+	bool ReadIndex(u64 offset, u64 end);
+	void RebuildIndex();
+
+	std::istream& m_Stream;
+	u64 m_FirstRecord;
+	u64 m_End; // offset of the index, or end of the file
+	std::string m_StartAttributes;
+	std::vector<std::pair<u32, u64> > m_Snapshots; // (turn, record offset)
+};
+
+/**
+ * Converts a text replay log (commands.txt) to the binary format, without snapshots.
+ * @return false if the text log couldn't be parsed.
+ */
+bool ConvertTextReplayToBinary(std::istream& text, std::ostream& binary);
+
+/**
+ * Converts a binary replay to the text format. Snapshots are dropped.
+ * @return false if the binary replay couldn't be read.
+ */
+bool ConvertBinaryReplayToText(std::istream& binary, std::ostream& text);
+
+#endif // INCLUDED_BINARYREPLAY
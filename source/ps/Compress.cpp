@@ -61,3 +61,101 @@ void DecompressZLib(const std::string& data, std::string& out, bool includeLengt
 
 	// TODO: better error reporting might be nice
 }
+
+// Amount of output to produce per call to deflate/inflate
+static const size_t STREAM_CHUNK_SIZE = 64*KiB;
+
+CZLibStreamCompressor::CZLibStreamCompressor()
+{
+	m_Stream = new z_stream;
+	memset(m_Stream, 0, sizeof(z_stream));
+	int zok = deflateInit(m_Stream, Z_DEFAULT_COMPRESSION);
+	ENSURE(zok == Z_OK);
+}
+
+CZLibStreamCompressor::~CZLibStreamCompressor()
+{
+	deflateEnd(m_Stream);
+	delete m_Stream;
+}
+
+void CZLibStreamCompressor::Compress(const char* data, size_t len, std::string& out)
+{
+	m_Stream->next_in = (Bytef*)data;
+	m_Stream->avail_in = (uInt)len;
+	Deflate(Z_NO_FLUSH, out);
+}
+
+void CZLibStreamCompressor::Finish(std::string& out)
+{
+	m_Stream->next_in = NULL;
+	m_Stream->avail_in = 0;
+	Deflate(Z_FINISH, out);
+}
+
+void CZLibStreamCompressor::Deflate(int flush, std::string& out)
+{
+	// Keep going until deflate has consumed all the input and
+	// stopped filling the whole output buffer
+	do
+	{
+		size_t pos = out.size();
+		out.resize(pos + STREAM_CHUNK_SIZE);
+		m_Stream->next_out = (Bytef*)&out[pos];
+		m_Stream->avail_out = (uInt)STREAM_CHUNK_SIZE;
+		int zok = deflate(m_Stream, flush);
+		ENSURE(zok == Z_OK || zok == Z_STREAM_END || zok == Z_BUF_ERROR);
+		out.resize(pos + STREAM_CHUNK_SIZE - m_Stream->avail_out);
+	}
+	while (m_Stream->avail_out == 0);
+}
+
+CZLibStreamDecompressor::CZLibStreamDecompressor(size_t maxSize) :
+	m_MaxSize(maxSize), m_Finished(false)
+{
+	m_Stream = new z_stream;
+	memset(m_Stream, 0, sizeof(z_stream));
+	int zok = inflateInit(m_Stream);
+	ENSURE(zok == Z_OK);
+}
+
+CZLibStreamDecompressor::~CZLibStreamDecompressor()
+{
+	inflateEnd(m_Stream);
+	delete m_Stream;
+}
+
+bool CZLibStreamDecompressor::Decompress(const char* data, size_t len, std::string& out)
+{
+	if (m_Finished)
+		return len == 0; // there mustn't be any data after the end of the stream
+
+	m_Stream->next_in = (Bytef*)data;
+	m_Stream->avail_in = (uInt)len;
+
+	// Keep going until inflate has consumed all the input and
+	// stopped filling the whole output buffer
+	do
+	{
+		size_t pos = out.size();
+		out.resize(pos + STREAM_CHUNK_SIZE);
+		m_Stream->next_out = (Bytef*)&out[pos];
+		m_Stream->avail_out = (uInt)STREAM_CHUNK_SIZE;
+		int zok = inflate(m_Stream, Z_NO_FLUSH);
+		out.resize(pos + STREAM_CHUNK_SIZE - m_Stream->avail_out);
+
+		if (m_Stream->total_out > m_MaxSize)
+			return false;
+
+		if (zok == Z_STREAM_END)
+		{
+			m_Finished = true;
+			return m_Stream->avail_in == 0;
+		}
+		if (zok != Z_OK && zok != Z_BUF_ERROR)
+			return false;
+	}
+	while (m_Stream->avail_in || m_Stream->avail_out == 0);
+
+	return true;
+}
@@ -20,11 +20,74 @@
 
 /**
  * @file
- * Simple (non-streaming) compression functions.
+ * Simple (non-streaming) compression functions, and streaming classes for
+ * data that is produced or received in pieces.
  */
 
 void CompressZLib(const std::string& data, std::string& out, bool includeLengthHeader);
 
 void DecompressZLib(const std::string& data, std::string& out, bool includeLengthHeader);
 
+struct z_stream_s;
+
+/**
+ * Compresses data incrementally into a zlib stream (with no length header),
+ * so the output can be sent before all the input has been compressed.
+ */
+class CZLibStreamCompressor
+{
+	NONCOPYABLE(CZLibStreamCompressor);
+public:
+	CZLibStreamCompressor();
+	~CZLibStreamCompressor();
+
+	/**
+	 * Compresses @p len bytes of @p data, appending any output to @p out.
+	 */
+	void Compress(const char* data, size_t len, std::string& out);
+
+	/**
+	 * Flushes the remaining output to @p out. No more data can be compressed afterwards.
+	 */
+	void Finish(std::string& out);
+
+private:
+	void Deflate(int flush, std::string& out);
+
+	z_stream_s* m_Stream;
+};
+
+/**
+ * Decompresses a zlib stream (as produced by CZLibStreamCompressor) incrementally.
+ */
+class CZLibStreamDecompressor
+{
+	NONCOPYABLE(CZLibStreamDecompressor);
+public:
+	/**
+	 * @param maxSize maximum total size of the decompressed data; streams that
+	 *  decompress to more than this are treated as invalid (so untrusted data
+	 *  can't make us allocate arbitrary amounts of memory)
+	 */
+	CZLibStreamDecompressor(size_t maxSize);
+	~CZLibStreamDecompressor();
+
+	/**
+	 * Decompresses @p len bytes of @p data, appending any output to @p out.
+	 * @return false if the data is invalid, continues past the end of the stream,
+	 *  or decompresses to more than the maximum size.
+	 */
+	bool Decompress(const char* data, size_t len, std::string& out);
+
+	/**
+	 * Returns whether the end of the stream has been reached.
+	 */
+	bool IsFinished() const { return m_Finished; }
+
+private:
+	z_stream_s* m_Stream;
+	size_t m_MaxSize;
+	bool m_Finished;
+};
+
 #endif // INCLUDED_COMPRESS
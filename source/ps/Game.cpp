@@ -67,7 +67,7 @@ CGame::CGame(bool disableGraphics):
 	m_PlayerID(-1),
 	m_IsSavedGame(false)
 {
-	m_ReplayLogger = new CReplayLogger(m_Simulation2->GetScriptInterface());
+	m_ReplayLogger = new CReplayLogger(*m_Simulation2);
 	// TODO: should use CDummyReplayLogger unless activated by cmd-line arg, perhaps?
 
 	// Need to set the CObjectManager references after various objects have
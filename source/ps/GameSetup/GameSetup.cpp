@@ -67,6 +67,7 @@
 #include "maths/MathUtil.h"
 
 #include "simulation2/Simulation2.h"
+#include "simulation2/system/DispatchStats.h"
 
 #include "scripting/ScriptingHost.h"
 #include "scripting/ScriptGlue.h"
@@ -697,6 +698,7 @@ void Shutdown(int UNUSED(flags))
 		CNetHost::Deinitialize();
 
 		SAFE_DELETE(g_ScriptStatsTable);
+		SAFE_DELETE(g_DispatchStatsTable);
 
 		// should be last, since the above use them
 		SAFE_DELETE(g_Logger);
@@ -856,6 +858,9 @@ void Init(const CmdLineArgs& args, int UNUSED(flags))
 	g_ScriptStatsTable = new CScriptStatsTable;
 	g_ProfileViewer.AddRootTable(g_ScriptStatsTable);
 
+	g_DispatchStatsTable = new CDispatchStatsTable;
+	g_ProfileViewer.AddRootTable(g_DispatchStatsTable);
+
 	InitScripting();	// before GUI
 
 	// g_ConfigDB, command line args, globals
@@ -868,6 +873,12 @@ void Init(const CmdLineArgs& args, int UNUSED(flags))
 	if (profilerHTTPEnable)
 		g_Profiler2.EnableHTTP();
 
+	// Optionally time message handlers for the profiler's dispatch table
+	// (By default it only counts calls, since timing every handler isn't free)
+	bool dispatchTiming = false;
+	CFG_GET_USER_VAL("profiler.dispatchtiming", Bool, dispatchTiming);
+	g_DispatchStatsTable->SetTiming(dispatchTiming);
+
 	if (!g_Quickstart)
 		g_UserReporter.Initialize(); // after config
 
@@ -24,13 +24,18 @@
 #include "lib/file/file_system.h"
 #include "lib/res/h_mgr.h"
 #include "lib/tex/tex.h"
+#include "ps/BinaryReplay.h"
+#include "ps/CLogger.h"
 #include "ps/Game.h"
 #include "ps/Loader.h"
 #include "ps/Profile.h"
 #include "ps/ProfileViewer.h"
+#include "ps/ReplayBenchmark.h"
+#include "ps/Util.h"
 #include "scriptinterface/ScriptInterface.h"
 #include "scriptinterface/ScriptStats.h"
 #include "simulation2/Simulation2.h"
+#include "simulation2/system/DispatchStats.h"
 #include "simulation2/helpers/SimulationCommand.h"
 
 #include <sstream>
@@ -42,17 +47,15 @@
 #define getpid _getpid // use the non-deprecated function name
 #endif
 
-static std::string Hexify(const std::string& s)
-{
-	std::stringstream str;
-	str << std::hex;
-	for (size_t i = 0; i < s.size(); ++i)
-		str << std::setfill('0') << std::setw(2) << (int)(unsigned char)s[i];
-	return str.str();
-}
+/**
+ * Number of turns between simulation state snapshots in the binary replay log.
+ * (Serializing the state takes a noticeable fraction of a turn, and each snapshot
+ * is typically a few megabytes, so this shouldn't be too frequent.)
+ */
+static const u32 REPLAY_SNAPSHOT_INTERVAL = 1000;
 
-CReplayLogger::CReplayLogger(ScriptInterface& scriptInterface) :
-	m_ScriptInterface(scriptInterface)
+CReplayLogger::CReplayLogger(CSimulation2& simulation) :
+	m_Simulation(simulation)
 {
 	// Construct the directory name based on the PID, to be relatively unique.
 	// Append "-1", "-2" etc if we run multiple matches in a single session,
@@ -68,27 +71,50 @@ CReplayLogger::CReplayLogger(ScriptInterface& scriptInterface) :
 	OsPath path = psLogDir() / L"sim_log" / name.str() / L"commands.txt";
 	CreateDirectories(path.Parent(), 0700);
 	m_Stream = new std::ofstream(OsString(path).c_str(), std::ofstream::out | std::ofstream::trunc);
+
+	OsPath binaryPath = path.ChangeExtension(L".bin");
+	m_BinaryStream = new std::ofstream(OsString(binaryPath).c_str(), std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+	m_BinaryWriter = new CBinaryReplayWriter(*m_BinaryStream);
 }
 
 CReplayLogger::~CReplayLogger()
 {
+	delete m_BinaryWriter; // writes the snapshot index
+	delete m_BinaryStream;
 	delete m_Stream;
 }
 
 void CReplayLogger::StartGame(const CScriptValRooted& attribs)
 {
-	*m_Stream << "start " << m_ScriptInterface.StringifyJSON(attribs.get(), false) << "\n";
+	std::string json = m_Simulation.GetScriptInterface().StringifyJSON(attribs.get(), false);
+	*m_Stream << "start " << json << "\n";
+	m_BinaryWriter->StartGame(json);
 }
 
 void CReplayLogger::Turn(u32 n, u32 turnLength, const std::vector<SimulationCommand>& commands)
 {
+	// The state before running the turn is what a replay needs to start from it
+	if (n > 0 && n % REPLAY_SNAPSHOT_INTERVAL == 0)
+	{
+		PROFILE3("replay snapshot");
+		std::stringstream stream;
+		if (m_Simulation.SerializeState(stream))
+			m_BinaryWriter->Snapshot(n, stream.str());
+	}
+
+	std::vector<SReplayCommand> binaryCommands(commands.size());
+
 	*m_Stream << "turn " << n << " " << turnLength << "\n";
 	for (size_t i = 0; i < commands.size(); ++i)
 	{
-		*m_Stream << "cmd " << commands[i].player << " " << m_ScriptInterface.StringifyJSON(commands[i].data.get(), false) << "\n";
+		binaryCommands[i].player = commands[i].player;
+		binaryCommands[i].data = m_Simulation.GetScriptInterface().StringifyJSON(commands[i].data.get(), false);
+		*m_Stream << "cmd " << commands[i].player << " " << binaryCommands[i].data << "\n";
 	}
 	*m_Stream << "end\n";
 	m_Stream->flush();
+
+	m_BinaryWriter->Turn(n, turnLength, binaryCommands);
 }
 
 void CReplayLogger::Hash(const std::string& hash, bool quick)
@@ -97,12 +123,21 @@ void CReplayLogger::Hash(const std::string& hash, bool quick)
 		*m_Stream << "hash-quick " << Hexify(hash) << "\n";
 	else
 		*m_Stream << "hash " << Hexify(hash) << "\n";
+
+	m_BinaryWriter->Hash(hash, quick);
 }
 
 ////////////////////////////////////////////////////////////////
 
+static bool IsBinaryReplay(const std::string& path)
+{
+	std::ifstream stream(path.c_str(), std::ifstream::in | std::ifstream::binary);
+	CBinaryReplayReader reader(stream);
+	return reader.Open();
+}
+
 CReplayPlayer::CReplayPlayer() :
-	m_Stream(NULL)
+	m_Stream(NULL), m_Binary(false), m_LogTurns(true), m_Benchmark(NULL)
 {
 }
 
@@ -115,11 +150,21 @@ void CReplayPlayer::Load(const std::string& path)
 {
 	ENSURE(!m_Stream);
 
-	m_Stream = new std::ifstream(path.c_str());
+	m_Binary = IsBinaryReplay(path);
+	if (m_Binary)
+		m_Stream = new std::ifstream(path.c_str(), std::ifstream::in | std::ifstream::binary);
+	else
+		m_Stream = new std::ifstream(path.c_str());
 	ENSURE(m_Stream->good());
 }
 
-void CReplayPlayer::Replay()
+void CReplayPlayer::SetBenchmark(CReplayBenchmark* benchmark)
+{
+	m_Benchmark = benchmark;
+	m_LogTurns = (benchmark == NULL);
+}
+
+void CReplayPlayer::Replay(u32 startTurn)
 {
 	ENSURE(m_Stream);
 
@@ -127,6 +172,9 @@ void CReplayPlayer::Replay()
 	new CProfileManager;
 	g_ScriptStatsTable = new CScriptStatsTable;
 	g_ProfileViewer.AddRootTable(g_ScriptStatsTable);
+	g_DispatchStatsTable = new CDispatchStatsTable;
+	g_DispatchStatsTable->SetTiming(true); // replays are run for profiling, so the cost is fine
+	g_ProfileViewer.AddRootTable(g_DispatchStatsTable);
 
 	CGame game(true);
 	g_Game = &game;
@@ -140,6 +188,30 @@ void CReplayPlayer::Replay()
 	// Initialise h_mgr so it doesn't crash when emitting sounds
 	h_mgr_init();
 
+	if (m_Binary)
+		ReplayBinary(game, startTurn);
+	else
+		ReplayText(game);
+
+	g_Profiler2.SaveToFile();
+
+	std::string hash;
+	bool ok = game.GetSimulation2()->ComputeStateHash(hash, false);
+	ENSURE(ok);
+	debug_printf(L"# Final state: %hs\n", Hexify(hash).c_str());
+
+	timer_DisplayClientTotals();
+
+	// Clean up
+	delete &g_TexMan;
+	tex_codec_unregister_all();
+
+	delete &g_Profiler;
+	delete &g_ProfileViewer;
+}
+
+void CReplayPlayer::ReplayText(CGame& game)
+{
 	std::vector<SimulationCommand> commands;
 	u32 turn = 0;
 	u32 turnLength = 0;
@@ -153,15 +225,7 @@ void CReplayPlayer::Replay()
 		{
 			std::string line;
 			std::getline(*m_Stream, line);
-			CScriptValRooted attribs = game.GetSimulation2()->GetScriptInterface().ParseJSON(line);
-
-			game.StartGame(attribs, "");
-
-			// TODO: Non progressive load can fail - need a decent way to handle this
-			LDR_NonprogressiveLoad();
-
-			PSRETURN ret = game.ReallyStartGame();
-			ENSURE(ret == PSRETURN_OK);
+			StartGame(game, line, "");
 		}
 		else if (type == "turn")
 		{
@@ -185,68 +249,167 @@ void CReplayPlayer::Replay()
 			std::string replayHash;
 			*m_Stream >> replayHash;
 
-			bool quick = (type == "hash-quick");
-
-//			if (turn >= 1300)
-//			if (turn >= 0)
-			if (turn % 100 == 0)
-			{
-				std::string hash;
-				bool ok = game.GetSimulation2()->ComputeStateHash(hash, quick);
-				ENSURE(ok);
-				std::string hexHash = Hexify(hash);
-				if (hexHash == replayHash)
-					debug_printf(L"hash ok (%hs)", hexHash.c_str());
-				else
-					debug_printf(L"HASH MISMATCH (%hs != %hs)", hexHash.c_str(), replayHash.c_str());
-			}
+			CheckHash(game, turn, replayHash, type == "hash-quick");
 		}
 		else if (type == "end")
 		{
-			{
-				g_Profiler2.RecordFrameStart();
-				PROFILE2("frame");
-				g_Profiler2.IncrementFrameNumber();
-				PROFILE2_ATTR("%d", g_Profiler2.GetFrameNumber());
+			RunTurn(game, turn, turnLength, commands);
+		}
+		else
+		{
+			debug_printf(L"Unrecognised replay token %hs\n", type.c_str());
+		}
+	}
+}
 
-				game.GetSimulation2()->Update(turnLength, commands);
-				commands.clear();
-			}
+void CReplayPlayer::ReplayBinary(CGame& game, u32 startTurn)
+{
+	CBinaryReplayReader reader(*m_Stream);
+	bool ok = reader.Open();
+	ENSURE(ok);
 
-//			std::string hash;
-//			bool ok = game.GetSimulation2()->ComputeStateHash(hash, true);
-//			ENSURE(ok);
-//			debug_printf(L"%hs", Hexify(hash).c_str());
+	SReplayRecord record;
+
+	if (startTurn > 0 && reader.SeekToSnapshot(startTurn, record))
+	{
+		debug_printf(L"Starting from snapshot at turn %u\n", record.turn);
+		// The new log would be missing the earlier turns, so don't write it
+		m_LogTurns = false;
+		StartGame(game, reader.GetStartAttributes(), record.data);
+	}
+	else
+	{
+		if (startTurn > 0)
+			debug_printf(L"No snapshot at or before turn %u - starting from turn 0\n", startTurn);
+		StartGame(game, reader.GetStartAttributes(), "");
+	}
 
-			debug_printf(L"\n");
+	std::vector<SimulationCommand> commands;
+	u32 turn = 0;
 
-			g_Profiler.Frame();
+	while (reader.ReadRecord(record))
+	{
+		switch (record.type)
+		{
+		case SReplayRecord::TURN:
+		{
+			turn = record.turn;
+			debug_printf(L"Turn %u (%u)... ", turn, record.turnLength);
 
-//			if (turn % 1000 == 0)
-//				JS_GC(game.GetSimulation2()->GetScriptInterface().GetContext());
+			for (size_t i = 0; i < record.commands.size(); ++i)
+			{
+				CScriptValRooted data = game.GetSimulation2()->GetScriptInterface().ParseJSON(record.commands[i].data);
+				SimulationCommand cmd = { record.commands[i].player, data };
+				commands.push_back(cmd);
+			}
 
-			if (turn % 20 == 0)
-				g_ProfileViewer.SaveToFile();
+			RunTurn(game, turn, record.turnLength, commands);
+			break;
 		}
-		else
-		{
-			debug_printf(L"Unrecognised replay token %hs\n", type.c_str());
+		case SReplayRecord::HASH:
+			CheckHash(game, turn, Hexify(record.data), record.quick);
+			break;
+		default:
+			// START was handled by the reader, and we only need one snapshot
+			break;
 		}
 	}
+}
 
-	g_Profiler2.SaveToFile();
+void CReplayPlayer::StartGame(CGame& game, const std::string& attribsJSON, const std::string& savedState)
+{
+	CScriptValRooted attribs = game.GetSimulation2()->GetScriptInterface().ParseJSON(attribsJSON);
 
-	std::string hash;
-	bool ok = game.GetSimulation2()->ComputeStateHash(hash, false);
-	ENSURE(ok);
-	debug_printf(L"# Final state: %hs\n", Hexify(hash).c_str());
+	game.StartGame(attribs, savedState);
 
-	timer_DisplayClientTotals();
+	// TODO: Non progressive load can fail - need a decent way to handle this
+	LDR_NonprogressiveLoad();
 
-	// Clean up
-	delete &g_TexMan;
-	tex_codec_unregister_all();
+	PSRETURN ret = game.ReallyStartGame();
+	ENSURE(ret == PSRETURN_OK);
+}
 
-	delete &g_Profiler;
-	delete &g_ProfileViewer;
+void CReplayPlayer::CheckHash(CGame& game, u32 turn, const std::string& replayHash, bool quick)
+{
+//	if (turn >= 1300)
+//	if (turn >= 0)
+	if (turn % 100 == 0)
+	{
+		std::string hash;
+		bool ok = game.GetSimulation2()->ComputeStateHash(hash, quick);
+		ENSURE(ok);
+		std::string hexHash = Hexify(hash);
+		if (hexHash == replayHash)
+			debug_printf(L"hash ok (%hs)", hexHash.c_str());
+		else
+			debug_printf(L"HASH MISMATCH (%hs != %hs)", hexHash.c_str(), replayHash.c_str());
+	}
+}
+
+void CReplayPlayer::RunTurn(CGame& game, u32 turn, u32 turnLength, std::vector<SimulationCommand>& commands)
+{
+	// Log the turn again, so replaying a text log also produces a binary log with snapshots
+	if (m_LogTurns)
+		game.GetReplayLogger().Turn(turn, turnLength, commands);
+
+	double time;
+	{
+		g_Profiler2.RecordFrameStart();
+		PROFILE2("frame");
+		g_Profiler2.IncrementFrameNumber();
+		PROFILE2_ATTR("%d", g_Profiler2.GetFrameNumber());
+
+		double start = timer_Time();
+		game.GetSimulation2()->Update(turnLength, commands);
+		time = timer_Time() - start;
+		commands.clear();
+	}
+
+//	std::string hash;
+//	bool ok = game.GetSimulation2()->ComputeStateHash(hash, true);
+//	ENSURE(ok);
+//	debug_printf(L"%hs", Hexify(hash).c_str());
+
+	debug_printf(L"\n");
+
+	g_Profiler.Frame();
+
+	if (m_Benchmark)
+	{
+		// Each turn is one profiler turn, so the per-turn times are exactly this turn's
+		g_Profiler.Turn();
+		m_Benchmark->RecordTurn(turn, time, g_Profiler.GetRoot());
+	}
+
+//	if (turn % 1000 == 0)
+//		JS_GC(game.GetSimulation2()->GetScriptInterface().GetContext());
+
+	if (turn % 20 == 0)
+		g_ProfileViewer.SaveToFile();
+}
+
+////////////////////////////////////////////////////////////////
+
+bool ConvertReplay(const std::string& inputPath, const std::string& outputPath)
+{
+	bool binary = IsBinaryReplay(inputPath);
+
+	std::ifstream input(inputPath.c_str(), binary ? std::ifstream::in | std::ifstream::binary : std::ifstream::in);
+	if (!input.good())
+	{
+		LOGERROR(L"Failed to open replay '%hs'", inputPath.c_str());
+		return false;
+	}
+
+	std::ofstream output(outputPath.c_str(), binary ? std::ofstream::out | std::ofstream::trunc : std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+	if (!output.good())
+	{
+		LOGERROR(L"Failed to create replay '%hs'", outputPath.c_str());
+		return false;
+	}
+
+	bool ok = binary ? ConvertBinaryReplayToText(input, output) : ConvertTextReplayToBinary(input, output);
+	if (!ok)
+		LOGERROR(L"Failed to convert replay '%hs'", inputPath.c_str());
+	return ok;
 }
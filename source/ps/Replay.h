@@ -18,9 +18,12 @@
 #ifndef INCLUDED_REPLAY
 #define INCLUDED_REPLAY
 
+class CBinaryReplayWriter;
+class CGame;
+class CReplayBenchmark;
 class CScriptValRooted;
+class CSimulation2;
 struct SimulationCommand;
-class ScriptInterface;
 
 /**
  * Replay log recorder interface.
@@ -60,13 +63,16 @@ public:
 };
 
 /**
- * Implementation of IReplayLogger that saves data to a file in the logs directory.
+ * Implementation of IReplayLogger that saves data to files in the logs directory:
+ * commands.txt in the text format, and commands.bin in the binary format
+ * (see BinaryReplay.h) which additionally has a snapshot of the simulation
+ * state every REPLAY_SNAPSHOT_INTERVAL turns.
  */
 class CReplayLogger : public IReplayLogger
 {
 	NONCOPYABLE(CReplayLogger);
 public:
-	CReplayLogger(ScriptInterface& scriptInterface);
+	CReplayLogger(CSimulation2& simulation);
 	~CReplayLogger();
 
 	virtual void StartGame(const CScriptValRooted& attribs);
@@ -74,12 +80,15 @@ public:
 	virtual void Hash(const std::string& hash, bool quick);
 
 private:
-	ScriptInterface& m_ScriptInterface;
+	CSimulation2& m_Simulation;
 	std::ostream* m_Stream;
+	std::ostream* m_BinaryStream;
+	CBinaryReplayWriter* m_BinaryWriter;
 };
 
 /**
  * Replay log replayer. Runs the log with no graphics and dumps some info to stdout.
+ * Accepts both the text and binary formats.
  */
 class CReplayPlayer
 {
@@ -88,10 +97,37 @@ public:
 	~CReplayPlayer();
 
 	void Load(const std::string& path);
-	void Replay();
+
+	/**
+	 * Runs the replay. For binary replays with snapshots, the simulation starts
+	 * from the latest snapshot at or before @p startTurn instead of from turn 0.
+	 */
+	void Replay(u32 startTurn = 0);
+
+	/**
+	 * Records the time of each turn in the given benchmark (which must have had
+	 * StartReplay called). Turns aren't logged again when benchmarking.
+	 */
+	void SetBenchmark(CReplayBenchmark* benchmark);
 
 private:
+	void ReplayText(CGame& game);
+	void ReplayBinary(CGame& game, u32 startTurn);
+	void StartGame(CGame& game, const std::string& attribs, const std::string& savedState);
+	void CheckHash(CGame& game, u32 turn, const std::string& replayHash, bool quick);
+	void RunTurn(CGame& game, u32 turn, u32 turnLength, std::vector<SimulationCommand>& commands);
+
 	std::istream* m_Stream;
+	bool m_Binary;
+	bool m_LogTurns;
+	CReplayBenchmark* m_Benchmark;
 };
 
+/**
+ * Converts a replay log between the text and binary formats, in whichever
+ * direction applies to the input file.
+ * @return false if the input couldn't be read or converted.
+ */
+bool ConvertReplay(const std::string& inputPath, const std::string& outputPath);
+
 #endif // INCLUDED_REPLAY
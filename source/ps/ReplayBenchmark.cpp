@@ -0,0 +1,321 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "ReplayBenchmark.h"
+
+#include "ps/Profile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+static const char* TOTAL_REGION = "turn";
+
+static bool RegionMatches(const char* name, const std::string& region)
+{
+	if (!region.empty() && region[region.size()-1] == '*')
+		return strncmp(name, region.c_str(), region.size()-1) == 0;
+	return region == name;
+}
+
+static double GetRegionTurnTime(const CProfileNode* node, const std::string& region)
+{
+	if (RegionMatches(node->GetName(), region))
+		return node->GetTurnTime();
+
+	double time = 0.0;
+	CProfileNode::const_profile_iterator it;
+	for (it = node->GetChildren()->begin(); it != node->GetChildren()->end(); ++it)
+		time += GetRegionTurnTime(*it, region);
+	for (it = node->GetScriptChildren()->begin(); it != node->GetScriptChildren()->end(); ++it)
+		time += GetRegionTurnTime(*it, region);
+	return time;
+}
+
+/**
+ * Returns the nearest-rank percentile of the sorted values.
+ */
+static double Percentile(const std::vector<double>& sorted, double percent)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t rank = (size_t)ceil(percent / 100.0 * sorted.size());
+	return sorted[std::max(rank, (size_t)1) - 1];
+}
+
+static std::string EscapeJSON(const std::string& str)
+{
+	std::string ret;
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		if (str[i] == '"' || str[i] == '\\')
+			ret += '\\';
+		ret += str[i];
+	}
+	return ret;
+}
+
+static bool CompareTurnTime(const std::pair<double, size_t>& a, const std::pair<double, size_t>& b)
+{
+	// Slowest first, and earliest first for equal times
+	if (a.first != b.first)
+		return a.first > b.first;
+	return a.second < b.second;
+}
+
+////////////////////////////////////////////////////////////////
+
+CReplayBenchmark::CReplayBenchmark(const std::vector<std::string>& regions, size_t numWorstTurns) :
+	m_Regions(regions), m_NumWorstTurns(numWorstTurns)
+{
+}
+
+std::vector<std::string> CReplayBenchmark::GetDefaultRegions()
+{
+	// These must be PROFILE names that are used in release builds too
+	std::vector<std::string> regions;
+	regions.push_back("ProcessLongRequests"); // asynchronous long paths, computed between turns
+	regions.push_back("ComputePath"); // synchronous long paths
+	regions.push_back("ComputeShortPath");
+	regions.push_back("ExecuteActiveQueries");
+	regions.push_back("AI setup");
+	regions.push_back("AI push commands");
+	regions.push_back("message *"); // CComponentManager's per-message dispatch samples
+	return regions;
+}
+
+void CReplayBenchmark::StartReplay(const std::string& name)
+{
+	m_Replays.push_back(SReplay());
+	m_Replays.back().name = name;
+}
+
+void CReplayBenchmark::RecordTurn(u32 turn, double time, const CProfileNode* profileRoot)
+{
+	std::vector<double> regionTimes(m_Regions.size(), 0.0);
+	for (size_t i = 0; i < m_Regions.size(); ++i)
+	{
+		CProfileNode::const_profile_iterator it;
+		for (it = profileRoot->GetChildren()->begin(); it != profileRoot->GetChildren()->end(); ++it)
+			regionTimes[i] += GetRegionTurnTime(*it, m_Regions[i]);
+	}
+
+	RecordTurn(turn, time, regionTimes);
+}
+
+void CReplayBenchmark::RecordTurn(u32 turn, double time, const std::vector<double>& regionTimes)
+{
+	ENSURE(!m_Replays.empty());
+	ENSURE(regionTimes.size() == m_Regions.size());
+
+	STurn t = { turn, time, regionTimes };
+	m_Replays.back().turns.push_back(t);
+}
+
+std::vector<CReplayBenchmark::SStats> CReplayBenchmark::GetStats() const
+{
+	std::vector<SStats> ret;
+	for (size_t r = 0; r < m_Replays.size(); ++r)
+	{
+		const SReplay& replay = m_Replays[r];
+
+		// Region -1 is the total turn time
+		for (ssize_t region = -1; region < (ssize_t)m_Regions.size(); ++region)
+		{
+			std::vector<double> times;
+			times.reserve(replay.turns.size());
+			double total = 0.0;
+			for (size_t i = 0; i < replay.turns.size(); ++i)
+			{
+				double time = 1000.0 * (region < 0 ? replay.turns[i].time : replay.turns[i].regionTimes[region]);
+				times.push_back(time);
+				total += time;
+			}
+			std::sort(times.begin(), times.end());
+
+			SStats stats;
+			stats.replay = replay.name;
+			stats.region = (region < 0 ? TOTAL_REGION : m_Regions[region]);
+			stats.turns = times.size();
+			stats.total = total;
+			stats.mean = times.empty() ? 0.0 : total / times.size();
+			stats.p50 = Percentile(times, 50);
+			stats.p90 = Percentile(times, 90);
+			stats.p99 = Percentile(times, 99);
+			stats.max = times.empty() ? 0.0 : times.back();
+			ret.push_back(stats);
+		}
+	}
+	return ret;
+}
+
+void CReplayBenchmark::WriteJSON(std::ostream& stream) const
+{
+	std::vector<SStats> stats = GetStats();
+	size_t statsPerReplay = m_Regions.size() + 1;
+
+	stream << std::fixed << std::setprecision(3);
+	stream << "{\n";
+	stream << "  \"units\": \"msec\",\n";
+	stream << "  \"replays\": [";
+	for (size_t r = 0; r < m_Replays.size(); ++r)
+	{
+		const SReplay& replay = m_Replays[r];
+
+		stream << (r ? ",\n" : "\n");
+		stream << "    {\n";
+		stream << "      \"name\": \"" << EscapeJSON(replay.name) << "\",\n";
+		stream << "      \"turns\": " << replay.turns.size() << ",\n";
+
+		stream << "      \"stats\": {";
+		for (size_t i = 0; i < statsPerReplay; ++i)
+		{
+			const SStats& s = stats[r*statsPerReplay + i];
+			stream << (i ? ",\n" : "\n");
+			stream << "        \"" << EscapeJSON(s.region) << "\": { \"total\": " << s.total << ", \"mean\": " << s.mean
+				<< ", \"p50\": " << s.p50 << ", \"p90\": " << s.p90 << ", \"p99\": " << s.p99 << ", \"max\": " << s.max << " }";
+		}
+		stream << "\n      },\n";
+
+		std::vector<std::pair<double, size_t> > order;
+		for (size_t i = 0; i < replay.turns.size(); ++i)
+			order.push_back(std::make_pair(replay.turns[i].time, i));
+		size_t numWorst = std::min(m_NumWorstTurns, order.size());
+		std::partial_sort(order.begin(), order.begin() + numWorst, order.end(), CompareTurnTime);
+
+		stream << "      \"worst_turns\": [";
+		for (size_t i = 0; i < numWorst; ++i)
+		{
+			const STurn& turn = replay.turns[order[i].second];
+			stream << (i ? ",\n" : "\n");
+			stream << "        { \"turn\": " << turn.turn << ", \"time\": " << 1000.0 * turn.time;
+			for (size_t j = 0; j < m_Regions.size(); ++j)
+				stream << ", \"" << EscapeJSON(m_Regions[j]) << "\": " << 1000.0 * turn.regionTimes[j];
+			stream << " }";
+		}
+		stream << "\n      ]\n";
+		stream << "    }";
+	}
+	stream << "\n  ]\n";
+	stream << "}\n";
+}
+
+void CReplayBenchmark::WriteCSV(std::ostream& stream) const
+{
+	std::vector<SStats> stats = GetStats();
+
+	stream << std::fixed << std::setprecision(3);
+	stream << "replay,region,turns,total,mean,p50,p90,p99,max\n";
+	for (size_t i = 0; i < stats.size(); ++i)
+	{
+		const SStats& s = stats[i];
+		stream << s.replay << "," << s.region << "," << s.turns << "," << s.total << "," << s.mean
+			<< "," << s.p50 << "," << s.p90 << "," << s.p99 << "," << s.max << "\n";
+	}
+}
+
+void CReplayBenchmark::WriteTurnsCSV(std::ostream& stream) const
+{
+	stream << std::fixed << std::setprecision(3);
+	stream << "replay,turn," << TOTAL_REGION;
+	for (size_t i = 0; i < m_Regions.size(); ++i)
+		stream << "," << m_Regions[i];
+	stream << "\n";
+
+	for (size_t r = 0; r < m_Replays.size(); ++r)
+	{
+		const SReplay& replay = m_Replays[r];
+		for (size_t i = 0; i < replay.turns.size(); ++i)
+		{
+			stream << replay.name << "," << replay.turns[i].turn << "," << 1000.0 * replay.turns[i].time;
+			for (size_t j = 0; j < m_Regions.size(); ++j)
+				stream << "," << 1000.0 * replay.turns[i].regionTimes[j];
+			stream << "\n";
+		}
+	}
+}
+
+bool CReplayBenchmark::CompareWithBaseline(std::istream& baseline, double threshold, double minDifference, std::vector<std::string>& regressions) const
+{
+	// Number of columns after the replay name (which might contain commas itself)
+	const size_t NUM_FIELDS = 8;
+
+	std::map<std::pair<std::string, std::string>, std::pair<double, double> > baselineTimes; // (replay, region) -> (mean, p90)
+
+	std::string line;
+	if (!std::getline(baseline, line) || line.compare(0, 14, "replay,region,") != 0)
+		return false;
+
+	while (std::getline(baseline, line))
+	{
+		if (line.empty())
+			continue;
+
+		std::vector<std::string> fields;
+		size_t end = line.size();
+		for (size_t i = 0; i < NUM_FIELDS; ++i)
+		{
+			if (end == 0)
+				return false;
+			size_t comma = line.rfind(',', end - 1);
+			if (comma == std::string::npos)
+				return false;
+			fields.push_back(line.substr(comma + 1, end - comma - 1));
+			end = comma;
+		}
+		std::string replay = line.substr(0, end);
+
+		// fields are in reverse order: max, p99, p90, p50, mean, total, turns, region
+		double mean, p90;
+		std::stringstream meanStr(fields[4]), p90Str(fields[2]);
+		if (!(meanStr >> mean) || !(p90Str >> p90))
+			return false;
+		baselineTimes[std::make_pair(replay, fields[7])] = std::make_pair(mean, p90);
+	}
+
+	std::vector<SStats> stats = GetStats();
+	for (size_t i = 0; i < stats.size(); ++i)
+	{
+		const SStats& s = stats[i];
+		std::map<std::pair<std::string, std::string>, std::pair<double, double> >::const_iterator it =
+			baselineTimes.find(std::make_pair(s.replay, s.region));
+		if (it == baselineTimes.end())
+			continue;
+
+		const char* names[2] = { "mean", "p90" };
+		double before[2] = { it->second.first, it->second.second };
+		double after[2] = { s.mean, s.p90 };
+		for (size_t j = 0; j < 2; ++j)
+		{
+			if (after[j] - before[j] >= minDifference && after[j] > before[j] * (1.0 + threshold))
+			{
+				std::stringstream msg;
+				msg << std::fixed << std::setprecision(3);
+				msg << s.replay << ": " << s.region << " " << names[j] << " " << before[j] << " -> " << after[j] << " msec";
+				if (before[j] > 0.0)
+					msg << " (+" << std::setprecision(1) << 100.0 * (after[j] / before[j] - 1.0) << "%)";
+				regressions.push_back(msg.str());
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,137 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_REPLAYBENCHMARK
+#define INCLUDED_REPLAYBENCHMARK
+
+class CProfileNode;
+
+/**
+ * Collects per-turn simulation timings while running replays (see CReplayPlayer),
+ * and reports them with percentiles and the slowest turns, so that changes to the
+ * engine can be checked against the simulation cost of real games.
+ *
+ * Each turn's total time is recorded, along with the time spent in a set of
+ * profiler regions (PROFILE/PROFILE3 names) read from the profiler's per-turn
+ * values. A region name ending in '*' matches every node whose name starts with
+ * the rest of it (e.g. "message *" for all message handling). Nested nodes that
+ * match the same region are only counted once.
+ *
+ * The summary CSV output can be given back as a baseline for a later run,
+ * to detect regressions.
+ */
+class CReplayBenchmark
+{
+	NONCOPYABLE(CReplayBenchmark);
+public:
+	/**
+	 * @param regions profiler regions to report, in addition to the total turn time.
+	 * @param numWorstTurns number of slowest turns to list for each replay.
+	 */
+	CReplayBenchmark(const std::vector<std::string>& regions, size_t numWorstTurns);
+
+	/**
+	 * Returns the regions that are usually interesting: pathfinding (both the
+	 * asynchronous long path requests and synchronous paths), range queries,
+	 * AI, and message handling (which is mostly scripts).
+	 */
+	static std::vector<std::string> GetDefaultRegions();
+
+	/**
+	 * Starts collecting timings for a new replay.
+	 */
+	void StartReplay(const std::string& name);
+
+	/**
+	 * Records a turn, with region times taken from the profiler tree.
+	 * CProfileManager::Turn must have been called since the turn was run.
+	 * @param time total time of the turn, in seconds.
+	 */
+	void RecordTurn(u32 turn, double time, const CProfileNode* profileRoot);
+
+	/**
+	 * Records a turn, with the given region times (in the same order as the
+	 * regions passed to the constructor, in seconds).
+	 */
+	void RecordTurn(u32 turn, double time, const std::vector<double>& regionTimes);
+
+	struct SStats
+	{
+		std::string replay;
+		std::string region; // "turn" for the total turn time
+		size_t turns;
+		// All times in milliseconds
+		double total;
+		double mean;
+		double p50;
+		double p90;
+		double p99;
+		double max;
+	};
+
+	/**
+	 * Returns statistics for each replay and region (including the total).
+	 */
+	std::vector<SStats> GetStats() const;
+
+	/**
+	 * Writes the full report: statistics and the slowest turns of each replay.
+	 */
+	void WriteJSON(std::ostream& stream) const;
+
+	/**
+	 * Writes the statistics, one line per replay and region. This is the
+	 * format expected by CompareWithBaseline.
+	 */
+	void WriteCSV(std::ostream& stream) const;
+
+	/**
+	 * Writes the time of every turn, one line per turn.
+	 */
+	void WriteTurnsCSV(std::ostream& stream) const;
+
+	/**
+	 * Compares the mean and 90th percentile times against a baseline written by
+	 * WriteCSV. Replays and regions missing from either side are ignored.
+	 * @param threshold allowed relative increase (e.g. 0.1 for 10%).
+	 * @param minDifference smallest increase (in msecs) that counts as a
+	 *  regression, so that tiny regions don't fail on noise.
+	 * @param regressions receives a description of each regression.
+	 * @return false if the baseline couldn't be parsed.
+	 */
+	bool CompareWithBaseline(std::istream& baseline, double threshold, double minDifference, std::vector<std::string>& regressions) const;
+
+private:
+	struct STurn
+	{
+		u32 turn;
+		double time;
+		std::vector<double> regionTimes;
+	};
+
+	struct SReplay
+	{
+		std::string name;
+		std::vector<STurn> turns;
+	};
+
+	std::vector<std::string> m_Regions;
+	size_t m_NumWorstTurns;
+	std::vector<SReplay> m_Replays;
+};
+
+#endif // INCLUDED_REPLAYBENCHMARK
@@ -43,6 +43,9 @@
 #include "maths/MathUtil.h"
 #include "graphics/GameView.h"
 
+#include <sstream>
+#include <iomanip>
+
 extern CStrW g_CursorName;
 
 static std::string SplitExts(const char *exts)
@@ -160,6 +163,17 @@ const wchar_t* ErrorString(int err)
 
 
 
+std::string Hexify(const std::string& s)
+{
+	std::stringstream str;
+	str << std::hex;
+	for (size_t i = 0; i < s.size(); ++i)
+		str << std::setfill('0') << std::setw(2) << (int)(unsigned char)s[i];
+	return str.str();
+}
+
+
+
 // write the specified texture to disk.
 // note: <t> cannot be made const because the image may have to be
 // transformed to write it out in the format determined by <fn>'s extension.
@@ -31,4 +31,9 @@ extern void WriteBigScreenshot(const VfsPath& extension, int tiles);
 
 extern Status tex_write(Tex* t, const VfsPath& filename);
 
+/**
+ * Returns the lowercase hexadecimal representation of the bytes in @p s.
+ */
+extern std::string Hexify(const std::string& s);
+
 #endif // PS_UTIL_H
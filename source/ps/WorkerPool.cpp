@@ -0,0 +1,206 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "WorkerPool.h"
+
+#include "lib/external_libraries/libsdl.h"
+#include "lib/sysdep/os_cpu.h"
+#include "ps/Profiler2.h"
+#include "ps/ThreadUtil.h"
+
+class CWorkerPoolImpl
+{
+	NONCOPYABLE(CWorkerPoolImpl);
+
+public:
+	CWorkerPoolImpl(const char* name, size_t numThreads) :
+		m_Name(name), m_Shutdown(false), m_Batch(NULL), m_NumTasks(0), m_NextTask(0)
+	{
+		// Use SDL semaphores since OS X doesn't implement sem_init
+		m_StartSem = SDL_CreateSemaphore(0);
+		m_DoneSem = SDL_CreateSemaphore(0);
+		ENSURE(m_StartSem && m_DoneSem);
+
+		// (This mustn't be resized once the threads have started)
+		m_ThreadData.resize(numThreads);
+
+		for (size_t i = 0; i < numThreads; ++i)
+		{
+			m_ThreadData[i].pool = this;
+			m_ThreadData[i].thread = i + 1;
+
+			pthread_t thread;
+			int ret = pthread_create(&thread, NULL, &RunThread, &m_ThreadData[i]);
+			if (ret != 0)
+			{
+				// We can still do the work with fewer threads
+				debug_warn(L"Failed to create worker thread");
+				break;
+			}
+			m_Threads.push_back(thread);
+		}
+	}
+
+	~CWorkerPoolImpl()
+	{
+		m_Shutdown = true;
+
+		// Wake up every thread so it sees the shutdown request
+		for (size_t i = 0; i < m_Threads.size(); ++i)
+			SDL_SemPost(m_StartSem);
+
+		for (size_t i = 0; i < m_Threads.size(); ++i)
+			pthread_join(m_Threads[i], NULL);
+
+		SDL_DestroySemaphore(m_StartSem);
+		SDL_DestroySemaphore(m_DoneSem);
+	}
+
+	size_t GetNumThreads() const
+	{
+		return m_Threads.size();
+	}
+
+	void RunBatch(CWorkerPool::IBatch& batch, size_t numTasks)
+	{
+		ENSURE(!m_Batch); // mustn't be called recursively
+
+		m_Batch = &batch;
+		m_NumTasks = numTasks;
+		m_NextTask = 0;
+
+		// Don't bother waking more threads than there are tasks for
+		// (the calling thread will do one of them)
+		size_t numWoken = std::min(m_Threads.size(), numTasks > 0 ? numTasks - 1 : 0);
+
+		for (size_t i = 0; i < numWoken; ++i)
+			SDL_SemPost(m_StartSem);
+
+		RunTasks(0);
+
+		// Wait until every woken thread has stopped touching the batch.
+		// A thread might run out of tasks and go back to wait for m_StartSem while
+		// another thread hasn't woken up yet, and then consume that thread's wakeup;
+		// that's fine since every wakeup results in exactly one m_DoneSem post.
+		{
+			PROFILE2("wait for workers");
+			for (size_t i = 0; i < numWoken; ++i)
+				SDL_SemWait(m_DoneSem);
+		}
+
+		m_Batch = NULL;
+	}
+
+private:
+	struct ThreadData
+	{
+		CWorkerPoolImpl* pool;
+		size_t thread;
+	};
+
+	static void* RunThread(void* data)
+	{
+		ThreadData* threadData = static_cast<ThreadData*>(data);
+
+		debug_SetThreadName(threadData->pool->m_Name.c_str());
+		g_Profiler2.RegisterCurrentThread(threadData->pool->m_Name);
+
+		threadData->pool->Run(threadData->thread);
+
+		return NULL;
+	}
+
+	void Run(size_t thread)
+	{
+		while (true)
+		{
+			g_Profiler2.RecordRegionEnter("semaphore wait");
+			SDL_SemWait(m_StartSem);
+			g_Profiler2.RecordRegionLeave("semaphore wait");
+
+			if (m_Shutdown)
+				return;
+
+			RunTasks(thread);
+
+			SDL_SemPost(m_DoneSem);
+		}
+	}
+
+	void RunTasks(size_t thread)
+	{
+		while (true)
+		{
+			size_t task;
+			{
+				CScopeLock lock(m_Mutex);
+				if (m_NextTask >= m_NumTasks)
+					return;
+				task = m_NextTask++;
+			}
+
+			m_Batch->Run(task, thread);
+		}
+	}
+
+	std::string m_Name;
+
+	std::vector<ThreadData> m_ThreadData;
+	std::vector<pthread_t> m_Threads;
+
+	SDL_sem* m_StartSem; // posted once per thread that should start working on the batch (or shut down)
+	SDL_sem* m_DoneSem; // posted once per m_StartSem wakeup, after the thread has run out of tasks
+	bool m_Shutdown;
+
+	// The current batch (only modified by the thread calling RunBatch, while the
+	// workers are waiting):
+	CWorkerPool::IBatch* m_Batch;
+	size_t m_NumTasks;
+
+	CMutex m_Mutex; // protects m_NextTask
+	size_t m_NextTask;
+};
+
+CWorkerPool::CWorkerPool(const char* name, size_t numThreads) :
+	m(new CWorkerPoolImpl(name, numThreads))
+{
+}
+
+CWorkerPool::~CWorkerPool()
+{
+	delete m;
+}
+
+size_t CWorkerPool::GetNumThreads() const
+{
+	return m->GetNumThreads();
+}
+
+void CWorkerPool::RunBatch(IBatch& batch, size_t numTasks)
+{
+	m->RunBatch(batch, numTasks);
+}
+
+size_t CWorkerPool::GetDefaultNumThreads(size_t maxThreads)
+{
+	size_t numProcessors = os_cpu_NumProcessors();
+	if (numProcessors <= 1)
+		return 0;
+	return std::min(numProcessors - 1, maxThreads);
+}
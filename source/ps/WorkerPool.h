@@ -0,0 +1,89 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_WORKERPOOL
+#define INCLUDED_WORKERPOOL
+
+class CWorkerPoolImpl;
+
+/**
+ * A set of worker threads for splitting up CPU-heavy work that the calling
+ * thread would otherwise do itself (and is going to wait for anyway).
+ *
+ * The work is given as a batch of independent tasks, identified by index.
+ * RunBatch wakes up the workers, runs tasks on the calling thread too, and
+ * returns once every task has finished. Tasks are handed out in increasing
+ * order, but may finish in any order, so anything that has to be deterministic
+ * must only depend on which tasks ran and not on their scheduling.
+ */
+class CWorkerPool
+{
+	NONCOPYABLE(CWorkerPool);
+
+public:
+	/**
+	 * Interface for a batch of tasks.
+	 */
+	class IBatch
+	{
+	public:
+		virtual ~IBatch() { }
+
+		/**
+		 * Runs the given task. This is called concurrently from several threads,
+		 * so tasks must not modify any shared state without locking.
+		 * @param thread identifies the calling thread, in the range [0, GetNumThreads()]
+		 *  (0 is the thread that called RunBatch), so that per-thread state can be
+		 *  reused between tasks without locking.
+		 */
+		virtual void Run(size_t task, size_t thread) = 0;
+	};
+
+	/**
+	 * Starts the given number of worker threads (which may be 0, in which case
+	 * all tasks are run by the calling thread).
+	 * @param name used for the threads' names in the profiler.
+	 */
+	CWorkerPool(const char* name, size_t numThreads);
+
+	/**
+	 * Stops and joins the worker threads. Must not be called while a batch is running.
+	 */
+	~CWorkerPool();
+
+	/**
+	 * Returns the number of worker threads (not counting the calling thread).
+	 */
+	size_t GetNumThreads() const;
+
+	/**
+	 * Runs tasks [0, numTasks) of the given batch, and returns once they're all finished.
+	 * Only one batch can run at a time.
+	 */
+	void RunBatch(IBatch& batch, size_t numTasks);
+
+	/**
+	 * Returns a reasonable number of worker threads for work that keeps the calling
+	 * thread busy too: one less than the number of processors, up to the given limit.
+	 */
+	static size_t GetDefaultNumThreads(size_t maxThreads);
+
+private:
+	CWorkerPoolImpl* m;
+};
+
+#endif // INCLUDED_WORKERPOOL
@@ -0,0 +1,183 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "WorkerThread.h"
+
+#include "lib/external_libraries/libsdl.h"
+#include "ps/Profiler2.h"
+#include "ps/ThreadUtil.h"
+
+#include <deque>
+
+class CWorkerThreadImpl
+{
+	NONCOPYABLE(CWorkerThreadImpl);
+
+public:
+	CWorkerThreadImpl(const char* name) :
+		m_Name(name), m_Started(false), m_Shutdown(false), m_Pending(0), m_Waiting(false)
+	{
+		// Use SDL semaphores since OS X doesn't implement sem_init
+		m_JobSem = SDL_CreateSemaphore(0);
+		m_DoneSem = SDL_CreateSemaphore(0);
+		ENSURE(m_JobSem && m_DoneSem);
+
+		int ret = pthread_create(&m_Thread, NULL, &RunThread, this);
+		if (ret != 0)
+		{
+			// We can still run the jobs, just not in parallel
+			debug_warn(L"Failed to create worker thread");
+			return;
+		}
+		m_Started = true;
+	}
+
+	~CWorkerThreadImpl()
+	{
+		if (m_Started)
+		{
+			Wait();
+
+			{
+				CScopeLock lock(m_Mutex);
+				m_Shutdown = true;
+			}
+			SDL_SemPost(m_JobSem);
+
+			pthread_join(m_Thread, NULL);
+		}
+
+		SDL_DestroySemaphore(m_JobSem);
+		SDL_DestroySemaphore(m_DoneSem);
+	}
+
+	void Queue(CWorkerThread::IJob& job)
+	{
+		if (!m_Started)
+		{
+			job.Run();
+			return;
+		}
+
+		{
+			CScopeLock lock(m_Mutex);
+			m_Jobs.push_back(&job);
+			++m_Pending;
+		}
+		SDL_SemPost(m_JobSem);
+	}
+
+	void Wait()
+	{
+		{
+			CScopeLock lock(m_Mutex);
+			if (m_Pending == 0)
+				return;
+			m_Waiting = true;
+		}
+
+		PROFILE2("wait for worker thread");
+
+		// The thread posts m_DoneSem exactly once after we set m_Waiting,
+		// when it has finished every pending job
+		SDL_SemWait(m_DoneSem);
+	}
+
+private:
+	static void* RunThread(void* data)
+	{
+		CWorkerThreadImpl* impl = static_cast<CWorkerThreadImpl*>(data);
+
+		debug_SetThreadName(impl->m_Name.c_str());
+		g_Profiler2.RegisterCurrentThread(impl->m_Name);
+
+		impl->Run();
+
+		return NULL;
+	}
+
+	void Run()
+	{
+		while (true)
+		{
+			g_Profiler2.RecordRegionEnter("semaphore wait");
+			SDL_SemWait(m_JobSem);
+			g_Profiler2.RecordRegionLeave("semaphore wait");
+
+			CWorkerThread::IJob* job;
+			{
+				CScopeLock lock(m_Mutex);
+				if (m_Jobs.empty())
+				{
+					// Every job post is matched by a queued job, so this must be the shutdown request
+					ENSURE(m_Shutdown);
+					return;
+				}
+				job = m_Jobs.front();
+				m_Jobs.pop_front();
+			}
+
+			job->Run();
+
+			{
+				CScopeLock lock(m_Mutex);
+				--m_Pending;
+				if (m_Pending == 0 && m_Waiting)
+				{
+					m_Waiting = false;
+					SDL_SemPost(m_DoneSem);
+				}
+			}
+		}
+	}
+
+	std::string m_Name;
+
+	pthread_t m_Thread;
+	bool m_Started;
+
+	SDL_sem* m_JobSem; // posted once per queued job (and once for shutdown)
+	SDL_sem* m_DoneSem; // posted when the jobs have all finished, if someone is waiting for them
+
+	CMutex m_Mutex; // protects everything below
+	bool m_Shutdown;
+	std::deque<CWorkerThread::IJob*> m_Jobs;
+	size_t m_Pending; // number of jobs that have been queued but not finished
+	bool m_Waiting; // whether the creating thread is waiting on m_DoneSem
+};
+
+CWorkerThread::CWorkerThread(const char* name) :
+	m(new CWorkerThreadImpl(name))
+{
+}
+
+CWorkerThread::~CWorkerThread()
+{
+	delete m;
+}
+
+void CWorkerThread::Queue(IJob& job)
+{
+	m->Queue(job);
+}
+
+void CWorkerThread::Wait()
+{
+	m->Wait();
+}
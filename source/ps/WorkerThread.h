@@ -0,0 +1,77 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_WORKERTHREAD
+#define INCLUDED_WORKERTHREAD
+
+class CWorkerThreadImpl;
+
+/**
+ * A single background thread that runs queued jobs one at a time, in the order
+ * they were queued.
+ *
+ * Unlike CWorkerPool, every job runs on the same thread, so it can be used for
+ * work that has to stay on one thread (e.g. anything using a script context,
+ * which is tied to the thread that created it) while running in parallel with
+ * the calling thread.
+ */
+class CWorkerThread
+{
+	NONCOPYABLE(CWorkerThread);
+
+public:
+	/**
+	 * Interface for a job to run on the thread.
+	 */
+	class IJob
+	{
+	public:
+		virtual ~IJob() { }
+
+		virtual void Run() = 0;
+	};
+
+	/**
+	 * Starts the thread.
+	 * If the thread can't be created, jobs will be run immediately by Queue instead.
+	 * @param name used for the thread's name in the profiler.
+	 */
+	CWorkerThread(const char* name);
+
+	/**
+	 * Waits for any queued jobs to finish, then stops and joins the thread.
+	 */
+	~CWorkerThread();
+
+	/**
+	 * Adds a job to the end of the queue, and returns without waiting for it to run.
+	 * The job is not copied, so it must stay valid until it has finished (see Wait).
+	 * Must only be called by the thread that created this object.
+	 */
+	void Queue(IJob& job);
+
+	/**
+	 * Blocks until every queued job has finished.
+	 * Must only be called by the thread that created this object.
+	 */
+	void Wait();
+
+private:
+	CWorkerThreadImpl* m;
+};
+
+#endif // INCLUDED_WORKERTHREAD
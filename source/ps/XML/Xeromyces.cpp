@@ -109,7 +109,7 @@ PSRETURN CXeromyces::Load(const PIVFS& vfs, const VfsPath& filename)
 	return ConvertFile(vfs, filename, xmbPath);
 }
 
-bool CXeromyces::GenerateCachedXMB(const PIVFS& vfs, const VfsPath& sourcePath, VfsPath& archiveCachePath)
+bool CXeromyces::GenerateCachedXMB(const PIVFS& vfs, const VfsPath& sourcePath, VfsPath& archiveCachePath, VfsPath& outputPath)
 {
 	CCacheLoader cacheLoader(vfs, L".xmb");
 	MD5 hash;
@@ -117,8 +117,15 @@ bool CXeromyces::GenerateCachedXMB(const PIVFS& vfs, const VfsPath& sourcePath,
 	PrepareCacheKey(hash, version);
 
 	archiveCachePath = cacheLoader.ArchiveCachePath(sourcePath);
+	outputPath = cacheLoader.LooseCachePath(sourcePath, hash, version);
+	if (outputPath.empty())
+		return false;
+
+	// Reuse the loose cache if it's been generated already
+	if (vfs->GetFileInfo(outputPath, NULL) >= 0)
+		return true;
 
-	return (ConvertFile(vfs, sourcePath, VfsPath("cache") / archiveCachePath) == PSRETURN_OK);
+	return (ConvertFile(vfs, sourcePath, outputPath) == PSRETURN_OK);
 }
 
 PSRETURN CXeromyces::ConvertFile(const PIVFS& vfs, const VfsPath& filename, const VfsPath& xmbPath)
@@ -54,11 +54,13 @@ public:
 	PSRETURN LoadString(const char* xml);
 
 	/**
-	 * Convert the given XML file into an XMB in the archive cache.
-	 * Returns the XMB path in @p archiveCachePath.
+	 * Convert the given XML file into an XMB in the loose cache (unless an
+	 * up-to-date one is already there), for storing in an archive.
+	 * Returns the name to store it as in the archive in @p archiveCachePath,
+	 * and the path of the loose cache file in @p outputPath.
 	 * Returns false on error.
 	 */
-	bool GenerateCachedXMB(const PIVFS& vfs, const VfsPath& sourcePath, VfsPath& archiveCachePath);
+	bool GenerateCachedXMB(const PIVFS& vfs, const VfsPath& sourcePath, VfsPath& archiveCachePath, VfsPath& outputPath);
 
 	/**
 	 * Call once when initialising the program, to load libxml2.
@@ -0,0 +1,269 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "lib/byte_order.h"
+#include "ps/BinaryReplay.h"
+#include "ps/CLogger.h"
+
+#include <sstream>
+
+class TestBinaryReplay : public CxxTest::TestSuite
+{
+	static const char* TextReplay()
+	{
+		return
+			"start {\"map\":\"test\"}\n"
+			"turn 0 200\n"
+			"end\n"
+			"turn 1 200\n"
+			"cmd 1 {\"type\":\"walk\",\"x\":1}\n"
+			"cmd 2 {\"type\":\"stop\"}\n"
+			"end\n"
+			"hash-quick 0123abcd\n"
+			"turn 2 500\n"
+			"end\n"
+			"hash 00ff\n";
+	}
+
+	void writeGame(CBinaryReplayWriter& writer, u32 turns)
+	{
+		writer.StartGame("{}");
+		for (u32 n = 0; n < turns; ++n)
+		{
+			if (n > 0 && n % 4 == 0)
+				writer.Snapshot(n, std::string(n, 's'));
+
+			std::vector<SReplayCommand> commands(n % 3);
+			for (size_t i = 0; i < commands.size(); ++i)
+			{
+				commands[i].player = (u32)i;
+				commands[i].data = "{}";
+			}
+			writer.Turn(n, 200, commands);
+		}
+	}
+
+public:
+	void test_text_roundtrip()
+	{
+		std::stringstream text(TextReplay());
+		std::stringstream binary;
+		TS_ASSERT(ConvertTextReplayToBinary(text, binary));
+
+		std::stringstream text2;
+		TS_ASSERT(ConvertBinaryReplayToText(binary, text2));
+		TS_ASSERT_STR_EQUALS(text2.str(), TextReplay());
+	}
+
+	void test_read_records()
+	{
+		std::stringstream text(TextReplay());
+		std::stringstream binary;
+		TS_ASSERT(ConvertTextReplayToBinary(text, binary));
+
+		CBinaryReplayReader reader(binary);
+		TS_ASSERT(reader.Open());
+		TS_ASSERT_STR_EQUALS(reader.GetStartAttributes(), "{\"map\":\"test\"}");
+		TS_ASSERT(reader.GetSnapshotTurns().empty());
+
+		SReplayRecord record;
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::START);
+
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::TURN);
+		TS_ASSERT_EQUALS(record.turn, (u32)0);
+		TS_ASSERT_EQUALS(record.commands.size(), (size_t)0);
+
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::TURN);
+		TS_ASSERT_EQUALS(record.turn, (u32)1);
+		TS_ASSERT_EQUALS(record.turnLength, (u32)200);
+		TS_ASSERT_EQUALS(record.commands.size(), (size_t)2);
+		TS_ASSERT_EQUALS(record.commands[1].player, (u32)2);
+		TS_ASSERT_STR_EQUALS(record.commands[1].data, "{\"type\":\"stop\"}");
+
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::HASH);
+		TS_ASSERT(record.quick);
+		TS_ASSERT_STR_EQUALS(record.data, std::string("\x01\x23\xab\xcd", 4));
+
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::HASH);
+		TS_ASSERT(!record.quick);
+
+		TS_ASSERT(!reader.ReadRecord(record));
+	}
+
+	void test_invalid()
+	{
+		std::stringstream text(TextReplay());
+		CBinaryReplayReader reader(text);
+		TS_ASSERT(!reader.Open());
+
+		TestLogger logger;
+		std::stringstream bad("turn 1 200\nfoo\n");
+		std::stringstream binary;
+		TS_ASSERT(!ConvertTextReplayToBinary(bad, binary));
+		TS_ASSERT_WSTR_CONTAINS(logger.GetOutput(), L"Unrecognised replay token foo");
+	}
+
+	void test_invalid_command_count()
+	{
+		std::stringstream binary;
+		{
+			CBinaryReplayWriter writer(binary);
+			writer.StartGame("{}");
+			writer.Turn(0, 200, std::vector<SReplayCommand>());
+		}
+
+		// Corrupt the turn's command count (after the file header, the
+		// start record and the turn record's header, turn and length)
+		std::string data = binary.str();
+		size_t countOffset = 8 + (5 + 2) + 5 + 8;
+		data.replace(countOffset, 4, "\xff\xff\xff\xff", 4);
+		std::stringstream corrupt(data);
+
+		CBinaryReplayReader reader(corrupt);
+		TS_ASSERT(reader.Open());
+
+		SReplayRecord record;
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::START);
+		TS_ASSERT(!reader.ReadRecord(record));
+	}
+
+	void test_invalid_index()
+	{
+		std::stringstream binary;
+		{
+			CBinaryReplayWriter writer(binary);
+			writeGame(writer, 14);
+		}
+		const std::string data = binary.str();
+
+		// The trailer is the index record's offset followed by the index magic
+		size_t indexOffset = (size_t)read_le64(data.data() + data.size() - 12);
+
+		// An index whose size runs past the end of the file is ignored, and the
+		// snapshots are found by scanning the records instead
+		{
+			std::string corrupt = data;
+			corrupt.replace(indexOffset + 1, 4, "\xf0\xff\xff\xff", 4);
+			std::stringstream stream(corrupt);
+
+			CBinaryReplayReader reader(stream);
+			TS_ASSERT(reader.Open());
+			TS_ASSERT_EQUALS(reader.GetSnapshotTurns().size(), (size_t)3);
+
+			SReplayRecord record;
+			TS_ASSERT(reader.SeekToSnapshot(10, record));
+			TS_ASSERT_EQUALS(record.turn, (u32)8);
+		}
+
+		// A snapshot offset past the end of the records is rejected without seeking
+		{
+			std::string corrupt = data;
+			corrupt.replace(data.size() - 12 - 8, 8, "\x00\x00\x00\x00\x01\x00\x00\x00", 8);
+			std::stringstream stream(corrupt);
+
+			CBinaryReplayReader reader(stream);
+			TS_ASSERT(reader.Open());
+			TS_ASSERT_EQUALS(reader.GetSnapshotTurns().size(), (size_t)3);
+
+			TestLogger logger;
+			SReplayRecord record;
+			TS_ASSERT(!reader.SeekToSnapshot(100, record));
+			TS_ASSERT_WSTR_CONTAINS(logger.GetOutput(), L"Invalid snapshot for turn 12");
+
+			TS_ASSERT(reader.ReadRecord(record));
+			TS_ASSERT_EQUALS(record.type, SReplayRecord::START);
+		}
+	}
+
+	void test_snapshots()
+	{
+		std::stringstream binary;
+		{
+			CBinaryReplayWriter writer(binary);
+			writeGame(writer, 14);
+		}
+
+		CBinaryReplayReader reader(binary);
+		TS_ASSERT(reader.Open());
+
+		std::vector<u32> turns = reader.GetSnapshotTurns();
+		TS_ASSERT_EQUALS(turns.size(), (size_t)3);
+		TS_ASSERT_EQUALS(turns[0], (u32)4);
+		TS_ASSERT_EQUALS(turns[2], (u32)12);
+
+		SReplayRecord record;
+		TS_ASSERT(!reader.SeekToSnapshot(3, record));
+
+		TS_ASSERT(reader.SeekToSnapshot(10, record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::SNAPSHOT);
+		TS_ASSERT_EQUALS(record.turn, (u32)8);
+		TS_ASSERT_STR_EQUALS(record.data, std::string(8, 's'));
+
+		// Reading continues from the snapshot's turn
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::TURN);
+		TS_ASSERT_EQUALS(record.turn, (u32)8);
+		TS_ASSERT_EQUALS(record.commands.size(), (size_t)2);
+
+		TS_ASSERT(reader.SeekToSnapshot(100, record));
+		TS_ASSERT_EQUALS(record.turn, (u32)12);
+
+		// Conversion to text drops the snapshots but keeps all the turns
+		std::stringstream text;
+		TS_ASSERT(ConvertBinaryReplayToText(binary, text));
+		TS_ASSERT_EQUALS(text.str().find("snapshot"), std::string::npos);
+		TS_ASSERT_DIFFERS(text.str().find("turn 13 200\n"), std::string::npos);
+	}
+
+	void test_unfinished()
+	{
+		// Simulate a crash in the middle of writing a record, before the index was written
+		std::stringstream binary;
+		size_t length;
+		{
+			CBinaryReplayWriter writer(binary);
+			writeGame(writer, 9);
+			length = binary.str().size() + 7;
+			writer.Turn(9, 200, std::vector<SReplayCommand>());
+		}
+		std::stringstream truncated(binary.str().substr(0, length));
+
+		CBinaryReplayReader reader(truncated);
+		TS_ASSERT(reader.Open());
+
+		std::vector<u32> turns = reader.GetSnapshotTurns();
+		TS_ASSERT_EQUALS(turns.size(), (size_t)2);
+
+		SReplayRecord record;
+		TS_ASSERT(reader.SeekToSnapshot(9, record));
+		TS_ASSERT_EQUALS(record.turn, (u32)8);
+
+		TS_ASSERT(reader.ReadRecord(record));
+		TS_ASSERT_EQUALS(record.type, SReplayRecord::TURN);
+		TS_ASSERT_EQUALS(record.turn, (u32)8);
+		TS_ASSERT(!reader.ReadRecord(record));
+	}
+};
@@ -0,0 +1,201 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "ps/ReplayBenchmark.h"
+
+#include "lib/timer.h"
+#include "ps/Profile.h"
+#include "ps/ProfileViewer.h"
+
+#include <sstream>
+
+class TestReplayBenchmark : public CxxTest::TestSuite
+{
+	std::vector<std::string> regions()
+	{
+		std::vector<std::string> regions;
+		regions.push_back("ComputePath");
+		regions.push_back("message *");
+		return regions;
+	}
+
+	// Records turns 0..99 taking (turn+1) msecs each, with ComputePath taking
+	// pathScale times the turn number
+	void record(CReplayBenchmark& benchmark, const std::string& name, double pathScale)
+	{
+		benchmark.StartReplay(name);
+		for (u32 turn = 0; turn < 100; ++turn)
+		{
+			std::vector<double> times;
+			times.push_back(pathScale * turn / 1000.0);
+			times.push_back(0.0005);
+			benchmark.RecordTurn(turn, (turn + 1) / 1000.0, times);
+		}
+	}
+
+	static void spin(double seconds)
+	{
+		double start = timer_Time();
+		while (timer_Time() - start < seconds)
+			;
+	}
+
+	static double regionMean(const std::vector<CReplayBenchmark::SStats>& stats, const std::string& region)
+	{
+		for (size_t i = 0; i < stats.size(); ++i)
+			if (stats[i].region == region)
+				return stats[i].mean;
+		TS_FAIL("region not found");
+		return 0.0;
+	}
+
+public:
+	void test_stats()
+	{
+		CReplayBenchmark benchmark(regions(), 3);
+		record(benchmark, "a", 0.5);
+
+		std::vector<CReplayBenchmark::SStats> stats = benchmark.GetStats();
+		TS_ASSERT_EQUALS(stats.size(), (size_t)3);
+
+		TS_ASSERT_STR_EQUALS(stats[0].replay, "a");
+		TS_ASSERT_STR_EQUALS(stats[0].region, "turn");
+		TS_ASSERT_EQUALS(stats[0].turns, (size_t)100);
+		TS_ASSERT_DELTA(stats[0].total, 5050.0, 0.001);
+		TS_ASSERT_DELTA(stats[0].mean, 50.5, 0.001);
+		TS_ASSERT_DELTA(stats[0].p50, 50.0, 0.001);
+		TS_ASSERT_DELTA(stats[0].p90, 90.0, 0.001);
+		TS_ASSERT_DELTA(stats[0].p99, 99.0, 0.001);
+		TS_ASSERT_DELTA(stats[0].max, 100.0, 0.001);
+
+		TS_ASSERT_STR_EQUALS(stats[1].region, "ComputePath");
+		TS_ASSERT_DELTA(stats[1].max, 49.5, 0.001);
+		TS_ASSERT_STR_EQUALS(stats[2].region, "message *");
+		TS_ASSERT_DELTA(stats[2].mean, 0.5, 0.001);
+	}
+
+	void test_json()
+	{
+		CReplayBenchmark benchmark(regions(), 2);
+		record(benchmark, "dir\\a", 0.5);
+
+		std::stringstream json;
+		benchmark.WriteJSON(json);
+		TS_ASSERT_DIFFERS(json.str().find("\"name\": \"dir\\\\a\""), std::string::npos);
+		TS_ASSERT_DIFFERS(json.str().find("{ \"turn\": 99, \"time\": 100.000, \"ComputePath\": 49.500, \"message *\": 0.500 },\n"
+			"        { \"turn\": 98, \"time\": 99.000,"), std::string::npos);
+		TS_ASSERT_EQUALS(json.str().find("\"turn\": 97"), std::string::npos);
+	}
+
+	void test_baseline()
+	{
+		CReplayBenchmark before(regions(), 0);
+		record(before, "a", 0.5);
+		record(before, "b,c", 0.5);
+
+		std::stringstream csv;
+		before.WriteCSV(csv);
+
+		std::vector<std::string> regressions;
+
+		// Same times, plus a replay that's not in the baseline
+		CReplayBenchmark same(regions(), 0);
+		record(same, "b,c", 0.5);
+		record(same, "d", 5.0);
+		TS_ASSERT(same.CompareWithBaseline(csv, 0.1, 0.1, regressions));
+		TS_ASSERT(regressions.empty());
+
+		// 20% slower pathfinding
+		CReplayBenchmark slower(regions(), 0);
+		record(slower, "b,c", 0.6);
+		csv.clear();
+		csv.seekg(0);
+		TS_ASSERT(slower.CompareWithBaseline(csv, 0.1, 0.1, regressions));
+		TS_ASSERT_EQUALS(regressions.size(), (size_t)2);
+		TS_ASSERT_STR_EQUALS(regressions[0], "b,c: ComputePath mean 24.750 -> 29.700 msec (+20.0%)");
+
+		// ...which is allowed with a higher threshold
+		regressions.clear();
+		csv.clear();
+		csv.seekg(0);
+		TS_ASSERT(slower.CompareWithBaseline(csv, 0.25, 0.1, regressions));
+		TS_ASSERT(regressions.empty());
+
+		std::stringstream bad("not a baseline\n");
+		TS_ASSERT(!slower.CompareWithBaseline(bad, 0.1, 0.1, regressions));
+	}
+
+	void test_profile_tree()
+	{
+		new CProfileViewer;
+		new CProfileManager;
+
+		// The profiler finds nodes by name pointer, so use the same ones throughout
+		const char* longRequests = "ProcessLongRequests";
+		const char* pathResult = "message PathResult";
+		const char* update = "message Update";
+		const char* positionChanged = "message PositionChanged";
+		const char* rangeQueries = "ExecuteActiveQueries";
+
+		// Profile a turn like the ones in a release build, with the default regions
+		// nested inside each other
+		g_Profiler.Frame();
+		g_Profiler.Start(longRequests);
+			spin(0.001);
+			g_Profiler.Start(pathResult);
+				spin(0.001);
+			g_Profiler.Stop();
+		g_Profiler.Stop();
+		g_Profiler.Start(update);
+			spin(0.001);
+			g_Profiler.Start(rangeQueries);
+				spin(0.001);
+			g_Profiler.Stop();
+			g_Profiler.Start(positionChanged);
+				spin(0.001);
+			g_Profiler.Stop();
+		g_Profiler.Stop();
+		g_Profiler.Frame();
+		g_Profiler.Turn();
+
+		CReplayBenchmark benchmark(CReplayBenchmark::GetDefaultRegions(), 1);
+		benchmark.StartReplay("a");
+		benchmark.RecordTurn(0, 0.01, g_Profiler.GetRoot());
+		std::vector<CReplayBenchmark::SStats> stats = benchmark.GetStats();
+
+		const CProfileNode* root = g_Profiler.GetRoot();
+		const CProfileNode* longRequestsNode = root->GetChild(longRequests);
+		const CProfileNode* pathResultNode = longRequestsNode->GetChild(pathResult);
+		const CProfileNode* updateNode = root->GetChild(update);
+		const CProfileNode* rangeQueriesNode = updateNode->GetChild(rangeQueries);
+		TS_ASSERT_LESS_THAN(0.002, longRequestsNode->GetTurnTime());
+		TS_ASSERT_LESS_THAN(0.001, pathResultNode->GetTurnTime());
+
+		TS_ASSERT_DELTA(regionMean(stats, "ProcessLongRequests"), 1000.0 * longRequestsNode->GetTurnTime(), 0.0001);
+		TS_ASSERT_DELTA(regionMean(stats, "ExecuteActiveQueries"), 1000.0 * rangeQueriesNode->GetTurnTime(), 0.0001);
+		TS_ASSERT_EQUALS(regionMean(stats, "ComputePath"), 0.0);
+
+		// Messages inside other regions are found, but the nested PositionChanged is
+		// already included in Update
+		TS_ASSERT_DELTA(regionMean(stats, "message *"), 1000.0 * (pathResultNode->GetTurnTime() + updateNode->GetTurnTime()), 0.0001);
+
+		delete &g_Profiler;
+		delete &g_ProfileViewer;
+	}
+};
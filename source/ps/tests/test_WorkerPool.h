@@ -0,0 +1,76 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "ps/WorkerPool.h"
+
+class TestWorkerPool : public CxxTest::TestSuite
+{
+	struct Batch : public CWorkerPool::IBatch
+	{
+		std::vector<u32> results;
+		std::vector<size_t> threads;
+
+		Batch(size_t numTasks) : results(numTasks, 0), threads(numTasks, (size_t)-1) { }
+
+		virtual void Run(size_t task, size_t thread)
+		{
+			// Do enough work that the tasks get spread over several threads
+			u32 x = (u32)task;
+			for (int i = 0; i < 10000; ++i)
+				x = x * 1664525 + 1013904223;
+			results[task] = x;
+			threads[task] = thread;
+		}
+	};
+
+	void check(CWorkerPool& pool, size_t numTasks)
+	{
+		Batch batch(numTasks);
+		pool.RunBatch(batch, numTasks);
+
+		Batch expected(numTasks);
+		for (size_t i = 0; i < numTasks; ++i)
+			expected.Run(i, 0);
+
+		TS_ASSERT(batch.results == expected.results);
+		for (size_t i = 0; i < numTasks; ++i)
+			TS_ASSERT_LESS_THAN_EQUALS(batch.threads[i], pool.GetNumThreads());
+	}
+
+public:
+	void test_no_threads()
+	{
+		CWorkerPool pool("test", 0);
+		TS_ASSERT_EQUALS(pool.GetNumThreads(), (size_t)0);
+		check(pool, 0);
+		check(pool, 1);
+		check(pool, 100);
+	}
+
+	void test_threads()
+	{
+		CWorkerPool pool("test", 3);
+		TS_ASSERT_EQUALS(pool.GetNumThreads(), (size_t)3);
+
+		// Run lots of batches of various sizes, to make sure threads are
+		// woken and waited for correctly
+		for (size_t i = 0; i < 200; ++i)
+			check(pool, i % 37);
+	}
+};
@@ -0,0 +1,79 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "ps/WorkerThread.h"
+
+class TestWorkerThread : public CxxTest::TestSuite
+{
+	struct Job : public CWorkerThread::IJob
+	{
+		std::vector<size_t>* log;
+		size_t id;
+		pthread_t thread;
+
+		virtual void Run()
+		{
+			thread = pthread_self();
+
+			// Take long enough that the jobs get queued up
+			volatile u32 x = (u32)id;
+			for (int i = 0; i < 10000; ++i)
+				x = x * 1664525 + 1013904223;
+
+			log->push_back(id);
+		}
+	};
+
+public:
+	void test_order()
+	{
+		for (size_t n = 0; n < 50; ++n)
+		{
+			std::vector<size_t> log;
+			std::vector<Job> jobs(n % 7);
+
+			{
+				CWorkerThread thread("test");
+				for (size_t i = 0; i < jobs.size(); ++i)
+				{
+					jobs[i].log = &log;
+					jobs[i].id = i;
+					thread.Queue(jobs[i]);
+
+					if (i % 3 == 2)
+						thread.Wait();
+				}
+
+				if (n % 2)
+					thread.Wait();
+
+				// (else the destructor has to wait for the jobs)
+			}
+
+			// Jobs must run in order, all on the same thread (which isn't this one)
+			TS_ASSERT_EQUALS(log.size(), jobs.size());
+			for (size_t i = 0; i < jobs.size() && i < log.size(); ++i)
+			{
+				TS_ASSERT_EQUALS(log[i], i);
+				TS_ASSERT(pthread_equal(jobs[i].thread, jobs[0].thread));
+				TS_ASSERT(!pthread_equal(jobs[i].thread, pthread_self()));
+			}
+		}
+	}
+};
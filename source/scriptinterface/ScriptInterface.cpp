@@ -38,7 +38,6 @@
 #include <boost/random/uniform_real.hpp>
 #include <boost/flyweight.hpp>
 #include <boost/flyweight/key_value.hpp>
-#include <boost/flyweight/no_locking.hpp>
 #include <boost/flyweight/no_tracking.hpp>
 
 #include "valgrind.h"
@@ -149,18 +148,18 @@ private:
 		std::string name;
 	};
 
-	// Flyweight types (with no_locking because the call hooks are only used in the
-	// main thread, and no_tracking because we mustn't delete values the profiler is
-	// using and it's not going to waste much memory)
+	// Flyweight types (with no_tracking because we mustn't delete values the profiler
+	// is using and it's not going to waste much memory). These keep the default
+	// locking policy: the call hooks only run in the main thread, but the string
+	// factory is shared with Engine.ProfileStart, which AI scripts call from the
+	// AI worker thread.
 	typedef boost::flyweight<
 		std::string,
-		boost::flyweights::no_tracking,
-		boost::flyweights::no_locking
+		boost::flyweights::no_tracking
 	> StringFlyweight;
 	typedef boost::flyweight<
 		boost::flyweights::key_value<ScriptLocation, ScriptLocationName>,
-		boost::flyweights::no_tracking,
-		boost::flyweights::no_locking
+		boost::flyweights::no_tracking
 	> LocFlyweight;
 
 	static void* jshook_function(JSContext* cx, JSStackFrame* fp, JSBool before, JSBool* UNUSED(ok), void* closure)
@@ -392,10 +391,10 @@ JSBool ProfileStart(JSContext* cx, uintN argc, jsval* vp)
 		if (!ScriptInterface::FromJSVal(cx, JS_ARGV(cx, vp)[0], str))
 			return JS_FALSE;
 
+		// can't use no_locking; AI scripts call this from the AI worker thread
 		typedef boost::flyweight<
 			std::string,
-			boost::flyweights::no_tracking,
-			boost::flyweights::no_locking
+			boost::flyweights::no_tracking
 		> StringFlyweight;
 
 		name = StringFlyweight(str).get().c_str();
@@ -692,6 +691,33 @@ bool ScriptInterface::CallFunction_(jsval val, const char* name, size_t argc, js
 	return ok ? true : false;
 }
 
+bool ScriptInterface::GetFunction(jsval val, const char* name, jsval& func)
+{
+	if (!JSVAL_IS_OBJECT(val) || JSVAL_IS_NULL(val))
+		return false;
+
+	if (!JS_GetProperty(m->m_cx, JSVAL_TO_OBJECT(val), name, &func))
+		return false;
+
+	return JSVAL_IS_OBJECT(func) && !JSVAL_IS_NULL(func) && JS_ObjectIsFunction(m->m_cx, JSVAL_TO_OBJECT(func));
+}
+
+bool ScriptInterface::CallFunctionValueVoid(jsval val, jsval func)
+{
+	jsval jsRet;
+	return CallFunctionValue_(val, func, 0, NULL, jsRet);
+}
+
+bool ScriptInterface::CallFunctionValue_(jsval val, jsval func, size_t argc, jsval* argv, jsval& ret)
+{
+	if (!JSVAL_IS_OBJECT(val) || JSVAL_IS_NULL(val))
+		return false;
+
+	JSBool ok = JS_CallFunctionValue(m->m_cx, JSVAL_TO_OBJECT(val), func, (uintN)argc, argv, &ret);
+
+	return ok ? true : false;
+}
+
 jsval ScriptInterface::GetGlobalObject()
 {
 	return OBJECT_TO_JSVAL(JS_GetGlobalObject(m->m_cx));
@@ -829,6 +855,14 @@ bool ScriptInterface::EnumeratePropertyNamesWithPrefix(jsval obj, const char* pr
 	return true;
 }
 
+bool ScriptInterface::GetPrototype(jsval obj, jsval& proto)
+{
+	if (!JSVAL_IS_OBJECT(obj) || JSVAL_IS_NULL(obj))
+		return false;
+	proto = OBJECT_TO_JSVAL(JS_GetPrototype(m->m_cx, JSVAL_TO_OBJECT(obj)));
+	return true;
+}
+
 bool ScriptInterface::SetPrototype(jsval obj, jsval proto)
 {
 	if (!JSVAL_IS_OBJECT(obj) || !JSVAL_IS_OBJECT(proto))
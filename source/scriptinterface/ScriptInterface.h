@@ -164,6 +164,31 @@ public:
 	template<typename T0, typename T1, typename T2, typename T3, typename R>
 	bool CallFunction(jsval val, const char* name, const T0& a0, const T1& a1, const T2& a2, const T3& a3, R& ret);
 
+	/**
+	 * Look up the named function property on the given object, so that it can be
+	 * called repeatedly with CallFunctionValue without resolving the name each time.
+	 * The caller is responsible for rooting the returned function.
+	 * @return false if the property is missing or isn't a function
+	 */
+	bool GetFunction(jsval val, const char* name, jsval& func);
+
+	/**
+	 * Call a function (from GetFunction) with the given object as 'this', with void return type and 0 arguments
+	 */
+	bool CallFunctionValueVoid(jsval val, jsval func);
+
+	/**
+	 * Call a function (from GetFunction) with the given object as 'this', with void return type and 1 argument
+	 */
+	template<typename T0>
+	bool CallFunctionValueVoid(jsval val, jsval func, const T0& a0);
+
+	/**
+	 * Call a function (from GetFunction) with the given object as 'this', with return type R and 0 arguments
+	 */
+	template<typename R>
+	bool CallFunctionValue(jsval val, jsval func, R& ret);
+
 	jsval GetGlobalObject();
 
 	JSClass* GetGlobalClass();
@@ -209,6 +234,8 @@ public:
 
 	bool EnumeratePropertyNamesWithPrefix(jsval obj, const char* prefix, std::vector<std::string>& out);
 
+	bool GetPrototype(jsval obj, jsval& proto);
+
 	bool SetPrototype(jsval obj, jsval proto);
 
 	bool FreezeObject(jsval obj, bool deep);
@@ -317,6 +344,7 @@ public:
 
 private:
 	bool CallFunction_(jsval val, const char* name, size_t argc, jsval* argv, jsval& ret);
+	bool CallFunctionValue_(jsval val, jsval func, size_t argc, jsval* argv, jsval& ret);
 	bool Eval_(const char* code, jsval& ret);
 	bool Eval_(const wchar_t* code, jsval& ret);
 	bool SetGlobal_(const char* name, jsval value, bool replace);
@@ -446,6 +474,25 @@ bool ScriptInterface::CallFunction(jsval val, const char* name, const T0& a0, co
 	return FromJSVal(GetContext(), jsRet, ret);
 }
 
+template<typename T0>
+bool ScriptInterface::CallFunctionValueVoid(jsval val, jsval func, const T0& a0)
+{
+	jsval jsRet;
+	jsval argv[1];
+	argv[0] = ToJSVal(GetContext(), a0);
+	return CallFunctionValue_(val, func, 1, argv, jsRet);
+}
+
+template<typename R>
+bool ScriptInterface::CallFunctionValue(jsval val, jsval func, R& ret)
+{
+	jsval jsRet;
+	bool ok = CallFunctionValue_(val, func, 0, NULL, jsRet);
+	if (!ok)
+		return false;
+	return FromJSVal(GetContext(), jsRet, ret);
+}
+
 template<typename T>
 bool ScriptInterface::SetGlobal(const char* name, const T& value, bool replace)
 {
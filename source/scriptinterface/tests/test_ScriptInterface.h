@@ -106,6 +106,27 @@ public:
 		TS_ASSERT_STR_EQUALS(source, "({a:#1=[#1#], b:#1#})");
 	}
 
+	void test_function_value()
+	{
+		ScriptInterface script("Test", "Test", ScriptInterface::CreateRuntime());
+
+		CScriptValRooted obj;
+		TS_ASSERT(script.Eval("({'n': 1, 'add': function(x) { this.n += x; }, 'get': function() { return this.n; }, 'notfunc': 2})", obj));
+
+		jsval add, get, func;
+		TS_ASSERT(script.GetFunction(obj.get(), "add", add));
+		TS_ASSERT(script.GetFunction(obj.get(), "get", get));
+		TS_ASSERT(!script.GetFunction(obj.get(), "notfunc", func));
+		TS_ASSERT(!script.GetFunction(obj.get(), "missing", func));
+
+		// The function must be called with the given object as 'this'
+		TS_ASSERT(script.CallFunctionValueVoid(obj.get(), add, 2));
+		TS_ASSERT(script.CallFunctionValueVoid(obj.get(), add, 3));
+		int n = 0;
+		TS_ASSERT(script.CallFunctionValue(obj.get(), get, n));
+		TS_ASSERT_EQUALS(n, 6);
+	}
+
 	void test_random()
 	{
 		ScriptInterface script("Test", "Test", ScriptInterface::CreateRuntime());
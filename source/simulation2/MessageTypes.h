@@ -299,6 +299,19 @@ public:
 	}
 };
 
+/**
+ * Sent when the water height has been changed.
+ */
+class CMessageWaterChanged : public CMessage
+{
+public:
+	DEFAULT_MESSAGE_IMPL(WaterChanged)
+
+	CMessageWaterChanged()
+	{
+	}
+};
+
 /**
  * Sent by CCmpRangeManager at most once per turn, when an active range query
  * has had matching units enter/leave the range since the last RangeUpdate.
@@ -21,6 +21,7 @@
 
 #include "simulation2/MessageTypes.h"
 #include "simulation2/system/ComponentManager.h"
+#include "simulation2/system/DispatchStats.h"
 #include "simulation2/system/ParamNode.h"
 #include "simulation2/system/SimContext.h"
 #include "simulation2/components/ICmpAIManager.h"
@@ -68,12 +69,18 @@ public:
 
 		RegisterFileReloadFunc(ReloadChangedFileCB, this);
 
+		if (g_DispatchStatsTable)
+			g_DispatchStatsTable->Add(&m_ComponentManager);
+
 // 		m_EnableOOSLog = true; // TODO: this should be a command-line flag or similar
 // 		m_EnableSerializationTest = true; // TODO: this should too
 	}
 
 	~CSimulation2Impl()
 	{
+		if (g_DispatchStatsTable)
+			g_DispatchStatsTable->Remove(&m_ComponentManager);
+
 		UnregisterFileReloadFunc(ReloadChangedFileCB, this);
 	}
 
@@ -103,6 +110,7 @@ public:
 		componentManager.AddComponent(SYSTEM_ENTITY, CID_SoundManager, noParam);
 		componentManager.AddComponent(SYSTEM_ENTITY, CID_Terrain, noParam);
 		componentManager.AddComponent(SYSTEM_ENTITY, CID_TerritoryManager, noParam);
+		componentManager.AddComponent(SYSTEM_ENTITY, CID_UnitRenderer, noParam);
 		componentManager.AddComponent(SYSTEM_ENTITY, CID_WaterManager, noParam);
 
 		if (!skipAI)
@@ -461,6 +469,10 @@ void CSimulation2Impl::UpdateComponents(CSimContext& simContext, fixed turnLengt
 
 	CComponentManager& componentManager = simContext.GetComponentManager();
 
+	// The dispatch statistics cover everything since the previous turn started,
+	// including the per-frame messages
+	componentManager.TurnDispatchStats();
+
 	CMessageTurnStart msgTurnStart;
 	componentManager.BroadcastMessage(msgTurnStart);
 
@@ -759,9 +771,9 @@ bool CSimulation2::DumpDebugState(std::ostream& stream)
 	return m->m_ComponentManager.DumpDebugState(stream, true);
 }
 
-bool CSimulation2::SerializeState(std::ostream& stream)
+bool CSimulation2::SerializeState(std::ostream& stream, std::vector<SSerializedSegment>* segments)
 {
-	return m->m_ComponentManager.SerializeState(stream);
+	return m->m_ComponentManager.SerializeState(stream, segments);
 }
 
 bool CSimulation2::DeserializeState(std::istream& stream)
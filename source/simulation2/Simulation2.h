@@ -38,6 +38,7 @@ class ScriptInterface;
 class CMessage;
 class SceneCollector;
 class CFrustum;
+struct SSerializedSegment;
 
 /**
  * Public API for simulation system.
@@ -211,7 +212,7 @@ public:
 
 	bool ComputeStateHash(std::string& outHash, bool quick);
 	bool DumpDebugState(std::ostream& stream);
-	bool SerializeState(std::ostream& stream);
+	bool SerializeState(std::ostream& stream, std::vector<SSerializedSegment>* segments = NULL);
 	bool DeserializeState(std::istream& stream);
 
 	std::string GenerateSchema();
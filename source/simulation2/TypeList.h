@@ -47,6 +47,7 @@ MESSAGE(RangeUpdate)
 MESSAGE(TerrainChanged)
 MESSAGE(TerritoriesChanged)
 MESSAGE(PathResult)
+MESSAGE(WaterChanged)
 
 // TemplateManager must come before all other (non-test) components,
 // so that it is the first to be (de)serialized
@@ -146,6 +147,9 @@ INTERFACE(UnitMotion)
 COMPONENT(UnitMotion) // must be after Obstruction
 COMPONENT(UnitMotionScripted)
 
+INTERFACE(UnitRenderer)
+COMPONENT(UnitRenderer) // must be before VisualActor
+
 INTERFACE(Vision)
 COMPONENT(Vision)
 
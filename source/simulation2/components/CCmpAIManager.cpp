@@ -29,6 +29,7 @@
 #include "ps/CLogger.h"
 #include "ps/Filesystem.h"
 #include "ps/Util.h"
+#include "ps/WorkerThread.h"
 #include "simulation2/components/ICmpAIInterface.h"
 #include "simulation2/components/ICmpCommandQueue.h"
 #include "simulation2/components/ICmpObstructionManager.h"
@@ -48,7 +49,7 @@
  * takes care of managing all the scripts.
  *
  * To avoid slow AI scripts causing jerky rendering, they are run in a background
- * thread (maintained by CAIWorker) so that it's okay if they take a whole simulation
+ * thread (maintained by CAIWorkerThread) so that it's okay if they take a whole simulation
  * turn before returning their results (though preferably they shouldn't use nearly
  * that much CPU).
  *
@@ -57,13 +58,18 @@
  * The AI scripts will then run asynchronously and return a list of commands to execute.
  * Any attempts to read the command list (including indirectly via serialization)
  * will block until it's actually completed, so the rest of the engine should avoid
- * reading it for as long as possible.
+ * reading it for as long as possible. The commands are always pushed at the start
+ * of the next turn, however long they took to compute, so the simulation stays
+ * deterministic.
  *
  * JS values are passed between the game and AI threads using ScriptInterface::StructuredClone.
  *
- * TODO: actually the thread isn't implemented yet, because performance hasn't been
- * sufficiently problematic to justify the complexity yet, but the CAIWorker interface
- * is designed to hopefully support threading when we want it.
+ * A JS context can only be used by the thread that created it, so CAIWorker
+ * (and all its script interfaces) is created, used and destroyed entirely on
+ * the AI thread. Everything except the turn computation (adding players, loading
+ * templates, serialization) is done synchronously while the caller waits,
+ * so AI scripts must only use IncludeModule (which accesses the non-thread-safe
+ * VFS) while they're being initialised.
  */
 
 class CAIWorker
@@ -464,8 +470,12 @@ private:
 		// Deserialize the game state, to pass to the AI's HandleMessage
 		CScriptVal state;
 		{
-			PROFILE3("AI compute read state");
+			PROFILE2("AI compute read state");
 			state = m_ScriptInterface.ReadStructuredClone(m_GameState);
+
+			// The caller still holds a reference to the game state, so it'll be
+			// freed by the thread whose script context created it
+			m_GameState.reset();
 			m_ScriptInterface.SetProperty(state.get(), "passabilityMap", m_PassabilityMapVal, true);
 			m_ScriptInterface.SetProperty(state.get(), "territoryMap", m_TerritoryMapVal, true);
 		}
@@ -478,7 +488,7 @@ private:
 
 		for (size_t i = 0; i < m_Players.size(); ++i)
 		{
-			PROFILE3("AI script");
+			PROFILE2("AI script");
 			PROFILE2_ATTR("player: %d", m_Players[i]->m_Player);
 			PROFILE2_ATTR("script: %ls", m_Players[i]->m_AIName.c_str());
 			m_Players[i]->Run(state);
@@ -489,7 +499,7 @@ private:
 		// since it avoids random GC delays while running other scripts)
 		if (m_TurnNum++ % 25 == 0)
 		{
-			PROFILE3("AI compute GC");
+			PROFILE2("AI compute GC");
 			m_ScriptInterface.MaybeGC();
 		}
 	}
@@ -514,6 +524,185 @@ private:
 	bool m_CommandsComputed;
 };
 
+/**
+ * Runs a CAIWorker on its own thread.
+ *
+ * StartComputation returns immediately, and every other call waits for the
+ * current computation (if any) to finish and then runs synchronously on the
+ * AI thread. Arguments and results are passed through member variables, which
+ * is safe since the calling thread is blocked while the job uses them.
+ */
+class CAIWorkerThread
+{
+	NONCOPYABLE(CAIWorkerThread);
+
+public:
+	CAIWorkerThread() :
+		m_Worker(NULL), m_ComputeJob(*this, &CAIWorkerThread::DoComputation), m_Thread("AI")
+	{
+		Call(&CAIWorkerThread::DoCreate);
+	}
+
+	~CAIWorkerThread()
+	{
+		Call(&CAIWorkerThread::DoDestroy);
+	}
+
+	bool AddPlayer(const std::wstring& aiName, player_id_t player, bool callConstructor)
+	{
+		m_AIName = aiName;
+		m_Player = player;
+		m_CallConstructor = callConstructor;
+		Call(&CAIWorkerThread::DoAddPlayer);
+		return m_Result;
+	}
+
+	void StartComputation(const shared_ptr<ScriptInterface::StructuredClone>& gameState, const Grid<u16>& passabilityMap, const Grid<u8>& territoryMap, bool territoryMapDirty)
+	{
+		m_Thread.Wait();
+
+		// Keep our own copies of everything the computation uses, since the
+		// simulation will carry on changing the originals.
+		// (Replacing m_GameState also releases the previous turn's state here,
+		// rather than on the AI thread.)
+		m_GameState = gameState;
+
+		if (passabilityMap.m_DirtyID != m_PassabilityMap.m_DirtyID)
+			m_PassabilityMap = passabilityMap;
+
+		m_TerritoryMapDirty = territoryMapDirty;
+		if (territoryMapDirty)
+			m_TerritoryMap = territoryMap;
+
+		m_Thread.Queue(m_ComputeJob);
+	}
+
+	void GetCommands(std::vector<CAIWorker::SCommandSets>& commands)
+	{
+		m_Commands = &commands;
+		Call(&CAIWorkerThread::DoGetCommands);
+	}
+
+	void LoadEntityTemplates(const std::vector<std::pair<std::string, const CParamNode*> >& templates)
+	{
+		m_Templates = &templates;
+		Call(&CAIWorkerThread::DoLoadEntityTemplates);
+	}
+
+	void Serialize(std::ostream& stream, bool isDebug)
+	{
+		m_OutStream = &stream;
+		m_IsDebug = isDebug;
+		Call(&CAIWorkerThread::DoSerialize);
+	}
+
+	void Deserialize(std::istream& stream)
+	{
+		m_InStream = &stream;
+		m_Error = PSRETURN_OK;
+		Call(&CAIWorkerThread::DoDeserialize);
+
+		// Rethrow deserialization errors on the caller's thread
+		if (m_Error != PSRETURN_OK)
+			ThrowError(m_Error);
+	}
+
+private:
+	typedef void (CAIWorkerThread::*JobFunc)();
+
+	struct Job : public CWorkerThread::IJob
+	{
+		Job(CAIWorkerThread& thread, JobFunc func) : m_Owner(thread), m_Func(func) { }
+
+		virtual void Run()
+		{
+			(m_Owner.*m_Func)();
+		}
+
+		CAIWorkerThread& m_Owner;
+		JobFunc m_Func;
+	};
+
+	void Call(JobFunc func)
+	{
+		Job job(*this, func);
+		m_Thread.Queue(job);
+		m_Thread.Wait();
+	}
+
+	void DoCreate()
+	{
+		m_Worker = new CAIWorker();
+	}
+
+	void DoDestroy()
+	{
+		SAFE_DELETE(m_Worker);
+	}
+
+	void DoAddPlayer()
+	{
+		m_Result = m_Worker->AddPlayer(m_AIName, m_Player, m_CallConstructor);
+	}
+
+	void DoComputation()
+	{
+		m_Worker->StartComputation(m_GameState, m_PassabilityMap, m_TerritoryMap, m_TerritoryMapDirty);
+		m_Worker->WaitToFinishComputation();
+	}
+
+	void DoGetCommands()
+	{
+		m_Worker->GetCommands(*m_Commands);
+	}
+
+	void DoLoadEntityTemplates()
+	{
+		m_Worker->LoadEntityTemplates(*m_Templates);
+	}
+
+	void DoSerialize()
+	{
+		m_Worker->Serialize(*m_OutStream, m_IsDebug);
+	}
+
+	void DoDeserialize()
+	{
+		try
+		{
+			m_Worker->Deserialize(*m_InStream);
+		}
+		catch (PSERROR& e)
+		{
+			m_Error = e.getCode();
+		}
+	}
+
+	CAIWorker* m_Worker; // only accessed by the AI thread
+
+	// Arguments and results of the current job
+	std::wstring m_AIName;
+	player_id_t m_Player;
+	bool m_CallConstructor;
+	bool m_Result;
+	std::vector<CAIWorker::SCommandSets>* m_Commands;
+	const std::vector<std::pair<std::string, const CParamNode*> >* m_Templates;
+	std::ostream* m_OutStream;
+	bool m_IsDebug;
+	std::istream* m_InStream;
+	PSRETURN m_Error;
+
+	// Inputs to the current computation (not modified until it has finished)
+	shared_ptr<ScriptInterface::StructuredClone> m_GameState;
+	Grid<u16> m_PassabilityMap;
+	Grid<u8> m_TerritoryMap;
+	bool m_TerritoryMapDirty;
+	Job m_ComputeJob;
+
+	// (Must be destroyed first, so the thread has stopped before anything it uses is destroyed)
+	CWorkerThread m_Thread;
+};
+
 
 
 class CCmpAIManager : public ICmpAIManager
@@ -598,7 +787,7 @@ public:
 
 	virtual void StartComputation()
 	{
-		PROFILE("AI setup");
+		PROFILE3("AI setup");
 
 		ForceLoadEntityTemplates();
 
@@ -636,6 +825,9 @@ public:
 
 	virtual void PushCommands()
 	{
+		// (This includes waiting for the AI thread to finish the computation)
+		PROFILE3("AI push commands");
+
 		ScriptInterface& scriptInterface = GetSimContext().GetScriptInterface();
 
 		std::vector<CAIWorker::SCommandSets> commands;
@@ -718,7 +910,7 @@ private:
 		scriptInterface.SetProperty(state.get(), "passabilityClasses", classesVal, true);
 	}
 
-	CAIWorker m_Worker;
+	CAIWorkerThread m_Worker;
 };
 
 REGISTER_COMPONENT_TYPE(AIManager)
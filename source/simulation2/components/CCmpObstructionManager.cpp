@@ -43,6 +43,11 @@
 #define STATIC_INDEX_TO_TAG(idx) tag_t(((idx) << 1) | 1)
 #define TAG_TO_INDEX(tag) ((tag).n >> 1)
 
+// Extra distance by which to expand subdivision lookups in the shape tests,
+// since the fixed-point rotation vectors aren't exactly unit length and so
+// shapes can collide very slightly outside their computed bounding boxes
+#define SHAPE_TEST_MARGIN CFixedVector2D(entity_pos_t::FromInt(1), entity_pos_t::FromInt(1))
+
 /**
  * Internal representation of axis-aligned sometimes-square sometimes-circle shapes for moving units
  */
@@ -119,8 +124,11 @@ public:
 	bool m_DebugOverlayDirty;
 	std::vector<SOverlayLine> m_DebugOverlayLines;
 
-	SpatialSubdivision<u32> m_UnitSubdivision;
-	SpatialSubdivision<u32> m_StaticSubdivision;
+	SpatialLooseGrid<u32> m_UnitSubdivision;
+	SpatialLooseGrid<u32> m_StaticSubdivision;
+	// Results of subdivision queries (reused to avoid allocations)
+	std::vector<u32> m_UnitShapesInRange;
+	std::vector<u32> m_StaticShapesInRange;
 
 	// TODO: using std::map is a bit inefficient; is there a better way to store these?
 	std::map<u32, UnitShape> m_UnitShapes;
@@ -128,6 +136,10 @@ public:
 	u32 m_UnitShapeNext; // next allocated id
 	u32 m_StaticShapeNext;
 
+	// Upper bound on the radius of any unit shape (not serialized; recomputed on
+	// deserialization), used to find units near a static shape through m_UnitSubdivision
+	entity_pos_t m_MaxUnitShapeRadius;
+
 	bool m_PassabilityCircular;
 
 	entity_pos_t m_WorldX0;
@@ -148,7 +160,10 @@ public:
 		m_UnitShapeNext = 1;
 		m_StaticShapeNext = 1;
 
+		m_MaxUnitShapeRadius = entity_pos_t::Zero();
+
 		m_DirtyID = 1; // init to 1 so default-initialised grids are considered dirty
+		m_DirtyAreasBaseID = m_DirtyID;
 
 		m_PassabilityCircular = false;
 
@@ -195,6 +210,9 @@ public:
 		Init(paramNode);
 
 		SerializeCommon(deserialize);
+
+		for (std::map<u32, UnitShape>::iterator it = m_UnitShapes.begin(); it != m_UnitShapes.end(); ++it)
+			m_MaxUnitShapeRadius = std::max(m_MaxUnitShapeRadius, it->second.r);
 	}
 
 	virtual void HandleMessage(const CMessage& msg, bool UNUSED(global))
@@ -250,7 +268,8 @@ public:
 		UnitShape shape = { ent, x, z, r, flags, group };
 		u32 id = m_UnitShapeNext++;
 		m_UnitShapes[id] = shape;
-		MakeDirtyUnit(flags);
+		m_MaxUnitShapeRadius = std::max(m_MaxUnitShapeRadius, r);
+		MakeDirtyUnit(flags, CFixedVector2D(x - r, z - r), CFixedVector2D(x + r, z + r));
 
 		m_UnitSubdivision.Add(id, CFixedVector2D(x - r, z - r), CFixedVector2D(x + r, z + r));
 
@@ -267,12 +286,13 @@ public:
 		StaticShape shape = { ent, x, z, u, v, w/2, h/2, flags };
 		u32 id = m_StaticShapeNext++;
 		m_StaticShapes[id] = shape;
-		MakeDirtyStatic(flags);
 
 		CFixedVector2D center(x, z);
 		CFixedVector2D bbHalfSize = Geometry::GetHalfBoundingBox(u, v, CFixedVector2D(w/2, h/2));
 		m_StaticSubdivision.Add(id, center - bbHalfSize, center + bbHalfSize);
 
+		MakeDirtyStatic(flags, center - bbHalfSize, center + bbHalfSize);
+
 		return STATIC_INDEX_TO_TAG(id);
 	}
 
@@ -309,10 +329,14 @@ public:
 				CFixedVector2D(x - shape.r, z - shape.r),
 				CFixedVector2D(x + shape.r, z + shape.r));
 
+			// Both the old and new positions need to be rasterised again
+			CFixedVector2D dirtyMin(std::min(x, shape.x) - shape.r, std::min(z, shape.z) - shape.r);
+			CFixedVector2D dirtyMax(std::max(x, shape.x) + shape.r, std::max(z, shape.z) + shape.r);
+
 			shape.x = x;
 			shape.z = z;
 
-			MakeDirtyUnit(shape.flags);
+			MakeDirtyUnit(shape.flags, dirtyMin, dirtyMax);
 		}
 		else
 		{
@@ -331,12 +355,19 @@ public:
 				CFixedVector2D(x, z) - toBbHalfSize,
 				CFixedVector2D(x, z) + toBbHalfSize);
 
+			CFixedVector2D dirtyMin(
+				std::min(shape.x - fromBbHalfSize.X, x - toBbHalfSize.X),
+				std::min(shape.z - fromBbHalfSize.Y, z - toBbHalfSize.Y));
+			CFixedVector2D dirtyMax(
+				std::max(shape.x + fromBbHalfSize.X, x + toBbHalfSize.X),
+				std::max(shape.z + fromBbHalfSize.Y, z + toBbHalfSize.Y));
+
 			shape.x = x;
 			shape.z = z;
 			shape.u = u;
 			shape.v = v;
 
-			MakeDirtyStatic(shape.flags);
+			MakeDirtyStatic(shape.flags, dirtyMin, dirtyMax);
 		}
 	}
 
@@ -378,7 +409,9 @@ public:
 				CFixedVector2D(shape.x - shape.r, shape.z - shape.r),
 				CFixedVector2D(shape.x + shape.r, shape.z + shape.r));
 
-			MakeDirtyUnit(shape.flags);
+			MakeDirtyUnit(shape.flags,
+				CFixedVector2D(shape.x - shape.r, shape.z - shape.r),
+				CFixedVector2D(shape.x + shape.r, shape.z + shape.r));
 			m_UnitShapes.erase(TAG_TO_INDEX(tag));
 		}
 		else
@@ -389,7 +422,7 @@ public:
 			CFixedVector2D bbHalfSize = Geometry::GetHalfBoundingBox(shape.u, shape.v, CFixedVector2D(shape.hw, shape.hh));
 			m_StaticSubdivision.Remove(TAG_TO_INDEX(tag), center - bbHalfSize, center + bbHalfSize);
 
-			MakeDirtyStatic(shape.flags);
+			MakeDirtyStatic(shape.flags, center - bbHalfSize, center + bbHalfSize);
 			m_StaticShapes.erase(TAG_TO_INDEX(tag));
 		}
 	}
@@ -418,7 +451,7 @@ public:
 	virtual bool TestStaticShape(const IObstructionTestFilter& filter, entity_pos_t x, entity_pos_t z, entity_pos_t a, entity_pos_t w, entity_pos_t h, std::vector<entity_id_t>* out);
 	virtual bool TestUnitShape(const IObstructionTestFilter& filter, entity_pos_t x, entity_pos_t z, entity_pos_t r, std::vector<entity_id_t>* out);
 
-	virtual bool Rasterise(Grid<u8>& grid);
+	virtual bool Rasterise(Grid<u8>& grid, GridRegion& dirty);
 	virtual void GetObstructionsInRange(const IObstructionTestFilter& filter, entity_pos_t x0, entity_pos_t z0, entity_pos_t x1, entity_pos_t z1, std::vector<ObstructionSquare>& squares);
 	virtual bool FindMostImportantObstruction(const IObstructionTestFilter& filter, entity_pos_t x, entity_pos_t z, entity_pos_t r, ObstructionSquare& square);
 
@@ -445,6 +478,18 @@ private:
 
 	size_t m_DirtyID;
 
+	// To let Rasterise() update only the tiles that have changed, we also remember
+	// the world-space bounds of the shapes affected by each of the most recent
+	// increments of m_DirtyID; m_DirtyAreas[n] is the area changed by increment
+	// number m_DirtyAreasBaseID+n+1. Grids older than m_DirtyAreasBaseID must be
+	// rasterised from scratch.
+	// (Not serialized, since Rasterise()d grids don't survive deserialization either.)
+
+	std::deque<std::pair<CFixedVector2D, CFixedVector2D> > m_DirtyAreas;
+	size_t m_DirtyAreasBaseID;
+
+	static const size_t MAX_DIRTY_AREAS = 64;
+
 	/**
 	 * Mark all previous Rasterise()d grids as dirty, and the debug display.
 	 * Call this when the world bounds have changed.
@@ -452,9 +497,25 @@ private:
 	void MakeDirtyAll()
 	{
 		++m_DirtyID;
+		m_DirtyAreas.clear();
+		m_DirtyAreasBaseID = m_DirtyID;
 		m_DebugOverlayDirty = true;
 	}
 
+	/**
+	 * Increment m_DirtyID, remembering that only the given area has changed.
+	 */
+	void MakeDirtyArea(CFixedVector2D posMin, CFixedVector2D posMax)
+	{
+		++m_DirtyID;
+		m_DirtyAreas.push_back(std::make_pair(posMin, posMax));
+		if (m_DirtyAreas.size() > MAX_DIRTY_AREAS)
+		{
+			m_DirtyAreas.pop_front();
+			++m_DirtyAreasBaseID;
+		}
+	}
+
 	/**
 	 * Mark the debug display as dirty.
 	 * Call this when nothing has changed except a unit's 'moving' flag.
@@ -466,28 +527,35 @@ private:
 
 	/**
 	 * Mark all previous Rasterise()d grids as dirty, if they depend on this shape.
-	 * Call this when a static shape has changed.
+	 * Call this when a static shape has changed, with the bounds of the area it covered
+	 * before and after the change.
 	 */
-	void MakeDirtyStatic(flags_t flags)
+	void MakeDirtyStatic(flags_t flags, CFixedVector2D posMin, CFixedVector2D posMax)
 	{
 		if (flags & (FLAG_BLOCK_PATHFINDING|FLAG_BLOCK_FOUNDATION))
-			++m_DirtyID;
+			MakeDirtyArea(posMin, posMax);
 
 		m_DebugOverlayDirty = true;
 	}
 
 	/**
 	 * Mark all previous Rasterise()d grids as dirty, if they depend on this shape.
-	 * Call this when a unit shape has changed.
+	 * Call this when a unit shape has changed, with the bounds of the area it covered
+	 * before and after the change.
 	 */
-	void MakeDirtyUnit(flags_t flags)
+	void MakeDirtyUnit(flags_t flags, CFixedVector2D posMin, CFixedVector2D posMax)
 	{
 		if (flags & (FLAG_BLOCK_PATHFINDING|FLAG_BLOCK_FOUNDATION))
-			++m_DirtyID;
+			MakeDirtyArea(posMin, posMax);
 
 		m_DebugOverlayDirty = true;
 	}
 
+	/**
+	 * Recompute the given region of a Rasterise()d grid from scratch.
+	 */
+	void RasteriseRegion(Grid<u8>& grid, const GridRegion& region);
+
 	/**
 	 * Test whether a Rasterise()d grid is dirty and needs updating
 	 */
@@ -527,7 +595,8 @@ bool CCmpObstructionManager::TestLine(const IObstructionTestFilter& filter, enti
 	CFixedVector2D posMin (std::min(x0, x1) - r, std::min(z0, z1) - r);
 	CFixedVector2D posMax (std::max(x0, x1) + r, std::max(z0, z1) + r);
 
-	std::vector<u32> unitShapes = m_UnitSubdivision.GetInRange(posMin, posMax);
+	std::vector<u32>& unitShapes = m_UnitShapesInRange;
+	m_UnitSubdivision.GetInRange(unitShapes, posMin, posMax);
 	for (size_t i = 0; i < unitShapes.size(); ++i)
 	{
 		std::map<u32, UnitShape>::iterator it = m_UnitShapes.find(unitShapes[i]);
@@ -542,7 +611,8 @@ bool CCmpObstructionManager::TestLine(const IObstructionTestFilter& filter, enti
 			return true;
 	}
 
-	std::vector<u32> staticShapes = m_StaticSubdivision.GetInRange(posMin, posMax);
+	std::vector<u32>& staticShapes = m_StaticShapesInRange;
+	m_StaticSubdivision.GetInRange(staticShapes, posMin, posMax);
 	for (size_t i = 0; i < staticShapes.size(); ++i)
 	{
 		std::map<u32, StaticShape>::iterator it = m_StaticShapes.find(staticShapes[i]);
@@ -566,8 +636,6 @@ bool CCmpObstructionManager::TestStaticShape(const IObstructionTestFilter& filte
 {
 	PROFILE("TestStaticShape");
 
-	// TODO: should use the subdivision stuff here, if performance is non-negligible
-
 	if (out)
 		out->clear();
 
@@ -590,8 +658,23 @@ bool CCmpObstructionManager::TestStaticShape(const IObstructionTestFilter& filte
 			return true;
 	}
 
-	for (std::map<u32, UnitShape>::iterator it = m_UnitShapes.begin(); it != m_UnitShapes.end(); ++it)
+	// Only shapes whose bounding boxes are near our bounding box can possibly collide.
+	// (The subdivisions return shape IDs in increasing order, so the output is in
+	// the same order as if we tested every shape.)
+	CFixedVector2D bbHalfSize = Geometry::GetHalfBoundingBox(u, v, halfSize);
+
+	// A unit collides if its center is inside our square expanded by its radius.
+	// Depending on our rotation, that can be up to sqrt(2)*r outside our bounding box,
+	// i.e. less than r outside the unit's own bounding box, so expand by the largest
+	// radius (plus a little margin for rounding in u and v)
+	CFixedVector2D unitMargin = CFixedVector2D(m_MaxUnitShapeRadius, m_MaxUnitShapeRadius) + SHAPE_TEST_MARGIN;
+	std::vector<u32>& unitShapes = m_UnitShapesInRange;
+	m_UnitSubdivision.GetInRange(unitShapes, center - bbHalfSize - unitMargin, center + bbHalfSize + unitMargin);
+	for (size_t i = 0; i < unitShapes.size(); ++i)
 	{
+		std::map<u32, UnitShape>::iterator it = m_UnitShapes.find(unitShapes[i]);
+		ENSURE(it != m_UnitShapes.end());
+
 		if (!filter.Allowed(UNIT_INDEX_TO_TAG(it->first), it->second.flags, it->second.group))
 			continue;
 
@@ -606,8 +689,13 @@ bool CCmpObstructionManager::TestStaticShape(const IObstructionTestFilter& filte
 		}
 	}
 
-	for (std::map<u32, StaticShape>::iterator it = m_StaticShapes.begin(); it != m_StaticShapes.end(); ++it)
+	std::vector<u32>& staticShapes = m_StaticShapesInRange;
+	m_StaticSubdivision.GetInRange(staticShapes, center - bbHalfSize - SHAPE_TEST_MARGIN, center + bbHalfSize + SHAPE_TEST_MARGIN);
+	for (size_t i = 0; i < staticShapes.size(); ++i)
 	{
+		std::map<u32, StaticShape>::iterator it = m_StaticShapes.find(staticShapes[i]);
+		ENSURE(it != m_StaticShapes.end());
+
 		if (!filter.Allowed(STATIC_INDEX_TO_TAG(it->first), it->second.flags, INVALID_ENTITY))
 			continue;
 
@@ -634,8 +722,6 @@ bool CCmpObstructionManager::TestUnitShape(const IObstructionTestFilter& filter,
 {
 	PROFILE("TestUnitShape");
 
-	// TODO: should use the subdivision stuff here, if performance is non-negligible
-
 	// Check that the shape is within the world
 	if (!IsInWorld(x, z, r))
 	{
@@ -647,8 +733,17 @@ bool CCmpObstructionManager::TestUnitShape(const IObstructionTestFilter& filter,
 
 	CFixedVector2D center(x, z);
 
-	for (std::map<u32, UnitShape>::iterator it = m_UnitShapes.begin(); it != m_UnitShapes.end(); ++it)
+	// Only shapes whose bounding boxes are near our bounding box can possibly collide.
+	// (The subdivisions return shape IDs in increasing order, so the output is in
+	// the same order as if we tested every shape.)
+
+	std::vector<u32>& unitShapes = m_UnitShapesInRange;
+	m_UnitSubdivision.GetInRange(unitShapes, CFixedVector2D(x - r, z - r), CFixedVector2D(x + r, z + r));
+	for (size_t i = 0; i < unitShapes.size(); ++i)
 	{
+		std::map<u32, UnitShape>::iterator it = m_UnitShapes.find(unitShapes[i]);
+		ENSURE(it != m_UnitShapes.end());
+
 		if (!filter.Allowed(UNIT_INDEX_TO_TAG(it->first), it->second.flags, it->second.group))
 			continue;
 
@@ -663,8 +758,17 @@ bool CCmpObstructionManager::TestUnitShape(const IObstructionTestFilter& filter,
 		}
 	}
 
-	for (std::map<u32, StaticShape>::iterator it = m_StaticShapes.begin(); it != m_StaticShapes.end(); ++it)
+	// A static shape collides if our center is inside it when expanded by our radius,
+	// which can be up to sqrt(2)*r outside its bounding box depending on its rotation
+	// (plus a little margin for rounding in u and v)
+	CFixedVector2D staticMargin = CFixedVector2D(r*2, r*2) + SHAPE_TEST_MARGIN;
+	std::vector<u32>& staticShapes = m_StaticShapesInRange;
+	m_StaticSubdivision.GetInRange(staticShapes, center - staticMargin, center + staticMargin);
+	for (size_t i = 0; i < staticShapes.size(); ++i)
 	{
+		std::map<u32, StaticShape>::iterator it = m_StaticShapes.find(staticShapes[i]);
+		ENSURE(it != m_StaticShapes.end());
+
 		if (!filter.Allowed(STATIC_INDEX_TO_TAG(it->first), it->second.flags, INVALID_ENTITY))
 			continue;
 
@@ -703,106 +807,176 @@ static void TileCenter(u16 i, u16 j, entity_pos_t& x, entity_pos_t& z)
 	z = entity_pos_t::FromInt(j*(int)TERRAIN_TILE_SIZE + (int)TERRAIN_TILE_SIZE/2);
 }
 
-bool CCmpObstructionManager::Rasterise(Grid<u8>& grid)
+// For tile-based pathfinding:
+// Since we only count tiles whose centers are inside the square,
+// we maybe want to expand the square a bit so we're less likely to think there's
+// free space between buildings when there isn't. But this is just a random guess
+// and needs to be tweaked until everything works nicely.
+//return entity_pos_t::FromInt(TERRAIN_TILE_SIZE / 2);
+// Actually that's bad because units get stuck when the A* pathfinder thinks they're
+// blocked on all sides, so it's better to underestimate
+static entity_pos_t GetPathfindingExpansion()
+{
+	return entity_pos_t::FromInt(0);
+}
+
+// For AI building foundation planning, we want to definitely block all
+// potentially-obstructed tiles (so we don't blindly build on top of an obstruction),
+// so we need to expand by at least 1/sqrt(2) of a tile
+static entity_pos_t GetFoundationExpansion()
+{
+	return (entity_pos_t::FromInt(TERRAIN_TILE_SIZE) * 3) / 4;
+}
+
+bool CCmpObstructionManager::Rasterise(Grid<u8>& grid, GridRegion& dirty)
 {
+	dirty = GridRegion();
+
 	if (!IsDirty(grid))
 		return false;
 
 	PROFILE("Rasterise");
 
+	if (grid.m_DirtyID < m_DirtyAreasBaseID)
+	{
+		// We don't know what changed since the grid was last updated,
+		// so recompute all of it
+		dirty = GridRegion::All(grid.m_W, grid.m_H);
+	}
+	else
+	{
+		// Only the tiles covered by the changed shapes (before or after they changed)
+		// need updating. Expanding a rotated shape grows its bounding box by up to
+		// sqrt(2) times the expansion, so be conservative.
+		entity_pos_t expand = GetFoundationExpansion() * 2;
+		for (size_t n = grid.m_DirtyID - m_DirtyAreasBaseID; n < m_DirtyAreas.size(); ++n)
+		{
+			u16 i0, j0, i1, j1;
+			NearestTile(m_DirtyAreas[n].first.X - expand, m_DirtyAreas[n].first.Y - expand, i0, j0, grid.m_W, grid.m_H);
+			NearestTile(m_DirtyAreas[n].second.X + expand, m_DirtyAreas[n].second.Y + expand, i1, j1, grid.m_W, grid.m_H);
+			dirty.Add(GridRegion(i0, j0, i1, j1));
+		}
+	}
+
 	grid.m_DirtyID = m_DirtyID;
 
-	// TODO: this is all hopelessly inefficient
-	// What we should perhaps do is have some kind of quadtree storing Shapes so it's
-	// quick to invalidate and update small numbers of tiles
+	if (!dirty.IsEmpty())
+		RasteriseRegion(grid, dirty);
 
-	grid.reset();
+	return true;
+}
 
-	// For tile-based pathfinding:
-	// Since we only count tiles whose centers are inside the square,
-	// we maybe want to expand the square a bit so we're less likely to think there's
-	// free space between buildings when there isn't. But this is just a random guess
-	// and needs to be tweaked until everything works nicely.
-	//entity_pos_t expandPathfinding = entity_pos_t::FromInt(TERRAIN_TILE_SIZE / 2);
-	// Actually that's bad because units get stuck when the A* pathfinder thinks they're
-	// blocked on all sides, so it's better to underestimate
-	entity_pos_t expandPathfinding = entity_pos_t::FromInt(0);
+void CCmpObstructionManager::RasteriseRegion(Grid<u8>& grid, const GridRegion& region)
+{
+	for (u16 j = region.j0; j <= region.j1; ++j)
+		for (u16 i = region.i0; i <= region.i1; ++i)
+			grid.set(i, j, 0);
 
-	// For AI building foundation planning, we want to definitely block all
-	// potentially-obstructed tiles (so we don't blindly build on top of an obstruction),
-	// so we need to expand by at least 1/sqrt(2) of a tile
-	entity_pos_t expandFoundation = (entity_pos_t::FromInt(TERRAIN_TILE_SIZE) * 3) / 4;
+	entity_pos_t expandPathfinding = GetPathfindingExpansion();
+	entity_pos_t expandFoundation = GetFoundationExpansion();
 
-	for (std::map<u32, StaticShape>::iterator it = m_StaticShapes.begin(); it != m_StaticShapes.end(); ++it)
+	// Find the shapes that might cover any tile in the region
+	if (region.Covers(grid.m_W, grid.m_H))
 	{
-		CFixedVector2D center(it->second.x, it->second.z);
+		m_StaticShapesInRange.clear();
+		for (std::map<u32, StaticShape>::iterator it = m_StaticShapes.begin(); it != m_StaticShapes.end(); ++it)
+			m_StaticShapesInRange.push_back(it->first);
 
-		if (it->second.flags & FLAG_BLOCK_PATHFINDING)
+		m_UnitShapesInRange.clear();
+		for (std::map<u32, UnitShape>::iterator it = m_UnitShapes.begin(); it != m_UnitShapes.end(); ++it)
+			m_UnitShapesInRange.push_back(it->first);
+	}
+	else
+	{
+		// A shape can only cover a tile if its expanded bounds overlap the tile.
+		// (Shapes outside the world can cover its edge tiles, but those get
+		// overwritten by the edge flags below, and the subdivisions keep such
+		// shapes near the edge anyway.)
+		CFixedVector2D posMin(
+			entity_pos_t::FromInt(region.i0 * (int)TERRAIN_TILE_SIZE) - expandFoundation,
+			entity_pos_t::FromInt(region.j0 * (int)TERRAIN_TILE_SIZE) - expandFoundation);
+		CFixedVector2D posMax(
+			entity_pos_t::FromInt((region.i1 + 1) * (int)TERRAIN_TILE_SIZE) + expandFoundation,
+			entity_pos_t::FromInt((region.j1 + 1) * (int)TERRAIN_TILE_SIZE) + expandFoundation);
+
+		m_StaticSubdivision.GetInRange(m_StaticShapesInRange, posMin, posMax);
+		m_UnitSubdivision.GetInRange(m_UnitShapesInRange, posMin, posMax);
+	}
+
+	for (size_t n = 0; n < m_StaticShapesInRange.size(); ++n)
+	{
+		const StaticShape& shape = m_StaticShapes[m_StaticShapesInRange[n]];
+
+		CFixedVector2D center(shape.x, shape.z);
+
+		if (shape.flags & FLAG_BLOCK_PATHFINDING)
 		{
-			CFixedVector2D halfSize(it->second.hw + expandPathfinding, it->second.hh + expandPathfinding);
-			CFixedVector2D halfBound = Geometry::GetHalfBoundingBox(it->second.u, it->second.v, halfSize);
+			CFixedVector2D halfSize(shape.hw + expandPathfinding, shape.hh + expandPathfinding);
+			CFixedVector2D halfBound = Geometry::GetHalfBoundingBox(shape.u, shape.v, halfSize);
 
 			u16 i0, j0, i1, j1;
 			NearestTile(center.X - halfBound.X, center.Y - halfBound.Y, i0, j0, grid.m_W, grid.m_H);
 			NearestTile(center.X + halfBound.X, center.Y + halfBound.Y, i1, j1, grid.m_W, grid.m_H);
-			for (u16 j = j0; j <= j1; ++j)
+			for (u16 j = std::max(j0, region.j0); j <= std::min(j1, region.j1); ++j)
 			{
-				for (u16 i = i0; i <= i1; ++i)
+				for (u16 i = std::max(i0, region.i0); i <= std::min(i1, region.i1); ++i)
 				{
 					entity_pos_t x, z;
 					TileCenter(i, j, x, z);
-					if (Geometry::PointIsInSquare(CFixedVector2D(x, z) - center, it->second.u, it->second.v, halfSize))
+					if (Geometry::PointIsInSquare(CFixedVector2D(x, z) - center, shape.u, shape.v, halfSize))
 						grid.set(i, j, grid.get(i, j) | TILE_OBSTRUCTED_PATHFINDING);
 				}
 			}
 		}
 
-		if (it->second.flags & FLAG_BLOCK_FOUNDATION)
+		if (shape.flags & FLAG_BLOCK_FOUNDATION)
 		{
-			CFixedVector2D halfSize(it->second.hw + expandFoundation, it->second.hh + expandFoundation);
-			CFixedVector2D halfBound = Geometry::GetHalfBoundingBox(it->second.u, it->second.v, halfSize);
+			CFixedVector2D halfSize(shape.hw + expandFoundation, shape.hh + expandFoundation);
+			CFixedVector2D halfBound = Geometry::GetHalfBoundingBox(shape.u, shape.v, halfSize);
 
 			u16 i0, j0, i1, j1;
 			NearestTile(center.X - halfBound.X, center.Y - halfBound.Y, i0, j0, grid.m_W, grid.m_H);
 			NearestTile(center.X + halfBound.X, center.Y + halfBound.Y, i1, j1, grid.m_W, grid.m_H);
-			for (u16 j = j0; j <= j1; ++j)
+			for (u16 j = std::max(j0, region.j0); j <= std::min(j1, region.j1); ++j)
 			{
-				for (u16 i = i0; i <= i1; ++i)
+				for (u16 i = std::max(i0, region.i0); i <= std::min(i1, region.i1); ++i)
 				{
 					entity_pos_t x, z;
 					TileCenter(i, j, x, z);
-					if (Geometry::PointIsInSquare(CFixedVector2D(x, z) - center, it->second.u, it->second.v, halfSize))
+					if (Geometry::PointIsInSquare(CFixedVector2D(x, z) - center, shape.u, shape.v, halfSize))
 						grid.set(i, j, grid.get(i, j) | TILE_OBSTRUCTED_FOUNDATION);
 				}
 			}
 		}
 	}
 
-	for (std::map<u32, UnitShape>::iterator it = m_UnitShapes.begin(); it != m_UnitShapes.end(); ++it)
+	for (size_t n = 0; n < m_UnitShapesInRange.size(); ++n)
 	{
-		CFixedVector2D center(it->second.x, it->second.z);
+		const UnitShape& shape = m_UnitShapes[m_UnitShapesInRange[n]];
 
-		if (it->second.flags & FLAG_BLOCK_PATHFINDING)
+		CFixedVector2D center(shape.x, shape.z);
+
+		if (shape.flags & FLAG_BLOCK_PATHFINDING)
 		{
-			entity_pos_t r = it->second.r + expandPathfinding;
+			entity_pos_t r = shape.r + expandPathfinding;
 
 			u16 i0, j0, i1, j1;
 			NearestTile(center.X - r, center.Y - r, i0, j0, grid.m_W, grid.m_H);
 			NearestTile(center.X + r, center.Y + r, i1, j1, grid.m_W, grid.m_H);
-			for (u16 j = j0; j <= j1; ++j)
-				for (u16 i = i0; i <= i1; ++i)
+			for (u16 j = std::max(j0, region.j0); j <= std::min(j1, region.j1); ++j)
+				for (u16 i = std::max(i0, region.i0); i <= std::min(i1, region.i1); ++i)
 					grid.set(i, j, grid.get(i, j) | TILE_OBSTRUCTED_PATHFINDING);
 		}
 
-		if (it->second.flags & FLAG_BLOCK_FOUNDATION)
+		if (shape.flags & FLAG_BLOCK_FOUNDATION)
 		{
-			entity_pos_t r = it->second.r + expandFoundation;
+			entity_pos_t r = shape.r + expandFoundation;
 
 			u16 i0, j0, i1, j1;
 			NearestTile(center.X - r, center.Y - r, i0, j0, grid.m_W, grid.m_H);
 			NearestTile(center.X + r, center.Y + r, i1, j1, grid.m_W, grid.m_H);
-			for (u16 j = j0; j <= j1; ++j)
-				for (u16 i = i0; i <= i1; ++i)
+			for (u16 j = std::max(j0, region.j0); j <= std::min(j1, region.j1); ++j)
+				for (u16 i = std::max(i0, region.i0); i <= std::min(i1, region.i1); ++i)
 					grid.set(i, j, grid.get(i, j) | TILE_OBSTRUCTED_FOUNDATION);
 		}
 	}
@@ -816,9 +990,9 @@ bool CCmpObstructionManager::Rasterise(Grid<u8>& grid)
 
 	if (m_PassabilityCircular)
 	{
-		for (u16 j = 0; j < grid.m_H; ++j)
+		for (u16 j = region.j0; j <= region.j1; ++j)
 		{
-			for (u16 i = 0; i < grid.m_W; ++i)
+			for (u16 i = region.i0; i <= region.i1; ++i)
 			{
 				// Based on CCmpRangeManager::LosIsOffWorld
 				// but tweaked since it's tile-based instead.
@@ -840,21 +1014,11 @@ bool CCmpObstructionManager::Rasterise(Grid<u8>& grid)
 		NearestTile(m_WorldX0, m_WorldZ0, i0, j0, grid.m_W, grid.m_H);
 		NearestTile(m_WorldX1, m_WorldZ1, i1, j1, grid.m_W, grid.m_H);
 
-		for (u16 j = 0; j < grid.m_H; ++j)
-			for (u16 i = 0; i < i0+edgeSize; ++i)
-				grid.set(i, j, edgeFlags);
-		for (u16 j = 0; j < grid.m_H; ++j)
-			for (u16 i = (u16)(i1-edgeSize+1); i < grid.m_W; ++i)
-				grid.set(i, j, edgeFlags);
-		for (u16 j = 0; j < j0+edgeSize; ++j)
-			for (u16 i = (u16)(i0+edgeSize); i < i1-edgeSize+1; ++i)
-				grid.set(i, j, edgeFlags);
-		for (u16 j = (u16)(j1-edgeSize+1); j < grid.m_H; ++j)
-			for (u16 i = (u16)(i0+edgeSize); i < i1-edgeSize+1; ++i)
-				grid.set(i, j, edgeFlags);
+		for (u16 j = region.j0; j <= region.j1; ++j)
+			for (u16 i = region.i0; i <= region.i1; ++i)
+				if (i < i0+edgeSize || i > i1-edgeSize || j < j0+edgeSize || j > j1-edgeSize)
+					grid.set(i, j, edgeFlags);
 	}
-
-	return true;
 }
 
 void CCmpObstructionManager::GetObstructionsInRange(const IObstructionTestFilter& filter, entity_pos_t x0, entity_pos_t z0, entity_pos_t x1, entity_pos_t z1, std::vector<ObstructionSquare>& squares)
@@ -863,7 +1027,8 @@ void CCmpObstructionManager::GetObstructionsInRange(const IObstructionTestFilter
 
 	ENSURE(x0 <= x1 && z0 <= z1);
 
-	std::vector<u32> unitShapes = m_UnitSubdivision.GetInRange(CFixedVector2D(x0, z0), CFixedVector2D(x1, z1));
+	std::vector<u32>& unitShapes = m_UnitShapesInRange;
+	m_UnitSubdivision.GetInRange(unitShapes, CFixedVector2D(x0, z0), CFixedVector2D(x1, z1));
 	for (size_t i = 0; i < unitShapes.size(); ++i)
 	{
 		std::map<u32, UnitShape>::iterator it = m_UnitShapes.find(unitShapes[i]);
@@ -884,7 +1049,8 @@ void CCmpObstructionManager::GetObstructionsInRange(const IObstructionTestFilter
 		squares.push_back(s);
 	}
 
-	std::vector<u32> staticShapes = m_StaticSubdivision.GetInRange(CFixedVector2D(x0, z0), CFixedVector2D(x1, z1));
+	std::vector<u32>& staticShapes = m_StaticShapesInRange;
+	m_StaticSubdivision.GetInRange(staticShapes, CFixedVector2D(x0, z0), CFixedVector2D(x1, z1));
 	for (size_t i = 0; i < staticShapes.size(); ++i)
 	{
 		std::map<u32, StaticShape>::iterator it = m_StaticShapes.find(staticShapes[i]);
@@ -1,4 +1,4 @@
-/* Copyright (C) 2011 Wildfire Games.
+/* Copyright (C) 2012 Wildfire Games.
  * This file is part of 0 A.D.
  *
  * 0 A.D. is free software: you can redistribute it and/or modify
@@ -27,6 +27,7 @@
 #include "ps/CLogger.h"
 #include "ps/CStr.h"
 #include "ps/Profile.h"
+#include "ps/WorkerPool.h"
 #include "renderer/Scene.h"
 #include "simulation2/MessageTypes.h"
 #include "simulation2/components/ICmpObstruction.h"
@@ -48,6 +49,8 @@ void CCmpPathfinder::Init(const CParamNode& UNUSED(paramNode))
 	m_Grid = NULL;
 	m_ObstructionGrid = NULL;
 	m_TerrainDirty = true;
+	m_UseHierarchicalPathfinder = true;
+	m_Workers = NULL;
 	m_NextAsyncTicket = 1;
 
 	m_DebugOverlay = NULL;
@@ -154,6 +157,8 @@ void CCmpPathfinder::Deinit()
 
 	delete m_Grid;
 	delete m_ObstructionGrid;
+
+	delete m_Workers;
 }
 
 struct SerializeLongRequest
@@ -219,7 +224,22 @@ void CCmpPathfinder::HandleMessage(const CMessage& msg, bool UNUSED(global))
 	}
 	case MT_TerrainChanged:
 	{
-		// TODO: we ought to only bother updating the dirtied region
+		const CMessageTerrainChanged& msgData = static_cast<const CMessageTerrainChanged&> (msg);
+
+		// (If there's no grid yet, it'll be computed from scratch when needed)
+		if (!m_Grid || msgData.i0 >= msgData.i1 || msgData.j0 >= msgData.j1)
+			break;
+
+		// The message gives a range of vertexes, and each tile depends on the
+		// vertexes at its corners, so the tiles on both sides of it are affected
+		m_TerrainDirtyRegion.Add(GridRegion(
+			(u16)clamp(msgData.i0 - 1, 0, m_MapSize-1), (u16)clamp(msgData.j0 - 1, 0, m_MapSize-1),
+			(u16)clamp(msgData.i1, 0, m_MapSize-1), (u16)clamp(msgData.j1, 0, m_MapSize-1)));
+		break;
+	}
+	case MT_WaterChanged:
+	{
+		// Any tile might have gone above or below the water, so recompute everything
 		m_TerrainDirty = true;
 		break;
 	}
@@ -316,6 +336,7 @@ void CCmpPathfinder::UpdateGrid()
 		SAFE_DELETE(m_Grid);
 		SAFE_DELETE(m_ObstructionGrid);
 		m_TerrainDirty = true;
+		m_TerrainDirtyRegion = GridRegion();
 	}
 
 	// Initialise the terrain data when first needed
@@ -328,26 +349,67 @@ void CCmpPathfinder::UpdateGrid()
 
 	CmpPtr<ICmpObstructionManager> cmpObstructionManager(GetSimContext(), SYSTEM_ENTITY);
 
-	bool obstructionsDirty = cmpObstructionManager->Rasterise(*m_ObstructionGrid);
+	GridRegion obstructionsDirty;
+	cmpObstructionManager->Rasterise(*m_ObstructionGrid, obstructionsDirty);
+
+	// Changing a tile's terrain can change whether it's underwater, and therefore which
+	// tiles next to it are shore tiles, and therefore the shore distances of land tiles
+	// around it. Passability only depends on shore distances up to shoreLimit, so we
+	// need to update the tiles up to shoreLimit+1 away from the changed terrain.
+	int shoreLimit = 0;
+	for (size_t n = 0; n < m_PassClasses.size(); ++n)
+		shoreLimit = std::max(shoreLimit, m_PassClasses[n].GetShoreDistanceLimit());
+
+	GridRegion terrainDirty = m_TerrainDirtyRegion.Expanded(shoreLimit + 1, m_MapSize, m_MapSize);
+
+	if (m_TerrainDirty || terrainDirty.Covers(m_MapSize, m_MapSize) || obstructionsDirty.Covers(m_MapSize, m_MapSize))
+	{
+		PROFILE("UpdateGrid full");
+
+		// Everything might have changed (e.g. a new map was loaded, or the world bounds
+		// changed and moved TILE_OUTOFBOUNDS) - recompute the whole grid
+
+		UpdateGridRegion(GridRegion::All(m_MapSize, m_MapSize), shoreLimit, NULL);
+		m_TerrainEdgeCaches.clear();
+
+		std::vector<pass_class_t> passClasses;
+		for (size_t n = 0; n < m_PassClasses.size(); ++n)
+			passClasses.push_back(m_PassClasses[n].m_Mask);
+		m_HierPathfinder.Recompute(*m_Grid, passClasses);
+	}
+	else if (!terrainDirty.IsEmpty())
+	{
+		PROFILE("UpdateGrid terrain");
+
+		// Part of the terrain changed (and maybe some obstructions too) - recompute
+		// every tile in the affected region
+
+		GridRegion region = terrainDirty;
+		region.Add(obstructionsDirty);
 
-	if (obstructionsDirty && !m_TerrainDirty)
+		Grid<u8> dirtyChunks(m_HierPathfinder.GetChunksW(), m_HierPathfinder.GetChunksH());
+		UpdateGridRegion(region, shoreLimit, &dirtyChunks);
+		m_HierPathfinder.Update(*m_Grid, dirtyChunks);
+		InvalidateTerrainEdges(region);
+	}
+	else if (!obstructionsDirty.IsEmpty())
 	{
 		PROFILE("UpdateGrid obstructions");
 
 		// Obstructions changed - we need to recompute passability
 		// Since terrain hasn't changed we only need to update the obstruction bits
-		// and can skip the rest of the data
+		// of the re-rasterised tiles and can skip the rest of the data
+		// (including m_TerrainEdgeCaches, which don't depend on those bits)
 
-		// TODO: if ObstructionManager::SetPassabilityCircular was called at runtime
-		// (which should probably never happen, but that's not guaranteed),
-		// then TILE_OUTOFBOUNDS will change and we can't use this fast path, but
-		// currently it'll just set obstructionsDirty and we won't notice
+		// Remember which chunks of the hierarchical pathfinder need updating
+		Grid<u8> dirtyChunks(m_HierPathfinder.GetChunksW(), m_HierPathfinder.GetChunksH());
 
-		for (u16 j = 0; j < m_MapSize; ++j)
+		for (u16 j = obstructionsDirty.j0; j <= obstructionsDirty.j1; ++j)
 		{
-			for (u16 i = 0; i < m_MapSize; ++i)
+			for (u16 i = obstructionsDirty.i0; i <= obstructionsDirty.i1; ++i)
 			{
 				TerrainTile& t = m_Grid->get(i, j);
+				TerrainTile old = t;
 
 				u8 obstruct = m_ObstructionGrid->get(i, j);
 
@@ -360,185 +422,285 @@ void CCmpPathfinder::UpdateGrid()
 					t |= 2;
 				else
 					t &= (TerrainTile)~2;
+
+				// (Only the pathfinding obstruction bit affects passability)
+				if ((t ^ old) & 1)
+					dirtyChunks.set(i / HierarchicalPathfinder::CHUNK_SIZE, j / HierarchicalPathfinder::CHUNK_SIZE, 1);
 			}
 		}
 
-		++m_Grid->m_DirtyID;
+		m_HierPathfinder.Update(*m_Grid, dirtyChunks);
 	}
-	else if (obstructionsDirty || m_TerrainDirty)
+	else
 	{
-		PROFILE("UpdateGrid full");
+		// Nothing changed
+		return;
+	}
+
+	m_TerrainDirty = false;
+	m_TerrainDirtyRegion = GridRegion();
+
+	++m_Grid->m_DirtyID;
+}
 
-		// Obstructions or terrain changed - we need to recompute passability
-		// TODO: only bother recomputing the region that has actually changed
+void CCmpPathfinder::UpdateGridRegion(const GridRegion& region, int shoreLimit, Grid<u8>* dirtyChunks)
+{
+	CmpPtr<ICmpWaterManager> cmpWaterMan(GetSimContext(), SYSTEM_ENTITY);
 
-		CmpPtr<ICmpWaterManager> cmpWaterMan(GetSimContext(), SYSTEM_ENTITY);
+	// TOOD: these bits should come from ICmpTerrain
+	CTerrain& terrain = GetSimContext().GetTerrain();
 
-		// TOOD: these bits should come from ICmpTerrain
-		CTerrain& terrain = GetSimContext().GetTerrain();
+	// The shore distances that affect passability only depend on tiles up to
+	// shoreLimit away, so we don't need to look any further than that
+	GridRegion window = region.Expanded(shoreLimit, m_MapSize, m_MapSize);
+	Grid<u16> shoreGrid(window.i1 - window.i0 + 1, window.j1 - window.j0 + 1);
+	ComputeShoreGrid(window, shoreGrid);
 
-		// avoid integer overflow in intermediate calculation
-		const u16 shoreMax = 32767;
-		
-		// First pass - find underwater tiles
-		Grid<bool> waterGrid(m_MapSize, m_MapSize);
-		for (u16 j = 0; j < m_MapSize; ++j)
+	// Apply passability classes to terrain
+	for (u16 j = region.j0; j <= region.j1; ++j)
+	{
+		for (u16 i = region.i0; i <= region.i1; ++i)
 		{
-			for (u16 i = 0; i < m_MapSize; ++i)
+			fixed x, z;
+			TileCenter(i, j, x, z);
+
+			TerrainTile t = 0;
+
+			u8 obstruct = m_ObstructionGrid->get(i, j);
+
+			fixed height = terrain.GetExactGroundLevelFixed(x, z);
+
+			fixed water;
+			if (!cmpWaterMan.null())
+				water = cmpWaterMan->GetWaterLevel(x, z);
+
+			fixed depth = water - height;
+
+			fixed slope = terrain.GetSlopeFixed(i, j);
+
+			fixed shoredist = fixed::FromInt(shoreGrid.get(i - window.i0, j - window.j0));
+
+			if (obstruct & ICmpObstructionManager::TILE_OBSTRUCTED_PATHFINDING)
+				t |= 1;
+
+			if (obstruct & ICmpObstructionManager::TILE_OBSTRUCTED_FOUNDATION)
+				t |= 2;
+
+			if (obstruct & ICmpObstructionManager::TILE_OUTOFBOUNDS)
 			{
-				fixed x, z;
-				TileCenter(i, j, x, z);
-				
-				bool underWater = !cmpWaterMan.null() && (cmpWaterMan->GetWaterLevel(x, z) > terrain.GetExactGroundLevelFixed(x, z));
-				waterGrid.set(i, j, underWater);
+				// If out of bounds, nobody is allowed to pass
+				for (size_t n = 0; n < m_PassClasses.size(); ++n)
+					t |= m_PassClasses[n].m_Mask;
 			}
-		}
-		// Second pass - find shore tiles
-		Grid<u16> shoreGrid(m_MapSize, m_MapSize);
-		for (u16 j = 0; j < m_MapSize; ++j)
-		{
-			for (u16 i = 0; i < m_MapSize; ++i)
+			else
 			{
-				// Find a land tile
-				if (!waterGrid.get(i, j))
+				for (size_t n = 0; n < m_PassClasses.size(); ++n)
 				{
-					if ((i > 0 && waterGrid.get(i-1, j)) || (i > 0 && j < m_MapSize-1 && waterGrid.get(i-1, j+1)) || (i > 0 && j > 0 && waterGrid.get(i-1, j-1))
-						|| (i < m_MapSize-1 && waterGrid.get(i+1, j)) || (i < m_MapSize-1 && j < m_MapSize-1 && waterGrid.get(i+1, j+1)) || (i < m_MapSize-1 && j > 0 && waterGrid.get(i+1, j-1))
-						|| (j > 0 && waterGrid.get(i, j-1)) || (j < m_MapSize-1 && waterGrid.get(i, j+1))
-						)
-					{	// If it's bordered by water, it's a shore tile
-						shoreGrid.set(i, j, 0);
-					}
-					else
-					{
-						shoreGrid.set(i, j, shoreMax);
-					}
+					if (!m_PassClasses[n].IsPassable(depth, slope, shoredist))
+						t |= m_PassClasses[n].m_Mask;
 				}
 			}
+
+			std::string moveClass = terrain.GetMovementClass(i, j);
+			if (m_TerrainCostClassTags.find(moveClass) != m_TerrainCostClassTags.end())
+				t |= COST_CLASS_MASK(m_TerrainCostClassTags[moveClass]);
+
+			// (The foundation obstruction bit doesn't affect passability)
+			if (dirtyChunks && ((t ^ m_Grid->get(i, j)) & ~2))
+				dirtyChunks->set(i / HierarchicalPathfinder::CHUNK_SIZE, j / HierarchicalPathfinder::CHUNK_SIZE, 1);
+
+			m_Grid->set(i, j, t);
 		}
+	}
+}
+
+void CCmpPathfinder::ComputeShoreGrid(const GridRegion& window, Grid<u16>& shoreGrid)
+{
+	ENSURE(shoreGrid.m_W == window.i1 - window.i0 + 1 && shoreGrid.m_H == window.j1 - window.j0 + 1);
 
-		// Expand influences on land to find shore distance
-		for (u16 y = 0; y < m_MapSize; ++y)
+	CmpPtr<ICmpWaterManager> cmpWaterMan(GetSimContext(), SYSTEM_ENTITY);
+
+	CTerrain& terrain = GetSimContext().GetTerrain();
+
+	// avoid integer overflow in intermediate calculation
+	const u16 shoreMax = 32767;
+
+	// First pass - find underwater tiles
+	// (including the ones just outside the window, since they determine which
+	// tiles in the window are shore tiles)
+	GridRegion waterWindow = window.Expanded(1, m_MapSize, m_MapSize);
+	Grid<bool> waterGrid(waterWindow.i1 - waterWindow.i0 + 1, waterWindow.j1 - waterWindow.j0 + 1);
+	for (u16 j = waterWindow.j0; j <= waterWindow.j1; ++j)
+	{
+		for (u16 i = waterWindow.i0; i <= waterWindow.i1; ++i)
 		{
-			u16 min = shoreMax;
-			for (u16 x = 0; x < m_MapSize; ++x)
-			{
-				if (!waterGrid.get(x, y))
-				{
-					u16 g = shoreGrid.get(x, y);
-					if (g > min)
-						shoreGrid.set(x, y, min);
-					else if (g < min)
-						min = g;
+			fixed x, z;
+			TileCenter(i, j, x, z);
 
-					++min;
-				}
+			bool underWater = !cmpWaterMan.null() && (cmpWaterMan->GetWaterLevel(x, z) > terrain.GetExactGroundLevelFixed(x, z));
+			waterGrid.set(i - waterWindow.i0, j - waterWindow.j0, underWater);
+		}
+	}
+
+	// Offset of the window inside waterGrid
+	const u16 di = window.i0 - waterWindow.i0;
+	const u16 dj = window.j0 - waterWindow.j0;
+
+	const u16 w = shoreGrid.m_W;
+	const u16 h = shoreGrid.m_H;
+
+	// Second pass - find shore tiles
+	for (u16 j = 0; j < h; ++j)
+	{
+		for (u16 i = 0; i < w; ++i)
+		{
+			// Find a land tile
+			if (!waterGrid.get(i+di, j+dj))
+			{
+				// If it's bordered by water, it's a shore tile
+				bool shore = false;
+				for (int nj = j+dj-1; nj <= j+dj+1; ++nj)
+					for (int ni = i+di-1; ni <= i+di+1; ++ni)
+						if (0 <= ni && ni < waterGrid.m_W && 0 <= nj && nj < waterGrid.m_H && waterGrid.get(ni, nj))
+							shore = true;
+
+				shoreGrid.set(i, j, shore ? 0 : shoreMax);
 			}
-			for (u16 x = m_MapSize; x > 0; --x)
+		}
+	}
+
+	// Expand influences on land to find shore distance
+	for (u16 y = 0; y < h; ++y)
+	{
+		u16 min = shoreMax;
+		for (u16 x = 0; x < w; ++x)
+		{
+			if (!waterGrid.get(x+di, y+dj))
 			{
-				if (!waterGrid.get(x-1, y))
-				{
-					u16 g = shoreGrid.get(x-1, y);
-					if (g > min)
-						shoreGrid.set(x-1, y, min);
-					else if (g < min)
-						min = g;
+				u16 g = shoreGrid.get(x, y);
+				if (g > min)
+					shoreGrid.set(x, y, min);
+				else if (g < min)
+					min = g;
 
-					++min;
-				}
+				++min;
 			}
 		}
-		for (u16 x = 0; x < m_MapSize; ++x)
+		for (u16 x = w; x > 0; --x)
 		{
-			u16 min = shoreMax;
-			for (u16 y = 0; y < m_MapSize; ++y)
+			if (!waterGrid.get(x-1+di, y+dj))
 			{
-				if (!waterGrid.get(x, y))
-				{
-					u16 g = shoreGrid.get(x, y);
-					if (g > min)
-						shoreGrid.set(x, y, min);
-					else if (g < min)
-						min = g;
+				u16 g = shoreGrid.get(x-1, y);
+				if (g > min)
+					shoreGrid.set(x-1, y, min);
+				else if (g < min)
+					min = g;
 
-					++min;
-				}
+				++min;
 			}
-			for (u16 y = m_MapSize; y > 0; --y)
+		}
+	}
+	for (u16 x = 0; x < w; ++x)
+	{
+		u16 min = shoreMax;
+		for (u16 y = 0; y < h; ++y)
+		{
+			if (!waterGrid.get(x+di, y+dj))
 			{
-				if (!waterGrid.get(x, y-1))
-				{
-					u16 g = shoreGrid.get(x, y-1);
-					if (g > min)
-						shoreGrid.set(x, y-1, min);
-					else if (g < min)
-						min = g;
+				u16 g = shoreGrid.get(x, y);
+				if (g > min)
+					shoreGrid.set(x, y, min);
+				else if (g < min)
+					min = g;
 
-					++min;
-				}
+				++min;
 			}
 		}
-
-		// Apply passability classes to terrain
-		for (u16 j = 0; j < m_MapSize; ++j)
+		for (u16 y = h; y > 0; --y)
 		{
-			for (u16 i = 0; i < m_MapSize; ++i)
+			if (!waterGrid.get(x+di, y-1+dj))
 			{
-				fixed x, z;
-				TileCenter(i, j, x, z);
-
-				TerrainTile t = 0;
-
-				u8 obstruct = m_ObstructionGrid->get(i, j);
+				u16 g = shoreGrid.get(x, y-1);
+				if (g > min)
+					shoreGrid.set(x, y-1, min);
+				else if (g < min)
+					min = g;
 
-				fixed height = terrain.GetExactGroundLevelFixed(x, z);
-
-				fixed water;
-				if (!cmpWaterMan.null())
-					water = cmpWaterMan->GetWaterLevel(x, z);
-
-				fixed depth = water - height;
-
-				fixed slope = terrain.GetSlopeFixed(i, j);
+				++min;
+			}
+		}
+	}
+}
 
-				fixed shoredist = fixed::FromInt(shoreGrid.get(i, j));
+//////////////////////////////////////////////////////////
 
-				if (obstruct & ICmpObstructionManager::TILE_OBSTRUCTED_PATHFINDING)
-					t |= 1;
+/**
+ * Computes batches of long path requests in parallel, using a pool of worker threads.
+ *
+ * Paths are computed with CCmpPathfinder::ComputePathOnGrid, which only reads
+ * the pathfinder's state, and each thread has its own scratch memory (kept between
+ * batches). Each result is stored in the slot matching its request, so the output
+ * doesn't depend on the number of threads or how they are scheduled.
+ */
+class PathfinderWorkers : public CWorkerPool::IBatch
+{
+	NONCOPYABLE(PathfinderWorkers);
+
+public:
+	/**
+	 * @param mainScratch working memory for the calling thread to use
+	 */
+	PathfinderWorkers(PathfinderScratch& mainScratch) :
+		// Use all the other processors (up to a fairly arbitrary limit),
+		// since the simulation thread is blocked until the batch is finished
+		m_Pool("pathfinder", CWorkerPool::GetDefaultNumThreads(7)),
+		m_Pathfinder(NULL), m_Requests(NULL), m_Results(NULL)
+	{
+		m_Scratch.push_back(&mainScratch);
+		for (size_t i = 0; i < m_Pool.GetNumThreads(); ++i)
+			m_Scratch.push_back(new PathfinderScratch());
+	}
 
-				if (obstruct & ICmpObstructionManager::TILE_OBSTRUCTED_FOUNDATION)
-					t |= 2;
+	~PathfinderWorkers()
+	{
+		for (size_t i = 1; i < m_Scratch.size(); ++i)
+			delete m_Scratch[i];
+	}
 
-				if (obstruct & ICmpObstructionManager::TILE_OUTOFBOUNDS)
-				{
-					// If out of bounds, nobody is allowed to pass
-					for (size_t n = 0; n < m_PassClasses.size(); ++n)
-						t |= m_PassClasses[n].m_Mask;
-				}
-				else
-				{
-					for (size_t n = 0; n < m_PassClasses.size(); ++n)
-					{
-						if (!m_PassClasses[n].IsPassable(depth, slope, shoredist))
-							t |= m_PassClasses[n].m_Mask;
-					}
-				}
+	/**
+	 * Computes all the given requests, and returns once they're all finished.
+	 */
+	void ComputePaths(const CCmpPathfinder& pathfinder, const std::vector<AsyncLongPathRequest>& requests, std::vector<ICmpPathfinder::Path>& results)
+	{
+		results.clear();
+		results.resize(requests.size());
 
-				std::string moveClass = terrain.GetMovementClass(i, j);
-				if (m_TerrainCostClassTags.find(moveClass) != m_TerrainCostClassTags.end())
-					t |= COST_CLASS_MASK(m_TerrainCostClassTags[moveClass]);
+		m_Pathfinder = &pathfinder;
+		m_Requests = &requests;
+		m_Results = &results;
 
-				m_Grid->set(i, j, t);
-			}
-		}
+		m_Pool.RunBatch(*this, requests.size());
 
-		m_TerrainDirty = false;
+		m_Pathfinder = NULL;
+		m_Requests = NULL;
+		m_Results = NULL;
+	}
 
-		++m_Grid->m_DirtyID;
+	virtual void Run(size_t task, size_t thread)
+	{
+		const AsyncLongPathRequest& req = (*m_Requests)[task];
+		m_Pathfinder->ComputePathOnGrid(req.x0, req.z0, req.goal, req.passClass, req.costClass, (*m_Results)[task], *m_Scratch[thread]);
 	}
-}
 
-//////////////////////////////////////////////////////////
+private:
+	CWorkerPool m_Pool;
+	std::vector<PathfinderScratch*> m_Scratch; // one per thread (indexed like the thread argument of Run; [0] isn't owned by us)
+
+	// The current batch:
+	const CCmpPathfinder* m_Pathfinder;
+	const std::vector<AsyncLongPathRequest>* m_Requests;
+	std::vector<ICmpPathfinder::Path>* m_Results;
+};
 
 // Async path requests:
 
@@ -576,12 +738,27 @@ void CCmpPathfinder::FinishAsyncRequests()
 
 void CCmpPathfinder::ProcessLongRequests(const std::vector<AsyncLongPathRequest>& longRequests)
 {
+	if (longRequests.empty())
+		return;
+
+	PROFILE3("ProcessLongRequests");
+
+	// Every path in the batch is computed against the grid as it is now, so the results
+	// don't depend on the order they're computed in (or on the order the result messages
+	// are handled in, even if the handlers modify obstructions)
+	UpdateGrid();
+
+	if (!m_Workers)
+		m_Workers = new PathfinderWorkers(m_Scratch);
+
+	std::vector<Path> paths;
+	m_Workers->ComputePaths(*this, longRequests, paths);
+
+	// Deliver the results in ticket order
 	for (size_t i = 0; i < longRequests.size(); ++i)
 	{
 		const AsyncLongPathRequest& req = longRequests[i];
-		Path path;
-		ComputePath(req.x0, req.z0, req.goal, req.passClass, req.costClass, path);
-		CMessagePathResult msg(req.ticket, path);
+		CMessagePathResult msg(req.ticket, paths[i]);
 		GetSimContext().GetComponentManager().PostMessage(req.notify, msg);
 	}
 }
@@ -1,4 +1,4 @@
-/* Copyright (C) 2011 Wildfire Games.
+/* Copyright (C) 2012 Wildfire Games.
  * This file is part of 0 A.D.
  *
  * 0 A.D. is free software: you can redistribute it and/or modify
@@ -25,6 +25,7 @@
  * CCmpPathfinder includes two pathfinding algorithms (one tile-based, one vertex-based)
  * with some shared state and functionality, so the code is split into
  * CCmpPathfinder_Vertex.cpp, CCmpPathfinder_Tile.cpp and CCmpPathfinder.cpp
+ * (The tile-based algorithm is guided by HierarchicalPathfinder.)
  */
 
 #include "simulation2/system/Component.h"
@@ -36,8 +37,11 @@
 #include "maths/MathUtil.h"
 #include "simulation2/helpers/Geometry.h"
 #include "simulation2/helpers/Grid.h"
+#include "simulation2/helpers/HierarchicalPathfinder.h"
+#include "simulation2/helpers/PriorityQueue.h"
 
 class PathfinderOverlay;
+class PathfinderWorkers;
 class SceneCollector;
 struct PathfindTile;
 
@@ -114,6 +118,20 @@ public:
 		return ((m_MinDepth <= waterdepth && waterdepth <= m_MaxDepth) && (steepness < m_MaxSlope) && (m_MinShore <= shoredist && shoredist <= m_MaxShore));
 	}
 
+	/**
+	 * Returns a shore distance (in tiles) such that IsPassable gives the same result
+	 * for every greater shore distance.
+	 */
+	int GetShoreDistanceLimit() const
+	{
+		int limit = 0;
+		if (m_MinShore != std::numeric_limits<fixed>::min())
+			limit = std::max(limit, m_MinShore.ToInt_RoundToInfinity());
+		if (m_MaxShore != std::numeric_limits<fixed>::max())
+			limit = std::max(limit, m_MaxShore.ToInt_RoundToInfinity());
+		return limit;
+	}
+
 	ICmpPathfinder::pass_class_t m_Mask;
 private:
 	fixed m_MinDepth;
@@ -136,7 +154,83 @@ const int COST_CLASS_BITS = 16 - (PASS_CLASS_BITS + 2);
 #define GET_COST_CLASS(item) ((item) >> (PASS_CLASS_BITS + 2))
 #define COST_CLASS_MASK(id) ( (TerrainTile) ((id) << (PASS_CLASS_BITS + 2)) )
 
-typedef SparseGrid<PathfindTile> PathfindTileGrid;
+typedef StampedGrid<PathfindTile> PathfindTileGrid;
+
+/**
+ * Maps tile coordinates onto indexes for PathfindTileQueue.
+ */
+struct PathfindTileIndex
+{
+	PathfindTileIndex(u16 w = 0) : m_W(w) { }
+
+	size_t operator()(const std::pair<u16, u16>& tile) const
+	{
+		return tile.first + tile.second * (size_t)m_W;
+	}
+
+	u16 m_W;
+};
+
+typedef PriorityQueueIndexedHeap<std::pair<u16, u16>, u32, PathfindTileIndex> PathfindTileQueue;
+
+/**
+ * Working memory for the tile-based pathfinder, kept between searches so it
+ * doesn't need to be reallocated for every path.
+ * Each thread that computes paths must have its own.
+ */
+struct PathfinderScratch
+{
+	NONCOPYABLE(PathfinderScratch);
+public:
+	PathfinderScratch();
+	~PathfinderScratch();
+
+	PathfindTileGrid* tiles; // lazily allocated
+	PathfindTileQueue open;
+	std::vector<u8> corridor;
+
+	u32 steps; // number of iterations in the most recent search
+};
+
+/**
+ * An impassable tile that borders passable tiles, which the short-range
+ * pathfinder treats as a terrain obstruction.
+ */
+struct TerrainEdgeTile
+{
+	enum
+	{
+		BOTTOM = 1,
+		TOP = 2,
+		LEFT = 4,
+		RIGHT = 8
+	};
+
+	u16 i, j;
+	u8 dirs; // the sides of the tile that have a passable neighbour
+};
+
+/**
+ * Cache of the TerrainEdgeTiles for one passability class. The map is split into
+ * chunks which are computed when first needed, and discarded when the grid
+ * changes in or next to them.
+ */
+struct TerrainEdgeCache
+{
+	static const u16 CHUNK_SIZE = 16; // tiles per side
+
+	struct Chunk
+	{
+		Chunk() : valid(false) { }
+
+		bool valid;
+		std::vector<TerrainEdgeTile> tiles; // in row-major order
+		u16 rowStart[CHUNK_SIZE+1]; // the chunk's n'th row is tiles[rowStart[n]] to tiles[rowStart[n+1]-1]
+	};
+
+	u16 chunksW;
+	std::vector<Chunk> chunks;
+};
 
 struct AsyncLongPathRequest
 {
@@ -174,6 +268,7 @@ public:
 		componentManager.SubscribeToMessageType(MT_Update);
 		componentManager.SubscribeToMessageType(MT_RenderSubmit); // for debug overlays
 		componentManager.SubscribeToMessageType(MT_TerrainChanged);
+		componentManager.SubscribeToMessageType(MT_WaterChanged);
 		componentManager.SubscribeToMessageType(MT_TurnStart);
 	}
 
@@ -201,7 +296,15 @@ public:
 	u16 m_MapSize; // tiles per side
 	Grid<TerrainTile>* m_Grid; // terrain/passability information
 	Grid<u8>* m_ObstructionGrid; // cached obstruction information (TODO: we shouldn't bother storing this, it's redundant with LSBs of m_Grid)
-	bool m_TerrainDirty; // indicates if m_Grid has been updated since terrain changed
+	bool m_TerrainDirty; // indicates if all of m_Grid needs to be recomputed because the terrain changed
+	GridRegion m_TerrainDirtyRegion; // tiles of m_Grid whose terrain has changed since it was last updated
+	HierarchicalPathfinder m_HierPathfinder; // connectivity information derived from m_Grid
+	std::map<pass_class_t, TerrainEdgeCache> m_TerrainEdgeCaches; // terrain obstructions for the short-range pathfinder
+	PathfinderWorkers* m_Workers; // threads for computing long paths in parallel (lazily created)
+	PathfinderScratch m_Scratch; // working memory for paths computed on the simulation thread
+
+	// Whether ComputePath should use m_HierPathfinder (only disabled for comparison in tests)
+	bool m_UseHierarchicalPathfinder;
 	
 	// For responsiveness we will process some moves in the same turn they were generated in
 	
@@ -275,7 +378,7 @@ public:
 	/**
 	 * Returns the tile containing the given position
 	 */
-	void NearestTile(entity_pos_t x, entity_pos_t z, u16& i, u16& j)
+	void NearestTile(entity_pos_t x, entity_pos_t z, u16& i, u16& j) const
 	{
 		i = (u16)clamp((x / (int)TERRAIN_TILE_SIZE).ToInt_RoundToZero(), 0, m_MapSize-1);
 		j = (u16)clamp((z / (int)TERRAIN_TILE_SIZE).ToInt_RoundToZero(), 0, m_MapSize-1);
@@ -292,11 +395,55 @@ public:
 
 	static fixed DistanceToGoal(CFixedVector2D pos, const CCmpPathfinder::Goal& goal);
 
+	/**
+	 * Uses m_HierPathfinder to prepare a tile-based path search from tile i0,j0
+	 * (which must be passable). If the goal can't be reached, it is replaced with
+	 * the nearest reachable tile. Then sets 'corridor' to the chunks the search
+	 * can be restricted to (see HierarchicalPathfinder::FindCorridor).
+	 */
+	void ComputeCorridor(u16 i0, u16 j0, Goal& goal, pass_class_t passClass, std::vector<u8>& corridor) const;
+
+	/**
+	 * Equivalent to ComputePath, except it uses the grid as it is (without calling
+	 * UpdateGrid) and the given working memory, and doesn't save any debug output.
+	 * It doesn't modify the pathfinder, so it can be called from several threads at once
+	 * (each with its own scratch), provided nothing modifies the pathfinder in the meantime.
+	 */
+	void ComputePathOnGrid(entity_pos_t x0, entity_pos_t z0, const Goal& goal, pass_class_t passClass, cost_class_t costClass, Path& ret, PathfinderScratch& scratch) const;
+
 	/**
 	 * Regenerates the grid based on the current obstruction list, if necessary
 	 */
 	void UpdateGrid();
 
+	/**
+	 * Recomputes the terrain passability and obstruction bits of the tiles in the
+	 * given region of m_Grid (using the shore distances of land tiles within the given
+	 * distance of the region), and marks the hierarchical pathfinder chunks whose
+	 * tiles changed in dirtyChunks (if non-NULL).
+	 */
+	void UpdateGridRegion(const GridRegion& region, int shoreLimit, Grid<u8>* dirtyChunks);
+
+	/**
+	 * Computes the distance from each land tile in the given window to the nearest
+	 * shore tile (or a large value if there is none), counting only paths inside
+	 * the window. Water tiles get 0. shoreGrid must be the same size as the window.
+	 */
+	void ComputeShoreGrid(const GridRegion& window, Grid<u16>& shoreGrid);
+
+	/**
+	 * Sets tiles to the TerrainEdgeTiles in the given region for the given
+	 * passability class, in row-major order, using m_TerrainEdgeCaches.
+	 * UpdateGrid must have been called first.
+	 */
+	void GetTerrainEdgeTiles(u16 i0, u16 j0, u16 i1, u16 j1, pass_class_t passClass, std::vector<TerrainEdgeTile>& tiles);
+
+	/**
+	 * Discards the cached TerrainEdgeTiles that might be affected by changes
+	 * to the given region of m_Grid.
+	 */
+	void InvalidateTerrainEdges(const GridRegion& region);
+
 	void RenderSubmit(SceneCollector& collector);
 };
 
@@ -30,7 +30,7 @@
 #include "renderer/TerrainOverlay.h"
 #include "simulation2/helpers/PriorityQueue.h"
 
-typedef PriorityQueueHeap<std::pair<u16, u16>, u32> PriorityQueue;
+typedef PathfindTileQueue PriorityQueue;
 
 #define PATHFIND_STATS 0
 
@@ -192,16 +192,22 @@ struct PathfinderState
 	u16 rGoal; // radius of goal (around tile center)
 
 	ICmpPathfinder::pass_class_t passClass;
-	std::vector<u32> moveCosts;
+	const std::vector<u32>* moveCosts;
 
-	PriorityQueue open;
+	PriorityQueue* open;
 	// (there's no explicit closed list; it's encoded in PathfindTile)
 
 	PathfindTileGrid* tiles;
-	Grid<TerrainTile>* terrain;
+	const Grid<TerrainTile>* terrain;
 
 	bool ignoreImpassable; // allows us to escape if stuck in patches of impassability
 
+	// If non-NULL, the search is restricted to the chunks that are non-zero in this array
+	// (indexed like the corridor from HierarchicalPathfinder::FindCorridor), and the goal
+	// is known to be reachable
+	const u8* corridor;
+	u16 corridorW;
+
 	u32 hBest; // heuristic of closest discovered tile to goal
 	u16 iBest, jBest; // closest tile
 
@@ -299,7 +305,11 @@ static void ProcessNeighbour(u16 pi, u16 pj, u16 i, u16 j, u32 pg, PathfinderSta
 	if (!IS_PASSABLE(tileTag, state.passClass) && !state.ignoreImpassable)
 		return;
 
-	u32 dg = CalculateCostDelta(pi, pj, i, j, state.tiles, state.moveCosts.at(GET_COST_CLASS(tileTag)));
+	// Reject tiles outside the corridor
+	if (state.corridor && !state.corridor[i / HierarchicalPathfinder::CHUNK_SIZE + (j / HierarchicalPathfinder::CHUNK_SIZE) * state.corridorW])
+		return;
+
+	u32 dg = CalculateCostDelta(pi, pj, i, j, state.tiles, state.moveCosts->at(GET_COST_CLASS(tileTag)));
 
 	u32 g = pg + dg; // cost to this tile = cost to predecessor + delta from predecessor
 
@@ -333,7 +343,7 @@ static void ProcessNeighbour(u16 pi, u16 pj, u16 i, u16 j, u32 pg, PathfinderSta
 			n.cost = g;
 			n.SetPred(pi, pj, i, j);
 			n.SetStep(state.steps);
-			state.open.promote(std::make_pair(i, j), g + n.h);
+			state.open->promote(std::make_pair(i, j), g + n.h);
 #if PATHFIND_STATS
 			state.numImproveOpen++;
 #endif
@@ -357,33 +367,141 @@ static void ProcessNeighbour(u16 pi, u16 pj, u16 i, u16 j, u32 pg, PathfinderSta
 	n.SetPred(pi, pj, i, j);
 	n.SetStep(state.steps);
 	PriorityQueue::Item t = { std::make_pair(i, j), g + n.h };
-	state.open.push(t);
+	state.open->push(t);
 #if PATHFIND_STATS
 	state.numAddToOpen++;
 #endif
 }
 
+PathfinderScratch::PathfinderScratch() :
+	tiles(NULL), steps(0)
+{
+}
+
+PathfinderScratch::~PathfinderScratch()
+{
+	delete tiles;
+}
+
+void CCmpPathfinder::ComputeCorridor(u16 i0, u16 j0, Goal& goal, pass_class_t passClass, std::vector<u8>& corridor) const
+{
+	PROFILE2("ComputeCorridor");
+
+	HierarchicalPathfinder::RegionID start = m_HierPathfinder.GetRegion(i0, j0, passClass);
+	u32 globalRegion = m_HierPathfinder.GetGlobalRegion(start, passClass);
+
+	// Find the regions containing tiles that are reachable from the start and that
+	// AtGoal accepts (i.e. within a couple of tiles of the goal shape)
+
+	CFixedVector2D halfSize;
+	if (goal.type == Goal::CIRCLE)
+		halfSize = CFixedVector2D(goal.hw, goal.hw);
+	else if (goal.type == Goal::SQUARE)
+		halfSize = Geometry::GetHalfBoundingBox(goal.u, goal.v, CFixedVector2D(goal.hw, goal.hh));
+	halfSize += CFixedVector2D(entity_pos_t::FromInt(TERRAIN_TILE_SIZE*2), entity_pos_t::FromInt(TERRAIN_TILE_SIZE*2));
+
+	u16 gi0, gj0, gi1, gj1;
+	NearestTile(goal.x - halfSize.X, goal.z - halfSize.Y, gi0, gj0);
+	NearestTile(goal.x + halfSize.X, goal.z + halfSize.Y, gi1, gj1);
+
+	std::set<HierarchicalPathfinder::RegionID> goalRegions;
+	for (u16 j = gj0; j <= gj1; ++j)
+	{
+		for (u16 i = gi0; i <= gi1; ++i)
+		{
+			if (m_HierPathfinder.GetGlobalRegion(i, j, passClass) == globalRegion && AtGoal(i, j, goal))
+				goalRegions.insert(m_HierPathfinder.GetRegion(i, j, passClass));
+		}
+	}
+
+	// If the goal is unreachable, head for the nearest tile that is reachable instead
+	// (rather than searching every reachable tile to find out)
+	if (goalRegions.empty())
+	{
+		u16 iGoal, jGoal, i, j;
+		NearestTile(goal.x, goal.z, iGoal, jGoal);
+		if (!m_HierPathfinder.FindNearestTileInGlobalRegion(iGoal, jGoal, globalRegion, passClass, i, j))
+			return;
+
+		goal.type = Goal::POINT;
+		TileCenter(i, j, goal.x, goal.z);
+		goalRegions.insert(m_HierPathfinder.GetRegion(i, j, passClass));
+	}
+
+	u16 iGoal, jGoal;
+	NearestTile(goal.x, goal.z, iGoal, jGoal);
+	m_HierPathfinder.FindCorridor(start, goalRegions, iGoal, jGoal, corridor, passClass);
+}
+
 void CCmpPathfinder::ComputePath(entity_pos_t x0, entity_pos_t z0, const Goal& goal, pass_class_t passClass, cost_class_t costClass, Path& path)
 {
 	UpdateGrid();
 
 	PROFILE3("ComputePath");
 
+	ComputePathOnGrid(x0, z0, goal, passClass, costClass, path, m_Scratch);
+
+	m_DebugSteps = m_Scratch.steps;
+
+	// Save this grid for debug display (taking it from the scratch memory,
+	// which will allocate a new one next time)
+	if (m_DebugOverlay)
+	{
+		delete m_DebugGrid;
+		m_DebugGrid = m_Scratch.tiles;
+		m_Scratch.tiles = NULL;
+	}
+}
+
+void CCmpPathfinder::ComputePathOnGrid(entity_pos_t x0, entity_pos_t z0, const Goal& requestedGoal, pass_class_t passClass, cost_class_t costClass, Path& path, PathfinderScratch& scratch) const
+{
+	PROFILE2("ComputePathOnGrid");
+
 	PathfinderState state = { 0 };
+	scratch.steps = 0;
 
-	// Convert the start/end coordinates to tile indexes
+	// Convert the start coordinates to tile indexes
 	u16 i0, j0;
 	NearestTile(x0, z0, i0, j0);
-	NearestTile(goal.x, goal.z, state.iGoal, state.jGoal);
 
 	// If we're already at the goal tile, then move directly to the exact goal coordinates
-	if (AtGoal(i0, j0, goal))
+	if (AtGoal(i0, j0, requestedGoal))
 	{
-		Waypoint w = { goal.x, goal.z };
+		Waypoint w = { requestedGoal.x, requestedGoal.z };
 		path.m_Waypoints.push_back(w);
 		return;
 	}
 
+	// To prevent units getting very stuck, if they start on an impassable tile
+	// surrounded entirely by impassable tiles, we ignore the impassability
+	state.ignoreImpassable = !IS_PASSABLE(m_Grid->get(i0, j0), passClass);
+
+	// Unless we're escaping from impassable terrain, use the hierarchical pathfinder
+	// to make sure the goal is reachable and to restrict the search to a corridor
+	// leading towards it
+	Goal goal = requestedGoal;
+	std::vector<u8>& corridor = scratch.corridor;
+	corridor.clear();
+	if (m_UseHierarchicalPathfinder && !state.ignoreImpassable && m_HierPathfinder.HasPassClass(passClass))
+	{
+		ComputeCorridor(i0, j0, goal, passClass, corridor);
+		if (!corridor.empty())
+		{
+			state.corridor = &corridor[0];
+			state.corridorW = m_HierPathfinder.GetChunksW();
+		}
+
+		// The goal may have been moved to the nearest reachable tile, which we might be on
+		if (AtGoal(i0, j0, goal))
+		{
+			Waypoint w = { goal.x, goal.z };
+			path.m_Waypoints.push_back(w);
+			return;
+		}
+	}
+
+	NearestTile(goal.x, goal.z, state.iGoal, state.jGoal);
+
 	// If the target is a circle, we want to aim for the edge of it (so e.g. if we're inside
 	// a large circle then the heuristics will aim us directly outwards);
 	// otherwise just aim at the center point. (We'll never try moving outwards to a square shape.)
@@ -393,11 +511,24 @@ void CCmpPathfinder::ComputePath(entity_pos_t x0, entity_pos_t z0, const Goal& g
 		state.rGoal = 0;
 
 	state.passClass = passClass;
-	state.moveCosts = m_MoveCosts.at(costClass);
+	state.moveCosts = &m_MoveCosts.at(costClass);
 
 	state.steps = 0;
 
-	state.tiles = new PathfindTileGrid(m_MapSize, m_MapSize);
+	if (!scratch.tiles || scratch.tiles->m_W != m_MapSize || scratch.tiles->m_H != m_MapSize)
+	{
+		delete scratch.tiles;
+		scratch.tiles = new PathfindTileGrid(m_MapSize, m_MapSize);
+	}
+	else
+	{
+		scratch.tiles->reset();
+	}
+	state.tiles = scratch.tiles;
+
+	scratch.open.clear(PathfindTileIndex(m_MapSize), m_MapSize*m_MapSize);
+	state.open = &scratch.open;
+
 	state.terrain = m_Grid;
 
 	state.iBest = i0;
@@ -405,34 +536,31 @@ void CCmpPathfinder::ComputePath(entity_pos_t x0, entity_pos_t z0, const Goal& g
 	state.hBest = CalculateHeuristic(i0, j0, state.iGoal, state.jGoal, state.rGoal);
 
 	PriorityQueue::Item start = { std::make_pair(i0, j0), 0 };
-	state.open.push(start);
+	state.open->push(start);
 	state.tiles->get(i0, j0).SetStatusOpen();
 	state.tiles->get(i0, j0).SetPred(i0, j0, i0, j0);
 	state.tiles->get(i0, j0).cost = 0;
 
-	// To prevent units getting very stuck, if they start on an impassable tile
-	// surrounded entirely by impassable tiles, we ignore the impassability
-	state.ignoreImpassable = !IS_PASSABLE(state.terrain->get(i0, j0), state.passClass);
-
 	while (1)
 	{
 		++state.steps;
 
 		// Hack to avoid spending ages computing giant paths, particularly when
 		// the destination is unreachable
-		if (state.steps > 40000)
+		// (not needed if the hierarchical pathfinder says the goal is reachable)
+		if (state.steps > 40000 && !state.corridor)
 			break;
 
 		// If we ran out of tiles to examine, give up
-		if (state.open.empty())
+		if (state.open->empty())
 			break;
 
 #if PATHFIND_STATS
-		state.sumOpenSize += state.open.size();
+		state.sumOpenSize += state.open->size();
 #endif
 
 		// Move best tile from open to closed
-		PriorityQueue::Item curr = state.open.pop();
+		PriorityQueue::Item curr = state.open->pop();
 		u16 i = curr.id.first;
 		u16 j = curr.id.second;
 		state.tiles->get(i, j).SetStatusClosed();
@@ -486,10 +614,7 @@ void CCmpPathfinder::ComputePath(entity_pos_t x0, entity_pos_t z0, const Goal& g
 		jp = n.GetPredJ(jp);
 	}
 
-	// Save this grid for debug display
-	delete m_DebugGrid;
-	m_DebugGrid = state.tiles;
-	m_DebugSteps = state.steps;
+	scratch.steps = state.steps;
 
 	PROFILE2_ATTR("from: (%d, %d)", i0, j0);
 	PROFILE2_ATTR("to: (%d, %d)", state.iGoal, state.jGoal);
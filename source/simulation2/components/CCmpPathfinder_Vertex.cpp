@@ -1,4 +1,4 @@
-/* Copyright (C) 2010 Wildfire Games.
+/* Copyright (C) 2012 Wildfire Games.
  * This file is part of 0 A.D.
  *
  * 0 A.D. is free software: you can redistribute it and/or modify
@@ -22,11 +22,13 @@
  *
  * Useful search term for this algorithm: "points of visibility".
  *
- * Since we sometimes want to use this for avoiding moving units, there is no
+ * Since we sometimes want to use this for avoiding moving units, there is little
  * pre-computation - the whole visibility graph is effectively regenerated for
- * each path, and it does A* over that graph.
+ * each path, and it does A* over that graph. Only the terrain edges are cached
+ * between paths (see CCmpPathfinder::GetTerrainEdgeTiles), and the obstruction
+ * edges are bucketed spatially so each visibility test only looks at nearby ones.
  *
- * This scales very poorly in the number of obstructions, so it should be used
+ * This still scales poorly in the number of obstructions, so it should be used
  * with a limited range and not exceedingly frequently.
  */
 
@@ -284,6 +286,199 @@ inline static bool CheckVisibilityTop(CFixedVector2D a, CFixedVector2D b, const
 }
 
 
+/**
+ * Check whether a ray from 'a' to 'b' crosses any of the four edges of an
+ * axis-aligned square (as used in the 'edgesAA' list). Equivalent to the
+ * CheckVisibilityLeft/Right/Bottom/Top tests on that square.
+ */
+inline static bool CheckVisibilityAASquare(CFixedVector2D a, CFixedVector2D b, CFixedVector2D abn, const Edge& e)
+{
+	// Left edge
+	if (a.X <= e.p0.X && a.X < b.X && b.X >= e.p0.X)
+	{
+		if ((CFixedVector2D(e.p0.X, e.p1.Y) - a).Dot(abn) <= fixed::Zero() &&
+			(CFixedVector2D(e.p0.X, e.p0.Y) - a).Dot(abn) >= fixed::Zero())
+			return false;
+	}
+
+	// Right edge
+	if (a.X >= e.p1.X && a.X > b.X && b.X <= e.p1.X)
+	{
+		if ((CFixedVector2D(e.p1.X, e.p0.Y) - a).Dot(abn) <= fixed::Zero() &&
+			(CFixedVector2D(e.p1.X, e.p1.Y) - a).Dot(abn) >= fixed::Zero())
+			return false;
+	}
+
+	// Bottom edge
+	if (a.Y <= e.p0.Y && a.Y < b.Y && b.Y >= e.p0.Y)
+	{
+		if ((CFixedVector2D(e.p0.X, e.p0.Y) - a).Dot(abn) <= fixed::Zero() &&
+			(CFixedVector2D(e.p1.X, e.p0.Y) - a).Dot(abn) >= fixed::Zero())
+			return false;
+	}
+
+	// Top edge
+	if (a.Y >= e.p1.Y && a.Y > b.Y && b.Y <= e.p1.Y)
+	{
+		if ((CFixedVector2D(e.p1.X, e.p1.Y) - a).Dot(abn) <= fixed::Zero() &&
+			(CFixedVector2D(e.p0.X, e.p1.Y) - a).Dot(abn) >= fixed::Zero())
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Spatial index over the axis-aligned squares of the 'edgesAA' list, so that
+ * each visibility test only has to look at the squares near the ray.
+ *
+ * The search area is divided into square buckets, and each square is listed
+ * in every bucket that its bounds (plus a small margin, to allow for rounding
+ * in the visibility tests) overlap. A ray can only be blocked by a square that
+ * it touches, which must be listed in one of the buckets the ray passes through.
+ * Anything outside the search area is clamped into the edge buckets.
+ */
+class EdgeBuckets
+{
+public:
+	EdgeBuckets(fixed x0, fixed z0, fixed x1, fixed z1, const std::vector<Edge>& edgesAA) :
+		m_EdgesAA(edgesAA), m_Stamps(edgesAA.size(), 0), m_Stamp(0)
+	{
+		m_X0 = x0.GetInternalValue();
+		m_Z0 = z0.GetInternalValue();
+		m_W = std::max(1, (int)((x1.GetInternalValue() - m_X0) / BUCKET_SIZE) + 1);
+		m_H = std::max(1, (int)((z1.GetInternalValue() - m_Z0) / BUCKET_SIZE) + 1);
+
+		// Count the squares in each bucket, then fill in the lists
+		std::vector<u32> counts(m_W * m_H, 0);
+		for (size_t n = 0; n < edgesAA.size(); ++n)
+		{
+			int i0, j0, i1, j1;
+			GetSquareBuckets(edgesAA[n], i0, j0, i1, j1);
+			for (int j = j0; j <= j1; ++j)
+				for (int i = i0; i <= i1; ++i)
+					++counts[j*m_W + i];
+		}
+
+		m_Start.resize(m_W * m_H + 1);
+		m_Start[0] = 0;
+		for (size_t b = 0; b < counts.size(); ++b)
+			m_Start[b+1] = m_Start[b] + counts[b];
+
+		m_Squares.resize(m_Start.back());
+		for (size_t n = 0; n < edgesAA.size(); ++n)
+		{
+			int i0, j0, i1, j1;
+			GetSquareBuckets(edgesAA[n], i0, j0, i1, j1);
+			for (int j = j0; j <= j1; ++j)
+				for (int i = i0; i <= i1; ++i)
+					m_Squares[m_Start[j*m_W + i + 1] - counts[j*m_W + i]--] = (u32)n;
+		}
+	}
+
+	/**
+	 * Equivalent to testing CheckVisibilityAASquare on every square.
+	 */
+	bool CheckVisibility(CFixedVector2D a, CFixedVector2D b)
+	{
+		CFixedVector2D abn = (b - a).Perpendicular();
+
+		i64 ax = a.X.GetInternalValue(), az = a.Y.GetInternalValue();
+		i64 bx = b.X.GetInternalValue(), bz = b.Y.GetInternalValue();
+
+		// Very short rays can be affected by rounding errors far beyond the margin,
+		// so just test them against everything
+		if (bx - ax < SHORT_RAY && ax - bx < SHORT_RAY && bz - az < SHORT_RAY && az - bz < SHORT_RAY)
+		{
+			for (size_t n = 0; n < m_EdgesAA.size(); ++n)
+				if (!CheckVisibilityAASquare(a, b, abn, m_EdgesAA[n]))
+					return false;
+			return true;
+		}
+
+		if (++m_Stamp == 0)
+		{
+			// Wrapped around, so reset the old stamps
+			std::fill(m_Stamps.begin(), m_Stamps.end(), 0);
+			m_Stamp = 1;
+		}
+
+		// Visit each column of buckets that the ray crosses, and the rows that
+		// the ray spans within that column (the buckets are ordered along the
+		// ray's X direction, which tends to find nearby blocking squares first)
+		if (ax > bx)
+		{
+			std::swap(ax, bx);
+			std::swap(az, bz);
+		}
+
+		int i0 = BucketX(ax), i1 = BucketX(bx);
+		for (int i = i0; i <= i1; ++i)
+		{
+			// The part of the ray inside this column
+			i64 cx0 = (i == i0 ? ax : m_X0 + (i64)i * BUCKET_SIZE);
+			i64 cx1 = (i == i1 ? bx : m_X0 + (i64)(i+1) * BUCKET_SIZE);
+			i64 cz0 = az, cz1 = bz;
+			if (bx != ax)
+			{
+				cz0 = az + (cx0 - ax) * (bz - az) / (bx - ax);
+				cz1 = az + (cx1 - ax) * (bz - az) / (bx - ax);
+			}
+
+			int j0 = BucketZ(std::min(cz0, cz1) - MARGIN);
+			int j1 = BucketZ(std::max(cz0, cz1) + MARGIN);
+			for (int j = j0; j <= j1; ++j)
+			{
+				size_t bucket = j*m_W + i;
+				for (u32 k = m_Start[bucket]; k < m_Start[bucket+1]; ++k)
+				{
+					u32 n = m_Squares[k];
+					if (m_Stamps[n] == m_Stamp)
+						continue;
+					m_Stamps[n] = m_Stamp;
+
+					if (!CheckVisibilityAASquare(a, b, abn, m_EdgesAA[n]))
+						return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+private:
+	// (All sizes are in the internal units of fixed)
+	static const i64 BUCKET_SIZE = 8 << fixed::fract_bits;
+	static const i64 MARGIN = 1 << (fixed::fract_bits - 2);
+	static const i64 SHORT_RAY = 1 << (fixed::fract_bits - 4);
+
+	int BucketX(i64 x) const
+	{
+		return x < m_X0 ? 0 : (int)std::min((i64)m_W - 1, (x - m_X0) / BUCKET_SIZE);
+	}
+
+	int BucketZ(i64 z) const
+	{
+		return z < m_Z0 ? 0 : (int)std::min((i64)m_H - 1, (z - m_Z0) / BUCKET_SIZE);
+	}
+
+	void GetSquareBuckets(const Edge& e, int& i0, int& j0, int& i1, int& j1) const
+	{
+		i0 = BucketX(e.p0.X.GetInternalValue() - MARGIN);
+		j0 = BucketZ(e.p0.Y.GetInternalValue() - MARGIN);
+		i1 = BucketX(e.p1.X.GetInternalValue() + MARGIN);
+		j1 = BucketZ(e.p1.Y.GetInternalValue() + MARGIN);
+	}
+
+	const std::vector<Edge>& m_EdgesAA;
+	i64 m_X0, m_Z0;
+	int m_W, m_H;
+	std::vector<u32> m_Start; // squares in bucket b are m_Squares[m_Start[b]] to m_Squares[m_Start[b+1]-1]
+	std::vector<u32> m_Squares; // indexes into m_EdgesAA
+	std::vector<u32> m_Stamps; // m_Stamp if the square has already been tested against the current ray
+	u32 m_Stamp;
+};
+
 static CFixedVector2D NearestPointOnGoal(CFixedVector2D pos, const CCmpPathfinder::Goal& goal)
 {
 	CFixedVector2D g(goal.x, goal.z);
@@ -327,118 +522,194 @@ CFixedVector2D CCmpPathfinder::GetNearestPointOnGoal(CFixedVector2D pos, const C
 
 typedef PriorityQueueHeap<u16, fixed> PriorityQueue;
 
-struct TileEdge
+/**
+ * Returns the TerrainEdgeTile::dirs of tile (i, j), or 0 if it isn't a terrain obstruction.
+ */
+static u8 TerrainEdgeDirs(const Grid<TerrainTile>& terrain, u16 i, u16 j, ICmpPathfinder::pass_class_t passClass)
 {
-	u16 i, j;
-	enum { TOP, BOTTOM, LEFT, RIGHT } dir;
-};
+	if (IS_TERRAIN_PASSABLE(terrain.get(i, j), passClass))
+		return 0;
 
-static void AddTerrainEdges(std::vector<Edge>& edgesAA, std::vector<Vertex>& vertexes,
-	u16 i0, u16 j0, u16 i1, u16 j1, fixed r,
+	// Find all edges between tiles of differently passability statuses
+	u8 dirs = 0;
+	if (j > 0 && IS_TERRAIN_PASSABLE(terrain.get(i, j-1), passClass))
+		dirs |= TerrainEdgeTile::BOTTOM;
+	if (j < terrain.m_H-1 && IS_TERRAIN_PASSABLE(terrain.get(i, j+1), passClass))
+		dirs |= TerrainEdgeTile::TOP;
+	if (i > 0 && IS_TERRAIN_PASSABLE(terrain.get(i-1, j), passClass))
+		dirs |= TerrainEdgeTile::LEFT;
+	if (i < terrain.m_W-1 && IS_TERRAIN_PASSABLE(terrain.get(i+1, j), passClass))
+		dirs |= TerrainEdgeTile::RIGHT;
+	return dirs;
+}
+
+static void ComputeTerrainEdgeChunk(TerrainEdgeCache::Chunk& chunk, u16 ci, u16 cj,
 	ICmpPathfinder::pass_class_t passClass, const Grid<TerrainTile>& terrain)
 {
-	PROFILE("AddTerrainEdges");
-
-	std::vector<TileEdge> tileEdges;
+	chunk.tiles.clear();
 
-	// Find all edges between tiles of differently passability statuses
-	for (u16 j = j0; j <= j1; ++j)
+	u16 i0 = ci * TerrainEdgeCache::CHUNK_SIZE;
+	u16 j0 = cj * TerrainEdgeCache::CHUNK_SIZE;
+	for (u16 n = 0; n < TerrainEdgeCache::CHUNK_SIZE; ++n)
 	{
-		for (u16 i = i0; i <= i1; ++i)
+		chunk.rowStart[n] = (u16)chunk.tiles.size();
+
+		u16 j = j0 + n;
+		if (j >= terrain.m_H)
+			continue;
+
+		for (u16 i = i0; i < std::min((int)terrain.m_W, i0 + TerrainEdgeCache::CHUNK_SIZE); ++i)
 		{
-			if (!IS_TERRAIN_PASSABLE(terrain.get(i, j), passClass))
+			u8 dirs = TerrainEdgeDirs(terrain, i, j, passClass);
+			if (dirs)
 			{
-				bool any = false; // whether we're adding any edges of this tile
+				TerrainEdgeTile tile = { i, j, dirs };
+				chunk.tiles.push_back(tile);
+			}
+		}
+	}
+	chunk.rowStart[TerrainEdgeCache::CHUNK_SIZE] = (u16)chunk.tiles.size();
 
-				if (j > 0 && IS_TERRAIN_PASSABLE(terrain.get(i, j-1), passClass))
-				{
-					TileEdge e = { i, j, TileEdge::BOTTOM };
-					tileEdges.push_back(e);
-					any = true;
-				}
+	chunk.valid = true;
+}
 
-				if (j < terrain.m_H-1 && IS_TERRAIN_PASSABLE(terrain.get(i, j+1), passClass))
-				{
-					TileEdge e = { i, j, TileEdge::TOP };
-					tileEdges.push_back(e);
-					any = true;
-				}
+void CCmpPathfinder::GetTerrainEdgeTiles(u16 i0, u16 j0, u16 i1, u16 j1, pass_class_t passClass, std::vector<TerrainEdgeTile>& tiles)
+{
+	PROFILE("GetTerrainEdgeTiles");
 
-				if (i > 0 && IS_TERRAIN_PASSABLE(terrain.get(i-1, j), passClass))
-				{
-					TileEdge e = { i, j, TileEdge::LEFT };
-					tileEdges.push_back(e);
-					any = true;
-				}
+	tiles.clear();
 
-				if (i < terrain.m_W-1 && IS_TERRAIN_PASSABLE(terrain.get(i+1, j), passClass))
+	// The caches are only invalidated when the terrain changes, so classes that
+	// include the obstruction bits have to be computed from scratch each time
+	if (passClass & 3)
+	{
+		for (u16 j = j0; j <= j1; ++j)
+		{
+			for (u16 i = i0; i <= i1; ++i)
+			{
+				u8 dirs = TerrainEdgeDirs(*m_Grid, i, j, passClass);
+				if (dirs)
 				{
-					TileEdge e = { i, j, TileEdge::RIGHT };
-					tileEdges.push_back(e);
-					any = true;
+					TerrainEdgeTile tile = { i, j, dirs };
+					tiles.push_back(tile);
 				}
+			}
+		}
+		return;
+	}
 
-				// If we want to add any edge, then add the whole square to the axis-aligned-edges list.
-				// (The inner edges are redundant but it's easier than trying to split the squares apart.)
-				if (any)
-				{
-					CFixedVector2D v0 = CFixedVector2D(fixed::FromInt(i * (int)TERRAIN_TILE_SIZE) - r, fixed::FromInt(j * (int)TERRAIN_TILE_SIZE) - r);
-					CFixedVector2D v1 = CFixedVector2D(fixed::FromInt((i+1) * (int)TERRAIN_TILE_SIZE) + r, fixed::FromInt((j+1) * (int)TERRAIN_TILE_SIZE) + r);
-					Edge e = { v0, v1 };
-					edgesAA.push_back(e);
-				}
+	const u16 size = TerrainEdgeCache::CHUNK_SIZE;
+
+	TerrainEdgeCache& cache = m_TerrainEdgeCaches[passClass];
+	if (cache.chunks.empty())
+	{
+		cache.chunksW = (m_Grid->m_W + size-1) / size;
+		cache.chunks.resize(cache.chunksW * ((m_Grid->m_H + size-1) / size));
+	}
+
+	// Copy the tiles from each chunk a row at a time, so they're in the same
+	// order as if we'd scanned the whole region
+	for (u16 j = j0; j <= j1; ++j)
+	{
+		u16 cj = j / size;
+		for (u16 ci = i0 / size; ci <= i1 / size; ++ci)
+		{
+			TerrainEdgeCache::Chunk& chunk = cache.chunks[cj*cache.chunksW + ci];
+			if (!chunk.valid)
+				ComputeTerrainEdgeChunk(chunk, ci, cj, passClass, *m_Grid);
+
+			for (u16 n = chunk.rowStart[j % size]; n < chunk.rowStart[j % size + 1]; ++n)
+			{
+				if (i0 <= chunk.tiles[n].i && chunk.tiles[n].i <= i1)
+					tiles.push_back(chunk.tiles[n]);
+			}
+		}
+	}
+}
+
+void CCmpPathfinder::InvalidateTerrainEdges(const GridRegion& region)
+{
+	// A tile's edges depend on its neighbours too
+	GridRegion expanded = region.Expanded(1, m_MapSize, m_MapSize);
+	if (expanded.IsEmpty())
+		return;
+
+	const u16 size = TerrainEdgeCache::CHUNK_SIZE;
+
+	for (std::map<pass_class_t, TerrainEdgeCache>::iterator it = m_TerrainEdgeCaches.begin(); it != m_TerrainEdgeCaches.end(); ++it)
+	{
+		TerrainEdgeCache& cache = it->second;
+		if (cache.chunks.empty())
+			continue;
+
+		for (u16 cj = expanded.j0 / size; cj <= expanded.j1 / size; ++cj)
+		{
+			for (u16 ci = expanded.i0 / size; ci <= expanded.i1 / size; ++ci)
+			{
+				TerrainEdgeCache::Chunk& chunk = cache.chunks[cj*cache.chunksW + ci];
+				chunk.valid = false;
+				chunk.tiles.clear();
 			}
 		}
 	}
+}
 
-	// TODO: maybe we should precompute these terrain edges since they'll rarely change?
+static void AddTerrainEdges(std::vector<Edge>& edgesAA, std::vector<Vertex>& vertexes,
+	const std::vector<TerrainEdgeTile>& tiles, fixed r)
+{
+	PROFILE("AddTerrainEdges");
+
+	// Add the whole square of every tile with an outer edge to the axis-aligned-edges list.
+	// (The inner edges are redundant but it's easier than trying to split the squares apart.)
+	for (size_t n = 0; n < tiles.size(); ++n)
+	{
+		u16 i = tiles[n].i;
+		u16 j = tiles[n].j;
+		CFixedVector2D v0 = CFixedVector2D(fixed::FromInt(i * (int)TERRAIN_TILE_SIZE) - r, fixed::FromInt(j * (int)TERRAIN_TILE_SIZE) - r);
+		CFixedVector2D v1 = CFixedVector2D(fixed::FromInt((i+1) * (int)TERRAIN_TILE_SIZE) + r, fixed::FromInt((j+1) * (int)TERRAIN_TILE_SIZE) + r);
+		Edge e = { v0, v1 };
+		edgesAA.push_back(e);
+	}
 
 	// TODO: for efficiency (minimising the A* search space), we should coalesce adjoining edges
 
 	// Add all the tile outer edges to the search vertex lists
-	for (size_t n = 0; n < tileEdges.size(); ++n)
+	for (size_t n = 0; n < tiles.size(); ++n)
 	{
-		u16 i = tileEdges[n].i;
-		u16 j = tileEdges[n].j;
+		u16 i = tiles[n].i;
+		u16 j = tiles[n].j;
 		CFixedVector2D v0, v1;
 		Vertex vert;
 		vert.status = Vertex::UNEXPLORED;
 		vert.quadOutward = QUADRANT_ALL;
 
-		switch (tileEdges[n].dir)
-		{
-		case TileEdge::BOTTOM:
+		if (tiles[n].dirs & TerrainEdgeTile::BOTTOM)
 		{
 			v0 = CFixedVector2D(fixed::FromInt(i * (int)TERRAIN_TILE_SIZE) - r, fixed::FromInt(j * (int)TERRAIN_TILE_SIZE) - r);
 			v1 = CFixedVector2D(fixed::FromInt((i+1) * (int)TERRAIN_TILE_SIZE) + r, fixed::FromInt(j * (int)TERRAIN_TILE_SIZE) - r);
 			vert.p.X = v0.X - EDGE_EXPAND_DELTA; vert.p.Y = v0.Y - EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_TR; vertexes.push_back(vert);
 			vert.p.X = v1.X + EDGE_EXPAND_DELTA; vert.p.Y = v1.Y - EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_TL; vertexes.push_back(vert);
-			break;
 		}
-		case TileEdge::TOP:
+		if (tiles[n].dirs & TerrainEdgeTile::TOP)
 		{
 			v0 = CFixedVector2D(fixed::FromInt((i+1) * (int)TERRAIN_TILE_SIZE) + r, fixed::FromInt((j+1) * (int)TERRAIN_TILE_SIZE) + r);
 			v1 = CFixedVector2D(fixed::FromInt(i * (int)TERRAIN_TILE_SIZE) - r, fixed::FromInt((j+1) * (int)TERRAIN_TILE_SIZE) + r);
 			vert.p.X = v0.X + EDGE_EXPAND_DELTA; vert.p.Y = v0.Y + EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_BL; vertexes.push_back(vert);
 			vert.p.X = v1.X - EDGE_EXPAND_DELTA; vert.p.Y = v1.Y + EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_BR; vertexes.push_back(vert);
-			break;
 		}
-		case TileEdge::LEFT:
+		if (tiles[n].dirs & TerrainEdgeTile::LEFT)
 		{
 			v0 = CFixedVector2D(fixed::FromInt(i * (int)TERRAIN_TILE_SIZE) - r, fixed::FromInt((j+1) * (int)TERRAIN_TILE_SIZE) + r);
 			v1 = CFixedVector2D(fixed::FromInt(i * (int)TERRAIN_TILE_SIZE) - r, fixed::FromInt(j * (int)TERRAIN_TILE_SIZE) - r);
 			vert.p.X = v0.X - EDGE_EXPAND_DELTA; vert.p.Y = v0.Y + EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_BR; vertexes.push_back(vert);
 			vert.p.X = v1.X - EDGE_EXPAND_DELTA; vert.p.Y = v1.Y - EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_TR; vertexes.push_back(vert);
-			break;
 		}
-		case TileEdge::RIGHT:
+		if (tiles[n].dirs & TerrainEdgeTile::RIGHT)
 		{
 			v0 = CFixedVector2D(fixed::FromInt((i+1) * (int)TERRAIN_TILE_SIZE) + r, fixed::FromInt(j * (int)TERRAIN_TILE_SIZE) - r);
 			v1 = CFixedVector2D(fixed::FromInt((i+1) * (int)TERRAIN_TILE_SIZE) + r, fixed::FromInt((j+1) * (int)TERRAIN_TILE_SIZE) + r);
 			vert.p.X = v0.X + EDGE_EXPAND_DELTA; vert.p.Y = v0.Y - EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_TL; vertexes.push_back(vert);
 			vert.p.X = v1.X + EDGE_EXPAND_DELTA; vert.p.Y = v1.Y + EDGE_EXPAND_DELTA; vert.quadInward = QUADRANT_BL; vertexes.push_back(vert);
-			break;
-		}
 		}
 	}
 }
@@ -478,21 +749,6 @@ static void SplitAAEdges(CFixedVector2D a,
 	}
 }
 
-/**
- * Functor for sorting edges by approximate proximity to a fixed point.
- */
-struct EdgeSort
-{
-	CFixedVector2D src;
-	EdgeSort(CFixedVector2D src) : src(src) { }
-	bool operator()(const Edge& a, const Edge& b)
-	{
-		if ((a.p0 - src).CompareLength(b.p0 - src) < 0)
-			return true;
-		return false;
-	}
-};
-
 void CCmpPathfinder::ComputeShortPath(const IObstructionTestFilter& filter,
 	entity_pos_t x0, entity_pos_t z0, entity_pos_t r,
 	entity_pos_t range, const Goal& goal, pass_class_t passClass, Path& path)
@@ -576,7 +832,10 @@ void CCmpPathfinder::ComputeShortPath(const IObstructionTestFilter& filter,
 		u16 i0, j0, i1, j1;
 		NearestTile(rangeXMin, rangeZMin, i0, j0);
 		NearestTile(rangeXMax, rangeZMax, i1, j1);
-		AddTerrainEdges(edgesAA, vertexes, i0, j0, i1, j1, r, passClass, *m_Grid);
+
+		std::vector<TerrainEdgeTile> tiles;
+		GetTerrainEdgeTiles(i0, j0, i1, j1, passClass, tiles);
+		AddTerrainEdges(edgesAA, vertexes, tiles, r);
 	}
 
 	// Find all the obstruction squares that might affect us
@@ -692,6 +951,10 @@ void CCmpPathfinder::ComputeShortPath(const IObstructionTestFilter& filter,
 
 	PROFILE_START("A*");
 
+	// Index the axis-aligned squares, since there are usually lots of them
+	// and only a few are near any particular ray
+	EdgeBuckets edgeBuckets(rangeXMin, rangeZMin, rangeXMax, rangeZMax, edgesAA);
+
 	PriorityQueue open;
 	PriorityQueue::Item qiStart = { START_VERTEX_ID, start.h };
 	open.push(qiStart);
@@ -712,16 +975,6 @@ void CCmpPathfinder::ComputeShortPath(const IObstructionTestFilter& filter,
 			break;
 		}
 
-		// Sort the edges so ones nearer this vertex are checked first by CheckVisibility,
-		// since they're more likely to block the rays
-		std::sort(edgesAA.begin(), edgesAA.end(), EdgeSort(vertexes[curr.id].p));
-
-		std::vector<EdgeAA> edgesLeft;
-		std::vector<EdgeAA> edgesRight;
-		std::vector<EdgeAA> edgesBottom;
-		std::vector<EdgeAA> edgesTop;
-		SplitAAEdges(vertexes[curr.id].p, edgesAA, edgesLeft, edgesRight, edgesBottom, edgesTop);
-
 		// Check the lines to every other vertex
 		for (size_t n = 0; n < vertexes.size(); ++n)
 		{
@@ -764,10 +1017,7 @@ void CCmpPathfinder::ComputeShortPath(const IObstructionTestFilter& filter,
 			}
 
 			bool visible =
-				CheckVisibilityLeft(vertexes[curr.id].p, npos, edgesLeft) &&
-				CheckVisibilityRight(vertexes[curr.id].p, npos, edgesRight) &&
-				CheckVisibilityBottom(vertexes[curr.id].p, npos, edgesBottom) &&
-				CheckVisibilityTop(vertexes[curr.id].p, npos, edgesTop) &&
+				edgeBuckets.CheckVisibility(vertexes[curr.id].p, npos) &&
 				CheckVisibility(vertexes[curr.id].p, npos, edges);
 
 			/*
@@ -873,7 +1123,10 @@ bool CCmpPathfinder::CheckMovement(const IObstructionTestFilter& filter,
 	u16 i0, j0, i1, j1;
 	NearestTile(std::min(x0, x1) - r, std::min(z0, z1) - r, i0, j0);
 	NearestTile(std::max(x0, x1) + r, std::max(z0, z1) + r, i1, j1);
-	AddTerrainEdges(edgesAA, vertexes, i0, j0, i1, j1, r, passClass, *m_Grid);
+
+	std::vector<TerrainEdgeTile> tiles;
+	GetTerrainEdgeTiles(i0, j0, i1, j1, passClass, tiles);
+	AddTerrainEdges(edgesAA, vertexes, tiles, r);
 
 	CFixedVector2D a(x0, z0);
 	CFixedVector2D b(x1, z1);
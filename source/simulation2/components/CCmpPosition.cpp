@@ -234,6 +234,8 @@ public:
 	{
 		m_YOffset = y;
 		m_RelativeToGround = false;
+
+		AdvertisePositionChanges();
 	}
 
 	virtual bool IsFloating()
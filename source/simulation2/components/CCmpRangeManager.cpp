@@ -24,6 +24,8 @@
 #include "simulation2/components/ICmpPosition.h"
 #include "simulation2/components/ICmpTerritoryManager.h"
 #include "simulation2/components/ICmpVision.h"
+#include "simulation2/helpers/EntityMap.h"
+#include "simulation2/helpers/LosStrip.h"
 #include "simulation2/helpers/Render.h"
 #include "simulation2/helpers/Spatial.h"
 
@@ -36,6 +38,10 @@
 #include "ps/Profile.h"
 #include "renderer/Scene.h"
 
+#if ARCH_X86_X64
+# include "lib/sysdep/arch/x86_x64/x86_x64.h"
+#endif
+
 #define DEBUG_RANGE_MANAGER_BOUNDS 0
 
 /**
@@ -43,13 +49,22 @@
  */
 struct Query
 {
+	Query() : destroyed(false), dirty(true) { }
+
 	bool enabled;
+	bool destroyed; // DestroyActiveQuery has been called, but the query hasn't been compacted away yet
 	entity_id_t source;
 	entity_pos_t minRange;
 	entity_pos_t maxRange;
 	u32 ownersMask;
 	i32 interface;
 	std::vector<entity_id_t> lastMatch;
+
+	// Incremental update state (not serialized; a query is dirty after deserialization).
+	// If the query is not dirty, and its source is still at lastSourcePos, and none of the
+	// subdivisions it covers have changed, then lastMatch is known to be up-to-date.
+	bool dirty;
+	CFixedVector2D lastSourcePos;
 };
 
 /**
@@ -98,6 +113,54 @@ struct SerializeQuery
 	}
 };
 
+/**
+ * Serialization helper template for the list of queries.
+ * Destroyed queries are skipped, and the format is the same as for SerializeMap.
+ */
+struct SerializeQueryList
+{
+	void operator()(ISerializer& serialize, const char* UNUSED(name), std::vector<std::pair<u32, Query> >& value)
+	{
+		u32 len = 0;
+		for (size_t i = 0; i < value.size(); ++i)
+			if (!value[i].second.destroyed)
+				++len;
+
+		serialize.NumberU32_Unbounded("length", len);
+		for (size_t i = 0; i < value.size(); ++i)
+		{
+			if (value[i].second.destroyed)
+				continue;
+			serialize.NumberU32_Unbounded("key", value[i].first);
+			SerializeQuery()(serialize, "value", value[i].second);
+		}
+	}
+
+	void operator()(IDeserializer& deserialize, const char* UNUSED(name), std::vector<std::pair<u32, Query> >& value)
+	{
+		value.clear();
+		u32 len;
+		deserialize.NumberU32_Unbounded("length", len);
+		value.resize(len);
+		for (size_t i = 0; i < len; ++i)
+		{
+			deserialize.NumberU32_Unbounded("key", value[i].first);
+			SerializeQuery()(deserialize, "value", value[i].second);
+		}
+	}
+};
+
+/**
+ * Functor for binary-searching the list of queries by tag.
+ */
+struct QueryTagOrdering
+{
+	bool operator()(const std::pair<u32, Query>& a, u32 b) const
+	{
+		return a.first < b;
+	}
+};
+
 /**
  * Serialization helper template for EntityData
  */
@@ -123,7 +186,7 @@ struct SerializeEntityData
  */
 struct EntityDistanceOrdering
 {
-	EntityDistanceOrdering(const std::map<entity_id_t, EntityData>& entities, const CFixedVector2D& source) :
+	EntityDistanceOrdering(const EntityMap<EntityData>& entities, const CFixedVector2D& source) :
 		m_EntityData(entities), m_Source(source)
 	{
 	}
@@ -137,7 +200,7 @@ struct EntityDistanceOrdering
 		return (vecA.CompareLength(vecB) < 0);
 	}
 
-	const std::map<entity_id_t, EntityData>& m_EntityData;
+	const EntityMap<EntityData>& m_EntityData;
 	CFixedVector2D m_Source;
 
 private:
@@ -182,9 +245,21 @@ public:
 
 	// Range query state:
 	tag_t m_QueryNext; // next allocated id
-	std::map<tag_t, Query> m_Queries;
-	std::map<entity_id_t, EntityData> m_EntityData;
-	SpatialSubdivision<entity_id_t> m_Subdivision; // spatial index of m_EntityData
+	// Queries sorted by tag (which always increases, so new ones are simply appended).
+	// Destroyed queries stay in place until there are enough to be worth compacting,
+	// so lookups can binary-search and updates are a linear scan.
+	std::vector<std::pair<tag_t, Query> > m_Queries;
+	size_t m_QueriesDestroyed;
+	EntityMap<EntityData> m_EntityData;
+	SpatialLooseGrid<entity_id_t> m_Subdivision; // spatial index of m_EntityData
+	std::vector<entity_id_t> m_SubdivisionResults; // reused by PerformQuery to avoid allocations
+
+	// Subdivisions in which some entity has entered, left, moved, or changed owner
+	// since the last ExecuteActiveQueries (used to skip queries whose results can't
+	// have changed). m_DirtyDivisionList contains the indexes of the non-zero entries
+	// of m_DirtyDivisions.
+	std::vector<u8> m_DirtyDivisions;
+	std::vector<u32> m_DirtyDivisionList;
 
 	// LOS state:
 
@@ -208,6 +283,30 @@ public:
 	// (TODO: this is usually a waste of memory)
 	std::vector<u32> m_LosStateRevealed;
 
+	// Tracking of changes to the LOS state, for GetLosDirtyRegions (not serialized).
+	// Each block of LOS_DIRTY_BLOCK_SIZE*LOS_DIRTY_BLOCK_SIZE vertexes stores the
+	// value of m_LosDirtyCounter when its state last changed; the counter is
+	// incremented whenever a caller collects the changes, so callers with a
+	// lower dirty ID haven't seen that change yet.
+	static const i32 LOS_DIRTY_BLOCK_SIZE = 16;
+	i32 m_LosDirtyBlocksPerSide;
+	std::vector<size_t> m_LosDirtyBlocks;
+	size_t m_LosDirtyCounter;
+	size_t m_LosResetCounter; // value of m_LosDirtyCounter when every vertex last changed
+
+	// For each row of vertexes, the range [first, second) of the ones that aren't
+	// LosIsOffWorld (which is always contiguous), so the strip kernels don't have
+	// to test each vertex
+	std::vector<std::pair<i32, i32> > m_LosOnWorldRows;
+
+	// Strip kernels (SSE2 versions if supported)
+	LosStrip::AddFunc m_LosAddStrip;
+	LosStrip::RemoveFunc m_LosRemoveStrip;
+
+	// Half-widths of the strips of a circle centered on a vertex, per distinct
+	// vision range, used as the initial guesses in LosUpdateHelper (not serialized)
+	std::map<entity_pos_t, std::vector<i32> > m_LosCircleSpans;
+
 	static std::string GetSchema()
 	{
 		return "<a:component type='system'/><empty/>";
@@ -216,6 +315,7 @@ public:
 	virtual void Init(const CParamNode& UNUSED(paramNode))
 	{
 		m_QueryNext = 1;
+		m_QueriesDestroyed = 0;
 
 		m_DebugOverlayEnabled = false;
 		m_DebugOverlayDirty = true;
@@ -234,6 +334,20 @@ public:
 		m_TerrainVerticesPerSide = 0;
 
 		m_TerritoriesDirtyID = 0;
+
+		m_LosDirtyBlocksPerSide = 0;
+		m_LosDirtyCounter = 1;
+		m_LosResetCounter = 1;
+
+		m_LosAddStrip = &LosStrip::Add;
+		m_LosRemoveStrip = &LosStrip::Remove;
+#if ARCH_X86_X64
+		if (x86_x64::Cap(x86_x64::CAP_SSE2))
+		{
+			m_LosAddStrip = &LosStrip::Add_SSE2;
+			m_LosRemoveStrip = &LosStrip::Remove_SSE2;
+		}
+#endif
 	}
 
 	virtual void Deinit()
@@ -249,8 +363,8 @@ public:
 		serialize.NumberFixed_Unbounded("world z1", m_WorldZ1);
 
 		serialize.NumberU32_Unbounded("query next", m_QueryNext);
-		SerializeMap<SerializeU32_Unbounded, SerializeQuery>()(serialize, "queries", m_Queries);
-		SerializeMap<SerializeU32_Unbounded, SerializeEntityData>()(serialize, "entity data", m_EntityData);
+		SerializeQueryList()(serialize, "queries", m_Queries);
+		SerializeEntityMap<SerializeEntityData>()(serialize, "entity data", m_EntityData);
 
 		SerializeMap<SerializeI32_Unbounded, SerializeBool>()(serialize, "los reveal all", m_LosRevealAll);
 		serialize.Bool("los circular", m_LosCircular);
@@ -319,7 +433,7 @@ public:
 			const CMessagePositionChanged& msgData = static_cast<const CMessagePositionChanged&> (msg);
 			entity_id_t ent = msgData.entity;
 
-			std::map<u32, EntityData>::iterator it = m_EntityData.find(ent);
+			EntityMap<EntityData>::iterator it = m_EntityData.find(ent);
 
 			// Ignore if we're not already tracking this entity
 			if (it == m_EntityData.end())
@@ -332,12 +446,15 @@ public:
 					CFixedVector2D from(it->second.x, it->second.z);
 					CFixedVector2D to(msgData.x, msgData.z);
 					m_Subdivision.Move(ent, from, to);
+					MarkDivisionsDirty(from);
+					MarkDivisionsDirty(to);
 					LosMove(it->second.owner, it->second.visionRange, from, to);
 				}
 				else
 				{
 					CFixedVector2D to(msgData.x, msgData.z);
 					m_Subdivision.Add(ent, to);
+					MarkDivisionsDirty(to);
 					LosAdd(it->second.owner, it->second.visionRange, to);
 				}
 
@@ -351,6 +468,7 @@ public:
 				{
 					CFixedVector2D from(it->second.x, it->second.z);
 					m_Subdivision.Remove(ent, from);
+					MarkDivisionsDirty(from);
 					LosRemove(it->second.owner, it->second.visionRange, from);
 				}
 
@@ -366,7 +484,7 @@ public:
 			const CMessageOwnershipChanged& msgData = static_cast<const CMessageOwnershipChanged&> (msg);
 			entity_id_t ent = msgData.entity;
 
-			std::map<u32, EntityData>::iterator it = m_EntityData.find(ent);
+			EntityMap<EntityData>::iterator it = m_EntityData.find(ent);
 
 			// Ignore if we're not already tracking this entity
 			if (it == m_EntityData.end())
@@ -375,6 +493,7 @@ public:
 			if (it->second.inWorld)
 			{
 				CFixedVector2D pos(it->second.x, it->second.z);
+				MarkDivisionsDirty(pos);
 				LosRemove(it->second.owner, it->second.visionRange, pos);
 				LosAdd(msgData.to, it->second.visionRange, pos);
 			}
@@ -389,14 +508,18 @@ public:
 			const CMessageDestroy& msgData = static_cast<const CMessageDestroy&> (msg);
 			entity_id_t ent = msgData.entity;
 
-			std::map<u32, EntityData>::iterator it = m_EntityData.find(ent);
+			EntityMap<EntityData>::iterator it = m_EntityData.find(ent);
 
 			// Ignore if we're not already tracking this entity
 			if (it == m_EntityData.end())
 				break;
 
 			if (it->second.inWorld)
-				m_Subdivision.Remove(ent, CFixedVector2D(it->second.x, it->second.z));
+			{
+				CFixedVector2D pos(it->second.x, it->second.z);
+				m_Subdivision.Remove(ent, pos);
+				MarkDivisionsDirty(pos);
+			}
 
 			// This will be called after Ownership's OnDestroy, so ownership will be set
 			// to -1 already and we don't have to do a LosRemove here
@@ -444,7 +567,7 @@ public:
 
 		std::vector<std::vector<u16> > oldPlayerCounts = m_LosPlayerCounts;
 		std::vector<u32> oldStateRevealed = m_LosStateRevealed;
-		SpatialSubdivision<entity_id_t> oldSubdivision = m_Subdivision;
+		SpatialLooseGrid<entity_id_t> oldSubdivision = m_Subdivision;
 
 		ResetDerivedData(true);
 		
@@ -470,6 +593,61 @@ public:
 			debug_warn(L"inconsistent revealed");
 		if (oldSubdivision != m_Subdivision)
 			debug_warn(L"inconsistent subdivs");
+
+		// Check that the incrementally-updated LOS state says exactly the
+		// on-world vertexes with a non-zero count are visible
+		if (!IsLosStateConsistent())
+			debug_warn(L"inconsistent los state");
+
+		// Check that every active query which ExecuteActiveQueries would skip
+		// really does have an up-to-date lastMatch
+		for (std::vector<std::pair<tag_t, Query> >::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
+		{
+			Query& q = it->second;
+			if (!q.enabled)
+				continue;
+
+			CmpPtr<ICmpPosition> cmpSourcePosition(GetSimContext(), q.source);
+			if (cmpSourcePosition.null() || !cmpSourcePosition->IsInWorld())
+				continue;
+
+			if (!IsQueryClean(q, cmpSourcePosition->GetPosition2D()))
+				continue;
+
+			std::vector<entity_id_t> r;
+			PerformQuery(q, r);
+			if (r != q.lastMatch)
+				debug_warn(L"inconsistent active query");
+		}
+	}
+
+	/**
+	 * Returns whether every player's visible bits in m_LosState are set for exactly
+	 * the on-world vertexes with a non-zero count (and those are explored too).
+	 */
+	bool IsLosStateConsistent()
+	{
+		if (m_LosState.size() != (size_t)(m_TerrainVerticesPerSide*m_TerrainVerticesPerSide))
+			return false;
+
+		for (player_id_t p = 1; p <= MAX_LOS_PLAYER_ID; ++p)
+		{
+			const std::vector<u16>& counts = m_LosPlayerCounts[p];
+			for (i32 j = 0; j < m_TerrainVerticesPerSide; ++j)
+			{
+				for (i32 i = 0; i < m_TerrainVerticesPerSide; ++i)
+				{
+					i32 idx = i + j*m_TerrainVerticesPerSide;
+					u32 state = m_LosState[idx] >> (2*(p-1));
+					bool visible = !counts.empty() && counts[idx] > 0 && !LosIsOffWorld(i, j);
+					if (((state & LOS_VISIBLE) != 0) != visible)
+						return false;
+					if ((state & LOS_VISIBLE) && !(state & LOS_EXPLORED))
+						return false;
+				}
+			}
+		}
+		return true;
 	}
 
 	// Reinitialise subdivisions and LOS data, based on entity data
@@ -488,7 +666,32 @@ public:
 		m_LosStateRevealed.clear();
 		m_LosStateRevealed.resize(m_TerrainVerticesPerSide*m_TerrainVerticesPerSide);
 
-		for (std::map<entity_id_t, EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
+		// When recomputing the state from scratch, everything has changed
+		// (unless the LOS state is being kept, e.g. by Verify)
+		m_LosDirtyBlocksPerSide = (m_TerrainVerticesPerSide + LOS_DIRTY_BLOCK_SIZE - 1) / LOS_DIRTY_BLOCK_SIZE;
+		if (m_LosDirtyBlocks.size() != (size_t)(m_LosDirtyBlocksPerSide*m_LosDirtyBlocksPerSide))
+		{
+			m_LosDirtyBlocks.clear();
+			m_LosDirtyBlocks.resize(m_LosDirtyBlocksPerSide*m_LosDirtyBlocksPerSide);
+			m_LosResetCounter = m_LosDirtyCounter;
+		}
+		if (!skipLosState)
+			m_LosResetCounter = m_LosDirtyCounter;
+
+		m_LosOnWorldRows.clear();
+		m_LosOnWorldRows.resize(m_TerrainVerticesPerSide, std::make_pair(0, 0));
+		for (i32 j = 0; j < m_TerrainVerticesPerSide; ++j)
+		{
+			i32 i0 = 0;
+			while (i0 < m_TerrainVerticesPerSide && LosIsOffWorld(i0, j))
+				++i0;
+			i32 i1 = i0;
+			while (i1 < m_TerrainVerticesPerSide && !LosIsOffWorld(i1, j))
+				++i1;
+			m_LosOnWorldRows[j] = std::make_pair(i0, i1);
+		}
+
+		for (EntityMap<EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
 		{
 			if (it->second.inWorld)
 				LosAdd(it->second.owner, it->second.visionRange, CFixedVector2D(it->second.x, it->second.z));
@@ -505,11 +708,75 @@ public:
 		// (TODO: find the optimal number instead of blindly guessing)
 		m_Subdivision.Reset(x1, z1, entity_pos_t::FromInt(8*TERRAIN_TILE_SIZE));
 
-		for (std::map<entity_id_t, EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
+		for (EntityMap<EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
 		{
 			if (it->second.inWorld)
 				m_Subdivision.Add(it->first, CFixedVector2D(it->second.x, it->second.z));
 		}
+
+		// The division layout may have changed, so we can't trust any incremental state
+		m_DirtyDivisions.clear();
+		m_DirtyDivisions.resize(m_Subdivision.GetDivisionsW() * m_Subdivision.GetDivisionsH());
+		m_DirtyDivisionList.clear();
+		for (std::vector<std::pair<tag_t, Query> >::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
+			it->second.dirty = true;
+	}
+
+	/**
+	 * Record that the set of entities near the given point (and therefore the
+	 * result of any query covering it) may have changed.
+	 */
+	void MarkDivisionsDirty(CFixedVector2D pos)
+	{
+		u32 i0, j0, i1, j1;
+		m_Subdivision.GetDivisionRange(pos, pos, i0, j0, i1, j1);
+		u32 w = m_Subdivision.GetDivisionsW();
+		for (u32 j = j0; j <= j1; ++j)
+		{
+			for (u32 i = i0; i <= i1; ++i)
+			{
+				u8& dirty = m_DirtyDivisions.at(i + j*w);
+				if (!dirty)
+				{
+					dirty = 1;
+					m_DirtyDivisionList.push_back(i + j*w);
+				}
+			}
+		}
+	}
+
+	void ClearDirtyDivisions()
+	{
+		for (size_t i = 0; i < m_DirtyDivisionList.size(); ++i)
+			m_DirtyDivisions[m_DirtyDivisionList[i]] = 0;
+		m_DirtyDivisionList.clear();
+	}
+
+	/**
+	 * Returns whether q.lastMatch is guaranteed to equal the result of PerformQuery,
+	 * given the source entity's current position, without actually performing the query.
+	 */
+	bool IsQueryClean(const Query& q, CFixedVector2D pos)
+	{
+		if (q.dirty || !(pos == q.lastSourcePos))
+			return false;
+
+		if (m_DirtyDivisionList.empty())
+			return true;
+
+		// Queries that ignore distance can be affected by every division
+		if (q.maxRange < entity_pos_t::Zero())
+			return false;
+
+		u32 i0, j0, i1, j1;
+		m_Subdivision.GetDivisionRange(pos - CFixedVector2D(q.maxRange, q.maxRange), pos + CFixedVector2D(q.maxRange, q.maxRange), i0, j0, i1, j1);
+		u32 w = m_Subdivision.GetDivisionsW();
+		for (u32 j = j0; j <= j1; ++j)
+			for (u32 i = i0; i <= i1; ++i)
+				if (m_DirtyDivisions[i + j*w])
+					return false;
+
+		return true;
 	}
 
 	virtual tag_t CreateActiveQuery(entity_id_t source,
@@ -517,46 +784,89 @@ public:
 		std::vector<int> owners, int requiredInterface)
 	{
 		tag_t id = m_QueryNext++;
-		m_Queries[id] = ConstructQuery(source, minRange, maxRange, owners, requiredInterface);
+		m_Queries.push_back(std::make_pair(id, ConstructQuery(source, minRange, maxRange, owners, requiredInterface)));
 
 		return id;
 	}
 
 	virtual void DestroyActiveQuery(tag_t tag)
 	{
-		if (m_Queries.find(tag) == m_Queries.end())
+		Query* q = FindQuery(tag);
+		if (!q)
 		{
 			LOGERROR(L"CCmpRangeManager: DestroyActiveQuery called with invalid tag %u", tag);
 			return;
 		}
 
-		m_Queries.erase(tag);
+		q->destroyed = true;
+		q->enabled = false;
+		std::vector<entity_id_t>().swap(q->lastMatch);
+
+		++m_QueriesDestroyed;
+		if (m_QueriesDestroyed > m_Queries.size() / 2)
+			CompactQueries();
 	}
 
 	virtual void EnableActiveQuery(tag_t tag)
 	{
-		std::map<tag_t, Query>::iterator it = m_Queries.find(tag);
-		if (it == m_Queries.end())
+		Query* q = FindQuery(tag);
+		if (!q)
 		{
 			LOGERROR(L"CCmpRangeManager: EnableActiveQuery called with invalid tag %u", tag);
 			return;
 		}
 
-		Query& q = it->second;
-		q.enabled = true;
+		q->enabled = true;
+		q->dirty = true;
 	}
 
 	virtual void DisableActiveQuery(tag_t tag)
 	{
-		std::map<tag_t, Query>::iterator it = m_Queries.find(tag);
-		if (it == m_Queries.end())
+		Query* q = FindQuery(tag);
+		if (!q)
 		{
 			LOGERROR(L"CCmpRangeManager: DisableActiveQuery called with invalid tag %u", tag);
 			return;
 		}
 
-		Query& q = it->second;
-		q.enabled = false;
+		q->enabled = false;
+	}
+
+	/**
+	 * Returns the non-destroyed query with the given tag, or NULL if there is none.
+	 * The pointer is invalidated by CreateActiveQuery and DestroyActiveQuery.
+	 */
+	Query* FindQuery(tag_t tag)
+	{
+		std::vector<std::pair<tag_t, Query> >::iterator it = std::lower_bound(m_Queries.begin(), m_Queries.end(), tag, QueryTagOrdering());
+		if (it == m_Queries.end() || it->first != tag || it->second.destroyed)
+			return NULL;
+		return &it->second;
+	}
+
+	/**
+	 * Remove all destroyed queries from m_Queries, preserving the order of the others.
+	 */
+	void CompactQueries()
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < m_Queries.size(); ++i)
+		{
+			if (m_Queries[i].second.destroyed)
+				continue;
+
+			if (i != n)
+			{
+				// Swap the match list rather than copying it
+				std::vector<entity_id_t> match;
+				match.swap(m_Queries[i].second.lastMatch);
+				m_Queries[n] = m_Queries[i];
+				m_Queries[n].second.lastMatch.swap(match);
+			}
+			++n;
+		}
+		m_Queries.resize(n);
+		m_QueriesDestroyed = 0;
 	}
 
 	virtual std::vector<entity_id_t> ExecuteQuery(entity_id_t source,
@@ -591,15 +901,16 @@ public:
 
 		std::vector<entity_id_t> r;
 
-		std::map<tag_t, Query>::iterator it = m_Queries.find(tag);
-		if (it == m_Queries.end())
+		Query* query = FindQuery(tag);
+		if (!query)
 		{
 			LOGERROR(L"CCmpRangeManager: ResetActiveQuery called with invalid tag %u", tag);
 			return r;
 		}
 
-		Query& q = it->second;
+		Query& q = *query;
 		q.enabled = true;
+		q.dirty = true;
 
 		CmpPtr<ICmpPosition> cmpSourcePosition(GetSimContext(), q.source);
 		if (cmpSourcePosition.null() || !cmpSourcePosition->IsInWorld())
@@ -612,6 +923,8 @@ public:
 		PerformQuery(q, r);
 
 		q.lastMatch = r;
+		q.dirty = false;
+		q.lastSourcePos = cmpSourcePosition->GetPosition2D();
 
 		// Return the list sorted by distance from the entity
 		CFixedVector2D pos = cmpSourcePosition->GetPosition2D();
@@ -626,7 +939,7 @@ public:
 
 		u32 ownerMask = CalcOwnerMask(player);
 
-		for (std::map<entity_id_t, EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
+		for (EntityMap<EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
 		{
 			// Check owner and add to list if it matches
 			if (CalcOwnerMask(it->second.owner) & ownerMask)
@@ -646,6 +959,10 @@ public:
 
 	/**
 	 * Update all currently-enabled active queries.
+	 *
+	 * Queries are only re-evaluated if their source has moved, or if some entity
+	 * in one of the subdivisions they cover has changed; otherwise the result
+	 * must be identical to lastMatch so there is nothing to report.
 	 */
 	void ExecuteActiveQueries()
 	{
@@ -655,7 +972,7 @@ public:
 		// no entities will move until we've finished checking all the ranges
 		std::vector<std::pair<entity_id_t, CMessageRangeUpdate> > messages;
 
-		for (std::map<tag_t, Query>::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
+		for (std::vector<std::pair<tag_t, Query> >::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
 		{
 			Query& q = it->second;
 
@@ -664,8 +981,20 @@ public:
 
 			CmpPtr<ICmpPosition> cmpSourcePosition(GetSimContext(), q.source);
 			if (cmpSourcePosition.null() || !cmpSourcePosition->IsInWorld())
+			{
+				// The dirty divisions will be forgotten below, so we'll need
+				// to recompute this query when the source returns
+				q.dirty = true;
+				continue;
+			}
+
+			CFixedVector2D sourcePos = cmpSourcePosition->GetPosition2D();
+			if (IsQueryClean(q, sourcePos))
 				continue;
 
+			q.dirty = false;
+			q.lastSourcePos = sourcePos;
+
 			std::vector<entity_id_t> r;
 			r.reserve(q.lastMatch.size());
 
@@ -682,8 +1011,7 @@ public:
 
 			// Return the 'added' list sorted by distance from the entity
 			// (Don't bother sorting 'removed' because they might not even have positions or exist any more)
-			CFixedVector2D pos = cmpSourcePosition->GetPosition2D();
-			std::stable_sort(added.begin(), added.end(), EntityDistanceOrdering(m_EntityData, pos));
+			std::stable_sort(added.begin(), added.end(), EntityDistanceOrdering(m_EntityData, sourcePos));
 
 			messages.push_back(std::make_pair(q.source, CMessageRangeUpdate(it->first)));
 			messages.back().second.added.swap(added);
@@ -692,6 +1020,11 @@ public:
 			it->second.lastMatch.swap(r);
 		}
 
+		// Every query now reflects the current state of the world (disabled ones will be
+		// marked dirty when re-enabled), so start tracking changes from scratch.
+		// (This must happen before sending the messages, since their handlers may move entities.)
+		ClearDirtyDivisions();
+
 		for (size_t i = 0; i < messages.size(); ++i)
 			GetSimContext().GetComponentManager().PostMessage(messages[i].first, messages[i].second);
 	}
@@ -733,7 +1066,7 @@ public:
 		// Special case: range -1.0 means check all entities ignoring distance
 		if (q.maxRange == entity_pos_t::FromInt(-1))
 		{
-			for (std::map<entity_id_t, EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
+			for (EntityMap<EntityData>::const_iterator it = m_EntityData.begin(); it != m_EntityData.end(); ++it)
 			{
 				if (!TestEntityQuery(q, it->first, it->second))
 					continue;
@@ -744,11 +1077,12 @@ public:
 		else
 		{
 			// Get a quick list of entities that are potentially in range
-			std::vector<entity_id_t> ents = m_Subdivision.GetNear(pos, q.maxRange);
+			std::vector<entity_id_t>& ents = m_SubdivisionResults;
+			m_Subdivision.GetNear(ents, pos, q.maxRange);
 
 			for (size_t i = 0; i < ents.size(); ++i)
 			{
-				std::map<entity_id_t, EntityData>::const_iterator it = m_EntityData.find(ents[i]);
+				EntityMap<EntityData>::const_iterator it = m_EntityData.find(ents[i]);
 				ENSURE(it != m_EntityData.end());
 
 				if (!TestEntityQuery(q, it->first, it->second))
@@ -811,9 +1145,11 @@ public:
 		{
 			m_DebugOverlayLines.clear();
 
-			for (std::map<tag_t, Query>::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
+			for (std::vector<std::pair<tag_t, Query> >::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
 			{
 				Query& q = it->second;
+				if (q.destroyed)
+					continue;
 
 				CmpPtr<ICmpPosition> cmpSourcePosition(GetSimContext(), q.source);
 				if (cmpSourcePosition.null() || !cmpSourcePosition->IsInWorld())
@@ -917,6 +1253,55 @@ public:
 	virtual void SetLosRevealAll(player_id_t player, bool enabled)
 	{
 		m_LosRevealAll[player] = enabled;
+
+		// This changes which state GetLosQuerier returns
+		m_LosResetCounter = m_LosDirtyCounter;
+	}
+
+	virtual void GetLosDirtyRegions(size_t* dirtyID, std::vector<LosRegion>& regions)
+	{
+		regions.clear();
+
+		// If the caller's ID is from before the last reset (or from a different
+		// instance of this component, e.g. before deserialization), then everything is dirty
+		if (*dirtyID <= m_LosResetCounter || *dirtyID > m_LosDirtyCounter)
+		{
+			if (m_TerrainVerticesPerSide > 0)
+			{
+				LosRegion all = { 0, 0, m_TerrainVerticesPerSide, m_TerrainVerticesPerSide };
+				regions.push_back(all);
+			}
+		}
+		else
+		{
+			// Merge horizontally adjacent dirty blocks into a single region
+			for (i32 bj = 0; bj < m_LosDirtyBlocksPerSide; ++bj)
+			{
+				i32 start = -1;
+				for (i32 bi = 0; bi <= m_LosDirtyBlocksPerSide; ++bi)
+				{
+					bool dirty = (bi < m_LosDirtyBlocksPerSide && m_LosDirtyBlocks[bi + bj*m_LosDirtyBlocksPerSide] >= *dirtyID);
+					if (dirty && start < 0)
+					{
+						start = bi;
+					}
+					else if (!dirty && start >= 0)
+					{
+						LosRegion region = {
+							start*LOS_DIRTY_BLOCK_SIZE,
+							bj*LOS_DIRTY_BLOCK_SIZE,
+							std::min(bi*LOS_DIRTY_BLOCK_SIZE, m_TerrainVerticesPerSide),
+							std::min((bj+1)*LOS_DIRTY_BLOCK_SIZE, m_TerrainVerticesPerSide)
+						};
+						regions.push_back(region);
+						start = -1;
+					}
+				}
+			}
+		}
+
+		// Later changes will be marked with the new counter value
+		*dirtyID = ++m_LosDirtyCounter;
 	}
 
 	virtual bool GetLosRevealAll(player_id_t player)
@@ -967,15 +1352,36 @@ public:
 				u8 p = grid.get(i, j) & ICmpTerritoryManager::TERRITORY_PLAYER_MASK;
 				if (p > 0 && p <= MAX_LOS_PLAYER_ID)
 				{
-					m_LosState[i + j*m_TerrainVerticesPerSide] |= (LOS_EXPLORED << (2*(p-1)));
-					m_LosState[i+1 + j*m_TerrainVerticesPerSide] |= (LOS_EXPLORED << (2*(p-1)));
-					m_LosState[i + (j+1)*m_TerrainVerticesPerSide] |= (LOS_EXPLORED << (2*(p-1)));
-					m_LosState[i+1 + (j+1)*m_TerrainVerticesPerSide] |= (LOS_EXPLORED << (2*(p-1)));
+					u32 explored = (LOS_EXPLORED << (2*(p-1)));
+					LosExploreVertex(i, j, explored);
+					LosExploreVertex(i+1, j, explored);
+					LosExploreVertex(i, j+1, explored);
+					LosExploreVertex(i+1, j+1, explored);
 				}
 			}
 		}
 	}
 
+	/**
+	 * Records that the LOS state of vertexes (i0,j) to (i1,j) (inclusive) has changed.
+	 */
+	inline void LosMarkDirty(i32 i0, i32 i1, i32 j)
+	{
+		size_t* row = &m_LosDirtyBlocks[(j / LOS_DIRTY_BLOCK_SIZE) * m_LosDirtyBlocksPerSide];
+		for (i32 b = i0 / LOS_DIRTY_BLOCK_SIZE; b <= i1 / LOS_DIRTY_BLOCK_SIZE; ++b)
+			row[b] = m_LosDirtyCounter;
+	}
+
+	inline void LosExploreVertex(i32 i, i32 j, u32 explored)
+	{
+		u32& state = m_LosState[i + j*m_TerrainVerticesPerSide];
+		if (!(state & explored))
+		{
+			state |= explored;
+			LosMarkDirty(i, i, j);
+		}
+	}
+
 	/**
 	 * Returns whether the given vertex is outside the normal bounds of the world
 	 * (i.e. outside the range of a circular map)
@@ -1016,21 +1422,17 @@ public:
 			return;
 
 		i32 idx0 = j*m_TerrainVerticesPerSide + i0;
-		i32 idx1 = j*m_TerrainVerticesPerSide + i1;
 
-		for (i32 idx = idx0; idx <= idx1; ++idx)
-		{
-			// Increasing from zero to non-zero - move from unexplored/explored to visible+explored
-			if (counts[idx] == 0)
-			{
-				i32 i = i0 + idx - idx0;
-				if (!LosIsOffWorld(i, j))
-					m_LosState[idx] |= ((LOS_VISIBLE | LOS_EXPLORED) << (2*(owner-1)));
-			}
+		// Only the on-world vertexes become visible
+		const std::pair<i32, i32>& onWorld = m_LosOnWorldRows[j];
+		i32 onWorld0 = std::max(onWorld.first - i0, 0);
+		i32 onWorld1 = std::max(onWorld.second - i0, 0);
 
-			ASSERT(counts[idx] < 65535);
-			counts[idx] = (u16)(counts[idx] + 1); // ignore overflow; the player should never have 64K units
-		}
+		bool changed = m_LosAddStrip(&counts[idx0], &m_LosState[idx0], i1 - i0 + 1,
+			(LOS_VISIBLE | LOS_EXPLORED) << (2*(owner-1)), onWorld0, onWorld1);
+
+		if (changed)
+			LosMarkDirty(i0, i1, j);
 	}
 
 	/**
@@ -1042,20 +1444,50 @@ public:
 			return;
 
 		i32 idx0 = j*m_TerrainVerticesPerSide + i0;
-		i32 idx1 = j*m_TerrainVerticesPerSide + i1;
 
-		for (i32 idx = idx0; idx <= idx1; ++idx)
-		{
-			ASSERT(counts[idx] > 0);
-			counts[idx] = (u16)(counts[idx] - 1);
+		bool changed = m_LosRemoveStrip(&counts[idx0], &m_LosState[idx0], i1 - i0 + 1,
+			LOS_VISIBLE << (2*(owner-1)));
 
-			// Decreasing from non-zero to zero - move from visible+explored to explored
-			if (counts[idx] == 0)
-			{
-				// (If LosIsOffWorld then this is a no-op, so don't bother doing the check)
-				m_LosState[idx] &= ~(LOS_VISIBLE << (2*(owner-1)));
-			}
+		if (changed)
+			LosMarkDirty(i0, i1, j);
+	}
+
+	/**
+	 * Returns the half-widths of the strips of a circle of radius @p r (in tiles)
+	 * centered on a vertex: element k is the largest h such that k^2 + h^2 <= r^2
+	 * (or 0 if there is none). Computed once per distinct vision range.
+	 */
+	const std::vector<i32>& GetLosCircleSpans(entity_pos_t visionRange, entity_pos_t r)
+	{
+		std::map<entity_pos_t, std::vector<i32> >::iterator it = m_LosCircleSpans.find(visionRange);
+		if (it != m_LosCircleSpans.end())
+			return it->second;
+
+		std::vector<i32>& spans = m_LosCircleSpans[visionRange];
+		entity_pos_t r2 = r.Square();
+		i32 h = r.ToInt_RoundToInfinity();
+		for (i32 k = 0; entity_pos_t::FromInt(k).Square() <= r2; ++k)
+		{
+			entity_pos_t k2 = entity_pos_t::FromInt(k).Square();
+			while (h > 0 && k2 + entity_pos_t::FromInt(h).Square() > r2)
+				--h;
+			spans.push_back(h);
 		}
+		return spans;
+	}
+
+	/**
+	 * Returns the initial guesses for the ends of the strip in row @p j of the circle
+	 * at (@p x, @p y), from the precomputed spans. The guesses only need to be
+	 * close (to minimise the adjustments) and to satisfy i0 <= xceil and
+	 * i1 >= xfloor (so the adjustments converge to the exact strip).
+	 */
+	inline void LosGuessStrip(const std::vector<i32>& spans, i32 j, entity_pos_t y, i32 xfloor, i32 xceil, i32& i0, i32& i1)
+	{
+		size_t k = (size_t)(entity_pos_t::FromInt(j) - y).Absolute().ToInt_RoundToNearest();
+		i32 h = (k < spans.size() ? spans[k] : 0);
+		i0 = xceil - h;
+		i1 = xfloor + h;
 	}
 
 	/**
@@ -1084,9 +1516,10 @@ public:
 		// to get smoother behaviour as a unit moves rather than jumping a whole tile
 		// at once.
 		// To avoid the cost of sqrt when computing the outline of the circle,
-		// we loop from the bottom to the top and estimate the width of the current
-		// strip based on the previous strip, then adjust each end of the strip
-		// inwards or outwards until it's the widest that still falls within the circle.
+		// we estimate the width of each strip from a table of the strip widths
+		// of a circle centered on a vertex (computed once per vision range),
+		// then adjust each end of the strip inwards or outwards until it's the
+		// widest that still falls within the circle.
 
 		// Compute top/bottom coordinates, and clamp to exclude the 1-tile border around the map
 		// (so that we never render the sharp edge of the map)
@@ -1105,12 +1538,14 @@ public:
 		i32 xfloor = (x - entity_pos_t::Epsilon()).ToInt_RoundToNegInfinity();
 		i32 xceil = (x + entity_pos_t::Epsilon()).ToInt_RoundToInfinity();
 
-		// Initialise the strip (i0, i1) to a rough guess
-		i32 i0 = xfloor;
-		i32 i1 = xceil;
+		const std::vector<i32>& spans = GetLosCircleSpans(visionRange, r);
 
 		for (i32 j = j0clamp; j <= j1clamp; ++j)
 		{
+			// Initialise the strip (i0, i1) to a rough guess
+			i32 i0, i1;
+			LosGuessStrip(spans, j, y, xfloor, xceil, i0, i1);
+
 			// Adjust i0 and i1 to be the outermost values that don't exceed
 			// the circle's radius (i.e. require dy^2 + dx^2 <= r^2).
 			// When moving the points inwards, clamp them to xceil+1 or xfloor-1
@@ -1194,13 +1629,14 @@ public:
 		i32 xfloor_to = (x_to - entity_pos_t::Epsilon()).ToInt_RoundToNegInfinity();
 		i32 xceil_to = (x_to + entity_pos_t::Epsilon()).ToInt_RoundToInfinity();
 
-		i32 i0_from = xfloor_from;
-		i32 i1_from = xceil_from;
-		i32 i0_to = xfloor_to;
-		i32 i1_to = xceil_to;
+		const std::vector<i32>& spans = GetLosCircleSpans(visionRange, r);
 
 		for (i32 j = j0clamp; j <= j1clamp; ++j)
 		{
+			i32 i0_from, i1_from, i0_to, i1_to;
+			LosGuessStrip(spans, j, y_from, xfloor_from, xceil_from, i0_from, i1_from);
+			LosGuessStrip(spans, j, y_to, xfloor_to, xceil_to, i0_to, i1_to);
+
 			entity_pos_t dy_from = entity_pos_t::FromInt(j) - y_from;
 			entity_pos_t dy2_from = dy_from.Square();
 			while (dy2_from + (entity_pos_t::FromInt(i0_from-1) - x_from).Square() <= r2)
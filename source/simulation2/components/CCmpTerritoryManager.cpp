@@ -59,6 +59,16 @@ public:
 	virtual void ProcessTile(ssize_t i, ssize_t j);
 };
 
+/*
+We compute the territory influence of an entity with a kind of best-first search,
+storing an 'open' list of tiles that have not yet been processed,
+then taking the highest-weight tile (closest to origin) and updating the weight
+of extending to each neighbour (based on radius-determining 'falloff' value,
+adjusted by terrain movement cost), and repeating until all tiles are processed.
+*/
+
+typedef PriorityQueueHeap<std::pair<u16, u16>, u32, std::greater<u32> > OpenQueue;
+
 class CCmpTerritoryManager : public ICmpTerritoryManager
 {
 public:
@@ -67,6 +77,7 @@ public:
 		componentManager.SubscribeGloballyToMessageType(MT_OwnershipChanged);
 		componentManager.SubscribeGloballyToMessageType(MT_PositionChanged);
 		componentManager.SubscribeToMessageType(MT_TerrainChanged);
+		componentManager.SubscribeToMessageType(MT_WaterChanged);
 		componentManager.SubscribeToMessageType(MT_Update);
 		componentManager.SubscribeToMessageType(MT_Interpolate);
 		componentManager.SubscribeToMessageType(MT_RenderSubmit);
@@ -86,6 +97,42 @@ public:
 	// Player ID in lower 6 bits; connected flag in bit 7, processed flag in high bit
 	Grid<u8>* m_Territories;
 
+	/**
+	 * Cached influence of a single entity: the inputs of its flood fill, and the
+	 * result restricted to the bounding box of the tiles it reached.
+	 */
+	struct SInfluence
+	{
+		player_id_t owner;
+		u16 i, j; // tile the influence spreads from
+		u32 weight;
+		u32 falloff;
+		GridRegion region;
+		std::vector<u32> values; // tiles in region, row by row
+
+		void swap(SInfluence& other)
+		{
+			std::swap(owner, other.owner);
+			std::swap(i, other.i);
+			std::swap(j, other.j);
+			std::swap(weight, other.weight);
+			std::swap(falloff, other.falloff);
+			std::swap(region, other.region);
+			values.swap(other.values);
+		}
+	};
+
+	// State for incremental recomputation of m_Territories. This isn't serialized,
+	// since it gets rebuilt (giving identical results) the first time it's needed.
+	std::map<entity_id_t, SInfluence> m_Influences;
+	std::map<player_id_t, Grid<u32> > m_PlayerInfluences; // sum of each player's entities' influences
+	Grid<u8> m_InfluenceCosts; // the cost grid that m_Influences were computed with
+	Grid<u8> m_TerritoryOwners; // player with the highest influence on each tile (without the connected flag)
+
+	// Scratch space for ComputeInfluence, reused to avoid allocating for every entity
+	std::vector<u32> m_InfluenceScratch;
+	OpenQueue m_InfluenceQueue;
+
 	// Set to true when territories change; will send a TerritoriesChanged message
 	// during the Update phase
 	bool m_TriggerEvent;
@@ -110,6 +157,10 @@ public:
 	virtual void Init(const CParamNode& UNUSED(paramNode))
 	{
 		m_Territories = NULL;
+		m_Influences.clear();
+		m_PlayerInfluences.clear();
+		m_InfluenceCosts = Grid<u8>();
+		m_TerritoryOwners = Grid<u8>();
 		m_DebugOverlay = NULL;
 //		m_DebugOverlay = new TerritoryOverlay(*this);
 		m_BoundaryLinesDirty = true;
@@ -163,6 +214,7 @@ public:
 			break;
 		}
 		case MT_TerrainChanged:
+		case MT_WaterChanged:
 		{
 			MakeDirty();
 			break;
@@ -241,6 +293,18 @@ public:
 
 	void CalculateTerritories();
 
+	/**
+	 * Flood-fills the influence of @p infl over @p costGrid, storing the result in @p infl.
+	 * @param bounded true if every cost is at least 1, so the flood fill only needs
+	 *  to consider tiles within the influence's maximum radius.
+	 */
+	void ComputeInfluence(SInfluence& infl, const Grid<u8>& costGrid, bool bounded);
+
+	/**
+	 * Adds (if @p sign is 1) or subtracts (if -1) @p infl to its owner's total influence.
+	 */
+	void AddPlayerInfluence(const SInfluence& infl, int sign);
+
 	/**
 	 * Updates @p grid based on the obstruction shapes of all entities with
 	 * a TerritoryInfluence component. Grid cells are 0 if no influence,
@@ -259,63 +323,58 @@ public:
 
 REGISTER_COMPONENT_TYPE(TerritoryManager)
 
-/*
-We compute the territory influence of an entity with a kind of best-first search,
-storing an 'open' list of tiles that have not yet been processed,
-then taking the highest-weight tile (closest to origin) and updating the weight
-of extending to each neighbour (based on radius-determining 'falloff' value,
-adjusted by terrain movement cost), and repeating until all tiles are processed.
-*/
-
-typedef PriorityQueueHeap<std::pair<u16, u16>, u32, std::greater<u32> > OpenQueue;
-
 static void ProcessNeighbour(u32 falloff, u16 i, u16 j, u32 pg, bool diagonal,
-		Grid<u32>& grid, OpenQueue& queue, const Grid<u8>& costGrid)
+		u32* values, const GridRegion& window, OpenQueue& queue, const Grid<u8>& costGrid)
 {
 	u32 dg = falloff * costGrid.get(i, j);
 	if (diagonal)
 		dg = (dg * 362) / 256;
 
+	u32& value = values[(j - window.j0) * (window.i1 - window.i0 + 1) + (i - window.i0)];
+
 	// Stop if new cost g=pg-dg is not better than previous value for that tile
 	// (arranged to avoid underflow if pg < dg)
-	if (pg <= grid.get(i, j) + dg)
+	if (pg <= value + dg)
 		return;
 
 	u32 g = pg - dg; // cost to this tile = cost to predecessor - falloff from predecessor
 
-	grid.set(i, j, g);
+	value = g;
 	OpenQueue::Item tile = { std::make_pair(i, j), g };
 	queue.push(tile);
 }
 
-static void FloodFill(Grid<u32>& grid, Grid<u8>& costGrid, OpenQueue& openTiles, u32 falloff)
+/**
+ * Expands the influences in @p openTiles outwards, storing the results in @p values,
+ * which covers the tiles in @p window (row by row) and must be initialised to 0
+ * except for the open tiles. Tiles outside the window are ignored, so it must be
+ * large enough to contain every tile the influence can reach.
+ */
+static void FloodFill(u32* values, const GridRegion& window, const Grid<u8>& costGrid, OpenQueue& openTiles, u32 falloff)
 {
-	u16 tilesW = grid.m_W;
-	u16 tilesH = grid.m_H;
-
 	while (!openTiles.empty())
 	{
 		OpenQueue::Item tile = openTiles.pop();
 
-		// Process neighbours (if they're not off the edge of the map)
+		// Process neighbours (if they're not off the edge of the window)
 		u16 x = tile.id.first;
 		u16 z = tile.id.second;
-		if (x > 0)
-			ProcessNeighbour(falloff, (u16)(x-1), z, tile.rank, false, grid, openTiles, costGrid);
-		if (x < tilesW-1)
-			ProcessNeighbour(falloff, (u16)(x+1), z, tile.rank, false, grid, openTiles, costGrid);
-		if (z > 0)
-			ProcessNeighbour(falloff, x, (u16)(z-1), tile.rank, false, grid, openTiles, costGrid);
-		if (z < tilesH-1)
-			ProcessNeighbour(falloff, x, (u16)(z+1), tile.rank, false, grid, openTiles, costGrid);
-		if (x > 0 && z > 0)
-			ProcessNeighbour(falloff, (u16)(x-1), (u16)(z-1), tile.rank, true, grid, openTiles, costGrid);
-		if (x > 0 && z < tilesH-1)
-			ProcessNeighbour(falloff, (u16)(x-1), (u16)(z+1), tile.rank, true, grid, openTiles, costGrid);
-		if (x < tilesW-1 && z > 0)
-			ProcessNeighbour(falloff, (u16)(x+1), (u16)(z-1), tile.rank, true, grid, openTiles, costGrid);
-		if (x < tilesW-1 && z < tilesH-1)
-			ProcessNeighbour(falloff, (u16)(x+1), (u16)(z+1), tile.rank, true, grid, openTiles, costGrid);
+		if (x > window.i0)
+			ProcessNeighbour(falloff, (u16)(x-1), z, tile.rank, false, values, window, openTiles, costGrid);
+		if (x < window.i1)
+			ProcessNeighbour(falloff, (u16)(x+1), z, tile.rank, false, values, window, openTiles, costGrid);
+		if (z > window.j0)
+			ProcessNeighbour(falloff, x, (u16)(z-1), tile.rank, false, values, window, openTiles, costGrid);
+		if (z < window.j1)
+			ProcessNeighbour(falloff, x, (u16)(z+1), tile.rank, false, values, window, openTiles, costGrid);
+		if (x > window.i0 && z > window.j0)
+			ProcessNeighbour(falloff, (u16)(x-1), (u16)(z-1), tile.rank, true, values, window, openTiles, costGrid);
+		if (x > window.i0 && z < window.j1)
+			ProcessNeighbour(falloff, (u16)(x-1), (u16)(z+1), tile.rank, true, values, window, openTiles, costGrid);
+		if (x < window.i1 && z > window.j0)
+			ProcessNeighbour(falloff, (u16)(x+1), (u16)(z-1), tile.rank, true, values, window, openTiles, costGrid);
+		if (x < window.i1 && z < window.j1)
+			ProcessNeighbour(falloff, (u16)(x+1), (u16)(z+1), tile.rank, true, values, window, openTiles, costGrid);
 	}
 }
 
@@ -336,8 +395,6 @@ void CCmpTerritoryManager::CalculateTerritories()
 	u16 tilesW = cmpTerrain->GetTilesPerSide();
 	u16 tilesH = cmpTerrain->GetTilesPerSide();
 
-	m_Territories = new Grid<u8>(tilesW, tilesH);
-
 	// Compute terrain-passability-dependent costs per tile
 	Grid<u8> influenceGrid(tilesW, tilesH);
 
@@ -368,8 +425,46 @@ void CCmpTerritoryManager::CalculateTerritories()
 	// Allow influence entities to override the terrain costs
 	RasteriseInfluences(influences, influenceGrid);
 
-	// Split influence entities into per-player lists, ignoring any with invalid properties
-	std::map<player_id_t, std::vector<entity_id_t> > influenceEntities;
+	// Influences are cheaper to compute if they can't spread unboundedly over zero-cost tiles
+	bool boundedInfluences = (std::find(influenceGrid.m_Data, influenceGrid.m_Data + tilesW*tilesH, 0) == influenceGrid.m_Data + tilesW*tilesH);
+
+	// Regions of tiles whose owner needs to be recomputed
+	std::vector<GridRegion> dirtyRegions;
+
+	// If the map size has changed, throw away all the cached state
+	if (m_TerritoryOwners.m_W != tilesW || m_TerritoryOwners.m_H != tilesH)
+	{
+		m_Influences.clear();
+		m_PlayerInfluences.clear();
+		m_InfluenceCosts = influenceGrid;
+		m_TerritoryOwners = Grid<u8>(tilesW, tilesH);
+		dirtyRegions.push_back(GridRegion::All(tilesW, tilesH));
+	}
+
+	// If any costs have changed, cached influences that reached those tiles (or
+	// were stopped next to them) need to be recomputed. Count the changed tiles
+	// in a summed-area table so we can quickly check each influence's region.
+	std::vector<u32> costChanges;
+	if (memcmp(m_InfluenceCosts.m_Data, influenceGrid.m_Data, tilesW*tilesH*sizeof(u8)) != 0)
+	{
+		costChanges.resize((tilesW+1)*(tilesH+1), 0);
+		for (u16 j = 0; j < tilesH; ++j)
+		{
+			for (u16 i = 0; i < tilesW; ++i)
+			{
+				u32 changed = (m_InfluenceCosts.get(i, j) != influenceGrid.get(i, j)) ? 1 : 0;
+				costChanges[(j+1)*(tilesW+1) + (i+1)] = changed
+					+ costChanges[j*(tilesW+1) + (i+1)]
+					+ costChanges[(j+1)*(tilesW+1) + i]
+					- costChanges[j*(tilesW+1) + i];
+			}
+		}
+
+		m_InfluenceCosts = influenceGrid;
+	}
+
+	// Update the cached influence of every valid entity, ignoring any with invalid properties
+	std::map<entity_id_t, SInfluence> influencesNew;
 	std::vector<entity_id_t> rootInfluenceEntities;
 	for (CComponentManager::InterfaceList::iterator it = influences.begin(); it != influences.end(); ++it)
 	{
@@ -396,78 +491,113 @@ void CCmpTerritoryManager::CalculateTerritories()
 		if (cmpPosition.null() || !cmpPosition->IsInWorld())
 			continue;
 
-		influenceEntities[owner].push_back(it->first);
-
 		if (cmpTerritoryInfluence->IsRoot())
 			rootInfluenceEntities.push_back(it->first);
-	}
 
-	// For each player, store the sum of influences on each tile
-	std::vector<std::pair<player_id_t, Grid<u32> > > playerGrids;
-	// TODO: this is a large waste of memory; we don't really need to store
-	// all the intermediate grids
+		CFixedVector2D pos = cmpPosition->GetPosition2D();
+		u16 i = (u16)clamp((pos.X / (int)TERRAIN_TILE_SIZE).ToInt_RoundToNegInfinity(), 0, tilesW-1);
+		u16 j = (u16)clamp((pos.Y / (int)TERRAIN_TILE_SIZE).ToInt_RoundToNegInfinity(), 0, tilesH-1);
 
-	for (std::map<player_id_t, std::vector<entity_id_t> >::iterator it = influenceEntities.begin(); it != influenceEntities.end(); ++it)
-	{
-		Grid<u32> playerGrid(tilesW, tilesH);
+		u32 weight = cmpTerritoryInfluence->GetWeight();
+		u32 radius = cmpTerritoryInfluence->GetRadius() / TERRAIN_TILE_SIZE;
+		u32 falloff = weight / radius; // earlier check for GetRadius() == 0 prevents divide-by-zero
 
-		std::vector<entity_id_t>& ents = it->second;
-		for (std::vector<entity_id_t>::iterator eit = ents.begin(); eit != ents.end(); ++eit)
-		{
-			// Compute the influence map of the current entity, then add it to the player grid
+		// TODO: we should have some maximum value on weight, to avoid overflow
+		// when doing all the sums
 
-			Grid<u32> entityGrid(tilesW, tilesH);
+		SInfluence& infl = influencesNew[it->first];
 
-			CmpPtr<ICmpPosition> cmpPosition(GetSimContext(), *eit);
-			CFixedVector2D pos = cmpPosition->GetPosition2D();
-			u16 i = (u16)clamp((pos.X / (int)TERRAIN_TILE_SIZE).ToInt_RoundToNegInfinity(), 0, tilesW-1);
-			u16 j = (u16)clamp((pos.Y / (int)TERRAIN_TILE_SIZE).ToInt_RoundToNegInfinity(), 0, tilesH-1);
+		std::map<entity_id_t, SInfluence>::iterator cached = m_Influences.find(it->first);
+		if (cached != m_Influences.end())
+		{
+			SInfluence& old = cached->second;
+			bool unchanged = (old.i == i && old.j == j && old.weight == weight && old.falloff == falloff);
 
-			CmpPtr<ICmpTerritoryInfluence> cmpTerritoryInfluence(GetSimContext(), *eit);
-			u32 weight = cmpTerritoryInfluence->GetWeight();
-			u32 radius = cmpTerritoryInfluence->GetRadius() / TERRAIN_TILE_SIZE;
-			u32 falloff = weight / radius; // earlier check for GetRadius() == 0 prevents divide-by-zero
+			// Tiles next to the region might have blocked the flood fill, so check them too
+			if (unchanged && !costChanges.empty())
+			{
+				GridRegion r = old.region.Expanded(1, tilesW, tilesH);
+				u32 count = costChanges[(r.j1+1)*(tilesW+1) + (r.i1+1)]
+					- costChanges[r.j0*(tilesW+1) + (r.i1+1)]
+					- costChanges[(r.j1+1)*(tilesW+1) + r.i0]
+					+ costChanges[r.j0*(tilesW+1) + r.i0];
+				unchanged = (count == 0);
+			}
 
-			// TODO: we should have some maximum value on weight, to avoid overflow
-			// when doing all the sums
+			if (unchanged && old.owner == owner)
+			{
+				// Nothing to do except keep the cached influence
+				infl.swap(old);
+				m_Influences.erase(cached);
+				continue;
+			}
 
-			// Initialise the tile under the entity
-			entityGrid.set(i, j, weight);
-			OpenQueue openTiles;
-			OpenQueue::Item tile = { std::make_pair((u16)i, (i16)j), weight };
-			openTiles.push(tile);
+			// Remove the old influence from its owner
+			AddPlayerInfluence(old, -1);
+			dirtyRegions.push_back(old.region);
 
-			// Expand influences outwards
-			FloodFill(entityGrid, influenceGrid, openTiles, falloff);
+			if (unchanged)
+			{
+				// Only the owner has changed, so reuse the flood fill
+				infl.swap(old);
+				m_Influences.erase(cached);
+				infl.owner = owner;
+				AddPlayerInfluence(infl, 1);
+				continue;
+			}
 
-			// TODO: we should do a sparse grid and only add the non-zero regions, for performance
-			for (u16 j = 0; j < entityGrid.m_H; ++j)
-				for (u16 i = 0; i < entityGrid.m_W; ++i)
-					playerGrid.set(i, j, playerGrid.get(i, j) + entityGrid.get(i, j));
+			m_Influences.erase(cached);
 		}
 
-		playerGrids.push_back(std::make_pair(it->first, playerGrid));
+		// Compute the influence map of the current entity, then add it to the player's total
+		infl.owner = owner;
+		infl.i = i;
+		infl.j = j;
+		infl.weight = weight;
+		infl.falloff = falloff;
+		ComputeInfluence(infl, influenceGrid, boundedInfluences);
+		AddPlayerInfluence(infl, 1);
+		dirtyRegions.push_back(infl.region);
 	}
 
-	// Set m_Territories to the player ID with the highest influence for each tile
-	for (u16 j = 0; j < tilesH; ++j)
+	// Remove the influences of any entities that have been destroyed or become invalid
+	for (std::map<entity_id_t, SInfluence>::iterator it = m_Influences.begin(); it != m_Influences.end(); ++it)
 	{
-		for (u16 i = 0; i < tilesW; ++i)
+		AddPlayerInfluence(it->second, -1);
+		dirtyRegions.push_back(it->second.region);
+	}
+	m_Influences.swap(influencesNew);
+
+	// Set each tile in the changed regions to the player ID with the highest influence
+	// (with ties going to the lowest player ID)
+	for (size_t n = 0; n < dirtyRegions.size(); ++n)
+	{
+		const GridRegion& r = dirtyRegions[n];
+		if (r.IsEmpty())
+			continue;
+
+		for (u16 j = r.j0; j <= r.j1; ++j)
 		{
-			u32 bestWeight = 0;
-			for (size_t k = 0; k < playerGrids.size(); ++k)
+			for (u16 i = r.i0; i <= r.i1; ++i)
 			{
-				u32 w = playerGrids[k].second.get(i, j);
-				if (w > bestWeight)
+				u8 owner = 0;
+				u32 bestWeight = 0;
+				for (std::map<player_id_t, Grid<u32> >::iterator it = m_PlayerInfluences.begin(); it != m_PlayerInfluences.end(); ++it)
 				{
-					player_id_t id = playerGrids[k].first;
-					m_Territories->set(i, j, (u8)id);
-					bestWeight = w;
+					u32 w = it->second.get(i, j);
+					if (w > bestWeight)
+					{
+						owner = (u8)it->first;
+						bestWeight = w;
+					}
 				}
+				m_TerritoryOwners.set(i, j, owner);
 			}
 		}
 	}
 
+	m_Territories = new Grid<u8>(m_TerritoryOwners);
+
 	// Detect territories connected to a 'root' influence (typically a civ center)
 	// belonging to their player, and mark them with the connected flag
 	for (std::vector<entity_id_t>::iterator it = rootInfluenceEntities.begin(); it != rootInfluenceEntities.end(); ++it)
@@ -527,6 +657,75 @@ void CCmpTerritoryManager::CalculateTerritories()
 	}
 }
 
+void CCmpTerritoryManager::ComputeInfluence(SInfluence& infl, const Grid<u8>& costGrid, bool bounded)
+{
+	// Each step away from the entity (including diagonally) reduces the influence
+	// by at least falloff*cost, so if every cost is at least 1 then it can't reach
+	// tiles more than weight/falloff steps away. Otherwise it might reach the whole map.
+	GridRegion window = GridRegion::All(costGrid.m_W, costGrid.m_H);
+	if (bounded && infl.falloff > 0)
+	{
+		u32 maxRadius = std::min(infl.weight / infl.falloff, (u32)std::max(costGrid.m_W, costGrid.m_H));
+		window = GridRegion(infl.i, infl.j, infl.i, infl.j).Expanded((int)maxRadius, costGrid.m_W, costGrid.m_H);
+	}
+
+	u16 windowW = (u16)(window.i1 - window.i0 + 1);
+	m_InfluenceScratch.assign(windowW * (window.j1 - window.j0 + 1), 0);
+	u32* values = &m_InfluenceScratch[0];
+
+	// Initialise the tile under the entity
+	values[(infl.j - window.j0) * windowW + (infl.i - window.i0)] = infl.weight;
+	OpenQueue::Item tile = { std::make_pair(infl.i, infl.j), infl.weight };
+	m_InfluenceQueue.push(tile);
+
+	// Expand influences outwards
+	FloodFill(values, window, costGrid, m_InfluenceQueue, infl.falloff);
+
+	// Store the bounding box of the tiles it reached
+	// (which includes the initial tile, so it's never empty)
+	GridRegion region(infl.i, infl.j, infl.i, infl.j);
+	for (u16 j = window.j0; j <= window.j1; ++j)
+	{
+		for (u16 i = window.i0; i <= window.i1; ++i)
+		{
+			if (values[(j - window.j0) * windowW + (i - window.i0)])
+			{
+				region.i0 = std::min(region.i0, i);
+				region.j0 = std::min(region.j0, j);
+				region.i1 = std::max(region.i1, i);
+				region.j1 = std::max(region.j1, j);
+			}
+		}
+	}
+
+	infl.region = region;
+	infl.values.clear();
+	infl.values.reserve((region.i1 - region.i0 + 1) * (region.j1 - region.j0 + 1));
+	for (u16 j = region.j0; j <= region.j1; ++j)
+		for (u16 i = region.i0; i <= region.i1; ++i)
+			infl.values.push_back(values[(j - window.j0) * windowW + (i - window.i0)]);
+}
+
+void CCmpTerritoryManager::AddPlayerInfluence(const SInfluence& infl, int sign)
+{
+	Grid<u32>& playerGrid = m_PlayerInfluences[infl.owner];
+	if (playerGrid.m_W != m_TerritoryOwners.m_W || playerGrid.m_H != m_TerritoryOwners.m_H)
+		playerGrid = Grid<u32>(m_TerritoryOwners.m_W, m_TerritoryOwners.m_H);
+
+	// (Sums might overflow and wrap around, but subtracting an influence still
+	// exactly undoes adding it)
+	const GridRegion& r = infl.region;
+	size_t n = 0;
+	for (u16 j = r.j0; j <= r.j1; ++j)
+	{
+		for (u16 i = r.i0; i <= r.i1; ++i)
+		{
+			u32 v = infl.values[n++];
+			playerGrid.set(i, j, sign > 0 ? playerGrid.get(i, j) + v : playerGrid.get(i, j) - v);
+		}
+	}
+}
+
 /**
  * Compute the tile indexes on the grid nearest to a given point
  */
@@ -0,0 +1,484 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "simulation2/system/Component.h"
+#include "ICmpUnitRenderer.h"
+
+#include "ICmpTerrain.h"
+#include "ICmpVisual.h"
+#include "simulation2/MessageTypes.h"
+
+#include "graphics/Frustum.h"
+#include "graphics/Terrain.h"
+#include "maths/BoundingBoxAligned.h"
+#include "maths/Vector3D.h"
+#include "ps/Profile.h"
+
+/**
+ * Unit renderer implementation.
+ *
+ * Units are stored in a grid of square cells, by the centre of their swept
+ * bounding sphere (units outside the map are clamped into the edge cells).
+ * Each cell has an axis-aligned box containing all its units' spheres, which
+ * is only ever grown while units move around during a turn, and recomputed
+ * from scratch at the start of the next turn if any unit shrank or left it.
+ *
+ * None of this is serialized, since it's all derived from the visual actors
+ * (which register themselves again when they're deserialized).
+ */
+class CCmpUnitRenderer : public ICmpUnitRenderer
+{
+public:
+	static void ClassInit(CComponentManager& componentManager)
+	{
+		componentManager.SubscribeToMessageType(MT_TurnStart);
+		componentManager.SubscribeToMessageType(MT_Interpolate);
+		componentManager.SubscribeToMessageType(MT_RenderSubmit);
+		componentManager.SubscribeToMessageType(MT_TerrainChanged);
+	}
+
+	DEFAULT_COMPONENT_ALLOCATOR(UnitRenderer)
+
+	// Width of the grid cells, in metres
+	static const ssize_t CELL_SIZE = 8*TERRAIN_TILE_SIZE;
+
+	static const size_t NO_CELL = (size_t)-1;
+
+	struct SUnit
+	{
+		entity_id_t entity; // INVALID_ENTITY if this tag is free
+		ICmpVisual* visual; // not owned; valid until RemoveUnit
+		float radius;
+		bool inWorld;
+		bool moving; // whether the unit is in m_MovingUnits
+		bool hasSounds; // whether the unit is in m_SoundUnits
+		CVector3D pos0; // position at the end of the previous turn
+		CVector3D pos1; // position at the end of the current turn
+
+		// Sphere containing the unit at any point between pos0 and pos1.
+		// The unit might follow the terrain up and down between the two
+		// positions, so the radius gets the whole distance moved as slack
+		CVector3D sweptCenter;
+		float sweptRadius;
+
+		size_t cell; // index into m_Cells, or NO_CELL if out of the world
+		u32 lastInterpolateFrame;
+		double animationTime; // m_AnimationTime when the unit's animation was last updated
+	};
+
+	struct SCell
+	{
+		std::vector<tag_t> units;
+		CBoundingBoxAligned bounds; // contains the swept spheres of all the units (and possibly more)
+		bool boundsLoose; // whether the cell is in m_LooseCells
+	};
+
+	std::vector<SUnit> m_Units; // indexed by tag-1
+	std::vector<tag_t> m_FreeTags;
+
+	size_t m_CellsPerSide;
+	std::vector<SCell> m_Cells;
+	std::vector<size_t> m_LooseCells; // cells whose bounds should be recomputed on the next turn
+
+	std::vector<tag_t> m_MovingUnits; // units whose pos0 and pos1 might differ
+	std::vector<tag_t> m_SoundUnits; // units that need their animations updated even when off screen
+	std::vector<tag_t> m_VisibleUnits; // units submitted by the latest RenderSubmit
+
+	u32 m_FrameNumber;
+	float m_FrameOffset;
+	double m_AnimationTime; // sum of all the frame times so far
+
+	static std::string GetSchema()
+	{
+		return "<a:component type='system'/><empty/>";
+	}
+
+	virtual void Init(const CParamNode& UNUSED(paramNode))
+	{
+		m_FrameNumber = 0;
+		m_FrameOffset = 0.f;
+		m_AnimationTime = 0.0;
+
+		m_CellsPerSide = 0;
+		ResizeGrid();
+	}
+
+	virtual void Deinit()
+	{
+	}
+
+	virtual void Serialize(ISerializer& UNUSED(serialize))
+	{
+		// Nothing to serialize
+	}
+
+	virtual void Deserialize(const CParamNode& paramNode, IDeserializer& UNUSED(deserialize))
+	{
+		Init(paramNode);
+	}
+
+	virtual void HandleMessage(const CMessage& msg, bool UNUSED(global))
+	{
+		switch (msg.GetType())
+		{
+		case MT_TurnStart:
+		{
+			TurnStart();
+			break;
+		}
+		case MT_Interpolate:
+		{
+			const CMessageInterpolate& msgData = static_cast<const CMessageInterpolate&> (msg);
+			Interpolate(msgData.frameTime, msgData.offset);
+			break;
+		}
+		case MT_RenderSubmit:
+		{
+			const CMessageRenderSubmit& msgData = static_cast<const CMessageRenderSubmit&> (msg);
+			RenderSubmit(msgData.collector, msgData.frustum, msgData.culling);
+			break;
+		}
+		case MT_TerrainChanged:
+		{
+			ResizeGrid();
+			break;
+		}
+		}
+	}
+
+	virtual tag_t AddUnit(entity_id_t ent, ICmpVisual* visual, float radius)
+	{
+		tag_t tag;
+		if (!m_FreeTags.empty())
+		{
+			tag = m_FreeTags.back();
+			m_FreeTags.pop_back();
+		}
+		else
+		{
+			m_Units.push_back(SUnit());
+			tag = (tag_t)m_Units.size();
+		}
+
+		SUnit& unit = m_Units[tag-1];
+		unit.entity = ent;
+		unit.visual = visual;
+		unit.radius = radius;
+		unit.inWorld = false;
+		unit.moving = false;
+		unit.hasSounds = false;
+		unit.pos0 = unit.pos1 = unit.sweptCenter = CVector3D(0, 0, 0);
+		unit.sweptRadius = radius;
+		unit.cell = NO_CELL;
+		unit.lastInterpolateFrame = m_FrameNumber - 1;
+		unit.animationTime = m_AnimationTime;
+		return tag;
+	}
+
+	virtual void RemoveUnit(tag_t tag)
+	{
+		SUnit& unit = GetUnit(tag);
+
+		RemoveFromCell(tag, unit);
+
+		if (unit.moving)
+			RemoveFromList(m_MovingUnits, tag);
+
+		if (unit.hasSounds)
+			RemoveFromList(m_SoundUnits, tag);
+
+		// If the tag is still in m_VisibleUnits, Interpolate will skip it
+		// (or if it gets reused, interpolate the new unit slightly early, which is harmless)
+		unit.entity = INVALID_ENTITY;
+		unit.visual = NULL;
+		unit.inWorld = false;
+		m_FreeTags.push_back(tag);
+	}
+
+	virtual void UpdateUnitRadius(tag_t tag, float radius)
+	{
+		SUnit& unit = GetUnit(tag);
+		unit.radius = radius;
+		if (unit.inWorld)
+			UpdateSweptBounds(tag, unit);
+	}
+
+	virtual void UpdateUnitPos(tag_t tag, bool inWorld, const CVector3D& pos)
+	{
+		SUnit& unit = GetUnit(tag);
+
+		if (!inWorld)
+		{
+			unit.inWorld = false;
+			RemoveFromCell(tag, unit);
+			return;
+		}
+
+		// Units that have just appeared aren't interpolated from wherever they were before
+		if (!unit.inWorld)
+			unit.pos0 = pos;
+
+		unit.inWorld = true;
+		unit.pos1 = pos;
+
+		if (!unit.moving && unit.pos0 != unit.pos1)
+		{
+			unit.moving = true;
+			m_MovingUnits.push_back(tag);
+		}
+
+		UpdateSweptBounds(tag, unit);
+	}
+
+	virtual void UpdateUnitSounds(tag_t tag, bool hasSounds)
+	{
+		SUnit& unit = GetUnit(tag);
+		if (hasSounds == unit.hasSounds)
+			return;
+
+		unit.hasSounds = hasSounds;
+		if (hasSounds)
+			m_SoundUnits.push_back(tag);
+		else
+			RemoveFromList(m_SoundUnits, tag);
+	}
+
+	virtual u32 GetFrameNumber()
+	{
+		return m_FrameNumber;
+	}
+
+	virtual float GetFrameOffset()
+	{
+		return m_FrameOffset;
+	}
+
+	virtual size_t GetNumVisibleUnits()
+	{
+		return m_VisibleUnits.size();
+	}
+
+private:
+	SUnit& GetUnit(tag_t tag)
+	{
+		ENSURE(0 < tag && tag <= m_Units.size() && m_Units[tag-1].entity != INVALID_ENTITY);
+		return m_Units[tag-1];
+	}
+
+	static void RemoveFromList(std::vector<tag_t>& list, tag_t tag)
+	{
+		std::vector<tag_t>::iterator it = std::find(list.begin(), list.end(), tag);
+		ENSURE(it != list.end());
+		*it = list.back();
+		list.pop_back();
+	}
+
+	static CBoundingBoxAligned GetSweptBox(const SUnit& unit)
+	{
+		CVector3D r(unit.sweptRadius, unit.sweptRadius, unit.sweptRadius);
+		return CBoundingBoxAligned(unit.sweptCenter - r, unit.sweptCenter + r);
+	}
+
+	size_t GetCellIndex(const CVector3D& pos)
+	{
+		ssize_t i = (ssize_t)floor(pos.X / CELL_SIZE);
+		ssize_t j = (ssize_t)floor(pos.Z / CELL_SIZE);
+		i = Clamp(i, (ssize_t)0, (ssize_t)m_CellsPerSide - 1);
+		j = Clamp(j, (ssize_t)0, (ssize_t)m_CellsPerSide - 1);
+		return (size_t)(j * m_CellsPerSide + i);
+	}
+
+	void MarkLoose(size_t cell)
+	{
+		if (!m_Cells[cell].boundsLoose)
+		{
+			m_Cells[cell].boundsLoose = true;
+			m_LooseCells.push_back(cell);
+		}
+	}
+
+	void RemoveFromCell(tag_t tag, SUnit& unit)
+	{
+		if (unit.cell == NO_CELL)
+			return;
+
+		std::vector<tag_t>& units = m_Cells[unit.cell].units;
+		std::vector<tag_t>::iterator it = std::find(units.begin(), units.end(), tag);
+		ENSURE(it != units.end());
+		*it = units.back();
+		units.pop_back();
+
+		MarkLoose(unit.cell);
+		unit.cell = NO_CELL;
+	}
+
+	void UpdateSweptBounds(tag_t tag, SUnit& unit)
+	{
+		unit.sweptCenter = (unit.pos0 + unit.pos1) * 0.5f;
+		unit.sweptRadius = unit.radius + (unit.pos1 - unit.pos0).Length();
+
+		size_t cell = GetCellIndex(unit.sweptCenter);
+		if (cell == unit.cell)
+		{
+			// The old sphere might have been larger than the new one
+			MarkLoose(cell);
+		}
+		else
+		{
+			RemoveFromCell(tag, unit);
+			unit.cell = cell;
+			m_Cells[cell].units.push_back(tag);
+		}
+
+		m_Cells[cell].bounds += GetSweptBox(unit);
+	}
+
+	void ResizeGrid()
+	{
+		size_t cellsPerSide = 1;
+		CmpPtr<ICmpTerrain> cmpTerrain(GetSimContext(), SYSTEM_ENTITY);
+		if (!cmpTerrain.null() && cmpTerrain->IsLoaded())
+		{
+			ssize_t size = cmpTerrain->GetTilesPerSide() * TERRAIN_TILE_SIZE;
+			cellsPerSide = std::max((size_t)1, (size_t)((size + CELL_SIZE - 1) / CELL_SIZE));
+		}
+
+		if (cellsPerSide == m_CellsPerSide)
+			return;
+
+		m_CellsPerSide = cellsPerSide;
+		m_Cells.clear();
+		m_Cells.resize(m_CellsPerSide * m_CellsPerSide);
+		m_LooseCells.clear();
+
+		for (size_t t = 0; t < m_Units.size(); ++t)
+		{
+			SUnit& unit = m_Units[t];
+			unit.cell = NO_CELL;
+			if (unit.entity != INVALID_ENTITY && unit.inWorld)
+				UpdateSweptBounds((tag_t)(t+1), unit);
+		}
+	}
+
+	void TurnStart()
+	{
+		// Every unit that moved during the last turn has reached its pos1 now;
+		// the ones that are still moving will call UpdateUnitPos again
+		for (size_t i = 0; i < m_MovingUnits.size(); ++i)
+		{
+			tag_t tag = m_MovingUnits[i];
+			SUnit& unit = m_Units[tag-1];
+			unit.moving = false;
+			unit.pos0 = unit.pos1;
+			if (unit.inWorld)
+				UpdateSweptBounds(tag, unit);
+		}
+		m_MovingUnits.clear();
+
+		for (size_t i = 0; i < m_LooseCells.size(); ++i)
+		{
+			SCell& cell = m_Cells[m_LooseCells[i]];
+			cell.bounds.SetEmpty();
+			for (size_t j = 0; j < cell.units.size(); ++j)
+				cell.bounds += GetSweptBox(m_Units[cell.units[j]-1]);
+			cell.boundsLoose = false;
+		}
+		m_LooseCells.clear();
+	}
+
+	void InterpolateUnit(SUnit& unit)
+	{
+		// Catch up with all the frames since the animation was last updated
+		// (which is just this one, unless the unit has come into view)
+		float frameTime = (float)(m_AnimationTime - unit.animationTime);
+		unit.animationTime = m_AnimationTime;
+		unit.lastInterpolateFrame = m_FrameNumber;
+
+		unit.visual->Interpolate(frameTime, m_FrameOffset);
+	}
+
+	void Interpolate(float frameTime, float frameOffset)
+	{
+		PROFILE("UnitRenderer::Interpolate");
+
+		++m_FrameNumber;
+		m_FrameOffset = frameOffset;
+		m_AnimationTime += frameTime;
+
+		// Interpolate the units that were visible in the previous frame. Units that
+		// have just come into view get interpolated when RenderSubmit finds them
+		for (size_t i = 0; i < m_VisibleUnits.size(); ++i)
+		{
+			SUnit& unit = m_Units[m_VisibleUnits[i]-1];
+			if (unit.entity != INVALID_ENTITY && unit.inWorld && unit.lastInterpolateFrame != m_FrameNumber)
+				InterpolateUnit(unit);
+		}
+
+		// Off-screen units whose animations play sounds are kept in time, so the
+		// sounds are heard; the others will catch up when they're next visible
+		for (size_t i = 0; i < m_SoundUnits.size(); ++i)
+		{
+			SUnit& unit = m_Units[m_SoundUnits[i]-1];
+			if (!unit.inWorld || unit.lastInterpolateFrame == m_FrameNumber)
+				continue;
+
+			float animationTime = (float)(m_AnimationTime - unit.animationTime);
+			unit.animationTime = m_AnimationTime;
+			unit.visual->UpdateAnimation(animationTime);
+		}
+	}
+
+	void RenderSubmit(SceneCollector& collector, const CFrustum& frustum, bool culling)
+	{
+		PROFILE("UnitRenderer::RenderSubmit");
+
+		m_VisibleUnits.clear();
+
+		for (size_t c = 0; c < m_Cells.size(); ++c)
+		{
+			const SCell& cell = m_Cells[c];
+			if (cell.units.empty())
+				continue;
+
+			if (culling && !frustum.IsBoxVisible(CVector3D(0, 0, 0), cell.bounds))
+				continue;
+
+			for (size_t i = 0; i < cell.units.size(); ++i)
+			{
+				const SUnit& unit = m_Units[cell.units[i]-1];
+				if (culling && !frustum.IsSphereVisible(unit.sweptCenter, unit.sweptRadius))
+					continue;
+
+				m_VisibleUnits.push_back(cell.units[i]);
+			}
+		}
+
+		for (size_t i = 0; i < m_VisibleUnits.size(); ++i)
+		{
+			SUnit& unit = m_Units[m_VisibleUnits[i]-1];
+
+			if (unit.lastInterpolateFrame != m_FrameNumber)
+				InterpolateUnit(unit);
+
+			unit.visual->RenderSubmit(collector, frustum, culling);
+		}
+	}
+};
+
+REGISTER_COMPONENT_TYPE(UnitRenderer)
@@ -1,4 +1,4 @@
-/* Copyright (C) 2011 Wildfire Games.
+/* Copyright (C) 2012 Wildfire Games.
  * This file is part of 0 A.D.
  *
  * 0 A.D. is free software: you can redistribute it and/or modify
@@ -23,12 +23,14 @@
 #include "ICmpOwnership.h"
 #include "ICmpPosition.h"
 #include "ICmpRangeManager.h"
+#include "ICmpUnitRenderer.h"
 #include "ICmpVision.h"
 #include "simulation2/MessageTypes.h"
 #include "simulation2/components/ICmpFootprint.h"
 
 #include "graphics/Frustum.h"
 #include "graphics/Model.h"
+#include "graphics/ModelDef.h"
 #include "graphics/ObjectBase.h"
 #include "graphics/ObjectEntry.h"
 #include "graphics/Unit.h"
@@ -45,10 +47,10 @@ public:
 	static void ClassInit(CComponentManager& componentManager)
 	{
 		componentManager.SubscribeToMessageType(MT_Update_Final);
-		componentManager.SubscribeToMessageType(MT_Interpolate);
-		componentManager.SubscribeToMessageType(MT_RenderSubmit);
 		componentManager.SubscribeToMessageType(MT_OwnershipChanged);
+		componentManager.SubscribeToMessageType(MT_PositionChanged);
 		componentManager.SubscribeGloballyToMessageType(MT_TerrainChanged);
+		componentManager.SubscribeToMessageType(MT_WaterChanged);
 	}
 
 	DEFAULT_COMPONENT_ALLOCATOR(VisualActor)
@@ -60,6 +62,11 @@ public:
 
 	ICmpRangeManager::ELosVisibility m_Visibility; // only valid between Interpolate and RenderSubmit
 
+	ICmpUnitRenderer::tag_t m_UnitRendererTag; // 0 if not registered with the unit renderer
+	float m_BoundsRadius; // radius that we registered with the unit renderer
+	const CObjectEntry* m_BoundsObject; // actor variation that m_BoundsRadius was computed for
+	u32 m_TransformFrame; // unit renderer frame number when the model's transform was last updated
+
 	// Current animation state
 	fixed m_AnimRunThreshold; // if non-zero this is the special walk/run mode
 	std::string m_AnimName;
@@ -135,6 +142,11 @@ public:
 	virtual void Init(const CParamNode& paramNode)
 	{
 		m_Unit = NULL;
+		m_Visibility = ICmpRangeManager::VIS_HIDDEN;
+		m_UnitRendererTag = 0;
+		m_BoundsRadius = 0.f;
+		m_BoundsObject = NULL;
+		m_TransformFrame = 0;
 
 		m_R = m_G = m_B = fixed::FromInt(1);
 
@@ -170,6 +182,17 @@ public:
 			InitSelectionShapeDescriptor(model, paramNode);
 
 			m_Unit->SetID(GetEntityId());
+
+			// Let the unit renderer decide when we need to be interpolated and rendered
+			CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+			if (!cmpUnitRenderer.null())
+			{
+				m_BoundsObject = &m_Unit->GetObject();
+				m_BoundsRadius = ComputeBoundsRadius();
+				m_UnitRendererTag = cmpUnitRenderer->AddUnit(GetEntityId(), this, m_BoundsRadius);
+				m_TransformFrame = cmpUnitRenderer->GetFrameNumber() - 1;
+				UpdateUnitPos();
+			}
 		}
 
 		SelectAnimation("idle", false, fixed::FromInt(1), L"");
@@ -177,6 +200,14 @@ public:
 
 	virtual void Deinit()
 	{
+		if (m_UnitRendererTag)
+		{
+			CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+			if (!cmpUnitRenderer.null())
+				cmpUnitRenderer->RemoveUnit(m_UnitRendererTag);
+			m_UnitRendererTag = 0;
+		}
+
 		if (m_Unit)
 		{
 			GetSimContext().GetUnitManager().DeleteUnit(m_Unit);
@@ -258,18 +289,6 @@ public:
 			Update(msgData.turnLength);
 			break;
 		}
-		case MT_Interpolate:
-		{
-			const CMessageInterpolate& msgData = static_cast<const CMessageInterpolate&> (msg);
-			Interpolate(msgData.frameTime, msgData.offset);
-			break;
-		}
-		case MT_RenderSubmit:
-		{
-			const CMessageRenderSubmit& msgData = static_cast<const CMessageRenderSubmit&> (msg);
-			RenderSubmit(msgData.collector, msgData.frustum, msgData.culling);
-			break;
-		}
 		case MT_OwnershipChanged:
 		{
 			const CMessageOwnershipChanged& msgData = static_cast<const CMessageOwnershipChanged&> (msg);
@@ -280,6 +299,20 @@ public:
 		{
 			const CMessageTerrainChanged& msgData = static_cast<const CMessageTerrainChanged&> (msg);
 			m_Unit->GetModel().SetTerrainDirty(msgData.i0, msgData.j0, msgData.i1, msgData.j1);
+			UpdateUnitPos();
+			break;
+		}
+		case MT_WaterChanged:
+		{
+			// Floating units move with the water surface
+			CmpPtr<ICmpPosition> cmpPosition(GetSimContext(), GetEntityId());
+			if (m_Unit->GetObject().m_Base->m_Properties.m_FloatOnWater || (!cmpPosition.null() && cmpPosition->IsFloating()))
+				UpdateUnitPos();
+			break;
+		}
+		case MT_PositionChanged:
+		{
+			UpdateUnitPos();
 			break;
 		}
 		}
@@ -289,6 +322,7 @@ public:
 	{
 		if (!m_Unit)
 			return CBoundingBoxAligned::EMPTY;
+		EnsureTransformUpToDate();
 		return m_Unit->GetModel().GetWorldBounds();
 	}
 
@@ -301,6 +335,7 @@ public:
 	{
 		if (!m_Unit)
 			return CBoundingBoxOriented::EMPTY;
+		EnsureTransformUpToDate();
 		return m_Unit->GetModel().GetSelectionBox();
 	}
 
@@ -308,6 +343,7 @@ public:
 	{
 		if (!m_Unit)
 			return CVector3D(0, 0, 0);
+		EnsureTransformUpToDate();
 		return m_Unit->GetModel().GetTransform().GetTranslation();
 	}
 
@@ -330,6 +366,8 @@ public:
 		if (!m_Unit)
 			return CVector3D();
 
+		EnsureTransformUpToDate();
+
 		if (m_Unit->GetModel().ToCModel())
 		{
 			// Ensure the prop transforms are correct
@@ -356,8 +394,10 @@ public:
 		if (m_Unit)
 		{
 			m_Unit->SetEntitySelection(m_AnimName);
+			UpdateBoundsRadius();
 			if (m_Unit->GetAnimation())
 				m_Unit->GetAnimation()->SetAnimationState(m_AnimName, m_AnimOnce, m_AnimSpeed.ToFloat(), m_AnimDesync.ToFloat(), m_SoundGroup.c_str());
+			UpdateUnitSounds(!m_SoundGroup.empty());
 		}
 	}
 
@@ -366,6 +406,7 @@ public:
 		if (m_Unit)
 		{
 			m_Unit->SetEntitySelection(selection);
+			UpdateBoundsRadius();
 		}
 	}
 
@@ -376,8 +417,10 @@ public:
 		if (m_Unit)
 		{
 			m_Unit->SetEntitySelection("walk");
+			UpdateBoundsRadius();
 			if (m_Unit->GetAnimation())
 				m_Unit->GetAnimation()->SetAnimationState("walk", false, 1.f, 0.f, L"");
+			UpdateUnitSounds(false);
 		}
 	}
 
@@ -454,9 +497,22 @@ public:
 
 		m_Unit->GetModel().SetPlayerID(playerID);
 
+		// The new actor might be a different size
+		if (m_UnitRendererTag)
+		{
+			m_BoundsObject = NULL;
+			UpdateBoundsRadius();
+			CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+			m_TransformFrame = cmpUnitRenderer->GetFrameNumber() - 1;
+		}
+
 		// TODO: should copy/reset silhouette flags
 	}
 
+	virtual void Interpolate(float frameTime, float frameOffset);
+	virtual void UpdateAnimation(float frameTime);
+	virtual void RenderSubmit(SceneCollector& collector, const CFrustum& frustum, bool culling);
+
 private:
 	int32_t GetActorSeed()
 	{
@@ -470,9 +526,25 @@ private:
 	/// before the model was constructed).
 	void InitSelectionShapeDescriptor(CModelAbstract& model, const CParamNode& paramNode);
 
+	/// Returns the radius of a sphere around the entity's position that contains the model and its props,
+	/// in any frame of any of their animations.
+	float ComputeBoundsRadius();
+
+	/// Recomputes the radius registered with the unit renderer, if the actor variation has changed.
+	void UpdateBoundsRadius();
+
+	/// Tells the unit renderer where we'll be at the end of the current turn.
+	void UpdateUnitPos();
+
+	/// Tells the unit renderer whether our current animation plays sounds, so it has to keep
+	/// updating us while we're off screen.
+	void UpdateUnitSounds(bool hasSounds);
+
+	/// Sets the model's transform for the current frame, if the unit renderer hasn't interpolated us
+	/// (because we're off screen), so that queries from the simulation and GUI still see the right position.
+	void EnsureTransformUpToDate();
+
 	void Update(fixed turnLength);
-	void Interpolate(float frameTime, float frameOffset);
-	void RenderSubmit(SceneCollector& collector, const CFrustum& frustum, bool culling);
 };
 
 REGISTER_COMPONENT_TYPE(VisualActor)
@@ -549,6 +621,120 @@ void CCmpVisualActor::InitSelectionShapeDescriptor(CModelAbstract& model, const
 	model.SetCustomSelectionShape(shapeDescriptor);
 }
 
+/// Returns the distance from @p center to the furthest corner of @p bounds, which covers them in any orientation.
+static float GetRadiusAround(const CBoundingBoxAligned& bounds, const CVector3D& center)
+{
+	if (bounds.IsEmpty())
+		return 0.f;
+
+	float radius = 0.f;
+	for (int i = 0; i < 8; ++i)
+	{
+		CVector3D corner(bounds[i & 1].X, bounds[(i >> 1) & 1].Y, bounds[(i >> 2) & 1].Z);
+		radius = std::max(radius, (corner - center).Length());
+	}
+	return radius;
+}
+
+/// Returns the radius of a sphere around the model's origin that contains it and its props,
+/// in any frame of any of the animations of @p objectEntry (which the model was built from).
+static float GetAnimatedRadiusRec(CModelAbstract& model, const CObjectEntry* objectEntry)
+{
+	CModel* cmodel = model.ToCModel();
+	if (!cmodel)
+	{
+		// Decals and particle emitters aren't animated, so their current bounds will do
+		model.ValidatePosition();
+		return GetRadiusAround(model.GetWorldBounds(), model.GetTransform().GetTranslation());
+	}
+
+	CBoundingBoxAligned bounds = cmodel->GetObjectBounds();
+	if (objectEntry)
+	{
+		std::vector<CSkeletonAnim*> anims = objectEntry->GetAllAnimations();
+		for (size_t i = 0; i < anims.size(); ++i)
+			bounds += cmodel->GetAnimationObjectBounds(anims[i]);
+	}
+
+	float meshRadius = GetRadiusAround(bounds, CVector3D(0, 0, 0));
+	float radius = meshRadius;
+
+	const std::vector<CModel::Prop>& props = cmodel->GetProps();
+	for (size_t i = 0; i < props.size(); ++i)
+	{
+		// Hidden props (e.g. ammo) are included too, since they can appear at any time.
+		// Props on bones move with the animation; assume the bones stay within the mesh
+		float offset = props[i].m_Point->m_Position.Length();
+		if (props[i].m_Point->m_BoneIndex != 0xFF)
+			offset += meshRadius;
+		radius = std::max(radius, offset + GetAnimatedRadiusRec(*props[i].m_Model, props[i].m_ObjectEntry));
+	}
+
+	return radius;
+}
+
+float CCmpVisualActor::ComputeBoundsRadius()
+{
+	return GetAnimatedRadiusRec(m_Unit->GetModel(), &m_Unit->GetObject());
+}
+
+void CCmpVisualActor::UpdateBoundsRadius()
+{
+	if (!m_UnitRendererTag || &m_Unit->GetObject() == m_BoundsObject)
+		return;
+
+	m_BoundsObject = &m_Unit->GetObject();
+	m_BoundsRadius = ComputeBoundsRadius();
+
+	CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+	cmpUnitRenderer->UpdateUnitRadius(m_UnitRendererTag, m_BoundsRadius);
+}
+
+void CCmpVisualActor::UpdateUnitPos()
+{
+	if (!m_UnitRendererTag)
+		return;
+
+	CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+	CmpPtr<ICmpPosition> cmpPosition(GetSimContext(), GetEntityId());
+	if (cmpPosition.null() || !cmpPosition->IsInWorld())
+	{
+		cmpUnitRenderer->UpdateUnitPos(m_UnitRendererTag, false, CVector3D(0, 0, 0));
+		return;
+	}
+
+	bool floating = m_Unit->GetObject().m_Base->m_Properties.m_FloatOnWater;
+	CVector3D pos = cmpPosition->GetInterpolatedTransform(1.f, floating).GetTranslation();
+	cmpUnitRenderer->UpdateUnitPos(m_UnitRendererTag, true, pos);
+}
+
+void CCmpVisualActor::UpdateUnitSounds(bool hasSounds)
+{
+	if (!m_UnitRendererTag)
+		return;
+
+	CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+	cmpUnitRenderer->UpdateUnitSounds(m_UnitRendererTag, hasSounds);
+}
+
+void CCmpVisualActor::EnsureTransformUpToDate()
+{
+	if (!m_UnitRendererTag)
+		return;
+
+	CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+	if (m_TransformFrame == cmpUnitRenderer->GetFrameNumber())
+		return;
+	m_TransformFrame = cmpUnitRenderer->GetFrameNumber();
+
+	CmpPtr<ICmpPosition> cmpPosition(GetSimContext(), GetEntityId());
+	if (cmpPosition.null() || !cmpPosition->IsInWorld())
+		return;
+
+	bool floating = m_Unit->GetObject().m_Base->m_Properties.m_FloatOnWater;
+	m_Unit->GetModel().SetTransform(cmpPosition->GetInterpolatedTransform(cmpUnitRenderer->GetFrameOffset(), floating));
+}
+
 void CCmpVisualActor::Update(fixed turnLength)
 {
 	if (m_Unit == NULL)
@@ -581,6 +767,8 @@ void CCmpVisualActor::Update(fixed turnLength)
 			if (m_Unit->GetAnimation())
 				m_Unit->GetAnimation()->SetAnimationState("run", false, speed, 0.f, L"");
 		}
+
+		UpdateBoundsRadius();
 	}
 }
 
@@ -625,6 +813,12 @@ void CCmpVisualActor::Interpolate(float frameTime, float frameOffset)
 	model.SetTransform(transform);
 	m_Unit->UpdateModel(frameTime);
 
+	if (m_UnitRendererTag)
+	{
+		CmpPtr<ICmpUnitRenderer> cmpUnitRenderer(GetSimContext(), SYSTEM_ENTITY);
+		m_TransformFrame = cmpUnitRenderer->GetFrameNumber();
+	}
+
 	// If not hidden, then we need to set up some extra state for rendering
 	if (m_Visibility != ICmpRangeManager::VIS_HIDDEN)
 	{
@@ -633,6 +827,14 @@ void CCmpVisualActor::Interpolate(float frameTime, float frameOffset)
 	}
 }
 
+void CCmpVisualActor::UpdateAnimation(float frameTime)
+{
+	if (m_Unit == NULL)
+		return;
+
+	m_Unit->UpdateModel(frameTime);
+}
+
 void CCmpVisualActor::RenderSubmit(SceneCollector& collector, const CFrustum& frustum, bool culling)
 {
 	if (m_Unit == NULL)
@@ -20,6 +20,8 @@
 #include "simulation2/system/Component.h"
 #include "ICmpWaterManager.h"
 
+#include "simulation2/MessageTypes.h"
+
 #include "graphics/RenderableObject.h"
 #include "graphics/Terrain.h"
 #include "renderer/Renderer.h"
@@ -46,7 +48,9 @@ public:
 
 	virtual void Init(const CParamNode& UNUSED(paramNode))
 	{
-		SetWaterLevel(entity_pos_t::FromInt(5));
+		// (Don't use SetWaterLevel, since other components can't be told about
+		// the change while they're being initialised)
+		m_WaterHeight = entity_pos_t::FromInt(5);
 	}
 
 	virtual void Deinit()
@@ -85,6 +89,12 @@ public:
 
 		// Tell the terrain it'll need to recompute its cached render data
 		GetSimContext().GetTerrain().MakeDirty(RENDERDATA_UPDATE_VERTICES);
+
+		// Tell the pathfinder etc that tiles might have gone above or below the water
+		// (this doesn't affect anything that only depends on the terrain, so we
+		// don't send TerrainChanged)
+		CMessageWaterChanged msg;
+		GetSimContext().GetComponentManager().BroadcastMessage(msg);
 	}
 
 	virtual entity_pos_t GetWaterLevel(entity_pos_t UNUSED(x), entity_pos_t UNUSED(z))
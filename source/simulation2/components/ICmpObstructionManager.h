@@ -203,11 +203,14 @@ public:
 	 * tiles that are intersected by a foundation-blocking shape will also have TILE_OBSTRUCTED_FOUNDATION;
 	 * tiles that are outside the world bounds will also have TILE_OUTOFBOUNDS;
 	 * others will be set to 0.
-	 * This is very cheap if the grid has been rasterised before and the set of shapes has not changed.
+	 * This is very cheap if the grid has been rasterised before and the set of shapes has not changed,
+	 * and only updates the tiles near the changed shapes if the grid is not too far out of date.
 	 * @param grid the grid to be updated
+	 * @param dirty set to the region of tiles that was updated (which covers the whole grid if
+	 *  it was rasterised from scratch, e.g. when the world bounds have changed)
 	 * @return true if any changes were made to the grid, false if it was already up-to-date
 	 */
-	virtual bool Rasterise(Grid<u8>& grid) = 0;
+	virtual bool Rasterise(Grid<u8>& grid, GridRegion& dirty) = 0;
 
 	/**
 	 * Standard representation for all types of shapes, for use with geometry processing code.
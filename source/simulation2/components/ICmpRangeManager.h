@@ -256,6 +256,23 @@ public:
 	 */
 	virtual CLosQuerier GetLosQuerier(player_id_t player) = 0;
 
+	/**
+	 * Rectangle of LOS vertexes, covering [i0, i1) x [j0, j1).
+	 */
+	struct LosRegion
+	{
+		i32 i0, j0, i1, j1;
+	};
+
+	/**
+	 * Returns the regions of vertexes whose LOS state (for any player) may have
+	 * changed since the last call with the same @p dirtyID, and updates dirtyID.
+	 * Callers should initialise dirtyID to 0, so the first call returns the whole map.
+	 * Changes to GetLosRevealAll flags count as changing the whole map.
+	 * The regions don't overlap, but may include some unchanged vertexes.
+	 */
+	virtual void GetLosDirtyRegions(size_t* dirtyID, std::vector<LosRegion>& regions) = 0;
+
 	/**
 	 * Returns the visibility status of the given entity, with respect to the given player.
 	 * Returns VIS_HIDDEN if the entity doesn't exist or is not in the world.
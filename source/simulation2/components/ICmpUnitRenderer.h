@@ -0,0 +1,101 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_ICMPUNITRENDERER
+#define INCLUDED_ICMPUNITRENDERER
+
+#include "simulation2/system/Interface.h"
+
+class CVector3D;
+class ICmpVisual;
+
+/**
+ * Unit renderer: keeps track of the entities with a visual representation
+ * (ICmpVisual), so only the ones that might be on screen have to be interpolated
+ * and submitted for rendering each frame.
+ *
+ * Each unit is registered with a bounding sphere around its position, and its
+ * positions at the start and end of the current turn. The units are kept in
+ * a grid of cells with the bounds of their contents, so they can be culled
+ * against the camera's frustum a cell at a time, and the per-frame cost
+ * depends on the number of visible units rather than the total.
+ *
+ * On MT_Interpolate, it calls ICmpVisual::Interpolate on the units that were
+ * visible in the previous frame. On MT_RenderSubmit, it culls the units against
+ * the frustum, interpolates any that weren't already, and calls
+ * ICmpVisual::RenderSubmit on the ones that passed. Other units' animations
+ * aren't updated at all; the time they missed is passed to Interpolate when
+ * they come into view. The exception is units whose current animation plays
+ * sounds, which get ICmpVisual::UpdateAnimation every frame so the sounds are
+ * still heard.
+ *
+ * Units that aren't interpolated in a frame keep their previous transforms;
+ * code that needs the transform of an off-screen unit (e.g. projectile launch
+ * points) should use GetFrameNumber and GetFrameOffset to update it on demand.
+ */
+class ICmpUnitRenderer : public IComponent
+{
+public:
+	typedef u32 tag_t; // 0 is never a valid tag
+
+	/**
+	 * Registers an entity's visual representation, which starts out of the world.
+	 * @param visual the entity's visual component, which must call RemoveUnit
+	 *  before it's destroyed
+	 * @param radius radius of a sphere centered on the entity's position that
+	 *  contains its model in any orientation and any frame of its animations
+	 * @return tag for the other functions
+	 */
+	virtual tag_t AddUnit(entity_id_t ent, ICmpVisual* visual, float radius) = 0;
+
+	virtual void RemoveUnit(tag_t tag) = 0;
+
+	virtual void UpdateUnitRadius(tag_t tag, float radius) = 0;
+
+	/**
+	 * Sets the unit's position at the end of the current turn. Within the turn,
+	 * the unit is rendered anywhere between this and its position at the end of
+	 * the previous turn.
+	 */
+	virtual void UpdateUnitPos(tag_t tag, bool inWorld, const CVector3D& pos) = 0;
+
+	/**
+	 * Sets whether the unit's current animation plays sounds, in which case
+	 * it keeps being updated while the unit is off screen.
+	 */
+	virtual void UpdateUnitSounds(tag_t tag, bool hasSounds) = 0;
+
+	/**
+	 * Returns the number of MT_Interpolate messages received so far.
+	 */
+	virtual u32 GetFrameNumber() = 0;
+
+	/**
+	 * Returns the frame offset of the latest MT_Interpolate.
+	 */
+	virtual float GetFrameOffset() = 0;
+
+	/**
+	 * Returns the number of units submitted to ICmpVisual::RenderSubmit by the
+	 * latest MT_RenderSubmit (for profiling and testing).
+	 */
+	virtual size_t GetNumVisibleUnits() = 0;
+
+	DECLARE_INTERFACE_TYPE(UnitRenderer)
+};
+
+#endif // INCLUDED_ICMPUNITRENDERER
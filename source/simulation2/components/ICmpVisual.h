@@ -26,7 +26,9 @@
 #include "maths/Fixed.h"
 #include "lib/file/vfs/vfs_path.h"
 
+class CFrustum;
 class CUnit;
+class SceneCollector;
 
 /**
  * The visual representation of an entity (typically an actor).
@@ -131,6 +133,29 @@ public:
 	 */
 	virtual void SetVariable(std::string name, float value) = 0;
 
+	/**
+	 * Update the model's transform and animation, and its LOS visibility, for the current frame.
+	 * Called by ICmpUnitRenderer, only for units that might be on screen.
+	 * @param frameTime time in seconds since the animation was last updated (which might be
+	 *  several frames, if the unit has just come into view)
+	 * @param frameOffset range [0, 1]; fractional time of the frame between the previous and next turns
+	 */
+	virtual void Interpolate(float frameTime, float frameOffset) = 0;
+
+	/**
+	 * Advance the model's animations (playing their sounds) without updating its transform.
+	 * Called by ICmpUnitRenderer instead of Interpolate, for units that are off screen
+	 * but whose animations have sounds.
+	 * @param frameTime time in seconds since the previous frame
+	 */
+	virtual void UpdateAnimation(float frameTime) = 0;
+
+	/**
+	 * Submit the model for rendering, if it's visible.
+	 * Called by ICmpUnitRenderer, after Interpolate, for units that weren't culled.
+	 */
+	virtual void RenderSubmit(SceneCollector& collector, const CFrustum& frustum, bool culling) = 0;
+
 	/**
 	 * Called when an actor file has been modified and reloaded dynamically.
 	 * If this component uses the named actor file, it should regenerate its actor
@@ -0,0 +1,193 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simulation2/system/ComponentTest.h"
+
+#include "simulation2/components/ICmpObstructionManager.h"
+#include "simulation2/helpers/Geometry.h"
+
+#include "lib/timer.h"
+#include "maths/FixedVector2D.h"
+#include "maths/Random.h"
+
+#include <boost/random/uniform_real.hpp>
+
+class TestCmpObstructionManager : public CxxTest::TestSuite
+{
+public:
+	void setUp()
+	{
+		CXeromyces::Startup();
+	}
+
+	void tearDown()
+	{
+		CXeromyces::Terminate();
+	}
+
+	struct Shapes
+	{
+		std::vector<ICmpObstructionManager::tag_t> unitTags;
+		std::vector<entity_id_t> unitEnts;
+		std::vector<ICmpObstructionManager::tag_t> staticTags;
+		std::vector<entity_id_t> staticEnts;
+	};
+
+	static entity_pos_t RandPos(WELL512& rng, double min, double max)
+	{
+		return entity_pos_t::FromDouble(boost::uniform_real<>(min, max)(rng));
+	}
+
+	static void AddRandomShapes(ICmpObstructionManager* cmp, WELL512& rng, size_t numUnits, size_t numStatics, double mapSize, Shapes& shapes)
+	{
+		for (size_t i = 0; i < numUnits; ++i)
+		{
+			entity_id_t ent = 1000 + (entity_id_t)shapes.unitEnts.size();
+			shapes.unitTags.push_back(cmp->AddUnitShape(ent, RandPos(rng, 8, mapSize-8), RandPos(rng, 8, mapSize-8), RandPos(rng, 0.5, 3), ICmpObstructionManager::FLAG_BLOCK_MOVEMENT, ent));
+			shapes.unitEnts.push_back(ent);
+		}
+
+		for (size_t i = 0; i < numStatics; ++i)
+		{
+			entity_id_t ent = 100000 + (entity_id_t)shapes.staticEnts.size();
+			shapes.staticTags.push_back(cmp->AddStaticShape(ent, RandPos(rng, 16, mapSize-16), RandPos(rng, 16, mapSize-16), RandPos(rng, 0, 6.3), RandPos(rng, 1, 20), RandPos(rng, 1, 20), ICmpObstructionManager::FLAG_BLOCK_MOVEMENT));
+			shapes.staticEnts.push_back(ent);
+		}
+	}
+
+	/**
+	 * Reference implementation of TestUnitShape that checks every shape.
+	 */
+	static std::vector<entity_id_t> BruteForceTestUnitShape(ICmpObstructionManager* cmp, const Shapes& shapes, entity_pos_t x, entity_pos_t z, entity_pos_t r)
+	{
+		std::vector<entity_id_t> out;
+		CFixedVector2D center(x, z);
+		for (size_t i = 0; i < shapes.unitTags.size(); ++i)
+		{
+			ICmpObstructionManager::ObstructionSquare s = cmp->GetObstruction(shapes.unitTags[i]);
+			if (!(s.x + s.hw < x - r || s.x - s.hw > x + r || s.z + s.hh < z - r || s.z - s.hh > z + r))
+				out.push_back(shapes.unitEnts[i]);
+		}
+		for (size_t i = 0; i < shapes.staticTags.size(); ++i)
+		{
+			ICmpObstructionManager::ObstructionSquare s = cmp->GetObstruction(shapes.staticTags[i]);
+			if (Geometry::PointIsInSquare(CFixedVector2D(s.x, s.z) - center, s.u, s.v, CFixedVector2D(s.hw + r, s.hh + r)))
+				out.push_back(shapes.staticEnts[i]);
+		}
+		return out;
+	}
+
+	/**
+	 * Reference implementation of TestStaticShape that checks every shape.
+	 */
+	static std::vector<entity_id_t> BruteForceTestStaticShape(ICmpObstructionManager* cmp, const Shapes& shapes, entity_pos_t x, entity_pos_t z, entity_angle_t a, entity_pos_t w, entity_pos_t h)
+	{
+		std::vector<entity_id_t> out;
+		ICmpObstructionManager::ObstructionSquare t = cmp->GetStaticShapeObstruction(x, z, a, w, h);
+		CFixedVector2D center(t.x, t.z);
+		for (size_t i = 0; i < shapes.unitTags.size(); ++i)
+		{
+			ICmpObstructionManager::ObstructionSquare s = cmp->GetObstruction(shapes.unitTags[i]);
+			if (Geometry::PointIsInSquare(CFixedVector2D(s.x, s.z) - center, t.u, t.v, CFixedVector2D(t.hw + s.hw, t.hh + s.hh)))
+				out.push_back(shapes.unitEnts[i]);
+		}
+		for (size_t i = 0; i < shapes.staticTags.size(); ++i)
+		{
+			ICmpObstructionManager::ObstructionSquare s = cmp->GetObstruction(shapes.staticTags[i]);
+			if (Geometry::TestSquareSquare(center, t.u, t.v, CFixedVector2D(t.hw, t.hh), CFixedVector2D(s.x, s.z), s.u, s.v, CFixedVector2D(s.hw, s.hh)))
+				out.push_back(shapes.staticEnts[i]);
+		}
+		return out;
+	}
+
+	void test_shape_tests()
+	{
+		ComponentTestHelper test;
+
+		ICmpObstructionManager* cmp = test.Add<ICmpObstructionManager>(CID_ObstructionManager, "", SYSTEM_ENTITY);
+		cmp->SetBounds(entity_pos_t::Zero(), entity_pos_t::Zero(), entity_pos_t::FromInt(512), entity_pos_t::FromInt(512));
+
+		WELL512 rng;
+		Shapes shapes;
+		AddRandomShapes(cmp, rng, 500, 200, 512.0, shapes);
+
+		// Check that the subdivision-based tests find exactly the same
+		// collisions (in the same order) as testing every shape
+
+		NullObstructionFilter filter;
+		for (size_t i = 0; i < 1000; ++i)
+		{
+			entity_pos_t x = RandPos(rng, 32, 480);
+			entity_pos_t z = RandPos(rng, 32, 480);
+
+			entity_pos_t r = RandPos(rng, 0, 8);
+			std::vector<entity_id_t> out;
+			bool collided = cmp->TestUnitShape(filter, x, z, r, &out);
+			std::vector<entity_id_t> expected = BruteForceTestUnitShape(cmp, shapes, x, z, r);
+			TS_ASSERT_EQUALS(out, expected);
+			TS_ASSERT_EQUALS(collided, !expected.empty());
+			TS_ASSERT_EQUALS(cmp->TestUnitShape(filter, x, z, r, NULL), !expected.empty());
+
+			entity_angle_t a = RandPos(rng, 0, 6.3);
+			entity_pos_t w = RandPos(rng, 1, 30);
+			entity_pos_t h = RandPos(rng, 1, 30);
+			collided = cmp->TestStaticShape(filter, x, z, a, w, h, &out);
+			expected = BruteForceTestStaticShape(cmp, shapes, x, z, a, w, h);
+			TS_ASSERT_EQUALS(out, expected);
+			TS_ASSERT_EQUALS(collided, !expected.empty());
+			TS_ASSERT_EQUALS(cmp->TestStaticShape(filter, x, z, a, w, h, NULL), !expected.empty());
+		}
+	}
+
+	// disabled by default; run tests with the "-test TestCmpObstructionManager" flag to enable
+	void test_performance_DISABLED()
+	{
+		ComponentTestHelper test;
+
+		ICmpObstructionManager* cmp = test.Add<ICmpObstructionManager>(CID_ObstructionManager, "", SYSTEM_ENTITY);
+		cmp->SetBounds(entity_pos_t::Zero(), entity_pos_t::Zero(), entity_pos_t::FromInt(1024), entity_pos_t::FromInt(1024));
+
+		WELL512 rng;
+		Shapes shapes;
+		NullObstructionFilter filter;
+
+		// The cost per test should stay roughly constant as the total number of shapes
+		// increases, since shape density (and therefore the number of nearby shapes) is
+		// mostly determined by the map size
+		const size_t totals[] = { 1000, 5000, 20000 };
+		for (size_t n = 0; n < ARRAY_SIZE(totals); ++n)
+		{
+			size_t units = totals[n] * 4 / 5 - shapes.unitTags.size();
+			size_t statics = totals[n] / 5 - shapes.staticTags.size();
+			AddRandomShapes(cmp, rng, units, statics, 1024.0, shapes);
+
+			const size_t numTests = 10000;
+			std::vector<entity_id_t> out;
+			double t = timer_Time();
+			for (size_t i = 0; i < numTests; ++i)
+			{
+				entity_pos_t x = RandPos(rng, 32, 992);
+				entity_pos_t z = RandPos(rng, 32, 992);
+				cmp->TestUnitShape(filter, x, z, entity_pos_t::FromInt(1), &out);
+				cmp->TestStaticShape(filter, x, z, entity_angle_t::FromInt(1), entity_pos_t::FromInt(20), entity_pos_t::FromInt(12), &out);
+			}
+			t = timer_Time() - t;
+
+			printf("\n[%d shapes: %f usec per TestUnitShape+TestStaticShape]", (int)totals[n], t * 1e6 / numTests);
+		}
+	}
+};
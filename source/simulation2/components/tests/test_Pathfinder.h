@@ -1,4 +1,4 @@
-/* Copyright (C) 2011 Wildfire Games.
+/* Copyright (C) 2012 Wildfire Games.
  * This file is part of 0 A.D.
  *
  * 0 A.D. is free software: you can redistribute it and/or modify
@@ -19,6 +19,8 @@
 
 #include "simulation2/components/ICmpObstructionManager.h"
 #include "simulation2/components/ICmpPathfinder.h"
+#include "simulation2/components/ICmpTerrain.h"
+#include "simulation2/components/CCmpPathfinder_Common.h"
 
 #include "graphics/MapReader.h"
 #include "graphics/Terrain.h"
@@ -30,6 +32,29 @@
 
 class TestCmpPathfinder : public CxxTest::TestSuite
 {
+	/**
+	 * Updates the pathfinder's grid (incrementally, if it can), and checks it
+	 * matches the grid computed from scratch.
+	 */
+	void CheckIncrementalUpdate(CCmpPathfinder* cmpPathfinder, ICmpObstructionManager* cmpObstructionManager, ICmpTerrain* cmpTerrain)
+	{
+		Grid<u16> incremental = cmpPathfinder->GetPassabilityGrid();
+
+		Grid<u8> obstructions(cmpPathfinder->m_MapSize, cmpPathfinder->m_MapSize);
+		GridRegion dirty;
+		TS_ASSERT(cmpObstructionManager->Rasterise(obstructions, dirty));
+		TS_ASSERT(dirty.Covers(obstructions.m_W, obstructions.m_H));
+		TS_ASSERT(memcmp(obstructions.m_Data, cmpPathfinder->m_ObstructionGrid->m_Data, obstructions.m_W*obstructions.m_H*sizeof(u8)) == 0);
+
+		// Pretend all the terrain has changed, to force a complete recomputation
+		cmpTerrain->MakeDirty(0, 0, cmpTerrain->GetVerticesPerSide(), cmpTerrain->GetVerticesPerSide());
+		const Grid<u16>& full = cmpPathfinder->GetPassabilityGrid();
+
+		TS_ASSERT_EQUALS(incremental.m_W, full.m_W);
+		TS_ASSERT_EQUALS(incremental.m_H, full.m_H);
+		TS_ASSERT(memcmp(incremental.m_Data, full.m_Data, full.m_W*full.m_H*sizeof(u16)) == 0);
+	}
+
 public:
 	void setUp()
 	{
@@ -56,6 +81,76 @@ public:
 		CXeromyces::Terminate();
 	}
 
+	// Checks that updating the grid after small changes to obstructions and terrain
+	// gives the same result as recomputing the whole thing
+	void test_incremental_update()
+	{
+		CTerrain terrain;
+
+		CSimulation2 sim2(NULL, &terrain);
+		sim2.LoadDefaultScripts();
+		sim2.ResetState();
+
+		CMapReader* mapReader = new CMapReader(); // it'll call "delete this" itself
+
+		LDR_BeginRegistering();
+		mapReader->LoadMap(L"maps/scenarios/Median Oasis.pmp", &terrain, NULL, NULL, NULL, NULL, NULL, NULL,
+			&sim2, &sim2.GetSimContext(), -1, false);
+		LDR_EndRegistering();
+		TS_ASSERT_OK(LDR_NonprogressiveLoad());
+
+		sim2.Update(0);
+
+		CmpPtr<ICmpPathfinder> cmp(sim2, SYSTEM_ENTITY);
+		CCmpPathfinder* cmpPathfinder = static_cast<CCmpPathfinder*>(cmp.operator->());
+		CmpPtr<ICmpObstructionManager> cmpObstructionManager(sim2, SYSTEM_ENTITY);
+		CmpPtr<ICmpTerrain> cmpTerrain(sim2, SYSTEM_ENTITY);
+
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		ICmpObstructionManager::flags_t flags = ICmpObstructionManager::FLAG_BLOCK_PATHFINDING | ICmpObstructionManager::FLAG_BLOCK_FOUNDATION;
+
+		// Place a building, then move and rotate it, then remove it
+		ICmpObstructionManager::tag_t tag = cmpObstructionManager->AddStaticShape(INVALID_ENTITY,
+			entity_pos_t::FromInt(300), entity_pos_t::FromInt(400), entity_angle_t::FromInt(1),
+			entity_pos_t::FromInt(30), entity_pos_t::FromInt(20), flags);
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		cmpObstructionManager->MoveShape(tag, entity_pos_t::FromInt(340), entity_pos_t::FromInt(380), entity_angle_t::FromInt(2));
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		cmpObstructionManager->RemoveShape(tag);
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		// Same for a blocking unit shape
+		tag = cmpObstructionManager->AddUnitShape(INVALID_ENTITY,
+			entity_pos_t::FromInt(100), entity_pos_t::FromInt(120), entity_pos_t::FromInt(6), flags, INVALID_ENTITY);
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		cmpObstructionManager->MoveShape(tag, entity_pos_t::FromInt(110), entity_pos_t::FromInt(100), entity_angle_t::Zero());
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		cmpObstructionManager->RemoveShape(tag);
+		CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+
+		// Dig holes and raise hills around the middle of the map (near the oasis),
+		// so that tiles change between land and water and the shore distances change
+		u16* heightmap = terrain.GetHeightMap();
+		ssize_t verts = terrain.GetVerticesPerSide();
+		for (ssize_t n = 0; n < 8; ++n)
+		{
+			ssize_t i0 = verts/2 - 32 + (n * 23) % 56;
+			ssize_t j0 = verts/2 - 32 + (n * 37) % 56;
+			u16 height = (n % 2) ? 0 : 16384;
+			for (ssize_t j = j0; j < j0 + 8; ++j)
+				for (ssize_t i = i0; i < i0 + 8; ++i)
+					heightmap[j*verts + i] = height;
+
+			cmpTerrain->MakeDirty(i0, j0, i0 + 8, j0 + 8);
+			CheckIncrementalUpdate(cmpPathfinder, cmpObstructionManager.operator->(), cmpTerrain.operator->());
+		}
+	}
+
 	// disabled by default; run tests with the "-test TestCmpPathfinder" flag to enable
 	void test_performance_DISABLED()
 	{
@@ -109,6 +204,75 @@ public:
 		printf("[%f]", t);
 	}
 
+	// Compares the hierarchical pathfinder against the plain tile-based A*,
+	// for a mixture of short and long paths (some of which are unreachable)
+	void test_performance_hierarchical_DISABLED()
+	{
+		CTerrain terrain;
+
+		CSimulation2 sim2(NULL, &terrain);
+		sim2.LoadDefaultScripts();
+		sim2.ResetState();
+
+		CMapReader* mapReader = new CMapReader(); // it'll call "delete this" itself
+
+		LDR_BeginRegistering();
+		mapReader->LoadMap(L"maps/scenarios/Median Oasis.pmp", &terrain, NULL, NULL, NULL, NULL, NULL, NULL,
+			&sim2, &sim2.GetSimContext(), -1, false);
+		LDR_EndRegistering();
+		TS_ASSERT_OK(LDR_NonprogressiveLoad());
+
+		sim2.Update(0);
+
+		CmpPtr<ICmpPathfinder> cmp(sim2, SYSTEM_ENTITY);
+		CCmpPathfinder* cmpPathfinder = static_cast<CCmpPathfinder*>(cmp.operator->());
+
+		ICmpPathfinder::pass_class_t passClass = cmp->GetPassabilityClass("default");
+		ICmpPathfinder::cost_class_t costClass = cmp->GetCostClass("default");
+
+		for (int hier = 0; hier < 2; ++hier)
+		{
+			cmpPathfinder->m_UseHierarchicalPathfinder = (hier != 0);
+
+			// Compute the grid before starting the timer
+			ICmpPathfinder::Path warmup;
+			ICmpPathfinder::Goal warmupGoal = { ICmpPathfinder::Goal::POINT, entity_pos_t::FromInt(1), entity_pos_t::FromInt(1) };
+			cmp->ComputePath(entity_pos_t::FromInt(1), entity_pos_t::FromInt(1), warmupGoal, passClass, costClass, warmup);
+
+			const int numPaths = 256;
+			u64 steps = 0;
+			double length = 0.0;
+			double t = timer_Time();
+
+			srand(1234);
+			for (int j = 0; j < numPaths; ++j)
+			{
+				entity_pos_t x0 = entity_pos_t::FromInt(rand() % 512);
+				entity_pos_t z0 = entity_pos_t::FromInt(rand() % 512);
+				int range = (j % 2) ? 64 : 512;
+				entity_pos_t x1 = x0 + entity_pos_t::FromInt(rand() % range - range/2);
+				entity_pos_t z1 = z0 + entity_pos_t::FromInt(rand() % range - range/2);
+				ICmpPathfinder::Goal goal = { ICmpPathfinder::Goal::POINT, x1, z1 };
+
+				ICmpPathfinder::Path path;
+				cmp->ComputePath(x0, z0, goal, passClass, costClass, path);
+				steps += cmpPathfinder->m_DebugSteps;
+
+				CFixedVector2D prev(x0, z0);
+				for (ssize_t i = (ssize_t)path.m_Waypoints.size()-1; i >= 0; --i)
+				{
+					CFixedVector2D p(path.m_Waypoints[i].x, path.m_Waypoints[i].z);
+					length += (p - prev).Length().ToDouble();
+					prev = p;
+				}
+			}
+
+			t = timer_Time() - t;
+			printf("%s: %f paths/sec, %f nodes expanded/path, %f average path length\n",
+				hier ? "Hierarchical" : "Flat", numPaths / t, (double)steps / numPaths, length / numPaths);
+		}
+	}
+
 	void test_performance_short_DISABLED()
 	{
 		CTerrain terrain;
@@ -139,4 +303,57 @@ public:
 		for (size_t i = 0; i < path.m_Waypoints.size(); ++i)
 			printf("# %d: %f %f\n", (int)i, path.m_Waypoints[i].x.ToFloat(), path.m_Waypoints[i].z.ToFloat());
 	}
+
+	// Times short paths through a crowd of units and buildings, like a large
+	// army moving through a town
+	void test_performance_short_crowded_DISABLED()
+	{
+		CTerrain terrain;
+		terrain.Initialize(5, NULL);
+
+		CSimulation2 sim2(NULL, &terrain);
+		sim2.LoadDefaultScripts();
+		sim2.ResetState();
+
+		const entity_pos_t range = entity_pos_t::FromInt(40);
+		const entity_pos_t size = entity_pos_t::FromInt(160);
+
+		CmpPtr<ICmpObstructionManager> cmpObstructionMan(sim2, SYSTEM_ENTITY);
+		CmpPtr<ICmpPathfinder> cmpPathfinder(sim2, SYSTEM_ENTITY);
+
+		srand(0);
+		for (size_t i = 0; i < 40; ++i)
+		{
+			fixed x = fixed::FromFloat(size.ToFloat() * rand()/(float)RAND_MAX);
+			fixed z = fixed::FromFloat(size.ToFloat() * rand()/(float)RAND_MAX);
+			entity_angle_t a = (i % 2) ? entity_angle_t::Zero() : fixed::FromFloat(3.f * rand()/(float)RAND_MAX);
+			cmpObstructionMan->AddStaticShape(INVALID_ENTITY, x, z, a, fixed::FromInt(6 + rand() % 10), fixed::FromInt(6 + rand() % 10), 0);
+		}
+		for (size_t i = 0; i < 1000; ++i)
+		{
+			fixed x = fixed::FromFloat(size.ToFloat() * rand()/(float)RAND_MAX);
+			fixed z = fixed::FromFloat(size.ToFloat() * rand()/(float)RAND_MAX);
+			cmpObstructionMan->AddUnitShape(INVALID_ENTITY, x, z, fixed::FromFloat(0.8f), 0, INVALID_ENTITY);
+		}
+
+		NullObstructionFilter filter;
+		ICmpPathfinder::pass_class_t passClass = cmpPathfinder->GetPassabilityClass("default");
+
+		const int numPaths = 200;
+		size_t waypoints = 0;
+		double t = timer_Time();
+
+		for (int j = 0; j < numPaths; ++j)
+		{
+			entity_pos_t x0 = range + fixed::FromFloat((size - range*2).ToFloat() * rand()/(float)RAND_MAX);
+			entity_pos_t z0 = range + fixed::FromFloat((size - range*2).ToFloat() * rand()/(float)RAND_MAX);
+			ICmpPathfinder::Goal goal = { ICmpPathfinder::Goal::POINT, x0 + range/2, z0 + range/2 };
+			ICmpPathfinder::Path path;
+			cmpPathfinder->ComputeShortPath(filter, x0, z0, fixed::FromFloat(0.8f), range, goal, passClass, path);
+			waypoints += path.m_Waypoints.size();
+		}
+
+		t = timer_Time() - t;
+		printf("%f paths/sec, %f waypoints/path\n", numPaths / t, (double)waypoints / numPaths);
+	}
 };
@@ -21,8 +21,10 @@
 #include "simulation2/components/ICmpPosition.h"
 #include "simulation2/components/ICmpVision.h"
 
+#include "lib/timer.h"
 #include "maths/Random.h"
 
+#include <boost/random/uniform_int.hpp>
 #include <boost/random/uniform_real.hpp>
 
 class MockVision : public ICmpVision
@@ -35,6 +37,19 @@ public:
 	virtual bool GetAlwaysVisible() { return false; }
 };
 
+/**
+ * Vision mock whose range can be changed by the test.
+ */
+class MockVisionRange : public MockVision
+{
+public:
+	MockVisionRange() : m_Range(entity_pos_t::FromInt(66)) { }
+
+	virtual entity_pos_t GetRange() { return m_Range; }
+
+	entity_pos_t m_Range;
+};
+
 class MockPosition : public ICmpPosition
 {
 public:
@@ -59,6 +74,21 @@ public:
 	virtual CMatrix3D GetInterpolatedTransform(float UNUSED(frameOffset), bool UNUSED(forceFloating)) { return CMatrix3D(); }
 };
 
+/**
+ * Position mock whose state can be changed by the test.
+ */
+class MockPositionMovable : public MockPosition
+{
+public:
+	MockPositionMovable() : m_InWorld(false) { }
+
+	virtual bool IsInWorld() { return m_InWorld; }
+	virtual CFixedVector2D GetPosition2D() { return m_Pos; }
+
+	bool m_InWorld;
+	CFixedVector2D m_Pos;
+};
+
 class TestCmpRangeManager : public CxxTest::TestSuite
 {
 public:
@@ -124,4 +154,294 @@ public:
 			cmp->Verify();
 		}
 	}
+
+	// Returns player 1's LOS state of every vertex
+	std::vector<u8> getLos(ICmpRangeManager* cmp, ssize_t size)
+	{
+		ICmpRangeManager::CLosQuerier los = cmp->GetLosQuerier(1);
+		std::vector<u8> state;
+		for (ssize_t j = 0; j < size; ++j)
+			for (ssize_t i = 0; i < size; ++i)
+				state.push_back(los.IsVisible(i, j) ? 2 : los.IsExplored(i, j) ? 1 : 0);
+		return state;
+	}
+
+	void test_los_dirty_regions()
+	{
+		ComponentTestHelper test;
+
+		ICmpRangeManager* cmp = test.Add<ICmpRangeManager>(CID_RangeManager, "");
+
+		MockVision vision;
+		test.AddMock(100, IID_Vision, vision);
+
+		MockPosition position;
+		test.AddMock(100, IID_Position, position);
+
+		const ssize_t size = 512/TERRAIN_TILE_SIZE + 1;
+		cmp->SetBounds(entity_pos_t::FromInt(0), entity_pos_t::FromInt(0), entity_pos_t::FromInt(512), entity_pos_t::FromInt(512), size);
+
+		size_t dirtyID = 0;
+		std::vector<ICmpRangeManager::LosRegion> regions;
+
+		// The first call reports the whole map
+		cmp->GetLosDirtyRegions(&dirtyID, regions);
+		TS_ASSERT_EQUALS(regions.size(), (size_t)1);
+		TS_ASSERT(regions[0].i0 == 0 && regions[0].j0 == 0 && regions[0].i1 == size && regions[0].j1 == size);
+
+		// Then nothing until the LOS changes
+		cmp->GetLosDirtyRegions(&dirtyID, regions);
+		TS_ASSERT(regions.empty());
+
+		{ CMessageCreate msg(100); cmp->HandleMessage(msg, false); }
+		{ CMessageOwnershipChanged msg(100, -1, 1); cmp->HandleMessage(msg, false); }
+
+		WELL512 rng;
+		for (size_t n = 0; n < 64; ++n)
+		{
+			std::vector<u8> before = getLos(cmp, size);
+
+			double x = boost::uniform_real<>(0.0, 512.0)(rng);
+			double z = boost::uniform_real<>(0.0, 512.0)(rng);
+			{ CMessagePositionChanged msg(100, true, entity_pos_t::FromDouble(x), entity_pos_t::FromDouble(z), entity_angle_t::Zero()); cmp->HandleMessage(msg, false); }
+
+			// Verify mustn't make everything look dirty
+			cmp->Verify();
+
+			std::vector<u8> after = getLos(cmp, size);
+
+			cmp->GetLosDirtyRegions(&dirtyID, regions);
+
+			// Every changed vertex must be in a region, but the regions
+			// shouldn't cover the whole map
+			ssize_t area = 0;
+			for (size_t r = 0; r < regions.size(); ++r)
+				area += (regions[r].i1 - regions[r].i0) * (regions[r].j1 - regions[r].j0);
+			TS_ASSERT_LESS_THAN(area, size*size);
+
+			for (ssize_t j = 0; j < size; ++j)
+			{
+				for (ssize_t i = 0; i < size; ++i)
+				{
+					if (before[i + j*size] == after[i + j*size])
+						continue;
+
+					bool found = false;
+					for (size_t r = 0; r < regions.size(); ++r)
+						if (regions[r].i0 <= i && i < regions[r].i1 && regions[r].j0 <= j && j < regions[r].j1)
+							found = true;
+					TS_ASSERT(found);
+				}
+			}
+		}
+
+		// Revealing the map changes everything
+		cmp->SetLosRevealAll(1, true);
+		cmp->GetLosDirtyRegions(&dirtyID, regions);
+		TS_ASSERT_EQUALS(regions.size(), (size_t)1);
+		TS_ASSERT(regions[0].i0 == 0 && regions[0].j0 == 0 && regions[0].i1 == size && regions[0].j1 == size);
+	}
+
+	void test_los_random()
+	{
+		ComponentTestHelper test;
+
+		ICmpRangeManager* cmp = test.Add<ICmpRangeManager>(CID_RangeManager, "");
+
+		cmp->SetBounds(entity_pos_t::FromInt(0), entity_pos_t::FromInt(0), entity_pos_t::FromInt(512), entity_pos_t::FromInt(512), 512/TERRAIN_TILE_SIZE + 1);
+
+		// A mix of vision ranges, including ones that aren't whole numbers of tiles
+		const size_t numEnts = 24;
+		MockVisionRange visions[numEnts];
+		MockPositionMovable positions[numEnts];
+		for (size_t i = 0; i < numEnts; ++i)
+		{
+			entity_id_t ent = 100 + (entity_id_t)i;
+			visions[i].m_Range = entity_pos_t::FromInt(8 + 13*(int)i) / 2;
+			test.AddMock(ent, IID_Vision, visions[i]);
+			test.AddMock(ent, IID_Position, positions[i]);
+			{ CMessageCreate msg(ent); cmp->HandleMessage(msg, false); }
+			{ CMessageOwnershipChanged msg(ent, -1, 1 + (i % 3)); cmp->HandleMessage(msg, false); }
+		}
+
+		// This tests that the LOS state stays consistent with the per-vertex counts
+		// (which Verify checks) as units with overlapping vision move around,
+		// including near the edges of square and circular maps
+
+		WELL512 rng;
+		for (size_t turn = 0; turn < 512; ++turn)
+		{
+			if (turn == 256)
+			{
+				cmp->SetLosCircular(true);
+				cmp->Verify();
+			}
+
+			RandomChange(cmp, rng, positions, numEnts, 16.0, true);
+		}
+	}
+
+	void test_active_queries()
+	{
+		ComponentTestHelper test;
+
+		ICmpRangeManager* cmp = test.Add<ICmpRangeManager>(CID_RangeManager, "");
+
+		cmp->SetBounds(entity_pos_t::FromInt(0), entity_pos_t::FromInt(0), entity_pos_t::FromInt(512), entity_pos_t::FromInt(512), 512/TERRAIN_TILE_SIZE + 1);
+
+		const size_t numEnts = 32;
+		MockPositionMovable positions[numEnts];
+		for (size_t i = 0; i < numEnts; ++i)
+		{
+			entity_id_t ent = 100 + (entity_id_t)i;
+			test.AddMock(ent, IID_Position, positions[i]);
+			{ CMessageCreate msg(ent); cmp->HandleMessage(msg, false); }
+			{ CMessageOwnershipChanged msg(ent, -1, 1 + (i % 2)); cmp->HandleMessage(msg, false); }
+		}
+
+		std::vector<int> owners;
+		owners.push_back(1);
+		owners.push_back(2);
+		std::vector<ICmpRangeManager::tag_t> tags;
+		for (size_t i = 0; i < numEnts; i += 4)
+		{
+			tags.push_back(cmp->CreateActiveQuery(100 + (entity_id_t)i, entity_pos_t::Zero(), entity_pos_t::FromInt(40 + 10*(int)i), owners, 0));
+			cmp->EnableActiveQuery(tags.back());
+		}
+		tags.push_back(cmp->CreateActiveQuery(101, entity_pos_t::FromInt(16), entity_pos_t::FromInt(-1), owners, 0));
+		cmp->EnableActiveQuery(tags.back());
+
+		// This tests that skipping the re-evaluation of unaffected queries
+		// never leaves them with a stale result
+
+		WELL512 rng;
+		for (size_t turn = 0; turn < 256; ++turn)
+		{
+			for (size_t n = 0; n < 4; ++n)
+			{
+				RandomChange(cmp, rng, positions, numEnts, 32.0, false);
+			}
+
+			{ CMessageUpdate msg(fixed::FromInt(1)); cmp->HandleMessage(msg, false); }
+			cmp->Verify();
+
+			if (turn % 64 == 0)
+			{
+				cmp->DisableActiveQuery(tags[0]);
+				cmp->ResetActiveQuery(tags[1]);
+				cmp->Verify();
+			}
+			else if (turn % 64 == 32)
+			{
+				cmp->EnableActiveQuery(tags[0]);
+				cmp->Verify();
+			}
+		}
+	}
+
+	// disabled by default; run tests with the "-test TestCmpRangeManager" flag to enable
+	void test_performance_DISABLED()
+	{
+		const size_t entityCounts[] = { 1000, 5000, 20000 };
+		for (size_t c = 0; c < ARRAY_SIZE(entityCounts); ++c)
+		{
+			const size_t numEnts = entityCounts[c];
+
+			ComponentTestHelper test;
+			ICmpRangeManager* cmp = test.Add<ICmpRangeManager>(CID_RangeManager, "");
+			cmp->SetBounds(entity_pos_t::FromInt(0), entity_pos_t::FromInt(0), entity_pos_t::FromInt(1024), entity_pos_t::FromInt(1024), 1024/TERRAIN_TILE_SIZE + 1);
+
+			WELL512 rng;
+			std::vector<MockPositionMovable> positions(numEnts);
+			for (size_t i = 0; i < numEnts; ++i)
+			{
+				entity_id_t ent = 100 + (entity_id_t)i;
+				positions[i].m_InWorld = true;
+				positions[i].m_Pos = CFixedVector2D(entity_pos_t::FromDouble(boost::uniform_real<>(0.0, 1024.0)(rng)), entity_pos_t::FromDouble(boost::uniform_real<>(0.0, 1024.0)(rng)));
+				test.AddMock(ent, IID_Position, positions[i]);
+				{ CMessageCreate msg(ent); cmp->HandleMessage(msg, false); }
+				{ CMessageOwnershipChanged msg(ent, -1, 1 + (i % 4)); cmp->HandleMessage(msg, false); }
+				{ CMessagePositionChanged msg(ent, true, positions[i].m_Pos.X, positions[i].m_Pos.Y, entity_angle_t::Zero()); cmp->HandleMessage(msg, false); }
+			}
+
+			std::vector<int> owners;
+			owners.push_back(2);
+			owners.push_back(3);
+
+			const size_t numQueries = 16384;
+			size_t matches = 0;
+			double t = timer_Time();
+			for (size_t i = 0; i < numQueries; ++i)
+			{
+				entity_id_t source = 100 + (entity_id_t)(i % numEnts);
+				matches += cmp->ExecuteQuery(source, entity_pos_t::Zero(), entity_pos_t::FromInt(72), owners, 0).size();
+			}
+			t = timer_Time() - t;
+
+			printf("\n[%d entities: %.0f queries/sec, %.1f matches/query]", (int)numEnts, numQueries / t, matches / (double)numQueries);
+		}
+	}
+
+private:
+	/**
+	 * Makes a random change to one of the entities (a move, moving out of the
+	 * world, or an ownership change), keeping @p positions in sync,
+	 * then checks the range manager is still consistent.
+	 * Small moves are up to 256/stepScale in each direction; if @p largeMoves is set,
+	 * entities can also jump anywhere on the map.
+	 */
+	void RandomChange(ICmpRangeManager* cmp, WELL512& rng, MockPositionMovable* positions, size_t numEnts, double stepScale, bool largeMoves)
+	{
+		size_t i = boost::uniform_int<>(0, numEnts-1)(rng);
+		entity_id_t ent = 100 + (entity_id_t)i;
+		int change = boost::uniform_int<>(0, 5)(rng);
+		if (change == 3 && !largeMoves)
+			change = 0;
+		switch (change)
+		{
+		case 0:
+		case 1:
+		case 2:
+		{
+			// Small move, which updates the LOS incrementally and usually stays
+			// within the same subdivision
+			double x = boost::uniform_real<>(0.0, 512.0)(rng);
+			double z = boost::uniform_real<>(0.0, 512.0)(rng);
+			if (positions[i].m_InWorld)
+			{
+				x = std::min(512.0, std::max(0.0, positions[i].m_Pos.X.ToDouble() + (x - 256.0) / stepScale));
+				z = std::min(512.0, std::max(0.0, positions[i].m_Pos.Y.ToDouble() + (z - 256.0) / stepScale));
+			}
+			positions[i].m_InWorld = true;
+			positions[i].m_Pos = CFixedVector2D(entity_pos_t::FromDouble(x), entity_pos_t::FromDouble(z));
+			CMessagePositionChanged msg(ent, true, positions[i].m_Pos.X, positions[i].m_Pos.Y, entity_angle_t::Zero());
+			cmp->HandleMessage(msg, false);
+			break;
+		}
+		case 3:
+		{
+			// Large move, or move into the world
+			positions[i].m_InWorld = true;
+			positions[i].m_Pos = CFixedVector2D(entity_pos_t::FromInt(boost::uniform_int<>(0, 512)(rng)), entity_pos_t::FromInt(boost::uniform_int<>(0, 512)(rng)));
+			CMessagePositionChanged msg(ent, true, positions[i].m_Pos.X, positions[i].m_Pos.Y, entity_angle_t::Zero());
+			cmp->HandleMessage(msg, false);
+			break;
+		}
+		case 4:
+		{
+			positions[i].m_InWorld = false;
+			CMessagePositionChanged msg(ent, false, entity_pos_t::Zero(), entity_pos_t::Zero(), entity_angle_t::Zero());
+			cmp->HandleMessage(msg, false);
+			break;
+		}
+		case 5:
+		{
+			int to = boost::uniform_int<>(0, 3)(rng);
+			CMessageOwnershipChanged msg(ent, -1, to); // (old owner is ignored)
+			cmp->HandleMessage(msg, false);
+			break;
+		}
+		}
+		cmp->Verify();
+	}
 };
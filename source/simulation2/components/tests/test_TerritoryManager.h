@@ -18,8 +18,20 @@
 #include "simulation2/system/ComponentTest.h"
 
 #include "ps/CStr.h"
+#include "graphics/MapReader.h"
 #include "graphics/Terrain.h"
+#include "graphics/TerrainTextureManager.h"
 #include "graphics/TerritoryBoundary.h"
+#include "lib/timer.h"
+#include "lib/tex/tex.h"
+#include "ps/Loader.h"
+#include "simulation2/Simulation2.h"
+#include "simulation2/components/ICmpOwnership.h"
+#include "simulation2/components/ICmpPosition.h"
+#include "simulation2/components/ICmpTemplateManager.h"
+#include "simulation2/components/ICmpTerrain.h"
+#include "simulation2/components/ICmpTerritoryInfluence.h"
+#include "simulation2/components/ICmpTerritoryManager.h"
 #include "simulation2/helpers/Grid.h"
 
 class TestCmpTerritoryManager : public CxxTest::TestSuite
@@ -35,6 +47,113 @@ public:
 		
 	}
 
+	// Checks that updating the territories after changes to influence entities
+	// and terrain gives the same result as computing them from scratch
+	void test_incremental_update()
+	{
+		TerrainData data;
+		CTerrain terrain;
+		CSimulation2 sim2(NULL, &terrain);
+		LoadMap(sim2, terrain);
+
+		CheckIncrementalUpdate(sim2, terrain);
+
+		entity_id_t ent = FindInfluenceEntity(sim2);
+		TS_ASSERT(ent != INVALID_ENTITY);
+		CmpPtr<ICmpPosition> cmpPosition(sim2, ent);
+		CmpPtr<ICmpOwnership> cmpOwnership(sim2, ent);
+		CFixedVector2D pos = cmpPosition->GetPosition2D();
+		player_id_t owner = cmpOwnership->GetOwner();
+
+		// Move an existing influence, then give it to another player
+		cmpPosition->JumpTo(pos.X + entity_pos_t::FromInt(60), pos.Y - entity_pos_t::FromInt(40));
+		CheckIncrementalUpdate(sim2, terrain);
+
+		cmpOwnership->SetOwner(owner == 1 ? 2 : 1);
+		CheckIncrementalUpdate(sim2, terrain);
+
+		// Add a copy of it next to another player's territory, then destroy it
+		CmpPtr<ICmpTemplateManager> cmpTemplateManager(sim2, SYSTEM_ENTITY);
+		entity_id_t copy = sim2.AddEntity(CStr(cmpTemplateManager->GetCurrentTemplateName(ent)).FromUTF8());
+		TS_ASSERT(copy != INVALID_ENTITY);
+		CmpPtr<ICmpPosition>(sim2, copy)->JumpTo(pos.X - entity_pos_t::FromInt(80), pos.Y + entity_pos_t::FromInt(20));
+		CmpPtr<ICmpOwnership>(sim2, copy)->SetOwner(owner);
+		CheckIncrementalUpdate(sim2, terrain);
+
+		sim2.DestroyEntity(copy);
+		sim2.FlushDestroyedEntities();
+		CheckIncrementalUpdate(sim2, terrain);
+
+		// Raise a hill next to the original position, to change the terrain costs
+		CmpPtr<ICmpTerrain> cmpTerrain(sim2, SYSTEM_ENTITY);
+		u16* heightmap = terrain.GetHeightMap();
+		ssize_t verts = terrain.GetVerticesPerSide();
+		ssize_t i0 = clamp((pos.X / (int)TERRAIN_TILE_SIZE).ToInt_RoundToZero() + 4, 0, (int)verts - 8);
+		ssize_t j0 = clamp((pos.Y / (int)TERRAIN_TILE_SIZE).ToInt_RoundToZero() + 4, 0, (int)verts - 8);
+		for (ssize_t j = j0; j < j0 + 8; ++j)
+			for (ssize_t i = i0; i < i0 + 8; ++i)
+				heightmap[j*verts + i] = 65535;
+		cmpTerrain->MakeDirty(i0, j0, i0 + 8, j0 + 8);
+		CheckIncrementalUpdate(sim2, terrain);
+	}
+
+	// Measures the time to recompute territories after adding one more building,
+	// with various numbers of buildings already on the map.
+	// (Disabled by default; run tests with the "-test TestCmpTerritoryManager" flag to enable)
+	void test_performance_DISABLED()
+	{
+		TerrainData data;
+		CTerrain terrain;
+		CSimulation2 sim2(NULL, &terrain);
+		LoadMap(sim2, terrain);
+
+		entity_id_t ent = FindInfluenceEntity(sim2);
+		TS_ASSERT(ent != INVALID_ENTITY);
+		CmpPtr<ICmpTemplateManager> cmpTemplateManager(sim2, SYSTEM_ENTITY);
+		std::wstring templateName = CStr(cmpTemplateManager->GetCurrentTemplateName(ent)).FromUTF8();
+
+		CmpPtr<ICmpTerritoryManager> cmpTerritoryManager(sim2, SYSTEM_ENTITY);
+		cmpTerritoryManager->GetTerritoryGrid();
+
+		entity_pos_t mapSize = entity_pos_t::FromInt((int)(terrain.GetTilesPerSide() * TERRAIN_TILE_SIZE));
+
+		size_t numBuildings = 0;
+		const size_t counts[] = { 10, 50, 100, 200, 400 };
+		for (size_t c = 0; c < ARRAY_SIZE(counts); ++c)
+		{
+			double total = 0.0;
+			while (numBuildings < counts[c])
+			{
+				// Scatter the buildings over the map, owned by several players
+				entity_id_t building = sim2.AddEntity(templateName);
+				entity_pos_t x = mapSize.Multiply(fixed::FromInt((int)((numBuildings * 37) % 101))) / 101;
+				entity_pos_t z = mapSize.Multiply(fixed::FromInt((int)((numBuildings * 59) % 103))) / 103;
+				CmpPtr<ICmpPosition>(sim2, building)->JumpTo(x, z);
+				CmpPtr<ICmpOwnership>(sim2, building)->SetOwner((player_id_t)(1 + numBuildings % 4));
+				++numBuildings;
+
+				double t = timer_Time();
+				cmpTerritoryManager->GetTerritoryGrid();
+				total += timer_Time() - t;
+			}
+
+			// Compare against computing everything from scratch, in a copy of the simulation
+			std::stringstream stream;
+			TS_ASSERT(sim2.SerializeState(stream));
+			CSimulation2 sim3(NULL, &terrain);
+			sim3.LoadDefaultScripts();
+			sim3.ResetState();
+			TS_ASSERT(sim3.DeserializeState(stream));
+			CmpPtr<ICmpTerritoryManager> cmpTerritoryManager3(sim3, SYSTEM_ENTITY);
+			double t = timer_Time();
+			cmpTerritoryManager3->GetTerritoryGrid();
+			t = timer_Time() - t;
+
+			printf("\n%d buildings: %f ms per added building; %f ms from scratch", (int)numBuildings, 1000.0*total/counts[c], 1000.0*t);
+		}
+		printf("\n");
+	}
+
 	void test_boundaries()
 	{
 		Grid<u8> grid = GetGrid("--------"
@@ -247,6 +366,92 @@ public:
 	}
 
 private:
+	/**
+	 * Mounts the VFS and loads the terrain textures (needed for terrain movement
+	 * costs) for the lifetime of the object, for the tests that load a real map.
+	 */
+	struct TerrainData
+	{
+		TerrainData()
+		{
+			CXeromyces::Startup();
+
+			g_VFS = CreateVfs(20 * MiB);
+			TS_ASSERT_OK(g_VFS->Mount(L"", DataDir()/"mods"/"public", VFS_MOUNT_MUST_EXIST));
+			TS_ASSERT_OK(g_VFS->Mount(L"cache/", DataDir()/"cache"));
+
+			// (TODO: this ought to be independent of any graphics code)
+			tex_codec_register_all();
+			new CTerrainTextureManager;
+			g_TexMan.LoadTerrainTextures();
+		}
+
+		~TerrainData()
+		{
+			delete &g_TexMan;
+			tex_codec_unregister_all();
+
+			g_VFS.reset();
+
+			CXeromyces::Terminate();
+		}
+	};
+
+	void LoadMap(CSimulation2& sim2, CTerrain& terrain)
+	{
+		sim2.LoadDefaultScripts();
+		sim2.ResetState();
+
+		CMapReader* mapReader = new CMapReader(); // it'll call "delete this" itself
+
+		LDR_BeginRegistering();
+		mapReader->LoadMap(L"maps/scenarios/Median Oasis.pmp", &terrain, NULL, NULL, NULL, NULL, NULL, NULL,
+			&sim2, &sim2.GetSimContext(), -1, false);
+		LDR_EndRegistering();
+		TS_ASSERT_OK(LDR_NonprogressiveLoad());
+
+		sim2.Update(0);
+	}
+
+	/// Returns a player-owned territory influence entity, or INVALID_ENTITY if there are none.
+	entity_id_t FindInfluenceEntity(CSimulation2& sim2)
+	{
+		CSimulation2::InterfaceList ents = sim2.GetEntitiesWithInterface(IID_TerritoryInfluence);
+		for (size_t i = 0; i < ents.size(); ++i)
+		{
+			CmpPtr<ICmpOwnership> cmpOwnership(sim2, ents[i].first);
+			CmpPtr<ICmpPosition> cmpPosition(sim2, ents[i].first);
+			if (!cmpOwnership.null() && cmpOwnership->GetOwner() > 0 && !cmpPosition.null() && cmpPosition->IsInWorld())
+				return ents[i].first;
+		}
+		return INVALID_ENTITY;
+	}
+
+	/**
+	 * Updates the territories (incrementally, if it can), and checks they match the
+	 * territories computed from scratch by a copy of the simulation.
+	 */
+	void CheckIncrementalUpdate(CSimulation2& sim2, CTerrain& terrain)
+	{
+		CmpPtr<ICmpTerritoryManager> cmpTerritoryManager(sim2, SYSTEM_ENTITY);
+		Grid<u8> incremental = cmpTerritoryManager->GetTerritoryGrid();
+
+		std::stringstream stream;
+		TS_ASSERT(sim2.SerializeState(stream));
+
+		CSimulation2 sim3(NULL, &terrain);
+		sim3.LoadDefaultScripts();
+		sim3.ResetState();
+		TS_ASSERT(sim3.DeserializeState(stream));
+
+		CmpPtr<ICmpTerritoryManager> cmpTerritoryManager3(sim3, SYSTEM_ENTITY);
+		const Grid<u8>& full = cmpTerritoryManager3->GetTerritoryGrid();
+
+		TS_ASSERT_EQUALS(incremental.m_W, full.m_W);
+		TS_ASSERT_EQUALS(incremental.m_H, full.m_H);
+		TS_ASSERT(memcmp(incremental.m_Data, full.m_Data, full.m_W*full.m_H*sizeof(u8)) == 0);
+	}
+
 	/// Parses a string representation of a grid into an actual Grid structure, such that the (i,j) axes are located in the bottom
 	/// left hand side of the map. Note: leaves all custom bits in the grid values at zero (anything outside 
 	/// ICmpTerritoryManager::TERRITORY_PLAYER_MASK).
@@ -0,0 +1,330 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simulation2/system/ComponentTest.h"
+
+#include "simulation2/components/ICmpUnitRenderer.h"
+#include "simulation2/components/ICmpVisual.h"
+
+#include "graphics/Frustum.h"
+#include "lib/timer.h"
+#include "maths/BoundingBoxAligned.h"
+#include "maths/BoundingBoxOriented.h"
+#include "maths/Random.h"
+#include "renderer/Scene.h"
+
+#include <boost/random/uniform_real.hpp>
+
+/**
+ * Visual that just counts how often the unit renderer calls it.
+ */
+class MockVisualCounter : public ICmpVisual
+{
+public:
+	DEFAULT_MOCK_COMPONENT()
+
+	MockVisualCounter() : m_Interpolated(0), m_Animated(0), m_Submitted(0), m_LastFrameTime(-1.f) { }
+
+	virtual CBoundingBoxAligned GetBounds() { return CBoundingBoxAligned::EMPTY; }
+	virtual CBoundingBoxOriented GetSelectionBox() { return CBoundingBoxOriented::EMPTY; }
+	virtual CVector3D GetPosition() { return CVector3D(); }
+	virtual std::wstring GetActorShortName() { return L""; }
+	virtual std::wstring GetProjectileActor() { return L""; }
+	virtual CVector3D GetProjectileLaunchPoint() { return CVector3D(); }
+	virtual CUnit* GetUnit() { return NULL; }
+	virtual void SelectAnimation(std::string UNUSED(name), bool UNUSED(once), fixed UNUSED(speed), std::wstring UNUSED(soundgroup)) { }
+	virtual void SetUnitEntitySelection(const CStr& UNUSED(selection)) { }
+	virtual void SelectMovementAnimation(fixed UNUSED(runThreshold)) { }
+	virtual void SetAnimationSyncRepeat(fixed UNUSED(repeattime)) { }
+	virtual void SetAnimationSyncOffset(fixed UNUSED(actiontime)) { }
+	virtual void SetShadingColour(fixed UNUSED(r), fixed UNUSED(g), fixed UNUSED(b), fixed UNUSED(a)) { }
+	virtual void SetVariable(std::string UNUSED(name), float UNUSED(value)) { }
+	virtual void Hotload(const VfsPath& UNUSED(name)) { }
+
+	virtual void Interpolate(float frameTime, float UNUSED(frameOffset))
+	{
+		m_Interpolated++;
+		m_LastFrameTime = frameTime;
+	}
+
+	virtual void UpdateAnimation(float UNUSED(frameTime))
+	{
+		m_Animated++;
+	}
+
+	virtual void RenderSubmit(SceneCollector& UNUSED(collector), const CFrustum& UNUSED(frustum), bool UNUSED(culling))
+	{
+		m_Submitted++;
+	}
+
+	void Reset()
+	{
+		m_Interpolated = m_Animated = m_Submitted = 0;
+		m_LastFrameTime = -1.f;
+	}
+
+	int m_Interpolated;
+	int m_Animated;
+	int m_Submitted;
+	float m_LastFrameTime;
+};
+
+/**
+ * Terrain with a 1024m map, for the performance test.
+ */
+class MockTerrainLarge : public MockTerrain
+{
+public:
+	virtual u16 GetTilesPerSide() { return 256; }
+	virtual u16 GetVerticesPerSide() { return 257; }
+};
+
+class NullSceneCollector : public SceneCollector
+{
+public:
+	virtual void Submit(CPatch* UNUSED(patch)) { }
+	virtual void Submit(SOverlayLine* UNUSED(overlay)) { }
+	virtual void Submit(SOverlayTexturedLine* UNUSED(overlay)) { }
+	virtual void Submit(SOverlaySprite* UNUSED(overlay)) { }
+	virtual void Submit(CModelDecal* UNUSED(decal)) { }
+	virtual void Submit(CParticleEmitter* UNUSED(emitter)) { }
+	virtual void SubmitNonRecursive(CModel* UNUSED(model)) { }
+};
+
+class TestCmpUnitRenderer : public CxxTest::TestSuite
+{
+public:
+	void setUp()
+	{
+		CxxTest::setAbortTestOnFail(true);
+	}
+
+	void tearDown()
+	{
+	}
+
+	// Frustum containing the vertical box above [x0, x1] x [z0, z1]
+	static CFrustum BoxFrustum(float x0, float z0, float x1, float z1)
+	{
+		CFrustum frustum;
+		CPlane plane;
+		plane.Set(CVector3D(1, 0, 0), CVector3D(x0, 0, 0));
+		frustum.AddPlane(plane);
+		plane.Set(CVector3D(-1, 0, 0), CVector3D(x1, 0, 0));
+		frustum.AddPlane(plane);
+		plane.Set(CVector3D(0, 0, 1), CVector3D(0, 0, z0));
+		frustum.AddPlane(plane);
+		plane.Set(CVector3D(0, 0, -1), CVector3D(0, 0, z1));
+		frustum.AddPlane(plane);
+		return frustum;
+	}
+
+	void frame(ICmpUnitRenderer* cmp, SceneCollector& collector, const CFrustum& frustum, bool culling = true)
+	{
+		{ CMessageInterpolate msg(0.1f, 0.5f); cmp->HandleMessage(msg, false); }
+		{ CMessageRenderSubmit msg(collector, frustum, culling); cmp->HandleMessage(msg, false); }
+	}
+
+	void test_basic()
+	{
+		ComponentTestHelper test;
+
+		MockTerrain terrain;
+		test.AddMock(SYSTEM_ENTITY, IID_Terrain, terrain);
+
+		MockVisualCounter visuals[3];
+
+		ICmpUnitRenderer* cmp = test.Add<ICmpUnitRenderer>(CID_UnitRenderer, "", SYSTEM_ENTITY);
+
+		ICmpUnitRenderer::tag_t tags[3];
+		for (size_t i = 0; i < 3; ++i)
+			tags[i] = cmp->AddUnit(100 + i, &visuals[i], 1.f);
+		TS_ASSERT(tags[0] != 0 && tags[1] != 0 && tags[2] != 0);
+
+		cmp->UpdateUnitPos(tags[0], true, CVector3D(10, 50, 10));
+		cmp->UpdateUnitPos(tags[1], true, CVector3D(50, 50, 50));
+		cmp->UpdateUnitPos(tags[2], true, CVector3D(10, 50, 50));
+
+		NullSceneCollector collector;
+		CFrustum frustum = BoxFrustum(0, 0, 20, 20);
+
+		// Only the unit inside the frustum is interpolated and submitted
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(cmp->GetFrameNumber(), (u32)1);
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)1);
+		TS_ASSERT_EQUALS(visuals[0].m_Interpolated, 1);
+		TS_ASSERT_EQUALS(visuals[0].m_Submitted, 1);
+		TS_ASSERT_DELTA(visuals[0].m_LastFrameTime, 0.1f, 0.0001f); // the time since it was added
+		TS_ASSERT_EQUALS(visuals[1].m_Interpolated + visuals[1].m_Submitted, 0);
+		TS_ASSERT_EQUALS(visuals[2].m_Interpolated + visuals[2].m_Submitted, 0);
+
+		// and the others' animations aren't updated at all
+		TS_ASSERT_EQUALS(visuals[1].m_Animated + visuals[2].m_Animated, 0);
+
+		// Once it's been visible, it's interpolated normally (and only once per frame),
+		// and off-screen units with sounds are kept in time
+		cmp->UpdateUnitSounds(tags[2], true);
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(visuals[0].m_Interpolated, 2);
+		TS_ASSERT_EQUALS(visuals[0].m_Animated, 0);
+		TS_ASSERT_EQUALS(visuals[0].m_Submitted, 2);
+		TS_ASSERT_DELTA(visuals[0].m_LastFrameTime, 0.1f, 0.0001f);
+		TS_ASSERT_EQUALS(cmp->GetFrameOffset(), 0.5f);
+		TS_ASSERT_EQUALS(visuals[1].m_Animated, 0);
+		TS_ASSERT_EQUALS(visuals[2].m_Animated, 1);
+		cmp->UpdateUnitSounds(tags[2], false);
+
+		// A unit moving through the frustum during the turn must be rendered,
+		// even though it starts and ends outside. It catches up with all the
+		// frames it missed at once
+		cmp->UpdateUnitPos(tags[1], true, CVector3D(-30, 50, 10));
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)2);
+		TS_ASSERT_EQUALS(visuals[1].m_Submitted, 1);
+		TS_ASSERT_EQUALS(visuals[1].m_Interpolated, 1);
+		TS_ASSERT_DELTA(visuals[1].m_LastFrameTime, 0.3f, 0.0001f);
+		TS_ASSERT_EQUALS(visuals[2].m_Animated, 1);
+
+		// At the start of the next turn, it's no longer moving
+		{ CMessageTurnStart msg; cmp->HandleMessage(msg, false); }
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)1);
+		TS_ASSERT_EQUALS(visuals[1].m_Submitted, 1);
+
+		// Without culling, every unit in the world is rendered
+		cmp->UpdateUnitPos(tags[2], false, CVector3D());
+		frame(cmp, collector, frustum, false);
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)2);
+		TS_ASSERT_EQUALS(visuals[1].m_Submitted, 2);
+		TS_ASSERT_EQUALS(visuals[2].m_Submitted, 0);
+
+		// Units that appear aren't swept from where they used to be
+		cmp->UpdateUnitPos(tags[2], true, CVector3D(40, 50, 40));
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)1);
+		TS_ASSERT_EQUALS(visuals[2].m_Submitted, 0);
+
+		// Removed units are never rendered or animated again, and their tags can be reused
+		cmp->UpdateUnitSounds(tags[0], true);
+		cmp->RemoveUnit(tags[0]);
+		visuals[0].Reset();
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)0);
+		TS_ASSERT_EQUALS(visuals[0].m_Interpolated + visuals[0].m_Animated + visuals[0].m_Submitted, 0);
+
+		ICmpUnitRenderer::tag_t tag = cmp->AddUnit(100, &visuals[0], 1.f);
+		TS_ASSERT_EQUALS(tag, tags[0]);
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(visuals[0].m_Submitted, 0); // not in the world yet
+		cmp->UpdateUnitPos(tag, true, CVector3D(15, 50, 15));
+		frame(cmp, collector, frustum);
+		TS_ASSERT_EQUALS(visuals[0].m_Submitted, 1);
+
+		// Units outside the map are clamped into the grid, not lost
+		cmp->UpdateUnitRadius(tags[2], 10.f);
+		cmp->UpdateUnitPos(tags[2], true, CVector3D(-5, 50, 500));
+		{ CMessageTurnStart msg; cmp->HandleMessage(msg, false); }
+		frame(cmp, collector, BoxFrustum(-10, 490, 0, 510));
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), (size_t)1);
+		TS_ASSERT_EQUALS(visuals[2].m_Submitted, 1);
+	}
+
+	// disabled by default; run tests with the "-test TestCmpUnitRenderer" flag to enable
+	void test_performance_DISABLED()
+	{
+		// The per-frame cost should depend on the number of visible units,
+		// not on how many more there are off screen
+		performance(500, 0);
+		performance(500, 10000);
+		performance(500, 100000);
+	}
+
+	void performance(size_t numVisible, size_t numOffScreen)
+	{
+		ComponentTestHelper test;
+
+		MockTerrainLarge terrain;
+		test.AddMock(SYSTEM_ENTITY, IID_Terrain, terrain);
+
+		ICmpUnitRenderer* cmp = test.Add<ICmpUnitRenderer>(CID_UnitRenderer, "", SYSTEM_ENTITY);
+
+		// A typical view covers a small fraction of the map
+		CFrustum frustum = BoxFrustum(400, 400, 560, 520);
+
+		// The visible units move around inside the view, the others in the
+		// far corner of the map
+		const size_t numUnits = numVisible + numOffScreen;
+		std::vector<MockVisualCounter> visuals(numUnits);
+		std::vector<ICmpUnitRenderer::tag_t> tags(numUnits);
+		std::vector<CBoundingBoxAligned> areas(numUnits);
+		std::vector<CVector3D> positions(numUnits);
+
+		WELL512 rng;
+		for (size_t i = 0; i < numUnits; ++i)
+		{
+			if (i < numVisible)
+				areas[i] = CBoundingBoxAligned(CVector3D(420, 50, 420), CVector3D(540, 50, 500));
+			else
+				areas[i] = CBoundingBoxAligned(CVector3D(0, 50, 0), CVector3D(300, 50, 1024));
+
+			tags[i] = cmp->AddUnit(100 + i, &visuals[i], 4.f);
+			positions[i] = CVector3D(
+				boost::uniform_real<float>(areas[i][0].X, areas[i][1].X)(rng), 50,
+				boost::uniform_real<float>(areas[i][0].Z, areas[i][1].Z)(rng));
+			cmp->UpdateUnitPos(tags[i], true, positions[i]);
+		}
+
+		NullSceneCollector collector;
+
+		const size_t numTurns = 50;
+		const size_t framesPerTurn = 10;
+		double tMove = 0, tInterpolate = 0, tRenderSubmit = 0;
+		for (size_t turn = 0; turn < numTurns; ++turn)
+		{
+			double t = timer_Time();
+			{ CMessageTurnStart msg; cmp->HandleMessage(msg, false); }
+			// A quarter of the units move each turn
+			for (size_t i = turn % 4; i < numUnits; i += 4)
+			{
+				positions[i].X = Clamp(positions[i].X + boost::uniform_real<float>(-2, 2)(rng), areas[i][0].X, areas[i][1].X);
+				positions[i].Z = Clamp(positions[i].Z + boost::uniform_real<float>(-2, 2)(rng), areas[i][0].Z, areas[i][1].Z);
+				cmp->UpdateUnitPos(tags[i], true, positions[i]);
+			}
+			tMove += timer_Time() - t;
+
+			for (size_t f = 0; f < framesPerTurn; ++f)
+			{
+				t = timer_Time();
+				{ CMessageInterpolate msg(0.02f, f / (float)framesPerTurn); cmp->HandleMessage(msg, false); }
+				tInterpolate += timer_Time() - t;
+
+				t = timer_Time();
+				{ CMessageRenderSubmit msg(collector, frustum, true); cmp->HandleMessage(msg, false); }
+				tRenderSubmit += timer_Time() - t;
+			}
+		}
+
+		TS_ASSERT_EQUALS(cmp->GetNumVisibleUnits(), numVisible);
+		for (size_t i = numVisible; i < numUnits; ++i)
+			TS_ASSERT_EQUALS(visuals[i].m_Interpolated + visuals[i].m_Animated, 0);
+
+		size_t numFrames = numTurns * framesPerTurn;
+		printf("\n[%d units, %d visible: %f usec per turn update, %f usec per Interpolate, %f usec per RenderSubmit]",
+			(int)numUnits, (int)cmp->GetNumVisibleUnits(),
+			tMove * 1e6 / numTurns, tInterpolate * 1e6 / numFrames, tRenderSubmit * 1e6 / numFrames);
+	}
+};
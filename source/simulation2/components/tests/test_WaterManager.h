@@ -0,0 +1,71 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simulation2/system/ComponentTest.h"
+
+#include "simulation2/Simulation2.h"
+#include "simulation2/components/ICmpWaterManager.h"
+
+#include "graphics/Terrain.h"
+
+class TestCmpWaterManager : public CxxTest::TestSuite
+{
+public:
+	void setUp()
+	{
+		CXeromyces::Startup();
+	}
+
+	void tearDown()
+	{
+		CXeromyces::Terminate();
+	}
+
+	void test_SetWaterLevel()
+	{
+		CTerrain terrain;
+		CSimulation2 sim(NULL, &terrain);
+		CComponentManager& componentManager = sim.GetSimContext().GetComponentManager();
+		ScriptInterface& scriptInterface = sim.GetScriptInterface();
+
+		// A script component that counts the messages that floating units and
+		// the pathfinder etc care about
+		TS_ASSERT(scriptInterface.LoadScript(L"test-water.js",
+			L"function TestWater() {}"
+			L"TestWater.prototype.Init = function() { this.water = 0; this.terrain = 0; };"
+			L"TestWater.prototype.OnWaterChanged = function(msg) { this.water++; };"
+			L"TestWater.prototype.OnTerrainChanged = function(msg) { this.terrain++; };"
+			L"Engine.RegisterComponentType(IID_UnknownScript, 'TestWater', TestWater);"));
+
+		CParamNode noParam;
+		TS_ASSERT(componentManager.AddComponent(SYSTEM_ENTITY, CID_WaterManager, noParam));
+		TS_ASSERT(componentManager.AddComponent(100, componentManager.LookupCID("TestWater"), noParam));
+
+		CmpPtr<ICmpWaterManager> cmpWaterManager(sim, SYSTEM_ENTITY);
+		cmpWaterManager->SetWaterLevel(entity_pos_t::FromInt(10));
+		TS_ASSERT_EQUALS(cmpWaterManager->GetWaterLevel(entity_pos_t::Zero(), entity_pos_t::Zero()), entity_pos_t::FromInt(10));
+
+		// Only WaterChanged is sent, since nothing that depends on just the terrain
+		// needs updating
+		jsval instance = componentManager.QueryInterface(100, IID_UnknownScript)->GetJSInstance();
+		int water = -1, terrainChanges = -1;
+		TS_ASSERT(scriptInterface.GetProperty(instance, "water", water));
+		TS_ASSERT(scriptInterface.GetProperty(instance, "terrain", terrainChanges));
+		TS_ASSERT_EQUALS(water, 1);
+		TS_ASSERT_EQUALS(terrainChanges, 0);
+	}
+};
@@ -0,0 +1,210 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_ENTITYMAP
+#define INCLUDED_ENTITYMAP
+
+#include "simulation2/system/Entity.h"
+#include "simulation2/serialization/ISerializer.h"
+#include "simulation2/serialization/IDeserializer.h"
+
+/**
+ * A fast replacement for std::map<entity_id_t, T>, for small T that is looked up
+ * very frequently (e.g. per-entity data in system components).
+ *
+ * Items are stored in a contiguous array indexed directly by entity ID, so lookups
+ * are a single array access and iteration is a linear scan in increasing ID order
+ * (i.e. the same order as std::map, so serialization is deterministic and unchanged).
+ *
+ * This relies on non-local entity IDs being allocated sequentially and never reused,
+ * so the array is never much larger than the number of entities that have existed.
+ * Local entities must not be used as keys (their IDs are huge).
+ *
+ * Empty slots are marked with an INVALID_ENTITY key, and are skipped by iterators.
+ * Inserting or erasing invalidates all iterators and references.
+ */
+template<typename T>
+class EntityMap
+{
+public:
+	typedef entity_id_t key_type;
+	typedef T mapped_type;
+	typedef std::pair<entity_id_t, T> value_type;
+
+private:
+	template<typename V>
+	class Iterator
+	{
+	public:
+		Iterator() : m_Ptr(NULL), m_End(NULL) { }
+		Iterator(V* ptr, V* end) : m_Ptr(ptr), m_End(end) { SkipEmpty(); }
+
+		// Allow conversion from iterator to const_iterator
+		template<typename V2>
+		Iterator(const Iterator<V2>& other) : m_Ptr(other.m_Ptr), m_End(other.m_End) { }
+
+		V& operator*() const { return *m_Ptr; }
+		V* operator->() const { return m_Ptr; }
+
+		Iterator& operator++()
+		{
+			++m_Ptr;
+			SkipEmpty();
+			return *this;
+		}
+
+		bool operator==(const Iterator& rhs) const { return m_Ptr == rhs.m_Ptr; }
+		bool operator!=(const Iterator& rhs) const { return m_Ptr != rhs.m_Ptr; }
+
+	private:
+		void SkipEmpty()
+		{
+			while (m_Ptr != m_End && m_Ptr->first == INVALID_ENTITY)
+				++m_Ptr;
+		}
+
+		V* m_Ptr;
+		V* m_End;
+
+		template<typename V2> friend class Iterator;
+		friend class EntityMap;
+	};
+
+public:
+	typedef Iterator<value_type> iterator;
+	typedef Iterator<const value_type> const_iterator;
+
+	EntityMap() : m_Count(0)
+	{
+	}
+
+	iterator begin() { return iterator(Data(), Data() + m_Data.size()); }
+	iterator end() { return iterator(Data() + m_Data.size(), Data() + m_Data.size()); }
+	const_iterator begin() const { return const_iterator(Data(), Data() + m_Data.size()); }
+	const_iterator end() const { return const_iterator(Data() + m_Data.size(), Data() + m_Data.size()); }
+
+	size_t size() const { return m_Count; }
+	bool empty() const { return m_Count == 0; }
+
+	void clear()
+	{
+		m_Data.clear();
+		m_Count = 0;
+	}
+
+	iterator find(entity_id_t id)
+	{
+		if (id >= m_Data.size() || m_Data[id].first == INVALID_ENTITY)
+			return end();
+		return iterator(Data() + id, Data() + m_Data.size());
+	}
+
+	const_iterator find(entity_id_t id) const
+	{
+		if (id >= m_Data.size() || m_Data[id].first == INVALID_ENTITY)
+			return end();
+		return const_iterator(Data() + id, Data() + m_Data.size());
+	}
+
+	/**
+	 * Inserts the item if its key is not already present.
+	 * Returns an iterator to the item with that key, and whether it was inserted
+	 * (matching std::map::insert).
+	 */
+	std::pair<iterator, bool> insert(const value_type& item)
+	{
+		entity_id_t id = item.first;
+		ENSURE(id != INVALID_ENTITY && !ENTITY_IS_LOCAL(id));
+
+		if (id >= m_Data.size())
+			m_Data.resize(id + 1, value_type(INVALID_ENTITY, T()));
+
+		if (m_Data[id].first != INVALID_ENTITY)
+			return std::make_pair(iterator(Data() + id, Data() + m_Data.size()), false);
+
+		m_Data[id] = item;
+		++m_Count;
+		return std::make_pair(iterator(Data() + id, Data() + m_Data.size()), true);
+	}
+
+	T& operator[](entity_id_t id)
+	{
+		return insert(value_type(id, T())).first->second;
+	}
+
+	void erase(iterator it)
+	{
+		ENSURE(it.m_Ptr->first != INVALID_ENTITY);
+		*it.m_Ptr = value_type(INVALID_ENTITY, T());
+		--m_Count;
+	}
+
+	size_t erase(entity_id_t id)
+	{
+		iterator it = find(id);
+		if (it == end())
+			return 0;
+		erase(it);
+		return 1;
+	}
+
+private:
+	value_type* Data() { return m_Data.empty() ? NULL : &m_Data[0]; }
+	const value_type* Data() const { return m_Data.empty() ? NULL : &m_Data[0]; }
+
+	std::vector<value_type> m_Data;
+	size_t m_Count;
+};
+
+/**
+ * Serialization helper template for EntityMap.
+ * Uses the same format as SerializeMap, so it can replace std::map without changing
+ * the serialized state.
+ */
+template<typename VS>
+struct SerializeEntityMap
+{
+	template<typename V>
+	void operator()(ISerializer& serialize, const char* UNUSED(name), EntityMap<V>& value)
+	{
+		size_t len = value.size();
+		serialize.NumberU32_Unbounded("length", (u32)len);
+		for (typename EntityMap<V>::iterator it = value.begin(); it != value.end(); ++it)
+		{
+			serialize.NumberU32_Unbounded("key", it->first);
+			VS()(serialize, "value", it->second);
+		}
+	}
+
+	template<typename V>
+	void operator()(IDeserializer& deserialize, const char* UNUSED(name), EntityMap<V>& value)
+	{
+		value.clear();
+		u32 len;
+		deserialize.NumberU32_Unbounded("length", len);
+		for (size_t i = 0; i < len; ++i)
+		{
+			entity_id_t k;
+			V v;
+			deserialize.NumberU32_Unbounded("key", k);
+			VS()(deserialize, "value", v);
+			value.insert(std::make_pair(k, v));
+		}
+	}
+};
+
+#endif // INCLUDED_ENTITYMAP
@@ -18,6 +18,7 @@
 #ifndef INCLUDED_GRID
 #define INCLUDED_GRID
 
+#include <algorithm>
 #include <cstring>
 
 #ifdef NDEBUG
@@ -46,7 +47,7 @@ public:
 		reset();
 	}
 
-	Grid(const Grid& g)
+	Grid(const Grid& g) : m_Data(NULL)
 	{
 		*this = g;
 	}
@@ -58,6 +59,7 @@ public:
 			m_W = g.m_W;
 			m_H = g.m_H;
 			m_DirtyID = g.m_DirtyID;
+			delete[] m_Data;
 			if (g.m_Data)
 			{
 				m_Data = new T[m_W * m_H];
@@ -102,9 +104,77 @@ public:
 	size_t m_DirtyID; // if this is < the id maintained by ICmpObstructionManager then it needs to be updated
 };
 
+/**
+ * Rectangle of cells in a Grid (with inclusive bounds), used for tracking which
+ * part of a grid has changed so that data derived from it can be updated incrementally.
+ */
+struct GridRegion
+{
+	/// Constructs an empty region.
+	GridRegion() : i0(1), j0(1), i1(0), j1(0)
+	{
+	}
+
+	GridRegion(u16 i0, u16 j0, u16 i1, u16 j1) : i0(i0), j0(j0), i1(i1), j1(j1)
+	{
+	}
+
+	/// Returns the region covering every cell of a w*h grid.
+	static GridRegion All(u16 w, u16 h)
+	{
+		if (w == 0 || h == 0)
+			return GridRegion();
+		return GridRegion(0, 0, (u16)(w-1), (u16)(h-1));
+	}
+
+	bool IsEmpty() const
+	{
+		return i0 > i1 || j0 > j1;
+	}
+
+	/// Returns whether this region covers every cell of a w*h grid.
+	bool Covers(u16 w, u16 h) const
+	{
+		return !IsEmpty() && i0 == 0 && j0 == 0 && i1+1 >= w && j1+1 >= h;
+	}
+
+	/// Grows this region to the bounding box of itself and @p r.
+	void Add(const GridRegion& r)
+	{
+		if (r.IsEmpty())
+			return;
+
+		if (IsEmpty())
+		{
+			*this = r;
+			return;
+		}
+
+		i0 = std::min(i0, r.i0);
+		j0 = std::min(j0, r.j0);
+		i1 = std::max(i1, r.i1);
+		j1 = std::max(j1, r.j1);
+	}
+
+	/// Returns this region grown by @p n cells in every direction, clipped to a w*h grid.
+	GridRegion Expanded(int n, u16 w, u16 h) const
+	{
+		if (IsEmpty())
+			return *this;
+
+		return GridRegion(
+			(u16)std::max((int)i0 - n, 0), (u16)std::max((int)j0 - n, 0),
+			(u16)std::min((int)i1 + n, w-1), (u16)std::min((int)j1 + n, h-1));
+	}
+
+	u16 i0, j0, i1, j1;
+};
+
 /**
  * Similar to Grid, except optimised for sparse usage (the grid is subdivided into
  * buckets whose contents are only initialised on demand, to save on memset cost).
+ * Buckets released by reset() are kept for reuse, so a grid can be reset and
+ * filled repeatedly without reallocating.
  */
 template<typename T>
 class SparseGrid
@@ -118,7 +188,15 @@ class SparseGrid
 		size_t b = (j >> BucketBits) * m_BW + (i >> BucketBits);
 		if (!m_Data[b])
 		{
-			m_Data[b] = new T[BucketSize*BucketSize];
+			if (m_FreeBuckets.empty())
+			{
+				m_Data[b] = new T[BucketSize*BucketSize];
+			}
+			else
+			{
+				m_Data[b] = m_FreeBuckets.back();
+				m_FreeBuckets.pop_back();
+			}
 			memset(m_Data[b], 0, BucketSize*BucketSize*sizeof(T));
 		}
 		return m_Data[b];
@@ -139,13 +217,18 @@ public:
 	~SparseGrid()
 	{
 		reset();
+		for (size_t i = 0; i < m_FreeBuckets.size(); ++i)
+			delete[] m_FreeBuckets[i];
 		delete[] m_Data;
 	}
 
 	void reset()
 	{
 		for (size_t i = 0; i < (size_t)(m_BW*m_BH); ++i)
-			delete[] m_Data[i];
+		{
+			if (m_Data[i])
+				m_FreeBuckets.push_back(m_Data[i]);
+		}
 
 		memset(m_Data, 0, m_BW*m_BH*sizeof(T*));
 	}
@@ -169,8 +252,88 @@ public:
 	u16 m_W, m_H;
 	u16 m_BW, m_BH;
 	T** m_Data;
+	std::vector<T*> m_FreeBuckets; // allocated buckets that aren't currently in m_Data
 
 	size_t m_DirtyID; // if this is < the id maintained by ICmpObstructionManager then it needs to be updated
 };
 
+/**
+ * Similar to Grid, except it can be reset to all-zero items in constant time,
+ * for scratch data that is reset much more often than it is fully used.
+ * Each item is stored alongside the generation in which it was last written;
+ * reset() just starts a new generation, and items from older generations are
+ * zeroed when they're first accessed.
+ * @c T must be a POD type that can be initialised with 0s.
+ */
+template<typename T>
+class StampedGrid
+{
+	NONCOPYABLE(StampedGrid);
+
+	struct Cell
+	{
+		T value;
+		u16 generation;
+	};
+
+public:
+	StampedGrid(u16 w, u16 h) : m_W(w), m_H(h), m_DirtyID(0), m_Generation(1)
+	{
+		ENSURE(m_W && m_H);
+
+		m_Data = new Cell[m_W*m_H];
+		memset(m_Data, 0, m_W*m_H*sizeof(Cell));
+	}
+
+	~StampedGrid()
+	{
+		delete[] m_Data;
+	}
+
+	void reset()
+	{
+		++m_Generation;
+
+		// If the generation counter wrapped around, old stamps might look current,
+		// so do a real reset
+		if (m_Generation == 0)
+		{
+			memset(m_Data, 0, m_W*m_H*sizeof(Cell));
+			m_Generation = 1;
+		}
+	}
+
+	void set(int i, int j, const T& value)
+	{
+#if GRID_BOUNDS_DEBUG
+		ENSURE(0 <= i && i < m_W && 0 <= j && j < m_H);
+#endif
+		Cell& cell = m_Data[j*m_W + i];
+		cell.value = value;
+		cell.generation = m_Generation;
+	}
+
+	T& get(int i, int j)
+	{
+#if GRID_BOUNDS_DEBUG
+		ENSURE(0 <= i && i < m_W && 0 <= j && j < m_H);
+#endif
+		Cell& cell = m_Data[j*m_W + i];
+		if (cell.generation != m_Generation)
+		{
+			memset(&cell.value, 0, sizeof(T));
+			cell.generation = m_Generation;
+		}
+		return cell.value;
+	}
+
+	u16 m_W, m_H;
+
+	size_t m_DirtyID; // if this is < the id maintained by ICmpObstructionManager then it needs to be updated
+
+private:
+	Cell* m_Data;
+	u16 m_Generation;
+};
+
 #endif // INCLUDED_GRID
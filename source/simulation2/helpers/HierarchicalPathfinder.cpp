@@ -0,0 +1,481 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "HierarchicalPathfinder.h"
+
+#include "ps/Profile.h"
+#include "simulation2/components/CCmpPathfinder_Common.h"
+#include "simulation2/helpers/PriorityQueue.h"
+
+void HierarchicalPathfinder::Chunk::InitRegions(u8 ci, u8 cj, const Grid<u16>& grid, pass_class_t passClass)
+{
+	m_ChunkI = ci;
+	m_ChunkJ = cj;
+	m_NumRegions = 0;
+	memset(m_Regions, 0, sizeof(m_Regions));
+
+	int i0 = ci * CHUNK_SIZE;
+	int j0 = cj * CHUNK_SIZE;
+	int w = std::min((int)CHUNK_SIZE, grid.m_W - i0);
+	int h = std::min((int)CHUNK_SIZE, grid.m_H - j0);
+
+	m_GlobalRegions.assign(1, 0);
+	m_RegionCenters.assign(1, std::make_pair((u16)0, (u16)0));
+
+	// Flood-fill each group of connected passable tiles that hasn't been
+	// assigned to a region yet
+
+	std::vector<std::pair<int, int> > stack;
+
+	for (int j = 0; j < h; ++j)
+	{
+		for (int i = 0; i < w; ++i)
+		{
+			if (m_Regions[j][i] || !IS_PASSABLE(grid.get(i0 + i, j0 + j), passClass))
+				continue;
+
+			u16 r = ++m_NumRegions;
+			int sumI = 0, sumJ = 0, count = 0;
+
+			m_Regions[j][i] = r;
+			stack.push_back(std::make_pair(i, j));
+			while (!stack.empty())
+			{
+				int a = stack.back().first;
+				int b = stack.back().second;
+				stack.pop_back();
+
+				sumI += a;
+				sumJ += b;
+				++count;
+
+#define EXPAND(a_, b_) \
+				if (!m_Regions[b_][a_] && IS_PASSABLE(grid.get(i0 + a_, j0 + b_), passClass)) \
+				{ \
+					m_Regions[b_][a_] = r; \
+					stack.push_back(std::make_pair(a_, b_)); \
+				}
+
+				if (a > 0)
+					EXPAND(a-1, b);
+				if (a < w-1)
+					EXPAND(a+1, b);
+				if (b > 0)
+					EXPAND(a, b-1);
+				if (b < h-1)
+					EXPAND(a, b+1);
+
+#undef EXPAND
+			}
+
+			m_GlobalRegions.push_back(0);
+			m_RegionCenters.push_back(std::make_pair((u16)(i0 + sumI / count), (u16)(j0 + sumJ / count)));
+		}
+	}
+}
+
+HierarchicalPathfinder::HierarchicalPathfinder() :
+	m_W(0), m_H(0), m_ChunksW(0), m_ChunksH(0)
+{
+}
+
+void HierarchicalPathfinder::Recompute(const Grid<u16>& grid, const std::vector<pass_class_t>& passClasses)
+{
+	PROFILE3("hierarchical pathfinder recompute");
+
+	m_W = grid.m_W;
+	m_H = grid.m_H;
+	m_ChunksW = (u16)((m_W + CHUNK_SIZE-1) / CHUNK_SIZE);
+	m_ChunksH = (u16)((m_H + CHUNK_SIZE-1) / CHUNK_SIZE);
+
+	// Chunk coordinates are stored in u8s
+	ENSURE(m_ChunksW <= 256 && m_ChunksH <= 256);
+
+	m_Data.clear();
+
+	for (size_t n = 0; n < passClasses.size(); ++n)
+	{
+		pass_class_t passClass = passClasses[n];
+		PassClassData& data = m_Data[passClass];
+
+		data.chunks.resize(m_ChunksW * m_ChunksH);
+		for (u16 cj = 0; cj < m_ChunksH; ++cj)
+			for (u16 ci = 0; ci < m_ChunksW; ++ci)
+				data.chunks[ci + cj*m_ChunksW].InitRegions((u8)ci, (u8)cj, grid, passClass);
+
+		for (u16 cj = 0; cj < m_ChunksH; ++cj)
+			for (u16 ci = 0; ci < m_ChunksW; ++ci)
+				FindEdges(data, (u8)ci, (u8)cj);
+
+		FindGlobalRegions(data);
+	}
+}
+
+void HierarchicalPathfinder::Update(const Grid<u16>& grid, const Grid<u8>& dirtyChunks)
+{
+	PROFILE3("hierarchical pathfinder update");
+
+	ENSURE(grid.m_W == m_W && grid.m_H == m_H);
+	ENSURE(dirtyChunks.m_W == m_ChunksW && dirtyChunks.m_H == m_ChunksH);
+
+	for (std::map<pass_class_t, PassClassData>::iterator it = m_Data.begin(); it != m_Data.end(); ++it)
+	{
+		PassClassData& data = it->second;
+
+		bool changed = false;
+		for (u16 cj = 0; cj < m_ChunksH; ++cj)
+		{
+			for (u16 ci = 0; ci < m_ChunksW; ++ci)
+			{
+				if (!dirtyChunks.get(ci, cj))
+					continue;
+
+				RemoveEdges(data, (u8)ci, (u8)cj);
+				data.chunks[ci + cj*m_ChunksW].InitRegions((u8)ci, (u8)cj, grid, it->first);
+				changed = true;
+			}
+		}
+
+		if (!changed)
+			continue;
+
+		// (This has to be done after all the chunks have been recomputed, since
+		// dirty chunks may be adjacent to each other)
+		for (u16 cj = 0; cj < m_ChunksH; ++cj)
+			for (u16 ci = 0; ci < m_ChunksW; ++ci)
+				if (dirtyChunks.get(ci, cj))
+					FindEdges(data, (u8)ci, (u8)cj);
+
+		FindGlobalRegions(data);
+	}
+}
+
+void HierarchicalPathfinder::RemoveEdges(PassClassData& data, u8 ci, u8 cj)
+{
+	const Chunk& chunk = GetChunk(data, ci, cj);
+	for (u16 r = 1; r <= chunk.m_NumRegions; ++r)
+	{
+		RegionID region(ci, cj, r);
+		EdgesMap::iterator it = data.edges.find(region);
+		if (it == data.edges.end())
+			continue;
+
+		for (std::set<RegionID>::iterator nit = it->second.begin(); nit != it->second.end(); ++nit)
+		{
+			EdgesMap::iterator neighbour = data.edges.find(*nit);
+			if (neighbour != data.edges.end())
+				neighbour->second.erase(region);
+		}
+
+		data.edges.erase(it);
+	}
+}
+
+void HierarchicalPathfinder::FindEdges(PassClassData& data, u8 ci, u8 cj)
+{
+	const Chunk& chunk = GetChunk(data, ci, cj);
+	int w = std::min((int)CHUNK_SIZE, m_W - ci*CHUNK_SIZE);
+	int h = std::min((int)CHUNK_SIZE, m_H - cj*CHUNK_SIZE);
+
+	// Connect regions containing adjacent passable tiles on either side of
+	// each edge of the chunk
+
+	if (ci > 0)
+	{
+		const Chunk& left = GetChunk(data, (u8)(ci-1), cj);
+		for (int j = 0; j < h; ++j)
+		{
+			u16 r0 = left.m_Regions[j][CHUNK_SIZE-1];
+			u16 r1 = chunk.m_Regions[j][0];
+			if (r0 && r1)
+			{
+				data.edges[RegionID((u8)(ci-1), cj, r0)].insert(RegionID(ci, cj, r1));
+				data.edges[RegionID(ci, cj, r1)].insert(RegionID((u8)(ci-1), cj, r0));
+			}
+		}
+	}
+
+	if (ci < m_ChunksW-1)
+	{
+		const Chunk& right = GetChunk(data, (u8)(ci+1), cj);
+		for (int j = 0; j < h; ++j)
+		{
+			u16 r0 = chunk.m_Regions[j][CHUNK_SIZE-1];
+			u16 r1 = right.m_Regions[j][0];
+			if (r0 && r1)
+			{
+				data.edges[RegionID(ci, cj, r0)].insert(RegionID((u8)(ci+1), cj, r1));
+				data.edges[RegionID((u8)(ci+1), cj, r1)].insert(RegionID(ci, cj, r0));
+			}
+		}
+	}
+
+	if (cj > 0)
+	{
+		const Chunk& bottom = GetChunk(data, ci, (u8)(cj-1));
+		for (int i = 0; i < w; ++i)
+		{
+			u16 r0 = bottom.m_Regions[CHUNK_SIZE-1][i];
+			u16 r1 = chunk.m_Regions[0][i];
+			if (r0 && r1)
+			{
+				data.edges[RegionID(ci, (u8)(cj-1), r0)].insert(RegionID(ci, cj, r1));
+				data.edges[RegionID(ci, cj, r1)].insert(RegionID(ci, (u8)(cj-1), r0));
+			}
+		}
+	}
+
+	if (cj < m_ChunksH-1)
+	{
+		const Chunk& top = GetChunk(data, ci, (u8)(cj+1));
+		for (int i = 0; i < w; ++i)
+		{
+			u16 r0 = chunk.m_Regions[CHUNK_SIZE-1][i];
+			u16 r1 = top.m_Regions[0][i];
+			if (r0 && r1)
+			{
+				data.edges[RegionID(ci, cj, r0)].insert(RegionID(ci, (u8)(cj+1), r1));
+				data.edges[RegionID(ci, (u8)(cj+1), r1)].insert(RegionID(ci, cj, r0));
+			}
+		}
+	}
+}
+
+void HierarchicalPathfinder::FindGlobalRegions(PassClassData& data)
+{
+	// Number the connected components of the region graph, in a fixed order
+	// so the numbering only depends on the current grid
+
+	for (size_t n = 0; n < data.chunks.size(); ++n)
+		std::fill(data.chunks[n].m_GlobalRegions.begin(), data.chunks[n].m_GlobalRegions.end(), 0);
+
+	u32 nextGlobal = 1;
+	std::vector<RegionID> stack;
+
+	for (size_t n = 0; n < data.chunks.size(); ++n)
+	{
+		Chunk& chunk = data.chunks[n];
+		for (u16 r = 1; r <= chunk.m_NumRegions; ++r)
+		{
+			if (chunk.m_GlobalRegions[r])
+				continue;
+
+			u32 global = nextGlobal++;
+			chunk.m_GlobalRegions[r] = global;
+			stack.push_back(RegionID(chunk.m_ChunkI, chunk.m_ChunkJ, r));
+			while (!stack.empty())
+			{
+				RegionID region = stack.back();
+				stack.pop_back();
+
+				EdgesMap::const_iterator it = data.edges.find(region);
+				if (it == data.edges.end())
+					continue;
+
+				for (std::set<RegionID>::const_iterator nit = it->second.begin(); nit != it->second.end(); ++nit)
+				{
+					u32& neighbourGlobal = data.chunks[nit->ci + nit->cj*m_ChunksW].m_GlobalRegions[nit->r];
+					if (!neighbourGlobal)
+					{
+						neighbourGlobal = global;
+						stack.push_back(*nit);
+					}
+				}
+			}
+		}
+	}
+}
+
+HierarchicalPathfinder::RegionID HierarchicalPathfinder::GetRegion(u16 i, u16 j, pass_class_t passClass) const
+{
+	std::map<pass_class_t, PassClassData>::const_iterator it = m_Data.find(passClass);
+	ENSURE(it != m_Data.end());
+
+	u8 ci = (u8)(i / CHUNK_SIZE);
+	u8 cj = (u8)(j / CHUNK_SIZE);
+	const Chunk& chunk = GetChunk(it->second, ci, cj);
+	return RegionID(ci, cj, chunk.m_Regions[j % CHUNK_SIZE][i % CHUNK_SIZE]);
+}
+
+u32 HierarchicalPathfinder::GetGlobalRegion(RegionID region, pass_class_t passClass) const
+{
+	std::map<pass_class_t, PassClassData>::const_iterator it = m_Data.find(passClass);
+	ENSURE(it != m_Data.end());
+
+	return GetChunk(it->second, region.ci, region.cj).m_GlobalRegions[region.r];
+}
+
+bool HierarchicalPathfinder::FindNearestTileInGlobalRegion(u16 i, u16 j, u32 globalRegion, pass_class_t passClass, u16& iOut, u16& jOut) const
+{
+	std::map<pass_class_t, PassClassData>::const_iterator it = m_Data.find(passClass);
+	ENSURE(it != m_Data.end());
+	const PassClassData& data = it->second;
+
+	// Find the chunks containing part of the global region, sorted by
+	// their (squared) distance from i,j
+	std::vector<std::pair<u32, size_t> > chunks;
+	for (size_t n = 0; n < data.chunks.size(); ++n)
+	{
+		const Chunk& chunk = data.chunks[n];
+		if (std::find(chunk.m_GlobalRegions.begin()+1, chunk.m_GlobalRegions.end(), globalRegion) == chunk.m_GlobalRegions.end())
+			continue;
+
+		int i0 = chunk.m_ChunkI * CHUNK_SIZE;
+		int j0 = chunk.m_ChunkJ * CHUNK_SIZE;
+		int di = std::max(0, std::max(i0 - (int)i, (int)i - (i0 + CHUNK_SIZE-1)));
+		int dj = std::max(0, std::max(j0 - (int)j, (int)j - (j0 + CHUNK_SIZE-1)));
+		chunks.push_back(std::make_pair((u32)(di*di + dj*dj), n));
+	}
+	std::sort(chunks.begin(), chunks.end());
+
+	// Search the tiles of the nearest chunks, until the remaining chunks
+	// are all further away than the best tile so far
+	bool found = false;
+	u32 bestDist = std::numeric_limits<u32>::max();
+	for (size_t n = 0; n < chunks.size() && chunks[n].first < bestDist; ++n)
+	{
+		const Chunk& chunk = data.chunks[chunks[n].second];
+		int i0 = chunk.m_ChunkI * CHUNK_SIZE;
+		int j0 = chunk.m_ChunkJ * CHUNK_SIZE;
+		for (int b = 0; b < CHUNK_SIZE; ++b)
+		{
+			for (int a = 0; a < CHUNK_SIZE; ++a)
+			{
+				u16 r = chunk.m_Regions[b][a];
+				if (!r || chunk.m_GlobalRegions[r] != globalRegion)
+					continue;
+
+				int di = i0 + a - (int)i;
+				int dj = j0 + b - (int)j;
+				u32 dist = (u32)(di*di + dj*dj);
+				if (dist < bestDist)
+				{
+					bestDist = dist;
+					iOut = (u16)(i0 + a);
+					jOut = (u16)(j0 + b);
+					found = true;
+				}
+			}
+		}
+	}
+
+	return found;
+}
+
+// Approximate cost of moving between two tiles in a straight line
+// (in the same units as the tile-based pathfinder's costs)
+static u32 RegionDistance(std::pair<u16, u16> a, std::pair<u16, u16> b)
+{
+	CFixedVector2D delta(fixed::FromInt(a.first - b.first), fixed::FromInt(a.second - b.second));
+	// (Avoid overflowing the fixed-point type on large maps)
+	return (u32)(delta.Length() * 16).ToInt_RoundToZero() * 16;
+}
+
+bool HierarchicalPathfinder::FindCorridor(RegionID start, const std::set<RegionID>& goals, u16 iGoal, u16 jGoal, std::vector<u8>& corridor, pass_class_t passClass) const
+{
+	PROFILE2("hierarchical pathfinder corridor");
+
+	std::map<pass_class_t, PassClassData>::const_iterator it = m_Data.find(passClass);
+	ENSURE(it != m_Data.end());
+	const PassClassData& data = it->second;
+
+	std::pair<u16, u16> goalPos(iGoal, jGoal);
+
+	// Standard A* over the graph of regions, moving between the centers of regions
+
+	typedef PriorityQueueHeap<RegionID, u32> RegionQueue;
+	RegionQueue open;
+	std::map<RegionID, u32> costs;
+	std::map<RegionID, RegionID> preds;
+	std::set<RegionID> closed;
+
+	costs[start] = 0;
+	preds[start] = start;
+	RegionQueue::Item startItem = { start, RegionDistance(GetChunk(data, start.ci, start.cj).m_RegionCenters[start.r], goalPos) };
+	open.push(startItem);
+
+	bool found = false;
+	RegionID curr;
+	while (!open.empty())
+	{
+		curr = open.pop().id;
+		if (goals.count(curr))
+		{
+			found = true;
+			break;
+		}
+
+		closed.insert(curr);
+
+		EdgesMap::const_iterator eit = data.edges.find(curr);
+		if (eit == data.edges.end())
+			continue;
+
+		std::pair<u16, u16> currPos = GetChunk(data, curr.ci, curr.cj).m_RegionCenters[curr.r];
+		u32 currCost = costs[curr];
+
+		for (std::set<RegionID>::const_iterator nit = eit->second.begin(); nit != eit->second.end(); ++nit)
+		{
+			if (closed.count(*nit))
+				continue;
+
+			std::pair<u16, u16> pos = GetChunk(data, nit->ci, nit->cj).m_RegionCenters[nit->r];
+			u32 cost = currCost + RegionDistance(currPos, pos);
+			u32 h = RegionDistance(pos, goalPos);
+
+			std::map<RegionID, u32>::iterator cit = costs.find(*nit);
+			if (cit == costs.end())
+			{
+				costs[*nit] = cost;
+				preds[*nit] = curr;
+				RegionQueue::Item item = { *nit, cost + h };
+				open.push(item);
+			}
+			else if (cost < cit->second)
+			{
+				cit->second = cost;
+				preds[*nit] = curr;
+				open.promote(*nit, cost + h);
+			}
+		}
+	}
+
+	if (!found)
+		return false;
+
+	// Mark the chunks along the route and their neighbours, so the tile-based
+	// search has some freedom to find a smoother path
+	corridor.assign(m_ChunksW * m_ChunksH, 0);
+	while (true)
+	{
+		int ci0 = std::max((int)curr.ci - 1, 0);
+		int cj0 = std::max((int)curr.cj - 1, 0);
+		int ci1 = std::min((int)curr.ci + 1, m_ChunksW - 1);
+		int cj1 = std::min((int)curr.cj + 1, m_ChunksH - 1);
+		for (int cj = cj0; cj <= cj1; ++cj)
+			for (int ci = ci0; ci <= ci1; ++ci)
+				corridor[ci + cj*m_ChunksW] = 1;
+
+		if (curr == start)
+			break;
+		curr = preds[curr];
+	}
+
+	return true;
+}
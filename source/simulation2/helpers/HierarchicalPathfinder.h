@@ -0,0 +1,179 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_HIERARCHICALPATHFINDER
+#define INCLUDED_HIERARCHICALPATHFINDER
+
+#include "simulation2/components/ICmpPathfinder.h"
+#include "simulation2/helpers/Grid.h"
+
+#include <map>
+#include <set>
+
+/**
+ * Hierarchical representation of the long-range pathfinder's passability grid,
+ * used to speed up and improve CCmpPathfinder::ComputePath.
+ *
+ * The map is split into square chunks of CHUNK_SIZE*CHUNK_SIZE tiles. For each
+ * passability class, each chunk is split into regions of tiles that are connected
+ * to each other (by the same horizontal/vertical moves the tile-based A* makes)
+ * without leaving the chunk. Regions in adjacent chunks are connected by an edge
+ * if any of their tiles are adjacent. Regions are then grouped into global regions,
+ * which are the connected components of that graph, so two tiles can reach each
+ * other iff they're in the same global region.
+ *
+ * This lets the pathfinder:
+ *  - reject unreachable goals immediately (and head for the nearest reachable
+ *    tile instead), rather than exploring every reachable tile;
+ *  - find a corridor of chunks leading to the goal by searching the (much smaller)
+ *    graph of regions, and then restrict the tile-based search to that corridor.
+ *
+ * The data is a pure function of the passability grid (it doesn't depend on the
+ * order of updates), so it doesn't need to be serialized.
+ */
+class HierarchicalPathfinder
+{
+public:
+	typedef ICmpPathfinder::pass_class_t pass_class_t;
+
+	enum { CHUNK_SIZE = 16 }; // tiles per side of a chunk
+
+	/**
+	 * Identifies a region within a single chunk.
+	 */
+	struct RegionID
+	{
+		u8 ci, cj; // chunk coordinates
+		u16 r; // region within the chunk (numbered from 1; 0 means impassable)
+
+		RegionID() : ci(0), cj(0), r(0) { }
+		RegionID(u8 ci_, u8 cj_, u16 r_) : ci(ci_), cj(cj_), r(r_) { }
+
+		bool operator<(const RegionID& b) const
+		{
+			if (cj != b.cj)
+				return cj < b.cj;
+			if (ci != b.ci)
+				return ci < b.ci;
+			return r < b.r;
+		}
+
+		bool operator==(const RegionID& b) const
+		{
+			return ci == b.ci && cj == b.cj && r == b.r;
+		}
+
+		bool operator!=(const RegionID& b) const
+		{
+			return !(*this == b);
+		}
+	};
+
+	HierarchicalPathfinder();
+
+	/**
+	 * Recomputes all the data from the given passability grid (as in
+	 * CCmpPathfinder::GetPassabilityGrid), for each of the given passability classes.
+	 */
+	void Recompute(const Grid<u16>& grid, const std::vector<pass_class_t>& passClasses);
+
+	/**
+	 * Recomputes the data for the chunks that are non-zero in @p dirtyChunks
+	 * (which has one entry per chunk), after those parts of the grid changed.
+	 */
+	void Update(const Grid<u16>& grid, const Grid<u8>& dirtyChunks);
+
+	/**
+	 * Returns whether the data has been computed for the given passability class.
+	 */
+	bool HasPassClass(pass_class_t passClass) const
+	{
+		return m_Data.find(passClass) != m_Data.end();
+	}
+
+	u16 GetChunksW() const { return m_ChunksW; }
+	u16 GetChunksH() const { return m_ChunksH; }
+
+	/**
+	 * Returns the region containing tile i,j (with r == 0 if the tile is impassable).
+	 * The passability class must have been computed.
+	 */
+	RegionID GetRegion(u16 i, u16 j, pass_class_t passClass) const;
+
+	/**
+	 * Returns the global region containing the given region (0 if it's impassable).
+	 */
+	u32 GetGlobalRegion(RegionID region, pass_class_t passClass) const;
+
+	/**
+	 * Returns the global region containing tile i,j (0 if it's impassable).
+	 */
+	u32 GetGlobalRegion(u16 i, u16 j, pass_class_t passClass) const
+	{
+		return GetGlobalRegion(GetRegion(i, j, passClass), passClass);
+	}
+
+	/**
+	 * Finds the tile in the given global region that is nearest (by Euclidean distance)
+	 * to tile i,j. Returns false if the global region has no tiles.
+	 */
+	bool FindNearestTileInGlobalRegion(u16 i, u16 j, u32 globalRegion, pass_class_t passClass, u16& iOut, u16& jOut) const;
+
+	/**
+	 * Searches the graph of regions for a route from @p start to any of @p goals
+	 * (aiming towards tile iGoal,jGoal), and marks the chunks along the route, and the
+	 * chunks adjacent to them, as non-zero in @p corridor (which has one entry per chunk,
+	 * indexed by ci + cj*GetChunksW()).
+	 * Returns false if there is no route (i.e. none of the goals are in the same global region).
+	 */
+	bool FindCorridor(RegionID start, const std::set<RegionID>& goals, u16 iGoal, u16 jGoal, std::vector<u8>& corridor, pass_class_t passClass) const;
+
+private:
+	struct Chunk
+	{
+		u8 m_ChunkI, m_ChunkJ;
+		u16 m_NumRegions;
+		u16 m_Regions[CHUNK_SIZE][CHUNK_SIZE]; // region of each tile, indexed by [j][i] relative to the chunk
+		std::vector<u32> m_GlobalRegions; // global region of each region (indexed by region; [0] is unused)
+		std::vector<std::pair<u16, u16> > m_RegionCenters; // average tile coordinates of each region (indexed by region; [0] is unused)
+
+		void InitRegions(u8 ci, u8 cj, const Grid<u16>& grid, pass_class_t passClass);
+	};
+
+	typedef std::map<RegionID, std::set<RegionID> > EdgesMap;
+
+	struct PassClassData
+	{
+		std::vector<Chunk> chunks; // indexed by ci + cj*m_ChunksW
+		EdgesMap edges;
+	};
+
+	const Chunk& GetChunk(const PassClassData& data, u8 ci, u8 cj) const
+	{
+		return data.chunks[ci + cj*m_ChunksW];
+	}
+
+	void RemoveEdges(PassClassData& data, u8 ci, u8 cj);
+	void FindEdges(PassClassData& data, u8 ci, u8 cj);
+	void FindGlobalRegions(PassClassData& data);
+
+	u16 m_W, m_H; // tiles per side
+	u16 m_ChunksW, m_ChunksH;
+	std::map<pass_class_t, PassClassData> m_Data;
+};
+
+#endif // INCLUDED_HIERARCHICALPATHFINDER
@@ -0,0 +1,202 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "LosStrip.h"
+
+#if ARCH_X86_X64
+# include <emmintrin.h>
+#endif
+
+namespace LosStrip
+{
+
+// The strip is split into the off-world parts at each end, where only the
+// counts change, and the on-world part, where the state changes too
+static void ClampOnWorld(size_t n, size_t& onWorld0, size_t& onWorld1)
+{
+	onWorld1 = std::min(onWorld1, n);
+	onWorld0 = std::min(onWorld0, onWorld1);
+}
+
+static void IncrementCounts(u16* counts, size_t n)
+{
+	for (size_t k = 0; k < n; ++k)
+	{
+		ASSERT(counts[k] < 65535);
+		counts[k] = (u16)(counts[k] + 1); // ignore overflow; the player should never have 64K units
+	}
+}
+
+static bool AddOnWorld(u16* counts, u32* state, size_t n, u32 bits)
+{
+	bool changed = false;
+	for (size_t k = 0; k < n; ++k)
+	{
+		// Increasing from zero to non-zero - move from unexplored/explored to visible+explored
+		if (counts[k] == 0)
+		{
+			u32 s = state[k] | bits;
+			changed |= (s != state[k]);
+			state[k] = s;
+		}
+
+		ASSERT(counts[k] < 65535);
+		counts[k] = (u16)(counts[k] + 1);
+	}
+	return changed;
+}
+
+bool Add(u16* counts, u32* state, size_t n, u32 bits, size_t onWorld0, size_t onWorld1)
+{
+	ClampOnWorld(n, onWorld0, onWorld1);
+	IncrementCounts(counts, onWorld0);
+	bool changed = AddOnWorld(counts + onWorld0, state + onWorld0, onWorld1 - onWorld0, bits);
+	IncrementCounts(counts + onWorld1, n - onWorld1);
+	return changed;
+}
+
+bool Remove(u16* counts, u32* state, size_t n, u32 bits)
+{
+	bool changed = false;
+	for (size_t k = 0; k < n; ++k)
+	{
+		ASSERT(counts[k] > 0);
+		counts[k] = (u16)(counts[k] - 1);
+
+		// Decreasing from non-zero to zero - move from visible+explored to explored
+		// (Off-world vertexes are never visible, so this is a no-op for them)
+		if (counts[k] == 0)
+		{
+			u32 s = state[k] & ~bits;
+			changed |= (s != state[k]);
+			state[k] = s;
+		}
+	}
+	return changed;
+}
+
+#if ARCH_X86_X64
+
+// Returns true if any bit of v is set
+static inline bool AnyBits_SSE2(__m128i v)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF;
+}
+
+static void IncrementCounts_SSE2(u16* counts, size_t n)
+{
+	const __m128i one = _mm_set1_epi16(1);
+
+	size_t k = 0;
+	for (; k + 8 <= n; k += 8)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i*)&counts[k]);
+		ASSERT(_mm_movemask_epi8(_mm_cmpeq_epi16(c, _mm_set1_epi16(-1))) == 0);
+		_mm_storeu_si128((__m128i*)&counts[k], _mm_add_epi16(c, one));
+	}
+
+	IncrementCounts(&counts[k], n - k);
+}
+
+static bool AddOnWorld_SSE2(u16* counts, u32* state, size_t n, u32 bits)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bitsv = _mm_set1_epi32((int)bits);
+
+	// OR of (old ^ new) for every state we update
+	__m128i changed = zero;
+
+	size_t k = 0;
+	for (; k + 8 <= n; k += 8)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i*)&counts[k]);
+		ASSERT(_mm_movemask_epi8(_mm_cmpeq_epi16(c, _mm_set1_epi16(-1))) == 0);
+		_mm_storeu_si128((__m128i*)&counts[k], _mm_add_epi16(c, one));
+
+		// In the common case where every vertex was already visible, the state doesn't change
+		__m128i wasZero = _mm_cmpeq_epi16(c, zero);
+		if (_mm_movemask_epi8(wasZero) == 0)
+			continue;
+
+		// Widen the 16-bit masks to match the 32-bit states
+		__m128i mask0 = _mm_unpacklo_epi16(wasZero, wasZero);
+		__m128i mask1 = _mm_unpackhi_epi16(wasZero, wasZero);
+
+		__m128i s0 = _mm_loadu_si128((const __m128i*)&state[k]);
+		__m128i s1 = _mm_loadu_si128((const __m128i*)&state[k+4]);
+		__m128i n0 = _mm_or_si128(s0, _mm_and_si128(mask0, bitsv));
+		__m128i n1 = _mm_or_si128(s1, _mm_and_si128(mask1, bitsv));
+		changed = _mm_or_si128(changed, _mm_or_si128(_mm_xor_si128(s0, n0), _mm_xor_si128(s1, n1)));
+		_mm_storeu_si128((__m128i*)&state[k], n0);
+		_mm_storeu_si128((__m128i*)&state[k+4], n1);
+	}
+
+	bool tailChanged = AddOnWorld(&counts[k], &state[k], n - k, bits);
+	return tailChanged || AnyBits_SSE2(changed);
+}
+
+bool Add_SSE2(u16* counts, u32* state, size_t n, u32 bits, size_t onWorld0, size_t onWorld1)
+{
+	ClampOnWorld(n, onWorld0, onWorld1);
+	IncrementCounts_SSE2(counts, onWorld0);
+	bool changed = AddOnWorld_SSE2(counts + onWorld0, state + onWorld0, onWorld1 - onWorld0, bits);
+	IncrementCounts_SSE2(counts + onWorld1, n - onWorld1);
+	return changed;
+}
+
+bool Remove_SSE2(u16* counts, u32* state, size_t n, u32 bits)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bitsv = _mm_set1_epi32((int)bits);
+
+	__m128i changed = zero;
+
+	size_t k = 0;
+	for (; k + 8 <= n; k += 8)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i*)&counts[k]);
+		ASSERT(_mm_movemask_epi8(_mm_cmpeq_epi16(c, zero)) == 0);
+		c = _mm_sub_epi16(c, one);
+		_mm_storeu_si128((__m128i*)&counts[k], c);
+
+		__m128i becameZero = _mm_cmpeq_epi16(c, zero);
+		if (_mm_movemask_epi8(becameZero) == 0)
+			continue;
+
+		__m128i mask0 = _mm_unpacklo_epi16(becameZero, becameZero);
+		__m128i mask1 = _mm_unpackhi_epi16(becameZero, becameZero);
+
+		__m128i s0 = _mm_loadu_si128((const __m128i*)&state[k]);
+		__m128i s1 = _mm_loadu_si128((const __m128i*)&state[k+4]);
+		__m128i n0 = _mm_andnot_si128(_mm_and_si128(mask0, bitsv), s0);
+		__m128i n1 = _mm_andnot_si128(_mm_and_si128(mask1, bitsv), s1);
+		changed = _mm_or_si128(changed, _mm_or_si128(_mm_xor_si128(s0, n0), _mm_xor_si128(s1, n1)));
+		_mm_storeu_si128((__m128i*)&state[k], n0);
+		_mm_storeu_si128((__m128i*)&state[k+4], n1);
+	}
+
+	bool tailChanged = Remove(&counts[k], &state[k], n - k, bits);
+	return tailChanged || AnyBits_SSE2(changed);
+}
+
+#endif // ARCH_X86_X64
+
+} // namespace
@@ -0,0 +1,65 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_HELPER_LOSSTRIP
+#define INCLUDED_HELPER_LOSSTRIP
+
+/**
+ * @file
+ * Kernels for CCmpRangeManager's LOS updates, which add or remove one unit's
+ * vision from a horizontal strip of vertexes.
+ *
+ * Each vertex has a count of the player's units that can see it, and a 32-bit
+ * LOS state for all players. Adding vision increments the counts, and sets
+ * the player's state bits for vertexes whose count was zero; removing vision
+ * decrements the counts, and clears the player's visible bit for vertexes
+ * whose count became zero.
+ *
+ * The SSE2 versions process 8 vertexes per iteration, and give exactly the
+ * same results as the scalar versions.
+ */
+
+namespace LosStrip
+{
+
+/**
+ * Increments @p counts[0..n). For every k in [@p onWorld0, @p onWorld1) whose
+ * count was zero, ORs @p bits into @p state[k].
+ * The counts mustn't overflow (this is only checked in debug builds).
+ * @return true if any state value changed.
+ */
+bool Add(u16* counts, u32* state, size_t n, u32 bits, size_t onWorld0, size_t onWorld1);
+
+/**
+ * Decrements @p counts[0..n). For every k whose count became zero,
+ * clears @p bits from @p state[k].
+ * The counts must be non-zero (this is only checked in debug builds).
+ * @return true if any state value changed.
+ */
+bool Remove(u16* counts, u32* state, size_t n, u32 bits);
+
+#if ARCH_X86_X64
+bool Add_SSE2(u16* counts, u32* state, size_t n, u32 bits, size_t onWorld0, size_t onWorld1);
+bool Remove_SSE2(u16* counts, u32* state, size_t n, u32 bits);
+#endif
+
+typedef bool (*AddFunc)(u16*, u32*, size_t, u32, size_t, size_t);
+typedef bool (*RemoveFunc)(u16*, u32*, size_t, u32);
+
+} // namespace
+
+#endif // INCLUDED_HELPER_LOSSTRIP
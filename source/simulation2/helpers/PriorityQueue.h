@@ -120,7 +120,172 @@ public:
 		return m_Heap.size();
 	}
 
+	void clear()
+	{
+		m_Heap.clear();
+	}
+
+	std::vector<Item> m_Heap;
+};
+
+/**
+ * Priority queue implemented as a D-ary heap, plus an index from each item's ID to
+ * its position in the heap, so promote() doesn't need to search for the item.
+ *
+ * IDs are mapped onto integers in [0, numIndexes) by an INDEX function object,
+ * which is given to clear() along with the range. clear() doesn't need to reset the
+ * index: an index entry is only trusted if it points at a heap item with the right ID.
+ *
+ * Items are popped in exactly the same order as from the other queues (since
+ * QueueItemPriority is a total order), so they're interchangeable.
+ */
+template <typename ID, typename R, typename INDEX, typename CMP = std::less<R>, size_t D = 4>
+class PriorityQueueIndexedHeap
+{
+public:
+	struct Item
+	{
+		ID id;
+		R rank; // f = g+h (estimated total cost of path through here)
+	};
+
+	/**
+	 * Removes all items, and sets how IDs are mapped onto indexes.
+	 */
+	void clear(const INDEX& index, size_t numIndexes)
+	{
+		m_Heap.clear();
+		m_Index = index;
+		if (m_Positions.size() < numIndexes)
+			m_Positions.resize(numIndexes);
+	}
+
+	void clear()
+	{
+		m_Heap.clear();
+	}
+
+	void push(const Item& item)
+	{
+#if PRIORITYQUEUE_DEBUG
+		ENSURE(!find(item.id));
+#endif
+		m_Heap.push_back(item);
+		SiftUp(m_Heap.size()-1);
+	}
+
+	Item* find(ID id)
+	{
+		size_t n = m_Positions[m_Index(id)];
+		if (n < m_Heap.size() && m_Heap[n].id == id)
+			return &m_Heap[n];
+		return NULL;
+	}
+
+	void promote(ID id, R newrank)
+	{
+		size_t n = m_Positions[m_Index(id)];
+#if PRIORITYQUEUE_DEBUG
+		ENSURE(n < m_Heap.size() && m_Heap[n].id == id);
+		ENSURE(CMP()(newrank, m_Heap[n].rank));
+#endif
+		m_Heap[n].rank = newrank;
+		SiftUp(n);
+	}
+
+	Item pop()
+	{
+#if PRIORITYQUEUE_DEBUG
+		ENSURE(m_Heap.size());
+#endif
+		Item r = m_Heap.front();
+		Item last = m_Heap.back();
+		m_Heap.pop_back();
+		if (!m_Heap.empty())
+		{
+			m_Heap.front() = last;
+			SiftDown(0);
+		}
+		return r;
+	}
+
+	bool empty()
+	{
+		return m_Heap.empty();
+	}
+
+	size_t size()
+	{
+		return m_Heap.size();
+	}
+
+private:
+	// Returns whether a should be popped before b
+	static bool Before(const Item& a, const Item& b)
+	{
+		return QueueItemPriority<Item, CMP>()(b, a);
+	}
+
+	void Place(size_t n, const Item& item)
+	{
+		m_Heap[n] = item;
+		m_Positions[m_Index(item.id)] = (u32)n;
+	}
+
+	void SiftUp(size_t n)
+	{
+		Item item = m_Heap[n];
+		while (n > 0)
+		{
+			size_t parent = (n - 1) / D;
+			if (!Before(item, m_Heap[parent]))
+				break;
+			Place(n, m_Heap[parent]);
+			n = parent;
+		}
+		Place(n, item);
+	}
+
+	void SiftDown(size_t n)
+	{
+		// Move the hole down to a leaf along the path of best children, then
+		// move the item back up to where it belongs (which is usually near the
+		// bottom, so this saves comparing against the item at every level)
+		Item item = m_Heap[n];
+		size_t size = m_Heap.size();
+		size_t top = n;
+		while (true)
+		{
+			size_t first = n*D + 1;
+			if (first >= size)
+				break;
+
+			size_t best = first;
+			size_t end = std::min(first + D, size);
+			for (size_t c = first + 1; c < end; ++c)
+			{
+				if (Before(m_Heap[c], m_Heap[best]))
+					best = c;
+			}
+
+			Place(n, m_Heap[best]);
+			n = best;
+		}
+
+		while (n > top)
+		{
+			size_t parent = (n - 1) / D;
+			if (!Before(item, m_Heap[parent]))
+				break;
+			Place(n, m_Heap[parent]);
+			n = parent;
+		}
+		Place(n, item);
+	}
+
 	std::vector<Item> m_Heap;
+	std::vector<u32> m_Positions; // position in m_Heap of each item, by index (may be stale)
+	INDEX m_Index;
 };
 
 /**
@@ -193,6 +358,11 @@ public:
 		return m_List.size();
 	}
 
+	void clear()
+	{
+		m_List.clear();
+	}
+
 	std::vector<Item> m_List;
 };
 
@@ -1,4 +1,4 @@
-/* Copyright (C) 2010 Wildfire Games.
+/* Copyright (C) 2011 Wildfire Games.
  * This file is part of 0 A.D.
  *
  * 0 A.D. is free software: you can redistribute it and/or modify
@@ -32,7 +32,8 @@
  * to Add (since this class doesn't remember which divisions an item
  * occupies).
  *
- * (TODO: maybe an adaptive quadtree would be better than fixed sizes?)
+ * See SpatialLooseGrid for an alternative with the same interface that
+ * copes better with clustered or variously-sized items.
  */
 template<typename T>
 class SpatialSubdivision
@@ -181,6 +182,18 @@ public:
 	std::vector<T> GetInRange(CFixedVector2D posMin, CFixedVector2D posMax)
 	{
 		std::vector<T> ret;
+		GetInRange(ret, posMin, posMax);
+		return ret;
+	}
+
+	/**
+	 * Equivalent to GetInRange(posMin, posMax), but replaces the contents of the
+	 * given vector instead of returning a new one (so a vector that is reused
+	 * for many queries won't need to allocate any memory).
+	 */
+	void GetInRange(std::vector<T>& ret, CFixedVector2D posMin, CFixedVector2D posMax)
+	{
+		ret.clear();
 
 		ENSURE(posMin.X <= posMax.X && posMin.Y <= posMax.Y);
 
@@ -200,8 +213,6 @@ public:
 		// Remove duplicates
 		std::sort(ret.begin(), ret.end());
 		ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
-
-		return ret;
 	}
 
 	/**
@@ -216,6 +227,39 @@ public:
 		return GetInRange(pos - CFixedVector2D(range, range), pos + CFixedVector2D(range, range));
 	}
 
+	/**
+	 * Equivalent to GetNear(pos, range), but replaces the contents of the given vector.
+	 */
+	void GetNear(std::vector<T>& ret, CFixedVector2D pos, entity_pos_t range)
+	{
+		GetInRange(ret, pos - CFixedVector2D(range, range), pos + CFixedVector2D(range, range));
+	}
+
+	u32 GetDivisionsW() const
+	{
+		return m_DivisionsW;
+	}
+
+	u32 GetDivisionsH() const
+	{
+		return m_DivisionsH;
+	}
+
+	/**
+	 * Computes the (inclusive) range of divisions that GetInRange would visit
+	 * for the given axis-aligned square range, or that Add would store an item
+	 * of that size in. Division (i,j) has index i + j*GetDivisionsW().
+	 */
+	void GetDivisionRange(CFixedVector2D posMin, CFixedVector2D posMax, u32& i0, u32& j0, u32& i1, u32& j1)
+	{
+		ENSURE(posMin.X <= posMax.X && posMin.Y <= posMax.Y);
+
+		i0 = GetI0(posMin.X);
+		j0 = GetJ0(posMin.Y);
+		i1 = GetI1(posMax.X);
+		j1 = GetJ1(posMax.Y);
+	}
+
 private:
 	// Helper functions for translating coordinates into division indexes
 	// (avoiding out-of-bounds accesses, and rounding correctly so that
@@ -260,7 +304,478 @@ private:
 };
 
 /**
- * Serialization helper template for SpatialSubdivision
+ * A hierarchical loose grid for finding items in ranges. It has the same interface
+ * as SpatialSubdivision (and the same serialization format, via
+ * SerializeSpatialSubdivision), so either can be used.
+ *
+ * Level 0 is a grid with the given division size, and each further level has cells
+ * twice as large, up to a single cell covering the whole world. Each item is stored
+ * in exactly one cell: the one containing the center of its bounding box, on the
+ * finest level whose cells are at least as large as the item. Cells are 'loose'
+ * (items may extend beyond their cell by up to half the size of the largest item
+ * on that level), so queries look at a slightly expanded range of cells on each
+ * non-empty level.
+ *
+ * Compared to SpatialSubdivision:
+ *  - Items are never duplicated across cells, so large items don't crowd lots of
+ *    lists, and query results don't need to have duplicates removed.
+ *  - Each item remembers its cell and its position in that cell's list, so Remove
+ *    and Move are O(1), and the 'from' coordinates passed to them are ignored.
+ *  - Query results are usually a much tighter over-approximation, since points are
+ *    not counted in every division they touch.
+ *
+ * T must be an unsigned integer type. Items are used as indexes into an array of
+ * per-item data, so they should be small (e.g. non-local entity IDs, or sequentially
+ * allocated tags).
+ *
+ * Items and queries outside the world bounds are clamped onto its edges (matching
+ * SpatialSubdivision, whose edge divisions effectively extend to infinity).
+ */
+template<typename T>
+class SpatialLooseGrid
+{
+	static const u32 NO_CELL = 0xFFFFFFFF;
+
+	struct Item
+	{
+		Item() : cell(NO_CELL), slot(0), level(0), i0(0), j0(0), i1(0), j1(0) { }
+
+		u32 cell; // index into m_Cells, or NO_CELL if this item is not present
+		u32 slot; // index of this item in m_Cells[cell]
+		u32 level; // index into m_Levels of the level containing cell
+
+		// Range of divisions this item would occupy in a SpatialSubdivision with
+		// the same division size (used for serialization and equivalence tests)
+		u32 i0, j0, i1, j1;
+	};
+
+	struct Level
+	{
+		i32 cellSize; // internal fixed-point value
+		u32 w, h; // number of cells
+		u32 offset; // index into m_Cells of this level's first cell
+		u32 count; // number of items stored in this level
+		i32 maxHalfSize; // upper bound on half the size of any item stored in this level (internal fixed-point value)
+	};
+
+public:
+	SpatialLooseGrid() :
+		m_DivisionsW(0), m_DivisionsH(0), m_MaxX(0), m_MaxZ(0)
+	{
+	}
+
+	/**
+	 * Equivalence test (ignoring how items are stored, and only comparing the
+	 * divisions each item would occupy in the equivalent SpatialSubdivision)
+	 */
+	bool operator==(const SpatialLooseGrid& rhs) const
+	{
+		if (m_DivisionSize != rhs.m_DivisionSize || m_DivisionsW != rhs.m_DivisionsW || m_DivisionsH != rhs.m_DivisionsH)
+			return false;
+
+		size_t n = std::max(m_Items.size(), rhs.m_Items.size());
+		for (size_t i = 0; i < n; ++i)
+		{
+			Item item1 = (i < m_Items.size() ? m_Items[i] : Item());
+			Item item2 = (i < rhs.m_Items.size() ? rhs.m_Items[i] : Item());
+			if ((item1.cell == NO_CELL) != (item2.cell == NO_CELL))
+				return false;
+			if (item1.cell != NO_CELL && (item1.i0 != item2.i0 || item1.j0 != item2.j0 || item1.i1 != item2.i1 || item1.j1 != item2.j1))
+				return false;
+		}
+
+		return true;
+	}
+
+	bool operator!=(const SpatialLooseGrid& rhs) const
+	{
+		return !(*this == rhs);
+	}
+
+	void Reset(entity_pos_t maxX, entity_pos_t maxZ, entity_pos_t divisionSize)
+	{
+		Init(divisionSize, (maxX / divisionSize).ToInt_RoundToInfinity(), (maxZ / divisionSize).ToInt_RoundToInfinity());
+	}
+
+	/**
+	 * Add an item with the given 'to' size.
+	 * The item must not already be present.
+	 */
+	void Add(T item, CFixedVector2D toMin, CFixedVector2D toMax)
+	{
+		ENSURE(toMin.X <= toMax.X && toMin.Y <= toMax.Y);
+
+		if (item >= m_Items.size())
+			m_Items.resize(item + 1);
+
+		ENSURE(m_Items[item].cell == NO_CELL);
+
+		SetDivisionRange(m_Items[item], toMin, toMax);
+
+		u32 level;
+		i32 halfSize;
+		u32 cell = GetCell(toMin, toMax, level, halfSize);
+		Insert(item, cell, level, halfSize);
+	}
+
+	/**
+	 * Remove an item.
+	 * The item must already be present. (The size is ignored; it is only
+	 * accepted for compatibility with SpatialSubdivision.)
+	 */
+	void Remove(T item, CFixedVector2D UNUSED(fromMin), CFixedVector2D UNUSED(fromMax))
+	{
+		ENSURE(item < m_Items.size() && m_Items[item].cell != NO_CELL);
+
+		Erase(item);
+	}
+
+	/**
+	 * Equivalent to Remove() then Add(), but faster.
+	 */
+	void Move(T item, CFixedVector2D UNUSED(fromMin), CFixedVector2D UNUSED(fromMax), CFixedVector2D toMin, CFixedVector2D toMax)
+	{
+		ENSURE(toMin.X <= toMax.X && toMin.Y <= toMax.Y);
+		ENSURE(item < m_Items.size() && m_Items[item].cell != NO_CELL);
+
+		SetDivisionRange(m_Items[item], toMin, toMax);
+
+		u32 level;
+		i32 halfSize;
+		u32 cell = GetCell(toMin, toMax, level, halfSize);
+
+		// Skip the work if we're staying in the same cell
+		if (cell == m_Items[item].cell)
+		{
+			m_Levels[level].maxHalfSize = std::max(m_Levels[level].maxHalfSize, halfSize);
+			return;
+		}
+
+		Erase(item);
+		Insert(item, cell, level, halfSize);
+	}
+
+	/**
+	 * Convenience function for Add() of individual points.
+	 */
+	void Add(T item, CFixedVector2D to)
+	{
+		Add(item, to, to);
+	}
+
+	/**
+	 * Convenience function for Remove() of individual points.
+	 */
+	void Remove(T item, CFixedVector2D from)
+	{
+		Remove(item, from, from);
+	}
+
+	/**
+	 * Convenience function for Move() of individual points.
+	 */
+	void Move(T item, CFixedVector2D from, CFixedVector2D to)
+	{
+		Move(item, from, from, to, to);
+	}
+
+	/**
+	 * Returns a sorted list of unique items that includes all items
+	 * within the given axis-aligned square range.
+	 */
+	std::vector<T> GetInRange(CFixedVector2D posMin, CFixedVector2D posMax)
+	{
+		std::vector<T> ret;
+		GetInRange(ret, posMin, posMax);
+		return ret;
+	}
+
+	/**
+	 * Equivalent to GetInRange(posMin, posMax), but replaces the contents of the
+	 * given vector instead of returning a new one (so a vector that is reused
+	 * for many queries won't need to allocate any memory).
+	 */
+	void GetInRange(std::vector<T>& ret, CFixedVector2D posMin, CFixedVector2D posMax)
+	{
+		ret.clear();
+
+		ENSURE(posMin.X <= posMax.X && posMin.Y <= posMax.Y);
+
+		i32 x0 = ClampX(posMin.X);
+		i32 z0 = ClampZ(posMin.Y);
+		i32 x1 = ClampX(posMax.X);
+		i32 z1 = ClampZ(posMax.Y);
+
+		for (size_t l = 0; l < m_Levels.size(); ++l)
+		{
+			const Level& level = m_Levels[l];
+			if (level.count == 0)
+				continue;
+
+			// Items in cell i have their center in [i*cellSize, (i+1)*cellSize) and
+			// extend at most maxHalfSize from it, so only these cells can contain
+			// items that overlap the range
+			u32 i0 = std::min((u32)(std::max(x0 - level.maxHalfSize, 0) / level.cellSize), level.w-1);
+			u32 j0 = std::min((u32)(std::max(z0 - level.maxHalfSize, 0) / level.cellSize), level.h-1);
+			u32 i1 = std::min((u32)((x1 + level.maxHalfSize) / level.cellSize), level.w-1);
+			u32 j1 = std::min((u32)((z1 + level.maxHalfSize) / level.cellSize), level.h-1);
+			for (u32 j = j0; j <= j1; ++j)
+			{
+				for (u32 i = i0; i <= i1; ++i)
+				{
+					const std::vector<T>& cell = m_Cells[level.offset + i + j*level.w];
+					ret.insert(ret.end(), cell.begin(), cell.end());
+				}
+			}
+		}
+
+		// Every item is in a single cell so there are no duplicates,
+		// but callers expect a consistent order
+		std::sort(ret.begin(), ret.end());
+	}
+
+	/**
+	 * Returns a sorted list of unique items that includes all items
+	 * within the given circular distance of the given point.
+	 */
+	std::vector<T> GetNear(CFixedVector2D pos, entity_pos_t range)
+	{
+		return GetInRange(pos - CFixedVector2D(range, range), pos + CFixedVector2D(range, range));
+	}
+
+	/**
+	 * Equivalent to GetNear(pos, range), but replaces the contents of the given vector.
+	 */
+	void GetNear(std::vector<T>& ret, CFixedVector2D pos, entity_pos_t range)
+	{
+		GetInRange(ret, pos - CFixedVector2D(range, range), pos + CFixedVector2D(range, range));
+	}
+
+	u32 GetDivisionsW() const
+	{
+		return m_DivisionsW;
+	}
+
+	u32 GetDivisionsH() const
+	{
+		return m_DivisionsH;
+	}
+
+	/**
+	 * Computes the (inclusive) range of divisions that a SpatialSubdivision with
+	 * the same division size would visit for the given axis-aligned square range.
+	 * Division (i,j) has index i + j*GetDivisionsW().
+	 */
+	void GetDivisionRange(CFixedVector2D posMin, CFixedVector2D posMax, u32& i0, u32& j0, u32& i1, u32& j1)
+	{
+		ENSURE(posMin.X <= posMax.X && posMin.Y <= posMax.Y);
+
+		i0 = GetI0(posMin.X);
+		j0 = GetJ0(posMin.Y);
+		i1 = GetI1(posMax.X);
+		j1 = GetJ1(posMax.Y);
+	}
+
+private:
+	void Init(entity_pos_t divisionSize, u32 divisionsW, u32 divisionsH)
+	{
+		m_DivisionSize = divisionSize;
+		m_DivisionsW = divisionsW;
+		m_DivisionsH = divisionsH;
+		m_MaxX = divisionSize.GetInternalValue() * (i32)divisionsW;
+		m_MaxZ = divisionSize.GetInternalValue() * (i32)divisionsH;
+
+		m_Levels.clear();
+		u32 numCells = 0;
+		for (u32 l = 0; ; ++l)
+		{
+			Level level;
+			level.cellSize = divisionSize.GetInternalValue() << l;
+			level.w = std::max((divisionsW + (1u << l) - 1) >> l, 1u);
+			level.h = std::max((divisionsH + (1u << l) - 1) >> l, 1u);
+			level.offset = numCells;
+			level.count = 0;
+			level.maxHalfSize = 0;
+			m_Levels.push_back(level);
+
+			numCells += level.w * level.h;
+			if (level.w == 1 && level.h == 1)
+				break;
+		}
+
+		m_Cells.clear();
+		m_Cells.resize(numCells);
+		m_Items.clear();
+	}
+
+	/**
+	 * Adds the items stored in the given SpatialSubdivision-style lists of items per division.
+	 */
+	void AddDivisions(const std::vector<std::vector<T> >& divs)
+	{
+		ENSURE(divs.size() == m_DivisionsW * m_DivisionsH);
+
+		// Find the range of divisions each item was stored in
+		std::vector<bool> found;
+		for (u32 j = 0; j < m_DivisionsH; ++j)
+		{
+			for (u32 i = 0; i < m_DivisionsW; ++i)
+			{
+				const std::vector<T>& div = divs[i + j*m_DivisionsW];
+				for (size_t n = 0; n < div.size(); ++n)
+				{
+					T id = div[n];
+					if (id >= m_Items.size())
+					{
+						m_Items.resize(id + 1);
+						found.resize(id + 1);
+					}
+
+					Item& item = m_Items[id];
+					if (!found[id])
+					{
+						found[id] = true;
+						item.i0 = item.i1 = i;
+						item.j0 = item.j1 = j;
+					}
+					else
+					{
+						item.i0 = std::min(item.i0, i);
+						item.j0 = std::min(item.j0, j);
+						item.i1 = std::max(item.i1, i);
+						item.j1 = std::max(item.j1, j);
+					}
+				}
+			}
+		}
+
+		// Store each item as if it covered all of those divisions,
+		// which contains its real bounds
+		for (size_t id = 0; id < found.size(); ++id)
+		{
+			if (!found[id])
+				continue;
+
+			const Item& item = m_Items[id];
+			CFixedVector2D posMin(m_DivisionSize * (int)item.i0, m_DivisionSize * (int)item.j0);
+			CFixedVector2D posMax(m_DivisionSize * (int)(item.i1 + 1), m_DivisionSize * (int)(item.j1 + 1));
+
+			u32 level;
+			i32 halfSize;
+			u32 cell = GetCell(posMin, posMax, level, halfSize);
+			Insert((T)id, cell, level, halfSize);
+		}
+	}
+
+	/**
+	 * Returns the cell that should contain an item with the given bounds, and the level
+	 * of that cell and half the item's size (rounded up).
+	 */
+	u32 GetCell(CFixedVector2D posMin, CFixedVector2D posMax, u32& l, i32& halfSize)
+	{
+		i32 x0 = ClampX(posMin.X);
+		i32 z0 = ClampZ(posMin.Y);
+		i32 x1 = ClampX(posMax.X);
+		i32 z1 = ClampZ(posMax.Y);
+
+		i32 size = std::max(x1 - x0, z1 - z0);
+		halfSize = size - size/2;
+
+		l = 0;
+		while (size > m_Levels[l].cellSize && l+1 < m_Levels.size())
+			++l;
+
+		const Level& level = m_Levels[l];
+		u32 i = std::min((u32)((x0 + (x1 - x0)/2) / level.cellSize), level.w-1);
+		u32 j = std::min((u32)((z0 + (z1 - z0)/2) / level.cellSize), level.h-1);
+		return level.offset + i + j*level.w;
+	}
+
+	void Insert(T id, u32 cell, u32 level, i32 halfSize)
+	{
+		Item& item = m_Items[id];
+		item.cell = cell;
+		item.slot = (u32)m_Cells[cell].size();
+		item.level = level;
+		m_Cells[cell].push_back(id);
+
+		m_Levels[level].count++;
+		m_Levels[level].maxHalfSize = std::max(m_Levels[level].maxHalfSize, halfSize);
+	}
+
+	void Erase(T id)
+	{
+		Item& item = m_Items[id];
+		std::vector<T>& cell = m_Cells[item.cell];
+
+		// Delete by swapping with the last element then popping
+		T last = cell.back();
+		cell[item.slot] = last;
+		m_Items[last].slot = item.slot;
+		cell.pop_back();
+
+		m_Levels[item.level].count--;
+		item.cell = NO_CELL;
+	}
+
+	void SetDivisionRange(Item& item, CFixedVector2D posMin, CFixedVector2D posMax)
+	{
+		item.i0 = GetI0(posMin.X);
+		item.j0 = GetJ0(posMin.Y);
+		item.i1 = GetI1(posMax.X);
+		item.j1 = GetJ1(posMax.Y);
+	}
+
+	i32 ClampX(entity_pos_t x)
+	{
+		return Clamp(x.GetInternalValue(), 0, m_MaxX);
+	}
+
+	i32 ClampZ(entity_pos_t z)
+	{
+		return Clamp(z.GetInternalValue(), 0, m_MaxZ);
+	}
+
+	// Helper functions for translating coordinates into division indexes
+	// (identical to SpatialSubdivision's)
+
+	u32 GetI0(entity_pos_t x)
+	{
+		return Clamp((x / m_DivisionSize).ToInt_RoundToInfinity()-1, 0, (int)m_DivisionsW-1);
+	}
+
+	u32 GetJ0(entity_pos_t z)
+	{
+		return Clamp((z / m_DivisionSize).ToInt_RoundToInfinity()-1, 0, (int)m_DivisionsH-1);
+	}
+
+	u32 GetI1(entity_pos_t x)
+	{
+		return Clamp((x / m_DivisionSize).ToInt_RoundToNegInfinity(), 0, (int)m_DivisionsW-1);
+	}
+
+	u32 GetJ1(entity_pos_t z)
+	{
+		return Clamp((z / m_DivisionSize).ToInt_RoundToNegInfinity(), 0, (int)m_DivisionsH-1);
+	}
+
+	entity_pos_t m_DivisionSize;
+	u32 m_DivisionsW;
+	u32 m_DivisionsH;
+	i32 m_MaxX; // world bounds (internal fixed-point value)
+	i32 m_MaxZ;
+	std::vector<Level> m_Levels;
+	std::vector<std::vector<T> > m_Cells;
+	std::vector<Item> m_Items; // indexed by item
+
+	template<typename ELEM> friend struct SerializeSpatialSubdivision;
+};
+
+/**
+ * Serialization helper template for SpatialSubdivision and SpatialLooseGrid.
+ * Both use the same format, so data serialized from one can be deserialized into the other.
+ * The items in each division are written in increasing order (which doesn't affect any
+ * query results), so both produce the same data for the same contents.
  */
 template<typename ELEM>
 struct SerializeSpatialSubdivision
@@ -268,8 +783,12 @@ struct SerializeSpatialSubdivision
 	template<typename T>
 	void operator()(ISerializer& serialize, const char* UNUSED(name), SpatialSubdivision<T>& value)
 	{
+		std::vector<std::vector<T> > divs(value.m_Divisions);
+		for (size_t i = 0; i < divs.size(); ++i)
+			std::sort(divs[i].begin(), divs[i].end());
+
 		serialize.NumberFixed_Unbounded("div size", value.m_DivisionSize);
-		SerializeVector<SerializeVector<ELEM> >()(serialize, "divs", value.m_Divisions);
+		SerializeVector<SerializeVector<ELEM> >()(serialize, "divs", divs);
 		serialize.NumberU32_Unbounded("divs w", value.m_DivisionsW);
 		serialize.NumberU32_Unbounded("divs h", value.m_DivisionsH);
 	}
@@ -286,6 +805,43 @@ struct SerializeSpatialSubdivision
 		value.m_DivisionsW = w;
 		value.m_DivisionsH = h;
 	}
+
+	template<typename T>
+	void operator()(ISerializer& serialize, const char* UNUSED(name), SpatialLooseGrid<T>& value)
+	{
+		// Construct the list of items in each division, in increasing order
+		std::vector<std::vector<T> > divs(value.m_DivisionsW * value.m_DivisionsH);
+		for (size_t id = 0; id < value.m_Items.size(); ++id)
+		{
+			const typename SpatialLooseGrid<T>::Item& item = value.m_Items[id];
+			if (item.cell == SpatialLooseGrid<T>::NO_CELL)
+				continue;
+
+			for (u32 j = item.j0; j <= item.j1; ++j)
+				for (u32 i = item.i0; i <= item.i1; ++i)
+					divs.at(i + j*value.m_DivisionsW).push_back((T)id);
+		}
+
+		serialize.NumberFixed_Unbounded("div size", value.m_DivisionSize);
+		SerializeVector<SerializeVector<ELEM> >()(serialize, "divs", divs);
+		serialize.NumberU32_Unbounded("divs w", value.m_DivisionsW);
+		serialize.NumberU32_Unbounded("divs h", value.m_DivisionsH);
+	}
+
+	template<typename T>
+	void operator()(IDeserializer& serialize, const char* UNUSED(name), SpatialLooseGrid<T>& value)
+	{
+		entity_pos_t divisionSize;
+		std::vector<std::vector<T> > divs;
+		u32 w, h;
+		serialize.NumberFixed_Unbounded("div size", divisionSize);
+		SerializeVector<SerializeVector<ELEM> >()(serialize, "divs", divs);
+		serialize.NumberU32_Unbounded("divs w", w);
+		serialize.NumberU32_Unbounded("divs h", h);
+
+		value.Init(divisionSize, w, h);
+		value.AddDivisions(divs);
+	}
 };
 
 #endif // INCLUDED_SPATIAL
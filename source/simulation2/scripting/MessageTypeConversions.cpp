@@ -267,6 +267,19 @@ CMessage* CMessageTerritoriesChanged::FromJSVal(ScriptInterface& UNUSED(scriptIn
 
 ////////////////////////////////
 
+jsval CMessageWaterChanged::ToJSVal(ScriptInterface& scriptInterface) const
+{
+	TOJSVAL_SETUP();
+	return OBJECT_TO_JSVAL(obj);
+}
+
+CMessage* CMessageWaterChanged::FromJSVal(ScriptInterface& UNUSED(scriptInterface), jsval UNUSED(val))
+{
+	return new CMessageWaterChanged();
+}
+
+////////////////////////////////
+
 jsval CMessageRangeUpdate::ToJSVal(ScriptInterface& scriptInterface) const
 {
 	TOJSVAL_SETUP();
@@ -25,6 +25,21 @@
 CComponentTypeScript::CComponentTypeScript(ScriptInterface& scriptInterface, jsval instance) :
 	m_ScriptInterface(scriptInterface), m_Instance(CScriptValRooted(scriptInterface.GetContext(), instance))
 {
+	UpdateCachedFunctions();
+}
+
+void CComponentTypeScript::UpdateCachedFunctions()
+{
+	jsval proto;
+	if (!m_ScriptInterface.GetPrototype(m_Instance.get(), proto))
+		proto = JSVAL_NULL;
+
+	if (!m_CachedPrototype.uninitialised() && m_CachedPrototype.get() == proto)
+		return;
+
+	m_CachedPrototype = CScriptValRooted(m_ScriptInterface.GetContext(), proto);
+	m_MessageHandlers.clear();
+
 	// Cache the property detection for efficiency
 	m_HasCustomSerialize = m_ScriptInterface.HasProperty(m_Instance.get(), "Serialize");
 	m_HasCustomDeserialize = m_ScriptInterface.HasProperty(m_Instance.get(), "Deserialize");
@@ -36,6 +51,37 @@ CComponentTypeScript::CComponentTypeScript(ScriptInterface& scriptInterface, jsv
 		if (m_ScriptInterface.GetProperty(m_Instance.get(), "Serialize", val) && JSVAL_IS_NULL(val.get()))
 			m_HasNullSerialize = true;
 	}
+
+	jsval func;
+	m_SerializeFunc = CScriptValRooted();
+	if (m_HasCustomSerialize && !m_HasNullSerialize && m_ScriptInterface.GetFunction(m_Instance.get(), "Serialize", func))
+		m_SerializeFunc = CScriptValRooted(m_ScriptInterface.GetContext(), func);
+
+	m_DeserializeFunc = CScriptValRooted();
+	if (m_HasCustomDeserialize && m_ScriptInterface.GetFunction(m_Instance.get(), "Deserialize", func))
+		m_DeserializeFunc = CScriptValRooted(m_ScriptInterface.GetContext(), func);
+}
+
+jsval CComponentTypeScript::GetMessageHandler(const CMessage& msg, bool global)
+{
+	int type = msg.GetType();
+	for (size_t i = 0; i < m_MessageHandlers.size(); ++i)
+		if (m_MessageHandlers[i].type == type && m_MessageHandlers[i].global == global)
+			return m_MessageHandlers[i].func.get();
+
+	SMessageHandler handler;
+	handler.type = type;
+	handler.global = global;
+
+	const char* name = global ? msg.GetScriptGlobalHandlerName() : msg.GetScriptHandlerName();
+	jsval func;
+	if (m_ScriptInterface.GetFunction(m_Instance.get(), name, func))
+		handler.func = CScriptValRooted(m_ScriptInterface.GetContext(), func);
+	else
+		LOGERROR(L"Script message handler %hs is not a function", name); // only reported once per component
+
+	m_MessageHandlers.push_back(handler);
+	return handler.func.get();
 }
 
 void CComponentTypeScript::Init(const CParamNode& paramNode, entity_id_t ent)
@@ -52,16 +98,22 @@ void CComponentTypeScript::Deinit()
 
 void CComponentTypeScript::HandleMessage(const CMessage& msg, bool global)
 {
-	const char* name = global ? msg.GetScriptGlobalHandlerName() : msg.GetScriptHandlerName();
+	UpdateCachedFunctions();
+
+	jsval func = GetMessageHandler(msg, global);
+	if (JSVAL_IS_VOID(func))
+		return;
 
 	CScriptVal msgVal = msg.ToJSValCached(m_ScriptInterface);
 
-	if (!m_ScriptInterface.CallFunctionVoid(m_Instance.get(), name, msgVal))
-		LOGERROR(L"Script message handler %hs failed", name);
+	if (!m_ScriptInterface.CallFunctionValueVoid(m_Instance.get(), func, msgVal))
+		LOGERROR(L"Script message handler %hs failed", global ? msg.GetScriptGlobalHandlerName() : msg.GetScriptHandlerName());
 }
 
 void CComponentTypeScript::Serialize(ISerializer& serialize)
 {
+	UpdateCachedFunctions();
+
 	// If the component set Serialize = null, then do no work here
 	if (m_HasNullSerialize)
 		return;
@@ -71,7 +123,7 @@ void CComponentTypeScript::Serialize(ISerializer& serialize)
 	if (m_HasCustomSerialize)
 	{
 		CScriptVal val;
-		if (!m_ScriptInterface.CallFunction(m_Instance.get(), "Serialize", val))
+		if (!m_ScriptInterface.CallFunctionValue(m_Instance.get(), m_SerializeFunc.get(), val))
 			LOGERROR(L"Script Serialize call failed");
 		serialize.ScriptVal("object", val);
 	}
@@ -83,6 +135,8 @@ void CComponentTypeScript::Serialize(ISerializer& serialize)
 
 void CComponentTypeScript::Deserialize(const CParamNode& paramNode, IDeserializer& deserialize, entity_id_t ent)
 {
+	UpdateCachedFunctions();
+
 	// Support a custom "Deserialize" function, to which we pass the deserialized data
 	// instead of automatically adding the deserialized properties onto the object
 	if (m_HasCustomDeserialize)
@@ -93,7 +147,7 @@ void CComponentTypeScript::Deserialize(const CParamNode& paramNode, IDeserialize
 		if (!m_HasNullSerialize)
 			deserialize.ScriptVal("object", val);
 
-		if (!m_ScriptInterface.CallFunctionVoid(m_Instance.get(), "Deserialize", val))
+		if (!m_ScriptInterface.CallFunctionValueVoid(m_Instance.get(), m_DeserializeFunc.get(), val))
 			LOGERROR(L"Script Deserialize call failed");
 	}
 	else
@@ -73,12 +73,40 @@ BOOST_PP_REPEAT(SCRIPT_INTERFACE_MAX_ARGS, OVERLOADS, ~)
 #undef OVERLOADS
 
 private:
+	/**
+	 * Resolves the Serialize/Deserialize functions, and forgets the cached message
+	 * handlers, if the instance's prototype has changed since they were last resolved
+	 * (which happens when the component type is hotloaded).
+	 */
+	void UpdateCachedFunctions();
+
+	/**
+	 * Returns the handler function for the given message, resolving it the first time
+	 * each message type is seen, or JSVAL_VOID if the instance has no such handler.
+	 */
+	jsval GetMessageHandler(const CMessage& msg, bool global);
+
 	ScriptInterface& m_ScriptInterface;
 	CScriptValRooted m_Instance;
 	bool m_HasCustomSerialize;
 	bool m_HasCustomDeserialize;
 	bool m_HasNullSerialize;
 
+	// Cached function handles, so we don't look them up by name on every call
+	CScriptValRooted m_CachedPrototype;
+	CScriptValRooted m_SerializeFunc;
+	CScriptValRooted m_DeserializeFunc;
+
+	struct SMessageHandler
+	{
+		int type;
+		bool global;
+		CScriptValRooted func; // undefined if the handler is missing
+	};
+
+	// Components handle only a few message types each, so a linear search is fastest
+	std::vector<SMessageHandler> m_MessageHandlers;
+
 	NONCOPYABLE(CComponentTypeScript);
 };
 
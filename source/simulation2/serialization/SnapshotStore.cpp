@@ -0,0 +1,249 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "SnapshotStore.h"
+
+#include "ps/CLogger.h"
+
+static u32 SegmentLength(const std::string& data, const std::vector<SSerializedSegment>& segments, size_t i)
+{
+	if (i + 1 < segments.size())
+		return segments[i+1].offset - segments[i].offset;
+	return (u32)data.size() - segments[i].offset;
+}
+
+/**
+ * Orders segments the way CComponentManager::SerializeState emits them:
+ * the state header first, then by component type, then by entity
+ * (with the type's header as entity 0).
+ */
+static bool SegmentKeyLess(const SSerializedSegment& a, const SSerializedSegment& b)
+{
+	if (a.type != b.type)
+	{
+		if (a.type == SSerializedSegment::HEADER)
+			return true;
+		if (b.type == SSerializedSegment::HEADER)
+			return false;
+		return a.type < b.type;
+	}
+	return a.entity < b.entity;
+}
+
+CSnapshotStore::CSnapshotStore(size_t maxMemory) :
+	m_MaxMemory(maxMemory), m_HasNewest(false), m_DeltasMemory(0)
+{
+}
+
+void CSnapshotStore::Clear()
+{
+	m_HasNewest = false;
+	m_Newest.data.clear();
+	m_Newest.segments.clear();
+	m_Deltas.clear();
+	m_DeltasMemory = 0;
+}
+
+size_t CSnapshotStore::GetNumStates() const
+{
+	return (m_HasNewest ? 1 : 0) + m_Deltas.size();
+}
+
+size_t CSnapshotStore::GetMemoryUsage() const
+{
+	if (!m_HasNewest)
+		return 0;
+	return m_Newest.data.size() + m_Newest.segments.size() * sizeof(SSerializedSegment) + m_DeltasMemory;
+}
+
+size_t CSnapshotStore::GetMemoryUsage(const SDelta& delta)
+{
+	return delta.runs.size() * sizeof(SRun) + delta.literalSegments.size() * sizeof(SSerializedSegment) + delta.literalData.size();
+}
+
+void CSnapshotStore::ComputeHash(const std::string& data, Hash& hash)
+{
+	MD5 md5;
+	md5.Update((const u8*)data.data(), data.size());
+	md5.Final(hash);
+}
+
+void CSnapshotStore::Push(const std::string& state, const std::vector<SSerializedSegment>& segments)
+{
+	ENSURE(!segments.empty() && segments[0].offset == 0);
+
+	SState newest;
+	newest.data = state;
+	newest.segments = segments;
+	ComputeHash(newest.data, newest.hash);
+
+	if (m_HasNewest)
+	{
+		// Replace the old newest state with its delta from the new one
+		m_Deltas.push_back(SDelta());
+		Encode(m_Newest, newest, m_Deltas.back());
+		m_DeltasMemory += GetMemoryUsage(m_Deltas.back());
+	}
+
+	m_Newest.data.swap(newest.data);
+	m_Newest.segments.swap(newest.segments);
+	memcpy(m_Newest.hash, newest.hash, sizeof(Hash));
+	m_HasNewest = true;
+
+	DropOldStates();
+}
+
+void CSnapshotStore::DropOldStates()
+{
+	while (!m_Deltas.empty() && GetMemoryUsage() > m_MaxMemory)
+	{
+		m_DeltasMemory -= GetMemoryUsage(m_Deltas.front());
+		m_Deltas.pop_front();
+	}
+}
+
+bool CSnapshotStore::Pop(std::string& state)
+{
+	if (!m_HasNewest)
+		return false;
+
+	Hash hash;
+	ComputeHash(m_Newest.data, hash);
+	if (memcmp(hash, m_Newest.hash, sizeof(Hash)) != 0)
+	{
+		LOGERROR(L"Stored simulation state failed its hash check");
+		Clear();
+		return false;
+	}
+
+	if (m_Deltas.empty())
+	{
+		state.swap(m_Newest.data);
+		Clear();
+		return true;
+	}
+
+	SState older;
+	bool ok = Decode(m_Deltas.back(), m_Newest, older);
+
+	m_DeltasMemory -= GetMemoryUsage(m_Deltas.back());
+	m_Deltas.pop_back();
+
+	state.swap(m_Newest.data);
+
+	if (!ok)
+	{
+		LOGERROR(L"Reconstructed simulation state failed its hash check; discarding older states");
+		Clear();
+		return true;
+	}
+
+	m_Newest.data.swap(older.data);
+	m_Newest.segments.swap(older.segments);
+	memcpy(m_Newest.hash, older.hash, sizeof(Hash));
+	return true;
+}
+
+void CSnapshotStore::Encode(const SState& target, const SState& base, SDelta& delta)
+{
+	memcpy(delta.hash, target.hash, sizeof(Hash));
+
+	// Both states have their segments in the same order, so walk through them together
+	size_t j = 0;
+	for (size_t i = 0; i < target.segments.size(); ++i)
+	{
+		const SSerializedSegment& seg = target.segments[i];
+		u32 length = SegmentLength(target.data, target.segments, i);
+
+		while (j < base.segments.size() && SegmentKeyLess(base.segments[j], seg))
+			++j;
+
+		bool unchanged = false;
+		if (j < base.segments.size() && base.segments[j].type == seg.type && base.segments[j].entity == seg.entity)
+		{
+			unchanged = (SegmentLength(base.data, base.segments, j) == length &&
+				memcmp(target.data.data() + seg.offset, base.data.data() + base.segments[j].offset, length) == 0);
+		}
+
+		if (unchanged)
+		{
+			if (!delta.runs.empty() && delta.runs.back().base != SRun::LITERAL &&
+				delta.runs.back().base + delta.runs.back().count == j)
+			{
+				delta.runs.back().count++;
+			}
+			else
+			{
+				SRun run = { (u32)j, 1 };
+				delta.runs.push_back(run);
+			}
+		}
+		else
+		{
+			if (!delta.runs.empty() && delta.runs.back().base == SRun::LITERAL)
+			{
+				delta.runs.back().count++;
+			}
+			else
+			{
+				SRun run = { SRun::LITERAL, 1 };
+				delta.runs.push_back(run);
+			}
+
+			SSerializedSegment literal = { seg.type, seg.entity, (u32)delta.literalData.size() };
+			delta.literalSegments.push_back(literal);
+			delta.literalData.append(target.data, seg.offset, length);
+		}
+	}
+}
+
+bool CSnapshotStore::Decode(const SDelta& delta, const SState& base, SState& target)
+{
+	target.data.clear();
+	target.segments.clear();
+
+	size_t nextLiteral = 0;
+	for (size_t r = 0; r < delta.runs.size(); ++r)
+	{
+		const SRun& run = delta.runs[r];
+		for (u32 k = 0; k < run.count; ++k)
+		{
+			SSerializedSegment seg;
+			if (run.base == SRun::LITERAL)
+			{
+				seg = delta.literalSegments[nextLiteral];
+				u32 length = SegmentLength(delta.literalData, delta.literalSegments, nextLiteral);
+				seg.offset = (u32)target.data.size();
+				target.data.append(delta.literalData, delta.literalSegments[nextLiteral].offset, length);
+				++nextLiteral;
+			}
+			else
+			{
+				seg = base.segments[run.base + k];
+				u32 length = SegmentLength(base.data, base.segments, run.base + k);
+				seg.offset = (u32)target.data.size();
+				target.data.append(base.data, base.segments[run.base + k].offset, length);
+			}
+			target.segments.push_back(seg);
+		}
+	}
+
+	ComputeHash(target.data, target.hash);
+	return memcmp(target.hash, delta.hash, sizeof(Hash)) == 0;
+}
@@ -0,0 +1,137 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_SNAPSHOTSTORE
+#define INCLUDED_SNAPSHOTSTORE
+
+#include "maths/MD5.h"
+
+#include <deque>
+
+/**
+ * Identifies part of a serialized simulation state (see CComponentManager::SerializeState):
+ * the state header, a component type's header, or a single component.
+ * The segment ends where the next one starts (or at the end of the data).
+ */
+struct SSerializedSegment
+{
+	static const u32 HEADER = 0xFFFFFFFF;
+
+	u32 type; // component type ID, or HEADER for the state header
+	u32 entity; // entity ID, or 0 for the component type's header
+	u32 offset; // start of the segment in the serialized data
+};
+
+/**
+ * Stack of serialized simulation states (e.g. for time warp), which only stores
+ * the parts of each state that differ from the next newer one.
+ *
+ * The newest state is kept in full. Older states are stored as reverse deltas:
+ * a list of which segments are unchanged in the next newer state, plus the data
+ * of the changed segments. Popping the newest state reconstructs the one before it
+ * from a single delta, and the oldest states can be dropped without touching
+ * the rest, so the store works as a ring buffer with a memory limit.
+ *
+ * Each state's hash is checked when it's reconstructed, so a bug in the delta
+ * code can't silently corrupt a rewound game.
+ */
+class CSnapshotStore
+{
+	NONCOPYABLE(CSnapshotStore);
+public:
+	/**
+	 * @param maxMemory approximate limit on the memory used by stored states;
+	 *  the oldest states are dropped to keep under it (but the newest is always kept).
+	 */
+	CSnapshotStore(size_t maxMemory);
+
+	void Clear();
+
+	size_t GetNumStates() const;
+
+	/**
+	 * Returns the approximate number of bytes used by the stored states.
+	 */
+	size_t GetMemoryUsage() const;
+
+	/**
+	 * Adds a new newest state. @p segments must be in the order they were
+	 * serialized, with the first at offset 0.
+	 */
+	void Push(const std::string& state, const std::vector<SSerializedSegment>& segments);
+
+	/**
+	 * Removes the newest state and returns it in @p state.
+	 * @return false if there are no states, or if the state failed its hash check
+	 *  (in which case all the older states are discarded too).
+	 */
+	bool Pop(std::string& state);
+
+private:
+	typedef u8 Hash[MD5::DIGESTSIZE];
+
+	struct SState
+	{
+		std::string data;
+		std::vector<SSerializedSegment> segments;
+		Hash hash;
+	};
+
+	// A run of consecutive segments, either copied from consecutive segments of
+	// the newer state or stored in the delta
+	struct SRun
+	{
+		static const u32 LITERAL = 0xFFFFFFFF;
+
+		u32 base; // first segment of the newer state, or LITERAL
+		u32 count;
+	};
+
+	struct SDelta
+	{
+		std::vector<SRun> runs;
+		std::vector<SSerializedSegment> literalSegments; // offsets are into literalData
+		std::string literalData;
+		Hash hash;
+	};
+
+	static void ComputeHash(const std::string& data, Hash& hash);
+	static size_t GetMemoryUsage(const SDelta& delta);
+
+	/**
+	 * Computes the delta that reconstructs @p target from @p base.
+	 */
+	static void Encode(const SState& target, const SState& base, SDelta& delta);
+
+	/**
+	 * Reconstructs the state from @p delta and @p base.
+	 * @return false if the result doesn't match the delta's hash.
+	 */
+	static bool Decode(const SDelta& delta, const SState& base, SState& target);
+
+	void DropOldStates();
+
+	size_t m_MaxMemory;
+
+	bool m_HasNewest;
+	SState m_Newest;
+
+	std::deque<SDelta> m_Deltas; // oldest first; back() is relative to m_Newest
+	size_t m_DeltasMemory;
+};
+
+#endif // INCLUDED_SNAPSHOTSTORE
@@ -26,9 +26,58 @@
 #include "simulation2/MessageTypes.h"
 #include "simulation2/components/ICmpTemplateManager.h"
 
+#include "lib/timer.h"
 #include "lib/utf8.h"
 #include "ps/CLogger.h"
 #include "ps/Filesystem.h"
+#include "ps/Profile.h"
+
+#include <boost/flyweight.hpp>
+#include <boost/flyweight/no_tracking.hpp>
+
+/**
+ * Returns a copy of the given string that stays valid until the program exits.
+ * The profiler identifies nodes by name pointer, and keeps its nodes after
+ * the component manager has been destroyed, so it can't use our own strings.
+ */
+static const char* InternProfileName(const std::string& name)
+{
+	typedef boost::flyweight<std::string, boost::flyweights::no_tracking> ProfileNameFlyweight;
+	return ProfileNameFlyweight(name).get().c_str();
+}
+
+/**
+ * Counts one dispatch of a message to a component type, and optionally adds
+ * the time until the end of the current scope.
+ * (The handlers may dispatch other messages, which can reallocate the statistics,
+ * so they're only looked up once the handlers have finished.)
+ */
+class CDispatchStatsSample
+{
+	NONCOPYABLE(CDispatchStatsSample);
+public:
+	CDispatchStatsSample(const CComponentManager& componentManager, CComponentManager::MessageTypeId mtid, CComponentManager::ComponentTypeId cid) :
+		m_ComponentManager(componentManager), m_Mtid(mtid), m_Cid(cid), m_Timing(componentManager.m_DispatchTiming), m_StartTime(0.0)
+	{
+		if (m_Timing)
+			m_StartTime = timer_Time();
+	}
+
+	~CDispatchStatsSample()
+	{
+		CComponentManager::DispatchStats& stats = m_ComponentManager.GetCurrentDispatchStats(m_Mtid, m_Cid);
+		++stats.calls;
+		if (m_Timing)
+			stats.time += timer_Time() - m_StartTime;
+	}
+
+private:
+	const CComponentManager& m_ComponentManager;
+	CComponentManager::MessageTypeId m_Mtid;
+	CComponentManager::ComponentTypeId m_Cid;
+	bool m_Timing;
+	double m_StartTime;
+};
 
 /**
  * Used for script-only message types.
@@ -52,10 +101,19 @@ public:
 	CScriptValRooted msg;
 };
 
+/**
+ * Comparison for binary searching the per-type component lists by entity ID.
+ */
+struct CompareEntityId
+{
+	bool operator()(const std::pair<entity_id_t, IComponent*>& a, entity_id_t b) const { return a.first < b; }
+	bool operator()(entity_id_t a, const std::pair<entity_id_t, IComponent*>& b) const { return a < b.first; }
+};
+
 CComponentManager::CComponentManager(CSimContext& context, bool skipScriptFunctions) :
 	m_NextScriptComponentTypeId(CID__LastNative),
 	m_ScriptInterface("Engine", "Simulation", ScriptInterface::CreateRuntime()),
-	m_SimContext(context), m_CurrentlyHotloading(false)
+	m_SimContext(context), m_CurrentlyHotloading(false), m_DispatchTiming(false)
 {
 	context.SetComponentManager(this);
 
@@ -194,17 +252,17 @@ void CComponentManager::Script_RegisterComponentType(void* cbdata, int iid, std:
 		}
 
 		// Remove the old component type's message subscriptions
-		std::map<MessageTypeId, std::vector<ComponentTypeId> >::iterator it;
+		std::vector<std::vector<ComponentTypeId> >::iterator it;
 		for (it = componentManager->m_LocalMessageSubscriptions.begin(); it != componentManager->m_LocalMessageSubscriptions.end(); ++it)
 		{
-			std::vector<ComponentTypeId>& types = it->second;
+			std::vector<ComponentTypeId>& types = *it;
 			std::vector<ComponentTypeId>::iterator ctit = find(types.begin(), types.end(), cid);
 			if (ctit != types.end())
 				types.erase(ctit);
 		}
 		for (it = componentManager->m_GlobalMessageSubscriptions.begin(); it != componentManager->m_GlobalMessageSubscriptions.end(); ++it)
 		{
-			std::vector<ComponentTypeId>& types = it->second;
+			std::vector<ComponentTypeId>& types = *it;
 			std::vector<ComponentTypeId>::iterator ctit = find(types.begin(), types.end(), cid);
 			if (ctit != types.end())
 				types.erase(ctit);
@@ -234,6 +292,7 @@ void CComponentManager::Script_RegisterComponentType(void* cbdata, int iid, std:
 		CScriptValRooted(componentManager->m_ScriptInterface.GetContext(), ctor)
 	};
 	componentManager->m_ComponentTypesById[cid] = ct;
+	componentManager->AddComponentTypeStorage(cid);
 
 	componentManager->m_CurrentComponent = cid; // needed by Subscribe
 
@@ -280,8 +339,8 @@ void CComponentManager::Script_RegisterComponentType(void* cbdata, int iid, std:
 	{
 		// For every script component with this cid, we need to switch its
 		// prototype from the old constructor's prototype property to the new one's
-		const std::map<entity_id_t, IComponent*>& comps = componentManager->m_ComponentsByTypeId[cid];
-		std::map<entity_id_t, IComponent*>::const_iterator eit = comps.begin();
+		const ComponentList& comps = componentManager->m_ComponentsByTypeId[cid];
+		ComponentList::const_iterator eit = comps.begin();
 		for (; eit != comps.end(); ++eit)
 		{
 			jsval instance = eit->second->GetJSInstance();
@@ -447,23 +506,21 @@ void CComponentManager::Script_DestroyEntity(void* cbdata, int ent)
 void CComponentManager::ResetState()
 {
 	// Delete all IComponents
-	std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::iterator iit = m_ComponentsByTypeId.begin();
-	for (; iit != m_ComponentsByTypeId.end(); ++iit)
+	for (size_t cid = 0; cid < m_ComponentsByTypeId.size(); ++cid)
 	{
-		std::map<entity_id_t, IComponent*>::iterator eit = iit->second.begin();
-		for (; eit != iit->second.end(); ++eit)
+		ComponentList& comps = m_ComponentsByTypeId[cid];
+		for (ComponentList::iterator eit = comps.begin(); eit != comps.end(); ++eit)
 		{
 			eit->second->Deinit();
-			m_ComponentTypesById[iit->first].dealloc(eit->second);
+			m_ComponentTypesById[(ComponentTypeId)cid].dealloc(eit->second);
 		}
+		comps.clear();
 	}
 
 	std::vector<boost::unordered_map<entity_id_t, IComponent*> >::iterator ifcit = m_ComponentsByInterface.begin();
 	for (; ifcit != m_ComponentsByInterface.end(); ++ifcit)
 		ifcit->clear();
 
-	m_ComponentsByTypeId.clear();
-
 	m_DestructionQueue.clear();
 
 	// Reset IDs
@@ -477,6 +534,7 @@ void CComponentManager::RegisterComponentType(InterfaceId iid, ComponentTypeId c
 	ComponentType c = { CT_Native, iid, alloc, dealloc, name, schema, CScriptValRooted() };
 	m_ComponentTypesById.insert(std::make_pair(cid, c));
 	m_ComponentTypeIdsByName[name] = cid;
+	AddComponentTypeStorage(cid);
 }
 
 void CComponentManager::RegisterComponentTypeScriptWrapper(InterfaceId iid, ComponentTypeId cid, AllocFunc alloc,
@@ -485,19 +543,71 @@ void CComponentManager::RegisterComponentTypeScriptWrapper(InterfaceId iid, Comp
 	ComponentType c = { CT_ScriptWrapper, iid, alloc, dealloc, name, schema, CScriptValRooted() };
 	m_ComponentTypesById.insert(std::make_pair(cid, c));
 	m_ComponentTypeIdsByName[name] = cid;
+	AddComponentTypeStorage(cid);
 	// TODO: merge with RegisterComponentType
 }
 
+void CComponentManager::AddComponentTypeStorage(ComponentTypeId cid)
+{
+	ENSURE(cid >= 0);
+	if ((size_t)cid >= m_ComponentsByTypeId.size())
+	{
+		m_ComponentsByTypeId.resize(cid+1);
+		ComponentTypeDispatch dispatch = { false };
+		m_ComponentTypeDispatch.resize(cid+1, dispatch);
+	}
+
+	// (This gets called again when a script component type is hotloaded)
+	const ComponentType& ct = m_ComponentTypesById[cid];
+	m_ComponentTypeDispatch[cid].isScript = (ct.type == CT_Script);
+}
+
 void CComponentManager::RegisterMessageType(MessageTypeId mtid, const char* name)
 {
 	m_MessageTypeIdsByName[name] = mtid;
 	m_MessageTypeNamesById[mtid] = name;
+
+	ENSURE(mtid >= 0);
+	if ((size_t)mtid >= m_MessageTypeProfileNames.size())
+		m_MessageTypeProfileNames.resize(mtid+1, "message");
+	m_MessageTypeProfileNames[mtid] = InternProfileName("message " + std::string(name));
+}
+
+const char* CComponentManager::GetMessageProfileName(MessageTypeId mtid) const
+{
+	if ((size_t)mtid < m_MessageTypeProfileNames.size())
+		return m_MessageTypeProfileNames[mtid];
+	return "message";
+}
+
+CComponentManager::DispatchStats& CComponentManager::GetCurrentDispatchStats(MessageTypeId mtid, ComponentTypeId cid) const
+{
+	if ((size_t)mtid >= m_DispatchStats.size())
+		m_DispatchStats.resize(mtid+1);
+	std::vector<DispatchStats>& stats = m_DispatchStats[mtid];
+	if ((size_t)cid >= stats.size())
+		stats.resize(cid+1);
+	return stats[cid];
+}
+
+void CComponentManager::SetDispatchTiming(bool enabled)
+{
+	m_DispatchTiming = enabled;
+}
+
+void CComponentManager::TurnDispatchStats()
+{
+	m_LastTurnDispatchStats.swap(m_DispatchStats);
+	m_DispatchStats.clear();
 }
 
 void CComponentManager::SubscribeToMessageType(MessageTypeId mtid)
 {
 	// TODO: verify mtid
 	ENSURE(m_CurrentComponent != CID__Invalid);
+	ENSURE(mtid >= 0);
+	if ((size_t)mtid >= m_LocalMessageSubscriptions.size())
+		m_LocalMessageSubscriptions.resize(mtid+1);
 	std::vector<ComponentTypeId>& types = m_LocalMessageSubscriptions[mtid];
 	types.push_back(m_CurrentComponent);
 	std::sort(types.begin(), types.end()); // TODO: just sort once at the end of LoadComponents
@@ -507,6 +617,9 @@ void CComponentManager::SubscribeGloballyToMessageType(MessageTypeId mtid)
 {
 	// TODO: verify mtid
 	ENSURE(m_CurrentComponent != CID__Invalid);
+	ENSURE(mtid >= 0);
+	if ((size_t)mtid >= m_GlobalMessageSubscriptions.size())
+		m_GlobalMessageSubscriptions.resize(mtid+1);
 	std::vector<ComponentTypeId>& types = m_GlobalMessageSubscriptions[mtid];
 	types.push_back(m_CurrentComponent);
 	std::sort(types.begin(), types.end()); // TODO: just sort once at the end of LoadComponents
@@ -528,6 +641,14 @@ std::string CComponentManager::LookupComponentTypeName(ComponentTypeId cid) cons
 	return it->second.name;
 }
 
+std::string CComponentManager::LookupMessageTypeName(MessageTypeId mtid) const
+{
+	std::map<MessageTypeId, std::string>::const_iterator it = m_MessageTypeNamesById.find(mtid);
+	if (it == m_MessageTypeNamesById.end())
+		return "";
+	return it->second;
+}
+
 CComponentManager::ComponentTypeId CComponentManager::GetScriptWrapper(InterfaceId iid)
 {
 	if (iid >= IID__LastNative && iid <= (int)m_InterfaceIdsByName.size()) // use <= since IDs start at 1
@@ -599,7 +720,8 @@ IComponent* CComponentManager::ConstructComponent(entity_id_t ent, ComponentType
 		return NULL;
 	}
 
-	std::map<entity_id_t, IComponent*>& emap2 = m_ComponentsByTypeId[cid];
+	ENSURE((size_t)cid < m_ComponentsByTypeId.size());
+	ComponentList& emap2 = m_ComponentsByTypeId[cid];
 
 	// If this is a scripted component, construct the appropriate JS object first
 	jsval obj = JSVAL_NULL;
@@ -622,7 +744,8 @@ IComponent* CComponentManager::ConstructComponent(entity_id_t ent, ComponentType
 
 	// Store a reference to the new component
 	emap1.insert(std::make_pair(ent, component));
-	emap2.insert(std::make_pair(ent, component));
+	// (New entity IDs are usually the highest so far, so this is normally a push_back)
+	emap2.insert(std::lower_bound(emap2.begin(), emap2.end(), ent, CompareEntityId()), std::make_pair(ent, component));
 	// TODO: We need to more careful about this - if an entity is constructed by a component
 	// while we're iterating over all components, this will invalidate the iterators and everything
 	// will break.
@@ -708,15 +831,15 @@ void CComponentManager::FlushDestroyedComponents()
 		PostMessage(ent, msg);
 
 		// Destroy the components, and remove from m_ComponentsByTypeId:
-		std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::iterator iit = m_ComponentsByTypeId.begin();
-		for (; iit != m_ComponentsByTypeId.end(); ++iit)
+		for (size_t cid = 0; cid < m_ComponentsByTypeId.size(); ++cid)
 		{
-			std::map<entity_id_t, IComponent*>::iterator eit = iit->second.find(ent);
-			if (eit != iit->second.end())
+			ComponentList& comps = m_ComponentsByTypeId[cid];
+			ComponentList::iterator eit = std::lower_bound(comps.begin(), comps.end(), ent, CompareEntityId());
+			if (eit != comps.end() && eit->first == ent)
 			{
 				eit->second->Deinit();
-				m_ComponentTypesById[iit->first].dealloc(eit->second);
-				iit->second.erase(ent);
+				m_ComponentTypesById[(ComponentTypeId)cid].dealloc(eit->second);
+				comps.erase(eit);
 			}
 		}
 
@@ -782,23 +905,25 @@ const CComponentManager::InterfaceListUnordered& CComponentManager::GetEntitiesW
 
 void CComponentManager::PostMessage(entity_id_t ent, const CMessage& msg) const
 {
+	// Profile each message type; the dispatches to each component type that handles
+	// it are counted separately (see GetDispatchStats), which is much cheaper than a
+	// profiler node per handler call
+	PROFILE(GetMessageProfileName(msg.GetType()));
+
 	// Send the message to components of ent, that subscribed locally to this message
-	std::map<MessageTypeId, std::vector<ComponentTypeId> >::const_iterator it;
-	it = m_LocalMessageSubscriptions.find(msg.GetType());
-	if (it != m_LocalMessageSubscriptions.end())
+	if ((size_t)msg.GetType() < m_LocalMessageSubscriptions.size())
 	{
-		std::vector<ComponentTypeId>::const_iterator ctit = it->second.begin();
-		for (; ctit != it->second.end(); ++ctit)
+		const std::vector<ComponentTypeId>& types = m_LocalMessageSubscriptions[msg.GetType()];
+		for (std::vector<ComponentTypeId>::const_iterator ctit = types.begin(); ctit != types.end(); ++ctit)
 		{
-			// Find the component instances of this type (if any)
-			std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator emap = m_ComponentsByTypeId.find(*ctit);
-			if (emap == m_ComponentsByTypeId.end())
-				continue;
-
-			// Send the message to all of them
-			std::map<entity_id_t, IComponent*>::const_iterator eit = emap->second.find(ent);
-			if (eit != emap->second.end())
+			// Find the component instance of this type (if any)
+			const ComponentList& comps = m_ComponentsByTypeId[*ctit];
+			ComponentList::const_iterator eit = std::lower_bound(comps.begin(), comps.end(), ent, CompareEntityId());
+			if (eit != comps.end() && eit->first == ent)
+			{
+				CDispatchStatsSample sample(*this, msg.GetType(), *ctit);
 				eit->second->HandleMessage(msg, false);
+			}
 		}
 	}
 
@@ -807,24 +932,14 @@ void CComponentManager::PostMessage(entity_id_t ent, const CMessage& msg) const
 
 void CComponentManager::BroadcastMessage(const CMessage& msg) const
 {
+	PROFILE(GetMessageProfileName(msg.GetType()));
+
 	// Send the message to components of all entities that subscribed locally to this message
-	std::map<MessageTypeId, std::vector<ComponentTypeId> >::const_iterator it;
-	it = m_LocalMessageSubscriptions.find(msg.GetType());
-	if (it != m_LocalMessageSubscriptions.end())
+	if ((size_t)msg.GetType() < m_LocalMessageSubscriptions.size())
 	{
-		std::vector<ComponentTypeId>::const_iterator ctit = it->second.begin();
-		for (; ctit != it->second.end(); ++ctit)
-		{
-			// Find the component instances of this type (if any)
-			std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator emap = m_ComponentsByTypeId.find(*ctit);
-			if (emap == m_ComponentsByTypeId.end())
-				continue;
-
-			// Send the message to all of them
-			std::map<entity_id_t, IComponent*>::const_iterator eit = emap->second.begin();
-			for (; eit != emap->second.end(); ++eit)
-				eit->second->HandleMessage(msg, false);
-		}
+		const std::vector<ComponentTypeId>& types = m_LocalMessageSubscriptions[msg.GetType()];
+		for (std::vector<ComponentTypeId>::const_iterator ctit = types.begin(); ctit != types.end(); ++ctit)
+			SendMessageToComponents(*ctit, msg, false);
 	}
 
 	SendGlobalMessage(INVALID_ENTITY, msg);
@@ -835,36 +950,47 @@ void CComponentManager::SendGlobalMessage(entity_id_t ent, const CMessage& msg)
 	// (Common functionality for PostMessage and BroadcastMessage)
 
 	// Send the message to components of all entities that subscribed globally to this message
-	std::map<MessageTypeId, std::vector<ComponentTypeId> >::const_iterator it;
-	it = m_GlobalMessageSubscriptions.find(msg.GetType());
-	if (it != m_GlobalMessageSubscriptions.end())
+	if ((size_t)msg.GetType() < m_GlobalMessageSubscriptions.size())
 	{
-		std::vector<ComponentTypeId>::const_iterator ctit = it->second.begin();
-		for (; ctit != it->second.end(); ++ctit)
+		const std::vector<ComponentTypeId>& types = m_GlobalMessageSubscriptions[msg.GetType()];
+		for (std::vector<ComponentTypeId>::const_iterator ctit = types.begin(); ctit != types.end(); ++ctit)
 		{
 			// Special case: Messages for non-local entities shouldn't be sent to script
 			// components that subscribed globally, so that we don't have to worry about
 			// them accidentally picking up non-network-synchronised data.
-			if (ENTITY_IS_LOCAL(ent))
-			{
-				std::map<ComponentTypeId, ComponentType>::const_iterator it = m_ComponentTypesById.find(*ctit);
-				if (it != m_ComponentTypesById.end() && it->second.type == CT_Script)
-					continue;
-			}
-
-			// Find the component instances of this type (if any)
-			std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator emap = m_ComponentsByTypeId.find(*ctit);
-			if (emap == m_ComponentsByTypeId.end())
+			if (ENTITY_IS_LOCAL(ent) && m_ComponentTypeDispatch[*ctit].isScript)
 				continue;
 
-			// Send the message to all of them
-			std::map<entity_id_t, IComponent*>::const_iterator eit = emap->second.begin();
-			for (; eit != emap->second.end(); ++eit)
-				eit->second->HandleMessage(msg, true);
+			SendMessageToComponents(*ctit, msg, true);
 		}
 	}
 }
 
+void CComponentManager::SendMessageToComponents(ComponentTypeId cid, const CMessage& msg, bool global) const
+{
+	// Send the message to every component of this type, in order of entity ID.
+	// Message handlers might construct new components (but won't destroy any until
+	// FlushDestroyedComponents), which can move the current one, so iterate by index
+	// and find our place again whenever the list grows. New components with higher
+	// entity IDs than the current one will receive the message too.
+	const ComponentList& comps = m_ComponentsByTypeId[cid];
+	if (comps.empty())
+		return;
+
+	CDispatchStatsSample sample(*this, msg.GetType(), cid);
+
+	for (size_t i = 0; i < comps.size(); ++i)
+	{
+		size_t size = comps.size();
+		entity_id_t ent = comps[i].first;
+
+		comps[i].second->HandleMessage(msg, global);
+
+		if (comps.size() != size)
+			i = std::lower_bound(comps.begin(), comps.end(), ent, CompareEntityId()) - comps.begin();
+	}
+}
+
 
 std::string CComponentManager::GenerateSchema()
 {
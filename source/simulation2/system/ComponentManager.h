@@ -32,6 +32,7 @@ class IComponent;
 class CParamNode;
 class CMessage;
 class CSimContext;
+struct SSerializedSegment;
 
 class CComponentManager
 {
@@ -117,6 +118,11 @@ public:
 	 */
 	std::string LookupComponentTypeName(ComponentTypeId cid) const;
 
+	/**
+	 * @return The name of the given message type, or "" if not found
+	 */
+	std::string LookupMessageTypeName(MessageTypeId mtid) const;
+
 	/**
 	 * Returns a new entity ID that has never been used before.
 	 * This affects the simulation state so it must only be called in network-synchronised ways.
@@ -206,12 +212,45 @@ public:
 	 */
 	void ResetState();
 
+	/**
+	 * Number of times one message type was dispatched to one component type, and the
+	 * time spent in those components' handlers (including any messages they sent).
+	 * A broadcast counts as one dispatch per component type, not per component.
+	 */
+	struct DispatchStats
+	{
+		DispatchStats() : calls(0), time(0.0) { }
+		u32 calls;
+		double time; // seconds; only measured when dispatch timing is enabled
+	};
+
+	/**
+	 * Dispatches are always counted, but timing them costs a couple of timer reads per
+	 * handler call, so it's disabled by default.
+	 */
+	void SetDispatchTiming(bool enabled);
+	bool GetDispatchTiming() const { return m_DispatchTiming; }
+
+	/**
+	 * Ends the current turn's dispatch statistics, so they are returned by
+	 * GetDispatchStats, and starts counting a new turn.
+	 */
+	void TurnDispatchStats();
+
+	/**
+	 * @return the last completed turn's dispatch statistics, indexed by
+	 * [MessageTypeId][ComponentTypeId] (either may be out of range if there were no calls)
+	 */
+	const std::vector<std::vector<DispatchStats> >& GetDispatchStats() const { return m_LastTurnDispatchStats; }
+
 	// Various state serialization functions:
 	bool ComputeStateHash(std::string& outHash, bool quick);
 	bool DumpDebugState(std::ostream& stream, bool includeDebugInfo);
 	// FlushDestroyedComponents must be called before SerializeState (since the destruction queue
-	// won't get serialized)
-	bool SerializeState(std::ostream& stream);
+	// won't get serialized).
+	// If segments is non-NULL, it receives the position of the header, each component type
+	// and each component in the output (for CSnapshotStore).
+	bool SerializeState(std::ostream& stream, std::vector<SSerializedSegment>* segments = NULL);
 	bool DeserializeState(std::istream& stream);
 
 	std::string GenerateSchema();
@@ -234,8 +273,15 @@ private:
 	static void Script_DestroyEntity(void* cbdata, int ent);
 	static CScriptVal Script_ReadJSONFile(void* cbdata, std::wstring fileName);
 
+	// Components of a single type, sorted by entity ID
+	typedef std::vector<std::pair<entity_id_t, IComponent*> > ComponentList;
+
 	CMessage* ConstructMessage(int mtid, CScriptVal data);
 	void SendGlobalMessage(entity_id_t ent, const CMessage& msg) const;
+	void SendMessageToComponents(ComponentTypeId cid, const CMessage& msg, bool global) const;
+	void AddComponentTypeStorage(ComponentTypeId cid);
+	const char* GetMessageProfileName(MessageTypeId mtid) const;
+	DispatchStats& GetCurrentDispatchStats(MessageTypeId mtid, ComponentTypeId cid) const;
 
 	ComponentTypeId GetScriptWrapper(InterfaceId iid);
 
@@ -248,9 +294,22 @@ private:
 	// TODO: some of these should be vectors
 	std::map<ComponentTypeId, ComponentType> m_ComponentTypesById;
 	std::vector<boost::unordered_map<entity_id_t, IComponent*> > m_ComponentsByInterface; // indexed by InterfaceId
-	std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> > m_ComponentsByTypeId;
-	std::map<MessageTypeId, std::vector<ComponentTypeId> > m_LocalMessageSubscriptions;
-	std::map<MessageTypeId, std::vector<ComponentTypeId> > m_GlobalMessageSubscriptions;
+	std::vector<ComponentList> m_ComponentsByTypeId; // indexed by ComponentTypeId
+	std::vector<std::vector<ComponentTypeId> > m_LocalMessageSubscriptions; // indexed by MessageTypeId; each sorted by ComponentTypeId
+	std::vector<std::vector<ComponentTypeId> > m_GlobalMessageSubscriptions; // indexed by MessageTypeId; each sorted by ComponentTypeId
+
+	// Per-type data needed when dispatching messages, set up when the component type is
+	// registered so that dispatching doesn't need to look in m_ComponentTypesById
+	struct ComponentTypeDispatch
+	{
+		bool isScript;
+	};
+	std::vector<ComponentTypeDispatch> m_ComponentTypeDispatch; // indexed by ComponentTypeId
+	std::vector<const char*> m_MessageTypeProfileNames; // indexed by MessageTypeId; interned so the profiler can keep using them
+
+	bool m_DispatchTiming;
+	mutable std::vector<std::vector<DispatchStats> > m_DispatchStats; // indexed by [MessageTypeId][ComponentTypeId]
+	std::vector<std::vector<DispatchStats> > m_LastTurnDispatchStats;
 	std::map<std::string, ComponentTypeId> m_ComponentTypeIdsByName;
 	std::map<std::string, MessageTypeId> m_MessageTypeIdsByName;
 	std::map<MessageTypeId, std::string> m_MessageTypeNamesById;
@@ -268,6 +327,7 @@ private:
 	boost::rand48 m_RNG;
 
 	friend class TestComponentManager;
+	friend class CDispatchStatsSample;
 };
 
 #endif // INCLUDED_COMPONENTMANAGER
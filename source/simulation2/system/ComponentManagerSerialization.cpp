@@ -30,6 +30,7 @@
 
 #include "simulation2/serialization/DebugSerializer.h"
 #include "simulation2/serialization/HashSerializer.h"
+#include "simulation2/serialization/SnapshotStore.h"
 #include "simulation2/serialization/StdSerializer.h"
 #include "simulation2/serialization/StdDeserializer.h"
 
@@ -63,13 +64,12 @@ bool CComponentManager::DumpDebugState(std::ostream& stream, bool includeDebugIn
 	std::map<entity_id_t, std::map<ComponentTypeId, IComponent*> > components;
 	std::map<ComponentTypeId, std::string> names;
 
-	std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator ctit = m_ComponentsByTypeId.begin();
-	for (; ctit != m_ComponentsByTypeId.end(); ++ctit)
+	for (size_t cid = 0; cid < m_ComponentsByTypeId.size(); ++cid)
 	{
-		std::map<entity_id_t, IComponent*>::const_iterator eit = ctit->second.begin();
-		for (; eit != ctit->second.end(); ++eit)
+		ComponentList::const_iterator eit = m_ComponentsByTypeId[cid].begin();
+		for (; eit != m_ComponentsByTypeId[cid].end(); ++eit)
 		{
-			components[eit->first][ctit->first] = eit->second;
+			components[eit->first][(ComponentTypeId)cid] = eit->second;
 		}
 	}
 
@@ -113,16 +113,17 @@ bool CComponentManager::ComputeStateHash(std::string& outHash, bool quick)
 
 	serializer.StringASCII("rng", SerializeRNG(m_RNG), 0, 32);
 
-	std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator cit = m_ComponentsByTypeId.begin();
-	for (; cit != m_ComponentsByTypeId.end(); ++cit)
+	for (size_t cid = 0; cid < m_ComponentsByTypeId.size(); ++cid)
 	{
 		// In quick mode, only check unit positions
-		if (quick && !(cit->first == CID_Position))
+		if (quick && (ComponentTypeId)cid != CID_Position)
 			continue;
 
+		const ComponentList& comps = m_ComponentsByTypeId[cid];
+
 		// Only emit component types if they have a component that will be serialized
 		bool needsSerialization = false;
-		for (std::map<entity_id_t, IComponent*>::const_iterator eit = cit->second.begin(); eit != cit->second.end(); ++eit)
+		for (ComponentList::const_iterator eit = comps.begin(); eit != comps.end(); ++eit)
 		{
 			// Don't serialize local entities
 			if (ENTITY_IS_LOCAL(eit->first))
@@ -135,9 +136,9 @@ bool CComponentManager::ComputeStateHash(std::string& outHash, bool quick)
 		if (!needsSerialization)
 			continue;
 
-		serializer.NumberI32_Unbounded("component type id", cit->first);
+		serializer.NumberI32_Unbounded("component type id", (ComponentTypeId)cid);
 
-		for (std::map<entity_id_t, IComponent*>::const_iterator eit = cit->second.begin(); eit != cit->second.end(); ++eit)
+		for (ComponentList::const_iterator eit = comps.begin(); eit != comps.end(); ++eit)
 		{
 			// Don't serialize local entities
 			if (ENTITY_IS_LOCAL(eit->first))
@@ -176,10 +177,20 @@ bool CComponentManager::ComputeStateHash(std::string& outHash, bool quick)
  * version), but it doesn't seem worth having a separate codepath for that.)
  */
 
-bool CComponentManager::SerializeState(std::ostream& stream)
+static void AddSerializedSegment(std::vector<SSerializedSegment>& segments, std::ostream& stream, std::streamoff start, u32 type, u32 entity)
+{
+	SSerializedSegment segment = { type, entity, (u32)(stream.tellp() - start) };
+	segments.push_back(segment);
+}
+
+bool CComponentManager::SerializeState(std::ostream& stream, std::vector<SSerializedSegment>* segments)
 {
 	CStdSerializer serializer(m_ScriptInterface, stream);
 
+	std::streamoff start = stream.tellp();
+	if (segments)
+		AddSerializedSegment(*segments, stream, start, SSerializedSegment::HEADER, 0);
+
 	// We don't serialize the destruction queue, since we'd have to be careful to skip local entities etc
 	// and it's (hopefully) easier to just expect callers to flush the queue before serializing
 	ENSURE(m_DestructionQueue.empty());
@@ -187,16 +198,16 @@ bool CComponentManager::SerializeState(std::ostream& stream)
 	serializer.StringASCII("rng", SerializeRNG(m_RNG), 0, 32);
 	serializer.NumberU32_Unbounded("next entity id", m_NextEntityId);
 
-	std::map<ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator cit;
-	
 	uint32_t numComponentTypes = 0;
 	std::set<ComponentTypeId> serializedComponentTypes;
 
-	for (cit = m_ComponentsByTypeId.begin(); cit != m_ComponentsByTypeId.end(); ++cit)
+	for (size_t cid = 0; cid < m_ComponentsByTypeId.size(); ++cid)
 	{
+		const ComponentList& comps = m_ComponentsByTypeId[cid];
+
 		// Only emit component types if they have a component that will be serialized
 		bool needsSerialization = false;
-		for (std::map<entity_id_t, IComponent*>::const_iterator eit = cit->second.begin(); eit != cit->second.end(); ++eit)
+		for (ComponentList::const_iterator eit = comps.begin(); eit != comps.end(); ++eit)
 		{
 			// Don't serialize local entities
 			if (ENTITY_IS_LOCAL(eit->first))
@@ -210,28 +221,33 @@ bool CComponentManager::SerializeState(std::ostream& stream)
 			continue;
 
 		numComponentTypes++;
-		serializedComponentTypes.insert(cit->first);
+		serializedComponentTypes.insert((ComponentTypeId)cid);
 	}
 
 	serializer.NumberU32_Unbounded("num component types", numComponentTypes);
 
-	for (cit = m_ComponentsByTypeId.begin(); cit != m_ComponentsByTypeId.end(); ++cit)
+	for (size_t cid = 0; cid < m_ComponentsByTypeId.size(); ++cid)
 	{
-		if (serializedComponentTypes.find(cit->first) == serializedComponentTypes.end())
+		if (serializedComponentTypes.find((ComponentTypeId)cid) == serializedComponentTypes.end())
 			continue;
 
-		std::map<ComponentTypeId, ComponentType>::const_iterator ctit = m_ComponentTypesById.find(cit->first);
+		const ComponentList& comps = m_ComponentsByTypeId[cid];
+
+		std::map<ComponentTypeId, ComponentType>::const_iterator ctit = m_ComponentTypesById.find((ComponentTypeId)cid);
 		if (ctit == m_ComponentTypesById.end())
 		{
 			debug_warn(L"Invalid ctit"); // this should never happen
 			return false;
 		}
 
+		if (segments)
+			AddSerializedSegment(*segments, stream, start, (u32)cid, 0);
+
 		serializer.StringASCII("name", ctit->second.name, 0, 255);
 
 		// Count the components before serializing any of them
 		uint32_t numComponents = 0;
-		for (std::map<entity_id_t, IComponent*>::const_iterator eit = cit->second.begin(); eit != cit->second.end(); ++eit)
+		for (ComponentList::const_iterator eit = comps.begin(); eit != comps.end(); ++eit)
 		{
 			// Don't serialize local entities
 			if (ENTITY_IS_LOCAL(eit->first))
@@ -244,12 +260,15 @@ bool CComponentManager::SerializeState(std::ostream& stream)
 		serializer.NumberU32_Unbounded("num components", numComponents);
 
 		// Serialize the components now
-		for (std::map<entity_id_t, IComponent*>::const_iterator eit = cit->second.begin(); eit != cit->second.end(); ++eit)
+		for (ComponentList::const_iterator eit = comps.begin(); eit != comps.end(); ++eit)
 		{
 			// Don't serialize local entities
 			if (ENTITY_IS_LOCAL(eit->first))
 				continue;
 
+			if (segments)
+				AddSerializedSegment(*segments, stream, start, (u32)cid, eit->first);
+
 			serializer.NumberU32_Unbounded("entity id", eit->first);
 			eit->second->Serialize(serializer);
 		}
@@ -0,0 +1,153 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "precompiled.h"
+
+#include "DispatchStats.h"
+
+#include "simulation2/system/ComponentManager.h"
+
+CDispatchStatsTable* g_DispatchStatsTable;
+
+enum
+{
+	Col_Message,
+	Col_Component,
+	Col_Calls,
+	Col_Time,
+	NumberColumns
+};
+
+CDispatchStatsTable::CDispatchStatsTable() :
+	m_Timing(false)
+{
+	m_ColumnDescriptions.push_back(ProfileColumn("Message", 180));
+	m_ColumnDescriptions.push_back(ProfileColumn("Component", 180));
+	m_ColumnDescriptions.push_back(ProfileColumn("calls/turn", 80));
+	m_ColumnDescriptions.push_back(ProfileColumn("msec/turn", 80));
+}
+
+void CDispatchStatsTable::Add(CComponentManager* componentManager)
+{
+	componentManager->SetDispatchTiming(m_Timing);
+	m_ComponentManagers.push_back(componentManager);
+}
+
+void CDispatchStatsTable::Remove(CComponentManager* componentManager)
+{
+	for (size_t i = 0; i < m_ComponentManagers.size(); )
+	{
+		if (m_ComponentManagers[i] == componentManager)
+			m_ComponentManagers.erase(m_ComponentManagers.begin() + i);
+		else
+			++i;
+	}
+}
+
+void CDispatchStatsTable::SetTiming(bool enabled)
+{
+	m_Timing = enabled;
+	for (size_t i = 0; i < m_ComponentManagers.size(); ++i)
+		m_ComponentManagers[i]->SetDispatchTiming(enabled);
+}
+
+CStr CDispatchStatsTable::GetName()
+{
+	return "dispatch";
+}
+
+CStr CDispatchStatsTable::GetTitle()
+{
+	return "Message dispatch";
+}
+
+struct SortDispatchRows
+{
+	template<typename T>
+	bool operator()(const T& a, const T& b) const
+	{
+		if (a.time != b.time)
+			return a.time > b.time;
+		return a.calls > b.calls;
+	}
+};
+
+void CDispatchStatsTable::UpdateRows()
+{
+	m_Rows.clear();
+	if (m_ComponentManagers.empty())
+		return;
+
+	const std::vector<std::vector<CComponentManager::DispatchStats> >& stats = m_ComponentManagers.back()->GetDispatchStats();
+	for (size_t mtid = 0; mtid < stats.size(); ++mtid)
+	{
+		for (size_t cid = 0; cid < stats[mtid].size(); ++cid)
+		{
+			if (stats[mtid][cid].calls == 0)
+				continue;
+			Row row = { (int)mtid, (int)cid, stats[mtid][cid].calls, stats[mtid][cid].time };
+			m_Rows.push_back(row);
+		}
+	}
+
+	// Most expensive first (or most frequent, if not timing)
+	std::sort(m_Rows.begin(), m_Rows.end(), SortDispatchRows());
+}
+
+size_t CDispatchStatsTable::GetNumberRows()
+{
+	// The viewer asks for the number of rows before reading them, so refresh here
+	UpdateRows();
+	return m_Rows.size();
+}
+
+const std::vector<ProfileColumn>& CDispatchStatsTable::GetColumns()
+{
+	return m_ColumnDescriptions;
+}
+
+CStr CDispatchStatsTable::GetCellText(size_t row, size_t col)
+{
+	if (row >= m_Rows.size() || m_ComponentManagers.empty())
+		return "???";
+
+	const Row& r = m_Rows[row];
+	switch (col)
+	{
+	case Col_Message:
+		return m_ComponentManagers.back()->LookupMessageTypeName(r.mtid);
+	case Col_Component:
+		return m_ComponentManagers.back()->LookupComponentTypeName(r.cid);
+	case Col_Calls:
+		return CStr::FromUInt(r.calls);
+	case Col_Time:
+	{
+		if (!m_ComponentManagers.back()->GetDispatchTiming())
+			return "-";
+		char buf[32];
+		sprintf_s(buf, ARRAY_SIZE(buf), "%.3f", r.time * 1000.0);
+		return CStr(buf);
+	}
+	default:
+		return "???";
+	}
+}
+
+AbstractProfileTable* CDispatchStatsTable::GetChild(size_t UNUSED(row))
+{
+	return 0;
+}
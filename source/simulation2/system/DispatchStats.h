@@ -0,0 +1,76 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDED_DISPATCHSTATS
+#define INCLUDED_DISPATCHSTATS
+
+#include "ps/ProfileViewer.h"
+
+class CComponentManager;
+
+/**
+ * Profiler table showing how many times each message type was dispatched to
+ * each component type during the last simulation turn, and how long the
+ * handlers took (see CComponentManager::GetDispatchStats).
+ */
+class CDispatchStatsTable : public AbstractProfileTable
+{
+	NONCOPYABLE(CDispatchStatsTable);
+public:
+	CDispatchStatsTable();
+
+	/**
+	 * Shows the given component manager's statistics, until it is removed.
+	 * (If there are several, the last one added is shown.)
+	 */
+	void Add(CComponentManager* componentManager);
+	void Remove(CComponentManager* componentManager);
+
+	/**
+	 * Enables timing of message handlers in current and future component managers.
+	 */
+	void SetTiming(bool enabled);
+
+	virtual CStr GetName();
+	virtual CStr GetTitle();
+	virtual size_t GetNumberRows();
+	virtual const std::vector<ProfileColumn>& GetColumns();
+	virtual CStr GetCellText(size_t row, size_t col);
+	virtual AbstractProfileTable* GetChild(size_t row);
+
+private:
+	struct Row
+	{
+		int mtid;
+		int cid;
+		u32 calls;
+		double time;
+	};
+
+	void UpdateRows();
+
+	std::vector<CComponentManager*> m_ComponentManagers;
+	bool m_Timing;
+	std::vector<Row> m_Rows;
+	std::vector<ProfileColumn> m_ColumnDescriptions;
+};
+
+// There's normally only one simulation, but it's constructed with each game,
+// so make this a global that the simulation can add itself to
+extern CDispatchStatsTable* g_DispatchStatsTable;
+
+#endif // INCLUDED_DISPATCHSTATS
@@ -23,6 +23,7 @@
 #include "simulation2/system/ParamNode.h"
 #include "simulation2/system/SimContext.h"
 #include "simulation2/serialization/ISerializer.h"
+#include "simulation2/serialization/SnapshotStore.h"
 #include "simulation2/components/ICmpTest.h"
 #include "simulation2/components/ICmpTemplateManager.h"
 
@@ -30,6 +31,8 @@
 #include "ps/Filesystem.h"
 #include "ps/XML/Xeromyces.h"
 
+#include "lib/timer.h"
+
 #define TS_ASSERT_STREAM(stream, len, buffer) \
 	TS_ASSERT_EQUALS(stream.str().length(), (size_t)len); \
 	TS_ASSERT_SAME_DATA(stream.str().data(), buffer, len)
@@ -38,8 +41,60 @@
 #define TS_ASSERT_THROWS_PSERROR(e, t, s) \
 	TS_ASSERT_THROWS_EQUALS(e, const t& ex, std::string(ex.what()), s)
 
+/**
+ * Component that records the order it receives messages in, and can construct
+ * a new component of its own type while handling a message.
+ */
+class CCmpTestOrder : public IComponent
+{
+public:
+	static IComponent* Allocate(ScriptInterface& UNUSED(scriptInterface), jsval UNUSED(instance)) { return new CCmpTestOrder(); }
+	static void Deallocate(IComponent* cmp) { delete static_cast<CCmpTestOrder*> (cmp); }
+
+	CCmpTestOrder() : m_Log(NULL), m_Manager(NULL), m_Cid(CID__Invalid), m_SpawnEnt(INVALID_ENTITY) { }
+
+	virtual void Init(const CParamNode& UNUSED(paramNode)) { }
+	virtual void Deinit() { }
+	virtual void Serialize(ISerializer& UNUSED(serialize)) { }
+	virtual void Deserialize(const CParamNode& UNUSED(paramNode), IDeserializer& UNUSED(deserialize)) { }
+
+	virtual void HandleMessage(const CMessage& UNUSED(msg), bool UNUSED(global))
+	{
+		m_Log->push_back(GetEntityId());
+
+		if (m_SpawnEnt != INVALID_ENTITY)
+		{
+			CCmpTestOrder* cmp = static_cast<CCmpTestOrder*> (m_Manager->ConstructComponent(m_SpawnEnt, m_Cid));
+			cmp->Setup(m_Log, m_Manager, m_Cid);
+			m_SpawnEnt = INVALID_ENTITY;
+		}
+	}
+
+	void Setup(std::vector<entity_id_t>* log, CComponentManager* manager, CComponentManager::ComponentTypeId cid)
+	{
+		m_Log = log;
+		m_Manager = manager;
+		m_Cid = cid;
+	}
+
+	std::vector<entity_id_t>* m_Log;
+	CComponentManager* m_Manager;
+	CComponentManager::ComponentTypeId m_Cid;
+	entity_id_t m_SpawnEnt;
+};
+
 class TestComponentManager : public CxxTest::TestSuite
 {
+	CComponentManager::ComponentTypeId RegisterTestOrder(CComponentManager& man)
+	{
+		CComponentManager::ComponentTypeId cid = man.m_NextScriptComponentTypeId++;
+		man.RegisterComponentType(IID_Test1, cid, CCmpTestOrder::Allocate, CCmpTestOrder::Deallocate, "TestOrder", "<empty/>");
+		man.m_CurrentComponent = cid;
+		man.SubscribeToMessageType(MT_Update);
+		man.m_CurrentComponent = CID__Invalid;
+		return cid;
+	}
+
 public:
 	void setUp()
 	{
@@ -211,6 +266,88 @@ public:
 		TS_ASSERT_EQUALS(static_cast<ICmpTest2*> (man.QueryInterface(ent4, IID_Test2))->GetX(), 21150);
 	}
 
+	void test_SendMessage_order()
+	{
+		CSimContext context;
+		CComponentManager man(context);
+		man.LoadComponentTypes();
+		CComponentManager::ComponentTypeId cid = RegisterTestOrder(man);
+
+		std::vector<entity_id_t> log;
+
+		// Add the components out of order
+		entity_id_t ents[] = { 30, 10, 40, 20 };
+		for (size_t i = 0; i < ARRAY_SIZE(ents); ++i)
+		{
+			CCmpTestOrder* cmp = static_cast<CCmpTestOrder*> (man.ConstructComponent(ents[i], cid));
+			cmp->Setup(&log, &man, cid);
+			if (ents[i] == 20)
+				cmp->m_SpawnEnt = 25; // after the current entity, so it gets this message too
+			if (ents[i] == 30)
+				cmp->m_SpawnEnt = 5; // before the current entity, so it doesn't
+		}
+
+		// Messages are received in order of entity ID
+		CMessageUpdate msg(fixed::FromInt(1));
+		man.BroadcastMessage(msg);
+		entity_id_t expected1[] = { 10, 20, 25, 30, 40 };
+		TS_ASSERT_EQUALS(log, std::vector<entity_id_t>(expected1, expected1 + ARRAY_SIZE(expected1)));
+
+		log.clear();
+		man.BroadcastMessage(msg);
+		entity_id_t expected2[] = { 5, 10, 20, 25, 30, 40 };
+		TS_ASSERT_EQUALS(log, std::vector<entity_id_t>(expected2, expected2 + ARRAY_SIZE(expected2)));
+
+		log.clear();
+		man.PostMessage(25, msg);
+		man.DestroyComponentsSoon(20);
+		man.FlushDestroyedComponents();
+		man.BroadcastMessage(msg);
+		entity_id_t expected3[] = { 25, 5, 10, 25, 30, 40 };
+		TS_ASSERT_EQUALS(log, std::vector<entity_id_t>(expected3, expected3 + ARRAY_SIZE(expected3)));
+	}
+
+	void test_DispatchStats()
+	{
+		CSimContext context;
+		CComponentManager man(context);
+		man.LoadComponentTypes();
+		man.SetDispatchTiming(true);
+
+		CParamNode noParam;
+		man.AddComponent(1, CID_Test1A, noParam);
+		man.AddComponent(2, CID_Test1B, noParam);
+		man.AddComponent(3, CID_Test2A, noParam);
+		man.AddComponent(4, CID_Test1A, noParam);
+
+		CMessageTurnStart msg1;
+		CMessageInterpolate msg3(0, 0);
+
+		// Test_1A, Test_2A subscribed locally to msg1; Test_1A locally and Test_1B globally to msg3
+		man.PostMessage(1, msg1);
+		man.BroadcastMessage(msg1);
+		man.BroadcastMessage(msg3);
+
+		// Nothing is reported until the turn ends
+		TS_ASSERT(man.GetDispatchStats().empty());
+		man.TurnDispatchStats();
+
+		const std::vector<std::vector<CComponentManager::DispatchStats> >& stats = man.GetDispatchStats();
+		TS_ASSERT_LESS_THAN((size_t)MT_Interpolate, stats.size());
+		TS_ASSERT_LESS_THAN((size_t)CID_Test2A, stats[MT_TurnStart].size());
+		TS_ASSERT_EQUALS(stats[MT_TurnStart][CID_Test1A].calls, 2u); // one post, one broadcast to both components
+		TS_ASSERT_EQUALS(stats[MT_TurnStart][CID_Test1B].calls, 0u);
+		TS_ASSERT_EQUALS(stats[MT_TurnStart][CID_Test2A].calls, 1u);
+		TS_ASSERT_LESS_THAN((size_t)CID_Test1B, stats[MT_Interpolate].size());
+		TS_ASSERT_EQUALS(stats[MT_Interpolate][CID_Test1A].calls, 1u);
+		TS_ASSERT_EQUALS(stats[MT_Interpolate][CID_Test1B].calls, 1u);
+		TS_ASSERT_LESS_THAN_EQUALS(0.0, stats[MT_TurnStart][CID_Test1A].time);
+
+		// The next turn starts counting from zero
+		man.TurnDispatchStats();
+		TS_ASSERT(man.GetDispatchStats().empty());
+	}
+
 	void test_ParamNode()
 	{
 		CSimContext context;
@@ -610,6 +747,26 @@ public:
 				"\x08\x52\x00\x00" // 21000
 		);
 
+		std::stringstream segmentedStream;
+		std::vector<SSerializedSegment> segments;
+		TS_ASSERT(man.SerializeState(segmentedStream, &segments));
+		TS_ASSERT_EQUALS(segmentedStream.str(), stateStream.str());
+		TS_ASSERT_EQUALS(segments.size(), (size_t)6);
+		u32 expectedSegments[6][3] = {
+			{ SSerializedSegment::HEADER, 0, 0 },
+			{ CID_Test1A, 0, 17 },
+			{ CID_Test1A, 1, 31 },
+			{ CID_Test1A, 2, 39 },
+			{ CID_Test2A, 0, 47 },
+			{ CID_Test2A, 1, 61 },
+		};
+		for (size_t i = 0; i < segments.size() && i < 6; ++i)
+		{
+			TS_ASSERT_EQUALS(segments[i].type, expectedSegments[i][0]);
+			TS_ASSERT_EQUALS(segments[i].entity, expectedSegments[i][1]);
+			TS_ASSERT_EQUALS(segments[i].offset, expectedSegments[i][2]);
+		}
+
 		CSimContext context2;
 		CComponentManager man2(context2);
 		man2.LoadComponentTypes();
@@ -760,4 +917,64 @@ public:
 		TS_ASSERT(man2.DeserializeState(stateStream));
 		TS_ASSERT_EQUALS(static_cast<ICmpTest1*> (man2.QueryInterface(ent2, IID_Test1))->GetX(), 12347);
 	}
+
+	// Compares BroadcastMessage against the old dispatch through nested std::maps
+	// (component type -> entity -> component), over 10K entities
+	void test_performance_DISABLED()
+	{
+		CSimContext context;
+		CComponentManager man(context);
+		man.LoadComponentTypes();
+
+		const entity_id_t numEntities = 10000;
+		const size_t numMessages = 100;
+
+		CParamNode noParam;
+		std::map<CComponentManager::ComponentTypeId, std::map<entity_id_t, IComponent*> > componentsByTypeId;
+		for (entity_id_t ent = 2; ent < 2 + numEntities; ++ent)
+		{
+			CComponentManager::ComponentTypeId cid1 = (ent % 2) ? CID_Test1A : CID_Test1B;
+			man.AddComponent(ent, cid1, noParam);
+			man.AddComponent(ent, CID_Test2A, noParam);
+			componentsByTypeId[cid1][ent] = man.QueryInterface(ent, IID_Test1);
+			componentsByTypeId[CID_Test2A][ent] = man.QueryInterface(ent, IID_Test2);
+		}
+
+		std::map<CComponentManager::MessageTypeId, std::vector<CComponentManager::ComponentTypeId> > subscriptions;
+		for (size_t mtid = 0; mtid < man.m_LocalMessageSubscriptions.size(); ++mtid)
+			subscriptions[(CComponentManager::MessageTypeId)mtid] = man.m_LocalMessageSubscriptions[mtid];
+
+		CMessageUpdate msg(fixed::FromInt(1));
+
+		double t = timer_Time();
+		for (size_t n = 0; n < numMessages; ++n)
+		{
+			std::map<CComponentManager::MessageTypeId, std::vector<CComponentManager::ComponentTypeId> >::const_iterator it = subscriptions.find(msg.GetType());
+			if (it == subscriptions.end())
+				continue;
+			for (std::vector<CComponentManager::ComponentTypeId>::const_iterator ctit = it->second.begin(); ctit != it->second.end(); ++ctit)
+			{
+				std::map<CComponentManager::ComponentTypeId, std::map<entity_id_t, IComponent*> >::const_iterator emap = componentsByTypeId.find(*ctit);
+				if (emap == componentsByTypeId.end())
+					continue;
+				for (std::map<entity_id_t, IComponent*>::const_iterator eit = emap->second.begin(); eit != emap->second.end(); ++eit)
+					eit->second->HandleMessage(msg, false);
+			}
+		}
+		t = timer_Time() - t;
+		printf("\nstd::map dispatch: %f us/broadcast\n", 1000000.0*t/numMessages);
+
+		t = timer_Time();
+		for (size_t n = 0; n < numMessages; ++n)
+			man.BroadcastMessage(msg);
+		t = timer_Time() - t;
+		printf("BroadcastMessage: %f us/broadcast\n", 1000000.0*t/numMessages);
+
+		t = timer_Time();
+		for (size_t n = 0; n < numMessages; ++n)
+			for (entity_id_t ent = 2; ent < 2 + numEntities; ent += 100)
+				man.PostMessage(ent, msg);
+		t = timer_Time() - t;
+		printf("PostMessage: %f us/message\n", 1000000.0*t/(numMessages*numEntities/100));
+	}
 };
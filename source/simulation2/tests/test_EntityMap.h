@@ -0,0 +1,91 @@
+/* Copyright (C) 2010 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "simulation2/helpers/EntityMap.h"
+
+class TestEntityMap : public CxxTest::TestSuite
+{
+public:
+	void test_basic()
+	{
+		EntityMap<int> m;
+		TS_ASSERT(m.empty());
+		TS_ASSERT(m.begin() == m.end());
+		TS_ASSERT(m.find(1) == m.end());
+
+		TS_ASSERT(m.insert(std::make_pair((entity_id_t)5, 50)).second);
+		TS_ASSERT(m.insert(std::make_pair((entity_id_t)2, 20)).second);
+		TS_ASSERT(!m.insert(std::make_pair((entity_id_t)5, 51)).second);
+		m[9] = 90;
+		TS_ASSERT_EQUALS(m.size(), (size_t)3);
+
+		TS_ASSERT_EQUALS(m.find(5)->second, 50);
+		TS_ASSERT(m.find(3) == m.end());
+		TS_ASSERT(m.find(100) == m.end());
+
+		// Iteration is in increasing ID order, like std::map
+		EntityMap<int>::const_iterator it = m.begin();
+		TS_ASSERT_EQUALS(it->first, (entity_id_t)2);
+		++it;
+		TS_ASSERT_EQUALS(it->first, (entity_id_t)5);
+		++it;
+		TS_ASSERT_EQUALS(it->first, (entity_id_t)9);
+		++it;
+		TS_ASSERT(it == m.end());
+
+		TS_ASSERT_EQUALS(m.erase(5), (size_t)1);
+		TS_ASSERT_EQUALS(m.erase(5), (size_t)0);
+		m.erase(m.find(2));
+		TS_ASSERT_EQUALS(m.size(), (size_t)1);
+		TS_ASSERT_EQUALS(m.begin()->first, (entity_id_t)9);
+
+		m.clear();
+		TS_ASSERT(m.empty());
+		TS_ASSERT(m.begin() == m.end());
+	}
+
+	void test_random()
+	{
+		EntityMap<int> m;
+		std::map<entity_id_t, int> ref;
+
+		srand(1234);
+		for (int i = 0; i < 10000; ++i)
+		{
+			entity_id_t id = 1 + rand() % 256;
+			if (rand() % 2)
+			{
+				TS_ASSERT_EQUALS(m.insert(std::make_pair(id, i)).second, ref.insert(std::make_pair(id, i)).second);
+			}
+			else
+			{
+				TS_ASSERT_EQUALS(m.erase(id), ref.erase(id));
+			}
+		}
+
+		TS_ASSERT_EQUALS(m.size(), ref.size());
+		std::map<entity_id_t, int>::iterator rit = ref.begin();
+		for (EntityMap<int>::iterator it = m.begin(); it != m.end(); ++it, ++rit)
+		{
+			TS_ASSERT_EQUALS(it->first, rit->first);
+			TS_ASSERT_EQUALS(it->second, rit->second);
+		}
+		TS_ASSERT(rit == ref.end());
+	}
+};
@@ -0,0 +1,139 @@
+/* Copyright (C) 2012 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "simulation2/helpers/LosStrip.h"
+#include "simulation2/components/ICmpRangeManager.h"
+
+#include "maths/Random.h"
+
+#include <boost/random/uniform_int.hpp>
+
+#if ARCH_X86_X64
+# include "lib/sysdep/arch/x86_x64/x86_x64.h"
+#endif
+
+class TestLosStrip : public CxxTest::TestSuite
+{
+	// Reference implementations, with the same per-vertex logic as the
+	// original CCmpRangeManager code
+	static bool addReference(u16* counts, u32* state, size_t n, u32 bits, size_t onWorld0, size_t onWorld1)
+	{
+		bool changed = false;
+		for (size_t k = 0; k < n; ++k)
+		{
+			if (counts[k] == 0 && onWorld0 <= k && k < onWorld1)
+			{
+				changed |= ((state[k] | bits) != state[k]);
+				state[k] |= bits;
+			}
+			counts[k]++;
+		}
+		return changed;
+	}
+
+	static bool removeReference(u16* counts, u32* state, size_t n, u32 bits)
+	{
+		bool changed = false;
+		for (size_t k = 0; k < n; ++k)
+		{
+			counts[k]--;
+			if (counts[k] == 0)
+			{
+				changed |= ((state[k] & ~bits) != state[k]);
+				state[k] &= ~bits;
+			}
+		}
+		return changed;
+	}
+
+	struct Data
+	{
+		std::vector<u16> counts;
+		std::vector<u32> state;
+	};
+
+	// Generates mostly small counts (so there are lots of transitions to and from zero),
+	// and states with a random mix of bits
+	void generate(WELL512& rng, size_t n, u16 minCount, Data& data)
+	{
+		data.counts.resize(n);
+		data.state.resize(n);
+		for (size_t k = 0; k < n; ++k)
+		{
+			data.counts[k] = (u16)boost::uniform_int<>(minCount, 3)(rng);
+			if (boost::uniform_int<>(0, 15)(rng) == 0)
+				data.counts[k] = 60000;
+			data.state[k] = (u32)boost::uniform_int<>(0, 0xFFFF)(rng) << 16 | (u32)boost::uniform_int<>(0, 0xFFFF)(rng);
+		}
+		if (boost::uniform_int<>(0, 3)(rng) == 0)
+			std::fill(data.state.begin(), data.state.end(), 0);
+	}
+
+	void check(LosStrip::AddFunc add, LosStrip::RemoveFunc remove)
+	{
+		WELL512 rng;
+		for (size_t t = 0; t < 2000; ++t)
+		{
+			size_t n = boost::uniform_int<>(0, 80)(rng);
+			size_t offset = boost::uniform_int<>(0, 7)(rng); // test unaligned strips
+			u32 owner = boost::uniform_int<>(1, 16)(rng);
+
+			size_t onWorld0 = boost::uniform_int<>(0, (int)n + 2)(rng);
+			size_t onWorld1 = boost::uniform_int<>(0, (int)n + 2)(rng);
+			if (onWorld1 < onWorld0)
+				std::swap(onWorld0, onWorld1);
+
+			Data data, expected;
+			generate(rng, n + 8, 0, data);
+			expected = data;
+
+			u32 addBits = (ICmpRangeManager::LOS_VISIBLE | ICmpRangeManager::LOS_EXPLORED) << (2*(owner-1));
+			bool changed = add(&data.counts[0] + offset, &data.state[0] + offset, n, addBits, onWorld0, onWorld1);
+			bool expectedChanged = addReference(&expected.counts[0] + offset, &expected.state[0] + offset, n, addBits, onWorld0, onWorld1);
+			TS_ASSERT_EQUALS(changed, expectedChanged);
+			TS_ASSERT(data.counts == expected.counts);
+			TS_ASSERT(data.state == expected.state);
+
+			generate(rng, n + 8, 1, data);
+			expected = data;
+
+			u32 removeBits = ICmpRangeManager::LOS_VISIBLE << (2*(owner-1));
+			changed = remove(&data.counts[0] + offset, &data.state[0] + offset, n, removeBits);
+			expectedChanged = removeReference(&expected.counts[0] + offset, &expected.state[0] + offset, n, removeBits);
+			TS_ASSERT_EQUALS(changed, expectedChanged);
+			TS_ASSERT(data.counts == expected.counts);
+			TS_ASSERT(data.state == expected.state);
+		}
+	}
+
+public:
+	void test_scalar()
+	{
+		check(&LosStrip::Add, &LosStrip::Remove);
+	}
+
+	void test_sse2()
+	{
+#if ARCH_X86_X64
+		if (!x86_x64::Cap(x86_x64::CAP_SSE2))
+			return;
+		check(&LosStrip::Add_SSE2, &LosStrip::Remove_SSE2);
+#endif
+	}
+};
@@ -0,0 +1,297 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "simulation2/helpers/Grid.h"
+#include "simulation2/helpers/PriorityQueue.h"
+
+#include "lib/timer.h"
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int.hpp>
+
+class TestPriorityQueue : public CxxTest::TestSuite
+{
+	typedef std::pair<u16, u16> TileID;
+
+	struct TileIndex
+	{
+		TileIndex(u16 w = 0) : m_W(w) { }
+		size_t operator()(const TileID& id) const { return id.first + id.second * (size_t)m_W; }
+		u16 m_W;
+	};
+
+	typedef PriorityQueueHeap<TileID, u32> HeapQueue;
+	typedef PriorityQueueIndexedHeap<TileID, u32, TileIndex> IndexedQueue;
+
+	struct Tile
+	{
+		u8 status; // 0 = unexplored, 1 = open, 2 = closed
+		u32 cost;
+	};
+
+	static void ResetQueue(HeapQueue& queue, u16 UNUSED(w), u16 UNUSED(h))
+	{
+		queue.clear();
+	}
+
+	static void ResetQueue(IndexedQueue& queue, u16 w, u16 h)
+	{
+		queue.clear(TileIndex(w), w*h);
+	}
+
+	// A simplified version of the tile-based pathfinder's A* search
+	template<typename G, typename Q>
+	static u32 Search(const Grid<u8>& walls, G& tiles, Q& open, u16 i0, u16 j0, u16 i1, u16 j1, u32& steps)
+	{
+		ResetQueue(open, walls.m_W, walls.m_H);
+
+		typename Q::Item start = { TileID(i0, j0), 0 };
+		open.push(start);
+		tiles.get(i0, j0).status = 1;
+
+		while (!open.empty())
+		{
+			typename Q::Item curr = open.pop();
+			u16 i = curr.id.first, j = curr.id.second;
+			tiles.get(i, j).status = 2;
+			u32 cost = tiles.get(i, j).cost;
+			++steps;
+
+			if (i == i1 && j == j1)
+				return cost;
+
+			const int di[] = { -1, 1, 0, 0 };
+			const int dj[] = { 0, 0, -1, 1 };
+			for (size_t n = 0; n < 4; ++n)
+			{
+				int ni = i + di[n], nj = j + dj[n];
+				if (ni < 0 || nj < 0 || ni >= walls.m_W || nj >= walls.m_H || walls.get(ni, nj))
+					continue;
+
+				Tile& t = tiles.get(ni, nj);
+				if (t.status == 2)
+					continue;
+
+				u32 g = cost + 256 + 64*((ni ^ nj) & 3); // vary the costs to get a mixture of ties and promotions
+				u32 h = 256 * (abs(ni - i1) + abs(nj - j1));
+				if (t.status == 1)
+				{
+					if (g < t.cost)
+					{
+						t.cost = g;
+						open.promote(TileID((u16)ni, (u16)nj), g + h);
+					}
+				}
+				else
+				{
+					t.status = 1;
+					t.cost = g;
+					typename Q::Item item = { TileID((u16)ni, (u16)nj), g + h };
+					open.push(item);
+				}
+			}
+		}
+
+		return 0;
+	}
+
+	boost::mt19937 m_Rng;
+
+	void MakeWalls(Grid<u8>& walls)
+	{
+		// Random wall segments, leaving most of the map connected
+		for (size_t n = 0; n < (size_t)walls.m_W * walls.m_H / 64; ++n)
+		{
+			int i = boost::uniform_int<>(0, walls.m_W-1)(m_Rng);
+			int j = boost::uniform_int<>(0, walls.m_H-1)(m_Rng);
+			bool horizontal = boost::uniform_int<>(0, 1)(m_Rng) != 0;
+			for (int k = 0; k < 16; ++k)
+			{
+				if (horizontal && i+k < walls.m_W)
+					walls.set(i+k, j, 1);
+				else if (!horizontal && j+k < walls.m_H)
+					walls.set(i, j+k, 1);
+			}
+		}
+	}
+
+public:
+	void test_indexed_heap()
+	{
+		// Random operations must pop items in the same order as PriorityQueueHeap
+		HeapQueue heap;
+		IndexedQueue indexed;
+		indexed.clear(TileIndex(32), 32*32);
+
+		std::vector<u32> ranks(32*32, 0); // 0 if not in the queues
+
+		for (size_t n = 0; n < 20000; ++n)
+		{
+			u16 i = (u16)boost::uniform_int<>(0, 31)(m_Rng);
+			u16 j = (u16)boost::uniform_int<>(0, 31)(m_Rng);
+			u32 rank = boost::uniform_int<u32>(1, 100)(m_Rng);
+			u32& current = ranks[i + j*32];
+
+			int op = boost::uniform_int<>(0, 2)(m_Rng);
+			if (op == 0 && !heap.empty())
+			{
+				HeapQueue::Item a = heap.pop();
+				IndexedQueue::Item b = indexed.pop();
+				TS_ASSERT(a.id == b.id);
+				TS_ASSERT_EQUALS(a.rank, b.rank);
+				ranks[a.id.first + a.id.second*32] = 0;
+			}
+			else if (current == 0)
+			{
+				TS_ASSERT(!indexed.find(TileID(i, j)));
+				HeapQueue::Item a = { TileID(i, j), rank };
+				IndexedQueue::Item b = { TileID(i, j), rank };
+				heap.push(a);
+				indexed.push(b);
+				current = rank;
+			}
+			else if (rank < current)
+			{
+				heap.promote(TileID(i, j), rank);
+				indexed.promote(TileID(i, j), rank);
+				current = rank;
+				TS_ASSERT_EQUALS(indexed.find(TileID(i, j))->rank, rank);
+			}
+
+			TS_ASSERT_EQUALS(heap.size(), indexed.size());
+		}
+
+		while (!heap.empty())
+		{
+			HeapQueue::Item a = heap.pop();
+			IndexedQueue::Item b = indexed.pop();
+			TS_ASSERT(a.id == b.id);
+		}
+		TS_ASSERT(indexed.empty());
+
+		// Clearing must forget every item, even though the index isn't reset
+		IndexedQueue::Item item = { TileID(1, 2), 10 };
+		indexed.push(item);
+		indexed.clear(TileIndex(32), 32*32);
+		TS_ASSERT(!indexed.find(TileID(1, 2)));
+		indexed.push(item);
+		TS_ASSERT_EQUALS(indexed.size(), (size_t)1);
+	}
+
+	void test_stamped_grid()
+	{
+		StampedGrid<u32> grid(4, 3);
+		TS_ASSERT_EQUALS(grid.get(3, 2), (u32)0);
+		grid.set(3, 2, 5);
+		grid.get(0, 0) = 7;
+		TS_ASSERT_EQUALS(grid.get(3, 2), (u32)5);
+		TS_ASSERT_EQUALS(grid.get(0, 0), (u32)7);
+
+		grid.reset();
+		TS_ASSERT_EQUALS(grid.get(3, 2), (u32)0);
+		TS_ASSERT_EQUALS(grid.get(0, 0), (u32)0);
+
+		// Values must not reappear when the generation counter wraps around
+		grid.set(1, 1, 9);
+		for (size_t n = 0; n < 65536; ++n)
+			grid.reset();
+		TS_ASSERT_EQUALS(grid.get(1, 1), (u32)0);
+	}
+
+	void test_search_equivalent()
+	{
+		Grid<u8> walls(64, 64);
+		MakeWalls(walls);
+
+		StampedGrid<Tile> stamped(64, 64);
+		IndexedQueue indexed;
+		HeapQueue heap;
+
+		for (size_t n = 0; n < 50; ++n)
+		{
+			u16 i0 = (u16)boost::uniform_int<>(0, 63)(m_Rng), j0 = (u16)boost::uniform_int<>(0, 63)(m_Rng);
+			u16 i1 = (u16)boost::uniform_int<>(0, 63)(m_Rng), j1 = (u16)boost::uniform_int<>(0, 63)(m_Rng);
+
+			SparseGrid<Tile> sparse(64, 64);
+			u32 steps1 = 0, steps2 = 0;
+			u32 cost1 = Search(walls, sparse, heap, i0, j0, i1, j1, steps1);
+			stamped.reset();
+			u32 cost2 = Search(walls, stamped, indexed, i0, j0, i1, j1, steps2);
+			TS_ASSERT_EQUALS(cost1, cost2);
+			TS_ASSERT_EQUALS(steps1, steps2);
+		}
+	}
+
+	// Compares the old pathfinder data structures (a freshly allocated SparseGrid
+	// and a binary heap with linear-time promote) against the new ones (a reused
+	// StampedGrid and the indexed heap), for long cross-map paths
+	void test_performance_DISABLED()
+	{
+		const u16 size = 512;
+		const size_t numPaths = 50;
+
+		Grid<u8> walls(size, size);
+		MakeWalls(walls);
+
+		std::vector<std::pair<TileID, TileID> > paths;
+		for (size_t n = 0; n < numPaths; ++n)
+		{
+			TileID from((u16)boost::uniform_int<>(0, 31)(m_Rng), (u16)boost::uniform_int<>(0, size-1)(m_Rng));
+			TileID to((u16)boost::uniform_int<>(size-32, size-1)(m_Rng), (u16)boost::uniform_int<>(0, size-1)(m_Rng));
+			paths.push_back(std::make_pair(from, to));
+		}
+
+		// Report the fastest of several runs, since timings are noisy
+		const int runs = 3;
+
+		std::vector<u32> costs(numPaths);
+		u32 steps = 0;
+		double best = 1e10;
+		for (int run = 0; run < runs; ++run)
+		{
+			steps = 0;
+			double t = timer_Time();
+			HeapQueue heap;
+			for (size_t n = 0; n < numPaths; ++n)
+			{
+				SparseGrid<Tile> tiles(size, size);
+				costs[n] = Search(walls, tiles, heap, paths[n].first.first, paths[n].first.second, paths[n].second.first, paths[n].second.second, steps);
+			}
+			best = std::min(best, timer_Time() - t);
+		}
+		printf("\nSparseGrid + PriorityQueueHeap: %f ms/path (%f steps/path)\n", 1000.0*best/numPaths, (double)steps/numPaths);
+
+		best = 1e10;
+		for (int run = 0; run < runs; ++run)
+		{
+			steps = 0;
+			double t = timer_Time();
+			StampedGrid<Tile> tiles(size, size);
+			IndexedQueue indexed;
+			for (size_t n = 0; n < numPaths; ++n)
+			{
+				tiles.reset();
+				u32 cost = Search(walls, tiles, indexed, paths[n].first.first, paths[n].first.second, paths[n].second.first, paths[n].second.second, steps);
+				TS_ASSERT_EQUALS(cost, costs[n]);
+			}
+			best = std::min(best, timer_Time() - t);
+		}
+		printf("StampedGrid + PriorityQueueIndexedHeap: %f ms/path (%f steps/path)\n", 1000.0*best/numPaths, (double)steps/numPaths);
+	}
+};
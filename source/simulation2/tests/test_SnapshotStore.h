@@ -0,0 +1,171 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "simulation2/serialization/SnapshotStore.h"
+
+#include <map>
+
+class TestSnapshotStore : public CxxTest::TestSuite
+{
+	typedef std::map<std::pair<u32, u32>, std::string> Components; // (type, entity) -> data
+
+	// Builds a state in the same layout as CComponentManager::SerializeState
+	void build(const std::string& header, const Components& components, std::string& state, std::vector<SSerializedSegment>& segments)
+	{
+		state.clear();
+		segments.clear();
+
+		SSerializedSegment headerSegment = { SSerializedSegment::HEADER, 0, 0 };
+		segments.push_back(headerSegment);
+		state += header;
+
+		u32 type = SSerializedSegment::HEADER;
+		for (Components::const_iterator it = components.begin(); it != components.end(); ++it)
+		{
+			if (it->first.first != type)
+			{
+				type = it->first.first;
+				SSerializedSegment typeSegment = { type, 0, (u32)state.size() };
+				segments.push_back(typeSegment);
+				state += "type";
+			}
+			SSerializedSegment segment = { type, it->first.second, (u32)state.size() };
+			segments.push_back(segment);
+			state += it->second;
+		}
+	}
+
+	void push(CSnapshotStore& store, const std::string& header, const Components& components, std::vector<std::string>& pushed)
+	{
+		std::string state;
+		std::vector<SSerializedSegment> segments;
+		build(header, components, state, segments);
+		store.Push(state, segments);
+		pushed.push_back(state);
+	}
+
+public:
+	void test_roundtrip()
+	{
+		CSnapshotStore store(64*MiB);
+		std::vector<std::string> pushed;
+
+		std::string state;
+		TS_ASSERT(!store.Pop(state));
+
+		Components components;
+		for (u32 ent = 1; ent <= 100; ++ent)
+		{
+			components[std::make_pair(1u, ent)] = std::string(100, (char)ent);
+			if (ent % 2)
+				components[std::make_pair(2u, ent)] = "x";
+		}
+		push(store, "turn 0", components, pushed);
+
+		// Change a component's value and size
+		components[std::make_pair(1u, 50u)] = std::string(200, 'a');
+		push(store, "turn 1", components, pushed);
+
+		// Add and remove entities and a component type
+		components.erase(std::make_pair(1u, 1u));
+		components.erase(std::make_pair(2u, 99u));
+		components[std::make_pair(1u, 101u)] = "new";
+		components[std::make_pair(3u, 5u)] = "new type";
+		push(store, "turn 2", components, pushed);
+
+		// Nothing changed
+		push(store, "turn 2", components, pushed);
+
+		// Same data under different entity IDs mustn't be confused
+		components.erase(std::make_pair(2u, 1u));
+		components[std::make_pair(2u, 2u)] = "x";
+		push(store, "turn 3", components, pushed);
+
+		TS_ASSERT_EQUALS(store.GetNumStates(), (size_t)5);
+
+		// Only the newest state should be stored in full
+		TS_ASSERT_LESS_THAN(store.GetMemoryUsage(), 2 * pushed.back().size());
+
+		for (size_t i = pushed.size(); i > 0; --i)
+		{
+			TS_ASSERT(store.Pop(state));
+			TS_ASSERT_EQUALS(state, pushed[i-1]);
+		}
+
+		TS_ASSERT_EQUALS(store.GetNumStates(), (size_t)0);
+		TS_ASSERT_EQUALS(store.GetMemoryUsage(), (size_t)0);
+		TS_ASSERT(!store.Pop(state));
+	}
+
+	void test_eviction()
+	{
+		CSnapshotStore store(6000);
+		std::vector<std::string> pushed;
+
+		// Each state changes 1000 bytes of the previous one
+		Components components;
+		for (u32 ent = 1; ent <= 3; ++ent)
+			components[std::make_pair(1u, ent)] = std::string(1000, 'a');
+
+		for (u32 turn = 0; turn < 10; ++turn)
+		{
+			components[std::make_pair(1u, turn % 3 + 1)] = std::string(1000, (char)('b' + turn));
+			push(store, "header", components, pushed);
+			TS_ASSERT_LESS_THAN_EQUALS(store.GetMemoryUsage(), (size_t)6000);
+		}
+
+		// The oldest states should have been dropped, leaving the newest
+		size_t num = store.GetNumStates();
+		TS_ASSERT_LESS_THAN(num, (size_t)10);
+		TS_ASSERT_LESS_THAN_EQUALS((size_t)2, num);
+
+		std::string state;
+		for (size_t i = 0; i < num; ++i)
+		{
+			TS_ASSERT(store.Pop(state));
+			TS_ASSERT_EQUALS(state, pushed[pushed.size() - 1 - i]);
+		}
+		TS_ASSERT(!store.Pop(state));
+
+		// The newest state is kept even when it's over the limit on its own
+		CSnapshotStore small(10);
+		push(small, "header", components, pushed);
+		push(small, "header", components, pushed);
+		TS_ASSERT_EQUALS(small.GetNumStates(), (size_t)1);
+		TS_ASSERT(small.Pop(state));
+		TS_ASSERT_EQUALS(state, pushed.back());
+	}
+
+	void test_clear()
+	{
+		CSnapshotStore store(64*MiB);
+		std::vector<std::string> pushed;
+
+		Components components;
+		components[std::make_pair(1u, 1u)] = "data";
+		push(store, "header", components, pushed);
+		push(store, "header", components, pushed);
+
+		store.Clear();
+		TS_ASSERT_EQUALS(store.GetNumStates(), (size_t)0);
+
+		std::string state;
+		TS_ASSERT(!store.Pop(state));
+	}
+};
@@ -0,0 +1,277 @@
+/* Copyright (C) 2011 Wildfire Games.
+ * This file is part of 0 A.D.
+ *
+ * 0 A.D. is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * 0 A.D. is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with 0 A.D.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lib/self_test.h"
+
+#include "simulation2/serialization/StdSerializer.h"
+#include "simulation2/serialization/StdDeserializer.h"
+#include "simulation2/helpers/Spatial.h"
+#include "scriptinterface/ScriptInterface.h"
+
+#include "lib/timer.h"
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int.hpp>
+
+class TestSpatial : public CxxTest::TestSuite
+{
+	struct Item
+	{
+		bool present;
+		CFixedVector2D posMin;
+		CFixedVector2D posMax;
+	};
+
+	boost::mt19937 m_Rng;
+
+	entity_pos_t RandPos(int min, int max)
+	{
+		return entity_pos_t::FromInt(boost::uniform_int<>(min*16, max*16)(m_Rng)) / 16;
+	}
+
+	// Applies a random sequence of adds/moves/removes to both spatial indexes,
+	// with a mixture of points, units and large buildings
+	template<typename S1, typename S2>
+	void RandomChanges(S1& s1, S2& s2, std::vector<Item>& items, int w, int h, int count)
+	{
+		for (int n = 0; n < count; ++n)
+		{
+			u32 id = boost::uniform_int<u32>(1, (u32)items.size()-1)(m_Rng);
+
+			int kind = boost::uniform_int<>(0, 3)(m_Rng);
+			int maxSize = (kind == 0 ? 0 : kind == 3 ? 100 : 4);
+			CFixedVector2D center(RandPos(-16, w+16), RandPos(-16, h+16));
+			CFixedVector2D halfSize(RandPos(0, maxSize), RandPos(0, maxSize));
+			CFixedVector2D posMin = center - halfSize;
+			CFixedVector2D posMax = center + halfSize;
+
+			Item& item = items[id];
+			if (!item.present)
+			{
+				s1.Add(id, posMin, posMax);
+				s2.Add(id, posMin, posMax);
+				item.present = true;
+			}
+			else if (boost::uniform_int<>(0, 2)(m_Rng) == 0)
+			{
+				s1.Remove(id, item.posMin, item.posMax);
+				s2.Remove(id, item.posMin, item.posMax);
+				item.present = false;
+			}
+			else
+			{
+				s1.Move(id, item.posMin, item.posMax, posMin, posMax);
+				s2.Move(id, item.posMin, item.posMax, posMin, posMax);
+			}
+			item.posMin = posMin;
+			item.posMax = posMax;
+		}
+	}
+
+public:
+	void test_loose_grid()
+	{
+		const int w = 500, h = 300;
+
+		SpatialSubdivision<u32> grid;
+		SpatialLooseGrid<u32> loose;
+		grid.Reset(entity_pos_t::FromInt(w), entity_pos_t::FromInt(h), entity_pos_t::FromInt(32));
+		loose.Reset(entity_pos_t::FromInt(w), entity_pos_t::FromInt(h), entity_pos_t::FromInt(32));
+
+		Item empty = { false, CFixedVector2D(), CFixedVector2D() };
+		std::vector<Item> items(200, empty);
+
+		std::vector<u32> results;
+		for (int n = 0; n < 100; ++n)
+		{
+			RandomChanges(grid, loose, items, w, h, 20);
+
+			for (int q = 0; q < 20; ++q)
+			{
+				CFixedVector2D center(RandPos(-32, w+32), RandPos(-32, h+32));
+				CFixedVector2D halfSize(RandPos(0, 40), RandPos(0, 40));
+				CFixedVector2D posMin = center - halfSize;
+				CFixedVector2D posMax = center + halfSize;
+
+				loose.GetInRange(results, posMin, posMax);
+				TS_ASSERT_EQUALS(results, loose.GetInRange(posMin, posMax));
+
+				// Results must be sorted and unique, and contain every item whose bounds overlap the range
+				for (size_t i = 1; i < results.size(); ++i)
+					TS_ASSERT_LESS_THAN(results[i-1], results[i]);
+
+				for (size_t i = 0; i < items.size(); ++i)
+				{
+					bool found = std::binary_search(results.begin(), results.end(), (u32)i);
+					if (!items[i].present)
+					{
+						TS_ASSERT(!found);
+						continue;
+					}
+
+					if (!(items[i].posMax.X < posMin.X || items[i].posMin.X > posMax.X || items[i].posMax.Y < posMin.Y || items[i].posMin.Y > posMax.Y))
+						TS_ASSERT(found);
+				}
+			}
+		}
+
+		// Check the incrementally-updated index matches a freshly built one
+		SpatialLooseGrid<u32> loose2;
+		loose2.Reset(entity_pos_t::FromInt(w), entity_pos_t::FromInt(h), entity_pos_t::FromInt(32));
+		for (size_t i = 0; i < items.size(); ++i)
+			if (items[i].present)
+				loose2.Add((u32)i, items[i].posMin, items[i].posMax);
+		TS_ASSERT(loose == loose2);
+
+		loose2.Remove(1, items[1].posMin, items[1].posMax);
+		loose2.Add(1, CFixedVector2D(entity_pos_t::FromInt(-1), entity_pos_t::FromInt(-1)));
+		TS_ASSERT(loose != loose2);
+	}
+
+	void test_serialize_compatible()
+	{
+		const int w = 400, h = 400;
+
+		ScriptInterface script("Test", "Test", ScriptInterface::CreateRuntime());
+
+		SpatialSubdivision<u32> grid;
+		SpatialLooseGrid<u32> loose;
+		grid.Reset(entity_pos_t::FromInt(w), entity_pos_t::FromInt(h), entity_pos_t::FromInt(32));
+		loose.Reset(entity_pos_t::FromInt(w), entity_pos_t::FromInt(h), entity_pos_t::FromInt(32));
+
+		Item empty = { false, CFixedVector2D(), CFixedVector2D() };
+		std::vector<Item> items(200, empty);
+		RandomChanges(grid, loose, items, w, h, 1000);
+
+		// Loose grid -> subdivision
+		{
+			std::stringstream stream;
+			CStdSerializer serialize(script, stream);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(serialize, "subdiv", loose);
+
+			CStdDeserializer deserialize(script, stream);
+			SpatialSubdivision<u32> grid2;
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(deserialize, "subdiv", grid2);
+			TS_ASSERT(grid == grid2);
+		}
+
+		// Subdivision -> loose grid
+		SpatialLooseGrid<u32> loose2;
+		{
+			std::stringstream stream;
+			CStdSerializer serialize(script, stream);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(serialize, "subdiv", grid);
+
+			CStdDeserializer deserialize(script, stream);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(deserialize, "subdiv", loose2);
+			TS_ASSERT(loose == loose2);
+		}
+
+		// Both kinds serialize identically when they have the same contents
+		{
+			std::stringstream stream1;
+			CStdSerializer serialize1(script, stream1);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(serialize1, "subdiv", grid);
+
+			std::stringstream stream2;
+			CStdSerializer serialize2(script, stream2);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(serialize2, "subdiv", loose);
+
+			TS_ASSERT_EQUALS(stream1.str(), stream2.str());
+		}
+
+		// Deserialized loose grids must serialize identically, and still find everything
+		{
+			std::stringstream stream1;
+			CStdSerializer serialize1(script, stream1);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(serialize1, "subdiv", loose);
+
+			std::stringstream stream2;
+			CStdSerializer serialize2(script, stream2);
+			SerializeSpatialSubdivision<SerializeU32_Unbounded>()(serialize2, "subdiv", loose2);
+
+			TS_ASSERT_EQUALS(stream1.str(), stream2.str());
+		}
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			if (!items[i].present)
+				continue;
+			std::vector<u32> results = loose2.GetInRange(items[i].posMin, items[i].posMax);
+			TS_ASSERT(std::binary_search(results.begin(), results.end(), (u32)i));
+
+			// Items loaded from the subdivision can be moved/removed like any others
+			loose2.Remove((u32)i, items[i].posMin, items[i].posMax);
+			loose.Remove((u32)i, items[i].posMin, items[i].posMax);
+		}
+		TS_ASSERT(loose == loose2);
+	}
+
+	template<typename S>
+	void measure(const char* name, int count)
+	{
+		const int size = 1024;
+		const int frames = 20;
+
+		S s;
+		s.Reset(entity_pos_t::FromInt(size), entity_pos_t::FromInt(size), entity_pos_t::FromInt(32));
+
+		// Units clustered in a few armies, moving a little every frame
+		std::vector<CFixedVector2D> pos(count+1);
+		for (int i = 1; i <= count; ++i)
+		{
+			int cluster = i % 8;
+			entity_pos_t cx = entity_pos_t::FromInt(128 + (cluster % 4) * 256);
+			entity_pos_t cz = entity_pos_t::FromInt(256 + (cluster / 4) * 512);
+			pos[i] = CFixedVector2D(cx + RandPos(-64, 64), cz + RandPos(-64, 64));
+			s.Add(i, pos[i]);
+		}
+
+		std::vector<u32> results;
+		size_t found = 0;
+
+		double t = timer_Time();
+		for (int f = 0; f < frames; ++f)
+		{
+			for (int i = 1; i <= count; ++i)
+			{
+				CFixedVector2D to = pos[i] + CFixedVector2D(RandPos(-1, 1), RandPos(-1, 1));
+				s.Move(i, pos[i], to);
+				pos[i] = to;
+			}
+
+			for (int i = 1; i <= count; i += 4)
+			{
+				s.GetNear(results, pos[i], entity_pos_t::FromInt(48));
+				found += results.size();
+			}
+		}
+		t = timer_Time() - t;
+
+		printf("%s, %d units: %f ms/frame (%f candidates/query)\n", name, count, 1000.0*t/frames, (double)found / (frames*((count+3)/4)));
+	}
+
+	void test_performance_DISABLED()
+	{
+		const int counts[] = { 1000, 5000, 20000 };
+		for (size_t i = 0; i < ARRAY_SIZE(counts); ++i)
+		{
+			measure<SpatialSubdivision<u32> >("SpatialSubdivision", counts[i]);
+			measure<SpatialLooseGrid<u32> >("SpatialLooseGrid", counts[i]);
+		}
+	}
+};